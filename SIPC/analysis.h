@@ -0,0 +1,242 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "subleq.h"
+
+// Static analysis of a loaded machine. Starting from ip, it follows every instruction to where
+// its c operand and its fall-through can lead, and collects every cell those instructions can
+// write through b. An instruction whose a operand is written may turn into an input or read
+// another cell, so it is followed both ways, and the walk goes on until no new writes turn up.
+//
+// The result holds for the memory it was made from, as long as only the program changes it.
+// When no reachable instruction writes a b or c operand, every write the program can make is
+// known, and cells outside that set are provably never modified: engines can then drop their
+// self-modification checks for writes that can't land in code.
+
+enum ANALYSIS_FLAG : uint8_t
+{
+	ANALYSIS_CODE = 1,			// Part of a reachable instruction
+	ANALYSIS_ENTRY = 2,			// The first byte of a reachable instruction
+	ANALYSIS_WRITTEN = 4,		// A reachable instruction may write it
+	ANALYSIS_READ = 8,			// The a operand of a reachable instruction points at it in memory
+};
+
+// What a cell is used for, as shown in the editor
+enum SUBLEQ_CELL : uint8_t
+{
+	SUBLEQ_CELL_UNUSED,			// Nothing reachable touches it
+	SUBLEQ_CELL_CODE,			// Part of an instruction, never written
+	SUBLEQ_CELL_MODIFIED_CODE,	// Part of an instruction the program rewrites
+	SUBLEQ_CELL_DATA,			// Written by the program
+	SUBLEQ_CELL_CONSTANT,		// Only ever read
+};
+
+inline const char* subleq_cell_str(const SUBLEQ_CELL c)
+{
+	switch (c)
+	{
+	case SUBLEQ_CELL_UNUSED:		return "unused";
+	case SUBLEQ_CELL_CODE:			return "code";
+	case SUBLEQ_CELL_MODIFIED_CODE:	return "modified code";
+	case SUBLEQ_CELL_DATA:			return "data";
+	case SUBLEQ_CELL_CONSTANT:		return "constant";
+	default:						return "unknown";
+	}
+}
+
+// A reachable instruction and the edges out of it
+struct subleq_cfg_node
+{
+	size_t ip;
+	size_t taken;		// Where c leads, SIZE_MAX if there is no such edge or going there halts
+	size_t next;		// The fall-through, the same
+	SUBLEQ_OP op;		// As it is in memory, SUBLEQ_OP_FAULT if it doesn't decode
+	bool dynamic;		// Its a operand is written, so op may change as the program runs
+};
+
+struct subleq_analysis
+{
+	size_t memsize = 0;
+	size_t entry = 0;
+	// ANALYSIS_* flags for every byte of memory
+	std::vector<uint8_t> flags;
+	// Every reachable instruction, in address order
+	std::vector<subleq_cfg_node> nodes;
+	// False if a reachable instruction writes the b or c operand of one, which could then write
+	// or jump anywhere. Nothing but the reachable code is known then.
+	bool closed = true;
+	// Some reachable code is written, only its a operands when closed
+	bool code_modified = false;
+	// When not closed, the first instruction found writing an operand and the operand
+	size_t writer = SIZE_MAX;
+	size_t written = SIZE_MAX;
+};
+
+inline bool _analysis_any(const subleq_analysis* an, const size_t addr, const size_t size, const uint8_t flag)
+{
+	for (size_t i = addr; i < addr + size && i < an->memsize; ++i)
+		if (an->flags[i] & flag)
+			return true;
+	return false;
+}
+
+// Where a jump to c leads, SIZE_MAX if it halts
+template <typename T>
+inline size_t _analysis_target(const subleq<T>* sim, const T c)
+{ return (size_t)c < sim->memsize ? (size_t)c : SIZE_MAX; }
+
+// The node for the instruction at ip with the writes found so far. One that subtracts a cell
+// from itself always jumps to c (the jmp macro), and one whose a is written goes both ways.
+template <typename T>
+subleq_cfg_node _analysis_node(const subleq<T>* sim, const subleq_analysis* an, const size_t ip)
+{
+	subleq_cfg_node n{ ip, SIZE_MAX, SIZE_MAX, SUBLEQ_OP_FAULT, false };
+	subleq_decoded<T> d;
+	if (!subleq_decode(sim, ip, d))
+		return n;
+	n.op = d.op;
+	n.dynamic = _analysis_any(an, ip, sizeof(T), ANALYSIS_WRITTEN);
+	if (d.b == _subleq_addr((T)(-1)))
+	{
+		if (n.dynamic || d.op == SUBLEQ_OP_OUT)
+			n.taken = _analysis_target(sim, d.c);
+	}
+	else if (_subleq_in_bounds(sim, d.b) && (n.dynamic || d.op != SUBLEQ_OP_FAULT))
+	{
+		n.taken = _analysis_target(sim, d.c);
+		if (n.dynamic || (d.op == SUBLEQ_OP_SUB && d.a != d.b))
+			n.next = _analysis_target(sim, d.next);
+	}
+	return n;
+}
+
+// Collects the nodes reachable from the entry, using ANALYSIS_ENTRY to mark the ones seen
+template <typename T>
+void _analysis_walk(const subleq<T>* sim, subleq_analysis* an)
+{
+	for (const subleq_cfg_node& n : an->nodes)
+		an->flags[n.ip] &= ~ANALYSIS_ENTRY;
+	an->nodes.clear();
+	std::vector<size_t> todo{ an->entry };
+	while (!todo.empty())
+	{
+		const size_t ip = todo.back();
+		todo.pop_back();
+		if (ip >= an->memsize || (an->flags[ip] & ANALYSIS_ENTRY))
+			continue;
+		an->flags[ip] |= ANALYSIS_ENTRY;
+		const subleq_cfg_node n = _analysis_node(sim, an, ip);
+		an->nodes.push_back(n);
+		if (n.taken != SIZE_MAX)
+			todo.push_back(n.taken);
+		if (n.next != SIZE_MAX)
+			todo.push_back(n.next);
+	}
+	std::sort(an->nodes.begin(), an->nodes.end(), [](const subleq_cfg_node& x, const subleq_cfg_node& y) { return x.ip < y.ip; });
+}
+
+// Analyzes the program from the machine's ip, nullptr if ip lies outside memory
+template <typename T>
+subleq_analysis* create_subleq_analysis(const subleq<T>* sim)
+{
+	if (!((size_t)sim->_ip < sim->memsize))
+		return nullptr;
+	subleq_analysis* an = new subleq_analysis();
+	an->memsize = sim->memsize;
+	an->entry = (size_t)sim->_ip;
+	an->flags.assign(sim->memsize, 0);
+
+	// Writes can make more code reachable, which can write more
+	bool grew = true;
+	while (grew)
+	{
+		_analysis_walk(sim, an);
+		grew = false;
+		for (const subleq_cfg_node& n : an->nodes)
+		{
+			subleq_decoded<T> d;
+			if (!n.dynamic && n.op == SUBLEQ_OP_FAULT)
+				continue;
+			if (!subleq_decode(sim, n.ip, d) || d.b == _subleq_addr((T)(-1)) || !_subleq_in_bounds(sim, d.b))
+				continue;
+			for (size_t i = d.b; i < d.b + sizeof(T); ++i)
+			{
+				grew |= !(an->flags[i] & ANALYSIS_WRITTEN);
+				an->flags[i] |= ANALYSIS_WRITTEN;
+			}
+		}
+	}
+
+	for (const subleq_cfg_node& n : an->nodes)
+	{
+		subleq_decoded<T> d;
+		if (!subleq_decode(sim, n.ip, d))
+			continue;
+		for (size_t i = n.ip; i < n.ip + sizeof(T) * 3; ++i)
+			an->flags[i] |= ANALYSIS_CODE;
+		an->code_modified |= _analysis_any(an, n.ip, sizeof(T) * 3, ANALYSIS_WRITTEN);
+		if (n.op == SUBLEQ_OP_SUB || n.op == SUBLEQ_OP_OUT)
+			for (size_t i = d.a; i < d.a + sizeof(T); ++i)
+				an->flags[i] |= ANALYSIS_READ;
+		if (!an->closed)
+			continue;
+		for (const size_t operand : { n.ip + sizeof(T), n.ip + sizeof(T) * 2 })
+		{
+			if (!_analysis_any(an, operand, sizeof(T), ANALYSIS_WRITTEN))
+				continue;
+			an->closed = false;
+			an->written = operand;
+			for (const subleq_cfg_node& w : an->nodes)
+			{
+				subleq_decoded<T> wd;
+				if (an->writer == SIZE_MAX && subleq_decode(sim, w.ip, wd) && wd.b + sizeof(T) > operand && wd.b < operand + sizeof(T))
+					an->writer = w.ip;
+			}
+			break;
+		}
+	}
+	return an;
+}
+
+inline void destroy_subleq_analysis(subleq_analysis* an)
+{ delete an; }
+
+// The reachable instruction at ip, nullptr if there is none
+inline const subleq_cfg_node* subleq_analysis_node(const subleq_analysis* an, const size_t ip)
+{
+	if (ip >= an->memsize || !(an->flags[ip] & ANALYSIS_ENTRY))
+		return nullptr;
+	auto it = std::lower_bound(an->nodes.begin(), an->nodes.end(), ip, [](const subleq_cfg_node& n, const size_t x) { return n.ip < x; });
+	return &*it;
+}
+
+// True if the program provably never writes a byte of [addr, addr + size)
+inline bool subleq_analysis_stable(const subleq_analysis* an, const size_t addr, const size_t size)
+{ return an->closed && !_analysis_any(an, addr, size, ANALYSIS_WRITTEN); }
+
+// True if the program provably never writes any of its reachable code
+inline bool subleq_analysis_code_stable(const subleq_analysis* an)
+{ return an->closed && !an->code_modified; }
+
+// What the cell of width bytes at addr is used for
+inline SUBLEQ_CELL subleq_analysis_cell(const subleq_analysis* an, const size_t addr, const size_t width)
+{
+	uint8_t f = 0;
+	for (size_t i = addr; i < addr + width && i < an->memsize; ++i)
+		f |= an->flags[i];
+	if ((f & ANALYSIS_CODE) && (f & ANALYSIS_WRITTEN)) return SUBLEQ_CELL_MODIFIED_CODE;
+	else if (f & ANALYSIS_CODE) return SUBLEQ_CELL_CODE;
+	else if (f & ANALYSIS_WRITTEN) return SUBLEQ_CELL_DATA;
+	else if (f & ANALYSIS_READ) return SUBLEQ_CELL_CONSTANT;
+	return SUBLEQ_CELL_UNUSED;
+}
+
+// subleq_run_cached, skipping the instruction cache's invalidation checks while ip is on code
+// the analysis proved is never written. an must have been made from this machine's memory.
+template <typename T>
+uint64_t subleq_run_analyzed(subleq<T>* state, subleq_icache<T>* cache, const subleq_analysis* an, uint64_t max_steps, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	if (an != nullptr && an->memsize == state->memsize && subleq_analysis_code_stable(an) && subleq_analysis_node(an, (size_t)state->_ip) != nullptr)
+		return subleq_run_cached<T, false>(state, cache, max_steps, FN_OnOutput, userarg);
+	return subleq_run_cached<T>(state, cache, max_steps, FN_OnOutput, userarg);
+}
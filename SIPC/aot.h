@@ -0,0 +1,347 @@
+#pragma once
+#include <bit>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include "subleq.h"
+#include "analysis.h"
+
+// Ahead-of-time translation of a machine into C++. Every instruction reachable from ip becomes
+// a labelled block in a generated <name>_run function, with its operands turned into constant
+// addresses and its branches into gotos. Calls enter through a switch on ip, and an ip that
+// wasn't translated is stepped through subleq_step until it reaches translated code again.
+// Programs may rewrite the a operands of their instructions, which are then read as they run,
+// but no reachable instruction may write the b or c operand of one.
+//
+// Images up to aot_max_image bytes are also embedded, with <name>_create to build a machine
+// from them and a constexpr <name>_eval that runs the program during compilation.
+
+// Images above this size are left out of the generated file, <name>_run then needs a machine
+// loaded some other way
+const size_t aot_max_image = 1 << 20;
+// Output bytes kept by <name>_eval
+const size_t aot_eval_output = 4096;
+// Steps <name>_eval takes by default, well inside the compilers' constexpr limits
+const uint64_t aot_eval_steps = 1 << 16;
+
+enum AOT_RESULT : uint8_t
+{
+	AOT_OK,
+	AOT_SELF_MODIFYING,		// A reachable instruction writes the b or c operand of one
+	AOT_NO_CODE,			// ip lies outside memory
+};
+
+inline const char* aot_result_str(const AOT_RESULT r)
+{
+	switch (r)
+	{
+	case AOT_OK:				return "ok";
+	case AOT_SELF_MODIFYING:	return "the program rewrites where its instructions write or jump";
+	case AOT_NO_CODE:			return "ip lies outside memory";
+	default:					return "unknown";
+	}
+}
+
+struct aot_info
+{
+	size_t instructions = 0;
+	bool image = false;			// The image and <name>_eval were generated
+	size_t dynamic = 0;			// Instructions whose a operand is written, and read as they run
+	// For AOT_SELF_MODIFYING, the instruction and the operand it writes
+	size_t writer = SIZE_MAX;
+	size_t written = SIZE_MAX;
+};
+
+// Reads a cell of the byte image the way the machine would, usable in constant expressions
+template <typename T>
+constexpr T aot_load(const uint8_t* mem, const size_t addr)
+{
+	std::make_unsigned_t<T> x = 0;
+	for (size_t i = 0; i < sizeof(T); ++i)
+	{
+		const size_t at = std::endian::native == std::endian::little ? sizeof(T) - 1 - i : i;
+		x = (std::make_unsigned_t<T>)((x << 4 << 4) | mem[addr + at]);
+	}
+	return (T)x;
+}
+
+template <typename T>
+constexpr void aot_store(uint8_t* mem, const size_t addr, const T value)
+{
+	std::make_unsigned_t<T> x = (std::make_unsigned_t<T>)value;
+	for (size_t i = 0; i < sizeof(T); ++i)
+	{
+		const size_t at = std::endian::native == std::endian::little ? i : sizeof(T) - 1 - i;
+		mem[addr + at] = (uint8_t)x;
+		x = (std::make_unsigned_t<T>)(x >> 4 >> 4);
+	}
+}
+
+template <typename T, size_t N>
+struct aot_eval_result
+{
+	T ip;
+	bool running;			// Still running after max_steps, false once halted or at a fault
+	uint64_t steps;
+	size_t output_size;
+	char output[aot_eval_output];	// The first output bytes
+	uint8_t memory[N];
+};
+
+// Runs a machine of N bytes holding image from ip like subleq_step would, in a constant
+// expression. Nothing is ever read as input, input instructions read -1.
+template <typename T, size_t N>
+constexpr aot_eval_result<T, N> aot_eval(const uint8_t* image, const size_t image_size, const T ip, const uint64_t max_steps)
+{
+	aot_eval_result<T, N> r{};
+	for (size_t i = 0; i < image_size; ++i)
+		r.memory[i] = image[i];
+	r.ip = ip;
+	r.running = true;
+	while (r.steps < max_steps && (size_t)r.ip < N)
+	{
+		const size_t at = (size_t)r.ip;
+		if (N - at < sizeof(T) * 3)
+			return r.running = false, r;
+		const T b = aot_load<T>(r.memory, at + sizeof(T));
+		const T c = aot_load<T>(r.memory, at + sizeof(T) * 2);
+		const size_t a_addr = _subleq_addr(aot_load<T>(r.memory, at));
+		const size_t b_addr = _subleq_addr(b);
+		const bool in = a_addr == _subleq_addr((T)(-1)) && b != (T)(-1);
+		if ((!in && (a_addr > N || N - a_addr < sizeof(T))) || (b != (T)(-1) && (b_addr > N || N - b_addr < sizeof(T))))
+			return r.running = false, r;
+
+		if (b == (T)(-1))
+		{
+			if (r.output_size < aot_eval_output)
+				r.output[r.output_size++] = (char)aot_load<T>(r.memory, a_addr);
+			r.ip = c;
+		}
+		else if (in)
+		{
+			aot_store<T>(r.memory, b_addr, (T)(-1));
+			r.ip = c;
+		}
+		else
+		{
+			const T x = _subleq_sub(aot_load<T>(r.memory, b_addr), aot_load<T>(r.memory, a_addr));
+			aot_store<T>(r.memory, b_addr, x);
+			r.ip = x <= 0 ? c : (T)(at + sizeof(T) * 3);
+		}
+		++r.steps;
+	}
+	r.running = (size_t)r.ip < N;
+	return r;
+}
+
+inline const char* _aot_cell_type(const size_t width)
+{
+	switch (width)
+	{
+	case 1:		return "int8_t";
+	case 2:		return "int16_t";
+	case 4:		return "int32_t";
+	default:	return "int64_t";
+	}
+}
+
+// A cell value as an unsigned literal, which converts back to any value of T
+template <typename T>
+inline unsigned long long _aot_lit(const T v)
+{ return (unsigned long long)(std::make_unsigned_t<T>)v; }
+
+inline void _aot_appendf(std::string& out, const char* fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	const int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	out.append(buf, n < 0 ? 0 : (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// The bytes of the image up to the last one that isn't zero
+template <typename T>
+size_t _aot_image_size(const subleq<T>* sim)
+{
+	size_t n = sim->memsize;
+	while (n > 0 && sim->memory[n - 1] == 0)
+		--n;
+	return n;
+}
+
+template <typename T>
+void _aot_emit_image(const subleq<T>* sim, const char* name, std::string& out)
+{
+	const size_t size = _aot_image_size(sim);
+	out += "// The initial memory up to its last non-zero byte, the rest is zero\n";
+	_aot_appendf(out, "constexpr uint8_t %s_image[%llu] = {", name, (unsigned long long)(size > 0 ? size : 1));
+	for (size_t i = 0; i < size; ++i)
+		_aot_appendf(out, "%s%u,", i % 32 == 0 ? "\n\t" : "", (unsigned)sim->memory[i]);
+	out += size == 0 ? " 0 };\n\n" : "\n};\n\n";
+
+	out += "// A machine holding the image, release it with destroy_subleq\n";
+	_aot_appendf(out, "inline subleq<%s_cell>* %s_create()\n{\n", name, name);
+	_aot_appendf(out, "\tsubleq<%s_cell>* sim = create_subleq<%s_cell>(%s_memsize);\n", name, name, name);
+	out += "\tif (sim == nullptr)\n\t\treturn nullptr;\n";
+	_aot_appendf(out, "\tmemcpy(sim->memory, %s_image, %llu);\n", name, (unsigned long long)size);
+	_aot_appendf(out, "\tsim->_ip = (%s_cell)%lluu;\n\treturn sim;\n}\n\n", name, _aot_lit(sim->_ip));
+
+	out += "// Runs the program from the image during compilation, input instructions read -1\n";
+	_aot_appendf(out, "constexpr aot_eval_result<%s_cell, %s_memsize> %s_eval(const uint64_t max_steps=aot_eval_steps)\n", name, name, name);
+	_aot_appendf(out, "{ return aot_eval<%s_cell, %s_memsize>(%s_image, %llu, (%s_cell)%lluu, max_steps); }\n\n",
+		name, name, name, (unsigned long long)size, name, _aot_lit(sim->_ip));
+}
+
+// Ends a block with a jump to target, falling through when it is the next block
+template <typename T>
+void _aot_emit_jump(std::string& out, const subleq<T>* sim, const T to, const size_t next_block)
+{
+	const size_t target = _analysis_target(sim, to);
+	if (target == SIZE_MAX)
+		_aot_appendf(out, "\tstate->_ip = (T)%lluu;\n\tgoto stop;\n", _aot_lit(to));
+	else if (target != next_block)
+		_aot_appendf(out, "\tgoto L_%llu;\n", (unsigned long long)target);
+}
+
+template <typename T>
+void _aot_emit_branch(std::string& out, const subleq<T>* sim, const subleq_decoded<T>& d, const size_t next_block)
+{
+	const size_t taken = _analysis_target(sim, d.c);
+	if (taken == SIZE_MAX)
+		_aot_appendf(out, "\tif (r <= 0) { state->_ip = (T)%lluu; goto stop; }\n", _aot_lit(d.c));
+	else
+		_aot_appendf(out, "\tif (r <= 0) goto L_%llu;\n", (unsigned long long)taken);
+	_aot_emit_jump(out, sim, d.next, next_block);
+}
+
+// An instruction whose a operand is written runs on the operand it holds when it gets there,
+// which decides between output, input and subtraction like subleq_step does
+template <typename T>
+void _aot_emit_dynamic(std::string& out, const subleq<T>* sim, const size_t ip, const subleq_decoded<T>& d, const size_t next_block)
+{
+	_aot_appendf(out, "\ta = _subleq_addr(*(T*)(mem + %llu));\n", (unsigned long long)ip);
+	if (d.b == _subleq_addr((T)(-1)))
+	{
+		_aot_appendf(out, "\tif (!_subleq_in_bounds(state, a)) { state->_ip = (T)%llu; state->running = false; return steps - 1; }\n", (unsigned long long)ip);
+		_aot_appendf(out, "\tif (FN_OnOutput != nullptr)\n\t{\n\t\tconst T at = (T)%llu;\n", (unsigned long long)ip);
+		out += "\t\tFN_OnOutput(state, *(T*)(mem + a), at, userarg);\n\t}\n";
+		_aot_emit_jump(out, sim, d.c, next_block);
+		return;
+	}
+	const size_t taken = _analysis_target(sim, d.c);
+	out += "\tif (a == _subleq_addr((T)(-1)))\n\t{\n";
+	_aot_appendf(out, "\t\t*(T*)(mem + %llu) = _subleq_input<T>(state->input);\n", (unsigned long long)d.b);
+	if (taken == SIZE_MAX)
+		_aot_appendf(out, "\t\tstate->_ip = (T)%lluu;\n\t\tgoto stop;\n\t}\n", _aot_lit(d.c));
+	else
+		_aot_appendf(out, "\t\tgoto L_%llu;\n\t}\n", (unsigned long long)taken);
+	_aot_appendf(out, "\tif (!_subleq_in_bounds(state, a)) { state->_ip = (T)%llu; state->running = false; return steps - 1; }\n", (unsigned long long)ip);
+	_aot_appendf(out, "\tr = _subleq_sub(*(T*)(mem + %llu), *(T*)(mem + a));\n", (unsigned long long)d.b);
+	_aot_appendf(out, "\t*(T*)(mem + %llu) = r;\n", (unsigned long long)d.b);
+	_aot_emit_branch(out, sim, d, next_block);
+}
+
+template <typename T>
+void _aot_emit_run(const subleq<T>* sim, const subleq_analysis* an, const char* name, std::string& out)
+{
+	out += "// Runs up to max_steps instructions and returns how many ran, like the other engines. The\n";
+	out += "// machine must hold the program this was generated from, and only its a operands may change.\n";
+	_aot_appendf(out, "inline uint64_t %s_run(subleq<%s_cell>* state, const uint64_t max_steps=UINT64_MAX, subleq_output_fn<%s_cell> FN_OnOutput=nullptr, void* userarg=nullptr)\n{\n", name, name, name);
+	_aot_appendf(out, "\ttypedef %s_cell T;\n", name);
+	out += "\tuint8_t* const mem = state->memory;\n\tuint64_t steps = 0;\n";
+	// The results of subtractions and a operands read as the program runs
+	const size_t vars = out.size();
+	_aot_appendf(out, "\t// A machine of another size runs on subleq_step alone\n\tconst bool native = state->memsize == %s_memsize;\n", name);
+	out += "\twhile (steps < max_steps && (size_t)state->_ip < state->memsize)\n\t{\n";
+	out += "\t\tswitch (native ? (size_t)state->_ip : SIZE_MAX)\n\t\t{\n";
+	for (const subleq_cfg_node& n : an->nodes)
+		_aot_appendf(out, "\t\tcase %llu: goto L_%llu;\n", (unsigned long long)n.ip, (unsigned long long)n.ip);
+	out += "\t\tdefault: break;\n\t\t}\n";
+	out += "\t\tif (!subleq_step(state, FN_OnOutput, userarg) && (size_t)state->_ip < state->memsize)\n\t\t\treturn steps;\n";
+	out += "\t\t++steps;\n\t}\n\tgoto stop;\n\n";
+
+	for (size_t i = 0; i < an->nodes.size(); ++i)
+	{
+		const size_t ip = an->nodes[i].ip;
+		const size_t next_block = i + 1 < an->nodes.size() ? an->nodes[i + 1].ip : SIZE_MAX;
+		subleq_decoded<T> d;
+		const bool whole = subleq_decode(sim, ip, d);
+		_aot_appendf(out, "L_%llu:\n\tif (steps == max_steps) { state->_ip = (T)%llu; goto stop; }\n", (unsigned long long)ip, (unsigned long long)ip);
+		const bool dynamic = whole && an->nodes[i].dynamic &&
+			(d.b == _subleq_addr((T)(-1)) || _subleq_in_bounds(sim, d.b));
+		if (!dynamic && d.op == SUBLEQ_OP_FAULT)
+		{
+			_aot_appendf(out, "\tstate->_ip = (T)%llu;\n\tstate->running = false;\n\treturn steps;\n", (unsigned long long)ip);
+			continue;
+		}
+		out += "\t++steps;\n";
+		if (dynamic)
+			_aot_emit_dynamic(out, sim, ip, d, next_block);
+		else if (d.op == SUBLEQ_OP_OUT)
+		{
+			_aot_appendf(out, "\tif (FN_OnOutput != nullptr)\n\t{\n\t\tconst T at = (T)%llu;\n", (unsigned long long)ip);
+			_aot_appendf(out, "\t\tFN_OnOutput(state, *(T*)(mem + %llu), at, userarg);\n\t}\n", (unsigned long long)d.a);
+			_aot_emit_jump(out, sim, d.c, next_block);
+		}
+		else if (d.op == SUBLEQ_OP_IN)
+		{
+			_aot_appendf(out, "\t*(T*)(mem + %llu) = _subleq_input<T>(state->input);\n", (unsigned long long)d.b);
+			_aot_emit_jump(out, sim, d.c, next_block);
+		}
+		else if (d.a == d.b)
+		{
+			_aot_appendf(out, "\t*(T*)(mem + %llu) = 0;\n", (unsigned long long)d.b);
+			_aot_emit_jump(out, sim, d.c, next_block);
+		}
+		else
+		{
+			_aot_appendf(out, "\tr = _subleq_sub(*(T*)(mem + %llu), *(T*)(mem + %llu));\n", (unsigned long long)d.b, (unsigned long long)d.a);
+			_aot_appendf(out, "\t*(T*)(mem + %llu) = r;\n", (unsigned long long)d.b);
+			_aot_emit_branch(out, sim, d, next_block);
+		}
+	}
+	out += "stop:\n\tstate->running = (size_t)state->_ip < state->memsize;\n\treturn steps;\n}\n";
+	const bool dynamic = out.find("\ta = ", vars) != std::string::npos;
+	if (out.find("\tr = ", vars) != std::string::npos)
+		out.insert(vars, dynamic ? "\tT r;\n\tsize_t a;\n" : "\tT r;\n");
+	else if (dynamic)
+		out.insert(vars, "\tsize_t a;\n");
+}
+
+// Writes C++ for the machine's program to out, with every name it defines starting with name
+template <typename T>
+AOT_RESULT aot_translate(const subleq<T>* sim, const char* name, std::string& out, aot_info* info=nullptr)
+{
+	aot_info unused;
+	if (info == nullptr)
+		info = &unused;
+	if (!((size_t)sim->_ip < sim->memsize))
+		return AOT_NO_CODE;
+	// An a operand may change when the program turns its instruction into an input (a == -1) or
+	// points it at another cell, a changed b or c could write or jump anywhere
+	subleq_analysis* an = create_subleq_analysis(sim);
+	if (!an->closed)
+	{
+		info->writer = an->writer;
+		info->written = an->written;
+		destroy_subleq_analysis(an);
+		return AOT_SELF_MODIFYING;
+	}
+	info->instructions = an->nodes.size();
+	for (const subleq_cfg_node& n : an->nodes)
+		info->dynamic += n.dynamic;
+
+	info->image = sim->memsize <= aot_max_image;
+	_aot_appendf(out, "// Generated from a SUBLEQ image by subleq-aot, %llu instructions\n", (unsigned long long)an->nodes.size());
+	out += "#pragma once\n#include \"aot.h\"\n\n";
+	_aot_appendf(out, "static_assert(std::endian::native == std::endian::%s, \"the image is in the byte order it was generated with\");\n",
+		std::endian::native == std::endian::little ? "little" : "big");
+	_aot_appendf(out, "typedef %s %s_cell;\n", _aot_cell_type(sizeof(T)), name);
+	_aot_appendf(out, "const size_t %s_memsize = %llu;\n\n", name, (unsigned long long)sim->memsize);
+	if (info->image)
+		_aot_emit_image(sim, name, out);
+	_aot_emit_run(sim, an, name, out);
+	destroy_subleq_analysis(an);
+	return AOT_OK;
+}
@@ -0,0 +1,113 @@
+// Ahead-of-time translator: turns a binary into C++ that runs its program natively
+//   subleq-aot [-n name] image.bin program.h
+#include <ctype.h>
+#include <fstream>
+#include "aot.h"
+#include "binfile.h"
+
+static void _aot_usage(const char* exe)
+{
+	fprintf(stderr,
+		"Usage: %s [-n name] image.bin program.h\n"
+		"  -n <name>      Prefix of everything the file defines, the image's file name by default\n",
+		exe);
+}
+
+// The file name without directories or extension, made into an identifier
+static std::string _aot_default_name(const char* path)
+{
+	std::string name = path;
+	const size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos)
+		name.erase(0, slash + 1);
+	const size_t dot = name.find('.');
+	if (dot != std::string::npos)
+		name.erase(dot);
+	for (char& c : name)
+		if (!isalnum((unsigned char)c))
+			c = '_';
+	if (name.empty() || isdigit((unsigned char)name[0]))
+		name.insert(0, "program_");
+	return name;
+}
+
+template <typename T>
+int _aot_translate_file(const char* image, const char* name, const char* out_name)
+{
+	subleq<T>* sim = nullptr;
+	const BIN_RESULT r = bin_load<T>(image, &sim);
+	if (r != BIN_OK)
+	{
+		fprintf(stderr, "Error: %s: %s\n", image, bin_result_str(r));
+		return 1;
+	}
+	std::string out;
+	aot_info info;
+	const AOT_RESULT a = aot_translate(sim, name, out, &info);
+	destroy_subleq(sim);
+	if (a == AOT_SELF_MODIFYING)
+	{
+		fprintf(stderr, "Error: %s, the instruction at %llu writes the cell at %llu\n", aot_result_str(a),
+			(unsigned long long)info.writer, (unsigned long long)info.written);
+		return 1;
+	}
+	if (a != AOT_OK)
+	{
+		fprintf(stderr, "Error: %s\n", aot_result_str(a));
+		return 1;
+	}
+
+	std::ofstream f(out_name, std::ios::binary);
+	f.write(out.data(), (std::streamsize)out.size());
+	if (!f)
+	{
+		fprintf(stderr, "Error: can't write %s\n", out_name);
+		return 1;
+	}
+	fprintf(stderr, "%llu instructions, %s\n", (unsigned long long)info.instructions,
+		info.image ? "with the image and a constexpr evaluator" : "without the image, it is too large");
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* image = nullptr;
+	const char* out_name = nullptr;
+	std::string name;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			name = argv[++i];
+		else if (argv[i][0] != '-' && image == nullptr)
+			image = argv[i];
+		else if (argv[i][0] != '-' && out_name == nullptr)
+			out_name = argv[i];
+		else
+		{
+			_aot_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (image == nullptr || out_name == nullptr)
+	{
+		_aot_usage(argv[0]);
+		return 1;
+	}
+	if (name.empty())
+		name = _aot_default_name(image);
+
+	uint8_t width = 0;
+	const BIN_RESULT r = bin_peek(image, &width);
+	if (r != BIN_OK)
+	{
+		fprintf(stderr, "Error: %s: %s\n", image, bin_result_str(r));
+		return 1;
+	}
+	switch (width)
+	{
+	case 1:		return _aot_translate_file<int8_t>(image, name.c_str(), out_name);
+	case 2:		return _aot_translate_file<int16_t>(image, name.c_str(), out_name);
+	case 4:		return _aot_translate_file<int32_t>(image, name.c_str(), out_name);
+	default:	return _aot_translate_file<int64_t>(image, name.c_str(), out_name);
+	}
+}
@@ -0,0 +1,1336 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "subleq.h"
+
+// Assembler for SUBLEQ source. Every line looks like
+//     [label:]... [mnemonic or .directive [operand, ...]] [; comment]
+// Operands are expressions over numbers (12, 0x1f, 0b101, 'a'), labels, .equ symbols,
+// $ (the address of the cell being written) and ? (the address of the cell after it) with
+// ( ) unary - ~ and binary * / % + - << >> & ^ |. Addresses are in bytes, like the ip.
+//
+//     subleq a, b[, c]	b -= a, jump to c if the result is <= 0, c defaults to the next instruction
+//     sub d, s			subleq s, d
+//     out a[, c]		Output the cell at a, then jump to c
+//     in b[, c]		Read an input byte into b, -1 at the end of input, then jump to c
+//     clr d			d = 0
+//     jmp c			Jump to c
+//     mov d, s			d = s
+//     add d, s			d += s
+//     halt				Jump out of memory
+//
+//     .data x, "text", ...	One cell per value or character
+//     .zero n				n cells of zero
+//     .org addr			Continue at addr, which may not go backwards
+//     .equ name, x			Define name as x
+//     .entry addr			Where the ip starts, 0 by default
+//     .width n			Cell width in bytes: 1, 2, 4 or 8, 1 by default
+//     .memsize n			Memory size in bytes, by default just big enough for the program
+//
+// jmp, mov, add and halt go through the scratch cell Z, which is allocated after the program
+// unless the source defines it. .org, .zero, .width and .memsize decide where everything goes,
+// so they can only use numbers, $ and .equ symbols that don't depend on labels.
+//
+// Sources are read in chunks and every line is parsed into postfix code that is kept around.
+// Assembling the same subleq_asm again only parses the lines that differ from last time, lays
+// everything out again and re-emits just the lines that were changed, moved, or use a symbol
+// whose value changed. The byte ranges that changed are left in patches, for copying into a
+// machine that is already running the old version.
+const uint8_t asm_default_width = 1;
+// Memory sizes past this are taken to be mistakes
+const size_t asm_max_memsize = (size_t)1 << 32;
+// Expressions may not need more than this many values on the stack at once
+const size_t asm_max_stack = 32;
+// How deep .equ symbols may be defined in terms of each other
+const unsigned asm_max_depth = 64;
+const size_t asm_chunk_size = 1 << 16;
+
+enum ASM_RESULT : uint8_t
+{
+	ASM_OK,
+	ASM_OPEN_FAILED,	// The source could not be opened
+	ASM_SYNTAX,			// A line could not be parsed
+	ASM_UNKNOWN,		// The mnemonic or directive doesn't exist
+	ASM_OPERANDS,		// Wrong number of operands
+	ASM_UNDEFINED,		// A symbol is used but never defined
+	ASM_REDEFINED,		// A symbol or directive is defined more than once
+	ASM_CYCLE,			// .equ symbols depend on each other in a loop, or too deeply
+	ASM_NOT_CONSTANT,	// A layout directive depends on a label
+	ASM_BAD_ORG,		// .org moves backwards
+	ASM_BAD_WIDTH,		// .width isn't 1, 2, 4 or 8
+	ASM_TOO_LARGE,		// The program doesn't fit in .memsize, or memory would be too large
+	ASM_DIV_ZERO,		// An expression divides by zero
+};
+
+inline const char* asm_result_str(const ASM_RESULT r)
+{
+	switch (r)
+	{
+	case ASM_OK:			return "OK";
+	case ASM_OPEN_FAILED:	return "Source could not be opened";
+	case ASM_SYNTAX:		return "Syntax error";
+	case ASM_UNKNOWN:		return "Unknown mnemonic or directive";
+	case ASM_OPERANDS:		return "Wrong number of operands";
+	case ASM_UNDEFINED:		return "Undefined symbol";
+	case ASM_REDEFINED:		return "Defined more than once";
+	case ASM_CYCLE:			return "Symbol depends on itself or is nested too deeply";
+	case ASM_NOT_CONSTANT:	return "Layout directives can't depend on labels";
+	case ASM_BAD_ORG:		return ".org can't move backwards";
+	case ASM_BAD_WIDTH:		return "Cell width must be 1, 2, 4 or 8";
+	case ASM_TOO_LARGE:		return "Program doesn't fit in memory";
+	case ASM_DIV_ZERO:		return "Division by zero";
+	default:				return "Unknown error";
+	}
+}
+
+enum ASM_OP : uint8_t
+{
+	OP_NUM,			// Pushes value
+	OP_SYM,			// Pushes the symbol with id value
+	OP_HERE,		// Pushes $
+	OP_NEXT,		// Pushes ?
+	OP_NEG,
+	OP_NOT,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_ADD,
+	OP_SUB,
+	OP_SHL,
+	OP_SHR,
+	OP_AND,
+	OP_XOR,
+	OP_OR,
+	OP_CELL,		// Pops a value and writes it as the next cell
+};
+
+struct asm_op
+{
+	ASM_OP op;
+	int64_t value;
+};
+
+enum ASM_LINE : uint8_t
+{
+	LINE_CELLS,		// Its ops write cells, this includes lines with nothing on them
+	LINE_ZERO,		// The rest are a single expression
+	LINE_ORG,
+	LINE_EQU,
+	LINE_ENTRY,
+	LINE_WIDTH,
+	LINE_MEMSIZE,
+};
+
+struct _asm_line
+{
+	// Of the text, lines with the same hash are taken to be unchanged
+	uint64_t hash = 0;
+	ASM_LINE kind = LINE_CELLS;
+	// Cells written by a LINE_CELLS line
+	uint64_t cells = 0;
+	// Where its cells go, after layout
+	size_t addr = 0;
+	size_t size = 0;
+	// Symbol ids of labels defined here, and of the .equ symbol
+	std::vector<uint32_t> labels;
+	uint32_t equ = UINT32_MAX;
+	std::vector<asm_op> ops;
+};
+
+enum ASM_SYMBOL : uint8_t
+{
+	SYM_UNDEFINED,
+	SYM_LABEL,
+	SYM_EQU,
+};
+
+struct _asm_symbol
+{
+	std::string name;
+	uint64_t hash = 0;
+	ASM_SYMBOL kind = SYM_UNDEFINED;
+	int64_t value = 0;
+	// Lines that refer to it, Z is only allocated while this isn't 0
+	uint32_t uses = 0;
+	// The line defining it
+	size_t line = 0;
+	// For .equ symbols: 0 not evaluated yet, 1 being evaluated, 2 done
+	uint8_t resolved = 0;
+	// Doesn't depend on any label
+	bool constant = false;
+	// Whether it was defined or had a different value in the assembly before
+	bool changed = false;
+};
+
+struct _asm_slot
+{
+	// Low bits of the hash, so most mismatches don't have to look at the entry
+	uint32_t hash;
+	// Entry index + 1, 0 for an empty slot
+	uint32_t index;
+};
+
+// Open addressing over the entries, ids never change once a name has been seen
+struct _asm_symbols
+{
+	std::vector<_asm_symbol> entries;
+	// The size is a power of two
+	std::vector<_asm_slot> slots;
+};
+
+struct asm_patch
+{
+	size_t addr;
+	size_t size;
+};
+
+struct subleq_asm
+{
+	uint8_t width = asm_default_width;
+	size_t memsize = 0;
+	int64_t ip = 0;
+	std::vector<uint8_t> image;
+	// Byte ranges of image that changed in the last assembly, only filled in when patchable
+	std::vector<asm_patch> patches;
+	// False after the first assembly, or when the cell width or memory size changed
+	bool patchable = false;
+	// 1-based, with the symbol or text the error was about
+	size_t error_line = 0;
+	std::string error_detail;
+
+	std::vector<_asm_line> lines;
+	_asm_symbols symbols;
+	// Id of the scratch cell the macros use
+	uint32_t z = 0;
+	// False after a failed assembly, the next one then starts from scratch
+	bool valid = false;
+	// Whether image holds a successful assembly, and its cell width. width and memsize may
+	// belong to a failed one.
+	bool has_image = false;
+	uint8_t image_width = 0;
+	// Operands of the line being parsed, where each of them starts, and what the line will run
+	std::vector<asm_op> scratch;
+	std::vector<size_t> starts;
+	std::vector<asm_op> emitted;
+};
+
+inline subleq_asm* create_subleq_asm()
+{ return new subleq_asm(); }
+
+inline void destroy_subleq_asm(subleq_asm* a)
+{ delete a; }
+
+inline uint64_t _asm_hash(const char* p, const char* end)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ull;
+	for (; p != end; ++p)
+		h = (h ^ (uint8_t)*p) * 1099511628211ull;
+	return h;
+}
+
+inline size_t _asm_slot_of(const uint64_t hash, const size_t num_slots)
+{ return (size_t)(hash ^ (hash >> 32)) & (num_slots - 1); }
+
+inline uint32_t _asm_intern(_asm_symbols& table, const char* name, const char* end)
+{
+	const uint64_t hash = _asm_hash(name, end);
+	const size_t len = (size_t)(end - name);
+	if (table.entries.size() * 2 >= table.slots.size())
+	{
+		std::vector<_asm_slot> slots(table.slots.empty() ? 1024 : table.slots.size() * 2, _asm_slot{ 0, 0 });
+		for (uint32_t i = 0; i < (uint32_t)table.entries.size(); ++i)
+		{
+			size_t s = _asm_slot_of(table.entries[i].hash, slots.size());
+			while (slots[s].index != 0)
+				s = (s + 1) & (slots.size() - 1);
+			slots[s] = { (uint32_t)table.entries[i].hash, i + 1 };
+		}
+		table.slots = std::move(slots);
+	}
+	size_t s = _asm_slot_of(hash, table.slots.size());
+	for (; table.slots[s].index != 0; s = (s + 1) & (table.slots.size() - 1))
+	{
+		if (table.slots[s].hash != (uint32_t)hash)
+			continue;
+		const _asm_symbol& sym = table.entries[table.slots[s].index - 1];
+		if (sym.name.size() == len && memcmp(sym.name.data(), name, len) == 0)
+			return table.slots[s].index - 1;
+	}
+	_asm_symbol sym;
+	sym.name.assign(name, len);
+	sym.hash = hash;
+	table.entries.push_back(std::move(sym));
+	table.slots[s] = { (uint32_t)hash, (uint32_t)table.entries.size() };
+	return (uint32_t)table.entries.size() - 1;
+}
+
+inline void _asm_put_cell(uint8_t* dst, const int64_t v, const uint8_t width)
+{
+	switch (width)
+	{
+	case 1:		{ const int8_t x = (int8_t)v; memcpy(dst, &x, 1); break; }
+	case 2:		{ const int16_t x = (int16_t)v; memcpy(dst, &x, 2); break; }
+	case 4:		{ const int32_t x = (int32_t)v; memcpy(dst, &x, 4); break; }
+	default:	memcpy(dst, &v, 8); break;
+	}
+}
+
+// Parsing
+
+inline bool _asm_ident_start(const char c)
+{ return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+
+inline bool _asm_ident_char(const char c)
+{ return _asm_ident_start(c) || (c >= '0' && c <= '9') || c == '.'; }
+
+struct _asm_parser
+{
+	subleq_asm* a;
+	const char* p;
+	const char* end;
+	// Stack depth of the expression being compiled
+	size_t depth;
+};
+
+inline void _asm_skip_space(_asm_parser& ps)
+{
+	while (ps.p != ps.end && (*ps.p == ' ' || *ps.p == '\t'))
+		++ps.p;
+	if (ps.p != ps.end && *ps.p == ';')
+		ps.p = ps.end;
+}
+
+inline ASM_RESULT _asm_syntax(_asm_parser& ps)
+{
+	const size_t len = (size_t)(ps.end - ps.p) < 24 ? (size_t)(ps.end - ps.p) : 24;
+	ps.a->error_detail.assign(ps.p, len);
+	return ASM_SYNTAX;
+}
+
+inline void _asm_push(_asm_parser& ps, const ASM_OP op, const int64_t value=0)
+{
+	ps.a->scratch.push_back({ op, value });
+	if (op <= OP_NEXT) ++ps.depth;
+	else if (op >= OP_MUL) --ps.depth;
+}
+
+// Counts every symbol a line refers to in or out of its uses
+inline void _asm_count_uses(subleq_asm* a, const _asm_line& line, const int32_t delta)
+{
+	for (const asm_op& op : line.ops)
+		if (op.op == OP_SYM)
+			a->symbols.entries[op.value].uses += delta;
+}
+
+// One character of a string or character literal, after the opening quote
+inline bool _asm_parse_char(_asm_parser& ps, int64_t& c)
+{
+	if (ps.p == ps.end)
+		return false;
+	c = (uint8_t)*ps.p++;
+	if (c != '\\')
+		return true;
+	if (ps.p == ps.end)
+		return false;
+	switch (*ps.p++)
+	{
+	case 'n':	c = '\n'; break;
+	case 't':	c = '\t'; break;
+	case 'r':	c = '\r'; break;
+	case '0':	c = 0; break;
+	case '\\':	c = '\\'; break;
+	case '\'':	c = '\''; break;
+	case '"':	c = '"'; break;
+	default:	return false;
+	}
+	return true;
+}
+
+inline bool _asm_parse_number(_asm_parser& ps, int64_t& value)
+{
+	uint64_t base = 10;
+	if (ps.end - ps.p > 2 && ps.p[0] == '0' && (ps.p[1] == 'x' || ps.p[1] == 'X')) { base = 16; ps.p += 2; }
+	else if (ps.end - ps.p > 2 && ps.p[0] == '0' && (ps.p[1] == 'b' || ps.p[1] == 'B')) { base = 2; ps.p += 2; }
+	uint64_t v = 0;
+	const char* start = ps.p;
+	for (; ps.p != ps.end; ++ps.p)
+	{
+		const char c = *ps.p;
+		uint64_t d = base;
+		if (c >= '0' && c <= '9') d = c - '0';
+		else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+		if (d >= base)
+			break;
+		v = v * base + d;
+	}
+	value = (int64_t)v;
+	return ps.p != start && (ps.p == ps.end || !_asm_ident_char(*ps.p));
+}
+
+inline ASM_RESULT _asm_parse_expr(_asm_parser& ps, int min_prec);
+
+inline ASM_RESULT _asm_parse_primary(_asm_parser& ps)
+{
+	_asm_skip_space(ps);
+	if (ps.p == ps.end)
+		return _asm_syntax(ps);
+	const char c = *ps.p;
+	if (c == '-' || c == '~' || c == '+')
+	{
+		++ps.p;
+		const ASM_RESULT r = _asm_parse_primary(ps);
+		if (r != ASM_OK)
+			return r;
+		if (c != '+')
+			_asm_push(ps, c == '-' ? OP_NEG : OP_NOT);
+	}
+	else if (c == '(')
+	{
+		++ps.p;
+		const ASM_RESULT r = _asm_parse_expr(ps, 0);
+		if (r != ASM_OK)
+			return r;
+		_asm_skip_space(ps);
+		if (ps.p == ps.end || *ps.p != ')')
+			return _asm_syntax(ps);
+		++ps.p;
+	}
+	else if (c >= '0' && c <= '9')
+	{
+		int64_t v = 0;
+		if (!_asm_parse_number(ps, v))
+			return _asm_syntax(ps);
+		_asm_push(ps, OP_NUM, v);
+	}
+	else if (c == '\'')
+	{
+		++ps.p;
+		int64_t v = 0;
+		if (!_asm_parse_char(ps, v) || ps.p == ps.end || *ps.p != '\'')
+			return _asm_syntax(ps);
+		++ps.p;
+		_asm_push(ps, OP_NUM, v);
+	}
+	else if (c == '$') { ++ps.p; _asm_push(ps, OP_HERE); }
+	else if (c == '?') { ++ps.p; _asm_push(ps, OP_NEXT); }
+	else if (_asm_ident_start(c))
+	{
+		const char* name = ps.p;
+		while (ps.p != ps.end && _asm_ident_char(*ps.p))
+			++ps.p;
+		_asm_push(ps, OP_SYM, _asm_intern(ps.a->symbols, name, ps.p));
+	}
+	else return _asm_syntax(ps);
+	if (ps.depth > asm_max_stack)
+	{
+		ps.a->error_detail = "expression too complex";
+		return ASM_SYNTAX;
+	}
+	return ASM_OK;
+}
+
+// Binary operators, higher precedence binds tighter
+inline int _asm_binary_op(const char* p, const char* end, ASM_OP& op, size_t& len)
+{
+	len = 1;
+	const char c = *p;
+	const char n = p + 1 != end ? p[1] : '\0';
+	switch (c)
+	{
+	case '*':	op = OP_MUL; return 5;
+	case '/':	op = OP_DIV; return 5;
+	case '%':	op = OP_MOD; return 5;
+	case '+':	op = OP_ADD; return 4;
+	case '-':	op = OP_SUB; return 4;
+	case '<':	if (n != '<') return -1; op = OP_SHL; len = 2; return 3;
+	case '>':	if (n != '>') return -1; op = OP_SHR; len = 2; return 3;
+	case '&':	op = OP_AND; return 2;
+	case '^':	op = OP_XOR; return 1;
+	case '|':	op = OP_OR; return 0;
+	default:	return -1;
+	}
+}
+
+inline ASM_RESULT _asm_parse_expr(_asm_parser& ps, const int min_prec)
+{
+	ASM_RESULT r = _asm_parse_primary(ps);
+	while (r == ASM_OK)
+	{
+		_asm_skip_space(ps);
+		if (ps.p == ps.end)
+			break;
+		ASM_OP op = OP_ADD;
+		size_t len = 0;
+		const int prec = _asm_binary_op(ps.p, ps.end, op, len);
+		if (prec < min_prec)
+			break;
+		ps.p += len;
+		if ((r = _asm_parse_expr(ps, prec + 1)) == ASM_OK)
+			_asm_push(ps, op);
+	}
+	return r;
+}
+
+// Appends operand i of the line being parsed as a cell
+inline void _asm_emit_operand(_asm_parser& ps, const size_t i)
+{
+	const std::vector<asm_op>& s = ps.a->scratch;
+	ps.a->emitted.insert(ps.a->emitted.end(), s.begin() + ps.a->starts[i], s.begin() + ps.a->starts[i + 1]);
+	ps.a->emitted.push_back({ OP_CELL, 0 });
+}
+
+inline void _asm_emit(_asm_parser& ps, const ASM_OP op, const int64_t value=0)
+{
+	ps.a->emitted.push_back({ op, value });
+	ps.a->emitted.push_back({ OP_CELL, 0 });
+}
+
+inline bool _asm_name_is(const char* name, const size_t len, const char* what)
+{
+	if (strlen(what) != len)
+		return false;
+	for (size_t i = 0; i < len; ++i)
+		if ((name[i] >= 'A' && name[i] <= 'Z' ? name[i] - 'A' + 'a' : name[i]) != what[i])
+			return false;
+	return true;
+}
+
+inline ASM_RESULT _asm_parse_line(subleq_asm* a, _asm_line& line, const char* p, const char* end)
+{
+	_asm_parser ps{ a, p, end, 0 };
+	while (true)
+	{
+		_asm_skip_space(ps);
+		const char* name = ps.p;
+		if (ps.p == ps.end || !_asm_ident_start(*ps.p))
+			break;
+		while (ps.p != ps.end && _asm_ident_char(*ps.p))
+			++ps.p;
+		const char* name_end = ps.p;
+		_asm_skip_space(ps);
+		if (ps.p == ps.end || *ps.p != ':')
+		{
+			ps.p = name;
+			break;
+		}
+		++ps.p;
+		line.labels.push_back(_asm_intern(a->symbols, name, name_end));
+	}
+	if (ps.p == ps.end)
+		return ASM_OK;
+
+	const char* name = ps.p;
+	if (*ps.p == '.')
+		++ps.p;
+	while (ps.p != ps.end && _asm_ident_char(*ps.p))
+		++ps.p;
+	const size_t name_len = (size_t)(ps.p - name);
+	if (name_len == 0)
+		return _asm_syntax(ps);
+
+	// .equ takes a name first
+	const bool equ = _asm_name_is(name, name_len, ".equ");
+	if (equ)
+	{
+		_asm_skip_space(ps);
+		const char* sym = ps.p;
+		while (ps.p != ps.end && _asm_ident_char(*ps.p))
+			++ps.p;
+		if (ps.p == sym || !_asm_ident_start(*sym))
+			return _asm_syntax(ps);
+		line.equ = _asm_intern(a->symbols, sym, ps.p);
+		_asm_skip_space(ps);
+		if (ps.p == ps.end || *ps.p != ',')
+			return _asm_syntax(ps);
+		++ps.p;
+	}
+
+	// Operands are compiled into scratch, .data writes its cells straight away
+	const bool data = _asm_name_is(name, name_len, ".data");
+	std::vector<size_t>& starts = a->starts;
+	a->scratch.clear();
+	a->emitted.clear();
+	starts.assign(1, 0);
+	_asm_skip_space(ps);
+	while (ps.p != ps.end)
+	{
+		if (data && *ps.p == '"')
+		{
+			++ps.p;
+			while (ps.p != ps.end && *ps.p != '"')
+			{
+				int64_t c = 0;
+				if (!_asm_parse_char(ps, c))
+					return _asm_syntax(ps);
+				_asm_emit(ps, OP_NUM, c);
+				line.cells++;
+			}
+			if (ps.p == ps.end)
+				return _asm_syntax(ps);
+			++ps.p;
+		}
+		else
+		{
+			ps.depth = 0;
+			const ASM_RESULT r = _asm_parse_expr(ps, 0);
+			if (r != ASM_OK)
+				return r;
+			starts.push_back(a->scratch.size());
+			if (data)
+			{
+				_asm_emit_operand(ps, starts.size() - 2);
+				line.cells++;
+			}
+		}
+		_asm_skip_space(ps);
+		if (ps.p == ps.end)
+			break;
+		if (*ps.p != ',')
+			return _asm_syntax(ps);
+		++ps.p;
+		_asm_skip_space(ps);
+	}
+	if (data)
+	{
+		line.ops.assign(a->emitted.begin(), a->emitted.end());
+		return ASM_OK;
+	}
+
+	const size_t n = starts.size() - 1;
+	auto operands = [&](const size_t min, const size_t max) {
+		if (n >= min && n <= max)
+			return true;
+		a->error_detail.assign(name, name_len);
+		return false;
+	};
+	// Three cells per instruction, with c defaulting to the next one
+	auto instr = [&](const int64_t x, const int64_t y) {
+		if (x >= 0) _asm_emit_operand(ps, (size_t)x); else _asm_emit(ps, OP_SYM, a->z);
+		if (y >= 0) _asm_emit_operand(ps, (size_t)y); else _asm_emit(ps, OP_SYM, a->z);
+		_asm_emit(ps, OP_NEXT);
+		line.cells += 3;
+	};
+	// Operand -1 is Z
+	const int64_t Z = -1;
+
+	if (_asm_name_is(name, name_len, "subleq"))
+	{
+		if (!operands(2, 3)) return ASM_OPERANDS;
+		_asm_emit_operand(ps, 0);
+		_asm_emit_operand(ps, 1);
+		if (n == 3) _asm_emit_operand(ps, 2); else _asm_emit(ps, OP_NEXT);
+		line.cells = 3;
+	}
+	else if (_asm_name_is(name, name_len, "out"))
+	{
+		if (!operands(1, 2)) return ASM_OPERANDS;
+		_asm_emit_operand(ps, 0);
+		_asm_emit(ps, OP_NUM, -1);
+		if (n == 2) _asm_emit_operand(ps, 1); else _asm_emit(ps, OP_NEXT);
+		line.cells = 3;
+	}
+	else if (_asm_name_is(name, name_len, "in"))
+	{
+		if (!operands(1, 2)) return ASM_OPERANDS;
+		_asm_emit(ps, OP_NUM, -1);
+		_asm_emit_operand(ps, 0);
+		if (n == 2) _asm_emit_operand(ps, 1); else _asm_emit(ps, OP_NEXT);
+		line.cells = 3;
+	}
+	else if (_asm_name_is(name, name_len, "sub"))
+	{
+		if (!operands(2, 2)) return ASM_OPERANDS;
+		instr(1, 0);
+	}
+	else if (_asm_name_is(name, name_len, "clr"))
+	{
+		if (!operands(1, 1)) return ASM_OPERANDS;
+		instr(0, 0);
+	}
+	else if (_asm_name_is(name, name_len, "jmp") || _asm_name_is(name, name_len, "halt"))
+	{
+		const bool halt = name_len == 4;
+		if (!operands(!halt, !halt)) return ASM_OPERANDS;
+		_asm_emit(ps, OP_SYM, a->z);
+		_asm_emit(ps, OP_SYM, a->z);
+		if (halt) _asm_emit(ps, OP_NUM, -1); else _asm_emit_operand(ps, 0);
+		line.cells = 3;
+	}
+	else if (_asm_name_is(name, name_len, "mov"))
+	{
+		if (!operands(2, 2)) return ASM_OPERANDS;
+		instr(0, 0);
+		instr(1, Z);
+		instr(Z, 0);
+		instr(Z, Z);
+	}
+	else if (_asm_name_is(name, name_len, "add"))
+	{
+		if (!operands(2, 2)) return ASM_OPERANDS;
+		instr(1, Z);
+		instr(Z, 0);
+		instr(Z, Z);
+	}
+	else
+	{
+		ASM_LINE kind = LINE_CELLS;
+		if (equ) kind = LINE_EQU;
+		else if (_asm_name_is(name, name_len, ".zero")) kind = LINE_ZERO;
+		else if (_asm_name_is(name, name_len, ".org")) kind = LINE_ORG;
+		else if (_asm_name_is(name, name_len, ".entry")) kind = LINE_ENTRY;
+		else if (_asm_name_is(name, name_len, ".width")) kind = LINE_WIDTH;
+		else if (_asm_name_is(name, name_len, ".memsize")) kind = LINE_MEMSIZE;
+		else
+		{
+			a->error_detail.assign(name, name_len);
+			return ASM_UNKNOWN;
+		}
+		if (!operands(1, 1)) return ASM_OPERANDS;
+		line.kind = kind;
+		line.ops = a->scratch;
+		return ASM_OK;
+	}
+	line.ops.assign(a->emitted.begin(), a->emitted.end());
+	return ASM_OK;
+}
+
+// Evaluation
+
+struct _asm_eval
+{
+	// Labels don't have addresses yet
+	bool constant = false;
+	bool used_label = false;
+	unsigned depth = 0;
+};
+
+inline ASM_RESULT _asm_run(subleq_asm* a, const _asm_line& line, size_t here, _asm_eval& ev, int64_t& value, uint8_t* out);
+
+inline ASM_RESULT _asm_symbol_value(subleq_asm* a, const uint32_t id, _asm_eval& ev, int64_t& value)
+{
+	_asm_symbol& sym = a->symbols.entries[id];
+	ASM_RESULT r = ASM_OK;
+	if (sym.kind == SYM_UNDEFINED)
+		r = ASM_UNDEFINED;
+	else if (sym.kind == SYM_LABEL)
+	{
+		if (ev.constant)
+			r = ASM_NOT_CONSTANT;
+		ev.used_label = true;
+	}
+	else if (sym.resolved == 2)
+	{
+		if (ev.constant && !sym.constant)
+			r = ASM_NOT_CONSTANT;
+		ev.used_label |= !sym.constant;
+	}
+	else if (sym.resolved == 1 || ev.depth >= asm_max_depth)
+		r = ASM_CYCLE;
+	else
+	{
+		sym.resolved = 1;
+		_asm_eval inner;
+		inner.constant = ev.constant;
+		inner.depth = ev.depth + 1;
+		const _asm_line& def = a->lines[sym.line];
+		int64_t v = 0;
+		r = _asm_run(a, def, def.addr, inner, v, nullptr);
+		if (r != ASM_OK)
+		{
+			// Worked out again once labels are known
+			sym.resolved = 0;
+			return r;
+		}
+		sym.value = v;
+		sym.resolved = 2;
+		sym.constant = !inner.used_label;
+		ev.used_label |= inner.used_label;
+	}
+	if (r != ASM_OK)
+	{
+		if (a->error_detail.empty())
+			a->error_detail = sym.name;
+		return r;
+	}
+	value = sym.value;
+	return ASM_OK;
+}
+
+// Runs a line's ops from here. Cells are written to out, other lines leave the value of
+// their expression in value.
+inline ASM_RESULT _asm_run(subleq_asm* a, const _asm_line& line, size_t here, _asm_eval& ev, int64_t& value, uint8_t* out)
+{
+	int64_t stack[asm_max_stack];
+	size_t sp = 0;
+	for (const asm_op& op : line.ops)
+	{
+		if (op.op == OP_NUM) stack[sp++] = op.value;
+		else if (op.op == OP_SYM)
+		{
+			const ASM_RESULT r = _asm_symbol_value(a, (uint32_t)op.value, ev, stack[sp]);
+			if (r != ASM_OK)
+			{
+				if (a->error_line == 0)
+					a->error_line = (size_t)(&line - a->lines.data()) + 1;
+				return r;
+			}
+			++sp;
+		}
+		else if (op.op == OP_HERE || op.op == OP_NEXT)
+		{
+			// Where an .equ is written has nothing to do with where it is used
+			if (ev.constant && ev.depth > 0)
+			{
+				a->error_detail = "$";
+				return ASM_NOT_CONSTANT;
+			}
+			ev.used_label |= ev.depth > 0;
+			stack[sp++] = (int64_t)(here + (op.op == OP_NEXT ? a->width : 0));
+		}
+		else if (op.op == OP_NEG) stack[sp - 1] = (int64_t)(0 - (uint64_t)stack[sp - 1]);
+		else if (op.op == OP_NOT) stack[sp - 1] = ~stack[sp - 1];
+		else if (op.op == OP_CELL)
+		{
+			_asm_put_cell(out, stack[--sp], a->width);
+			out += a->width;
+			here += a->width;
+		}
+		else
+		{
+			const int64_t y = stack[--sp];
+			int64_t& x = stack[sp - 1];
+			switch (op.op)
+			{
+			case OP_MUL:	x = (int64_t)((uint64_t)x * (uint64_t)y); break;
+			case OP_ADD:	x = (int64_t)((uint64_t)x + (uint64_t)y); break;
+			case OP_SUB:	x = (int64_t)((uint64_t)x - (uint64_t)y); break;
+			case OP_SHL:	x = (int64_t)((uint64_t)x << (y & 63)); break;
+			case OP_SHR:	x = x >> (y & 63); break;
+			case OP_AND:	x &= y; break;
+			case OP_XOR:	x ^= y; break;
+			case OP_OR:		x |= y; break;
+			default:
+				if (y == 0)
+				{
+					if (a->error_line == 0)
+						a->error_line = (size_t)(&line - a->lines.data()) + 1;
+					return ASM_DIV_ZERO;
+				}
+				// INT64_MIN / -1 overflows
+				if (y == -1) x = op.op == OP_DIV ? (int64_t)(0 - (uint64_t)x) : 0;
+				else x = op.op == OP_DIV ? x / y : x % y;
+				break;
+			}
+		}
+	}
+	value = sp > 0 ? stack[sp - 1] : 0;
+	return ASM_OK;
+}
+
+// Evaluates a layout directive, which can't depend on labels
+inline ASM_RESULT _asm_constant(subleq_asm* a, const size_t i, const size_t here, int64_t& value)
+{
+	_asm_eval ev;
+	ev.constant = true;
+	const ASM_RESULT r = _asm_run(a, a->lines[i], here, ev, value, nullptr);
+	if (r != ASM_OK && a->error_line == 0)
+		a->error_line = i + 1;
+	return r;
+}
+
+// Defines every symbol and works out where every line goes
+inline ASM_RESULT _asm_layout(subleq_asm* a)
+{
+	std::vector<_asm_symbol>& syms = a->symbols.entries;
+	std::vector<int64_t> old_values(syms.size());
+	std::vector<uint8_t> old_defined(syms.size());
+	for (size_t i = 0; i < syms.size(); ++i)
+	{
+		old_values[i] = syms[i].value;
+		old_defined[i] = syms[i].kind != SYM_UNDEFINED;
+		syms[i].kind = SYM_UNDEFINED;
+		syms[i].value = 0;
+		syms[i].resolved = 0;
+	}
+
+	size_t width_line = SIZE_MAX, memsize_line = SIZE_MAX, entry_line = SIZE_MAX;
+	for (size_t i = 0; i < a->lines.size(); ++i)
+	{
+		const _asm_line& line = a->lines[i];
+		auto define = [&](const uint32_t id, const ASM_SYMBOL kind) {
+			_asm_symbol& sym = syms[id];
+			if (sym.kind != SYM_UNDEFINED)
+			{
+				a->error_line = i + 1;
+				a->error_detail = sym.name;
+				return false;
+			}
+			sym.kind = kind;
+			sym.line = i;
+			return true;
+		};
+		for (const uint32_t id : line.labels)
+			if (!define(id, SYM_LABEL))
+				return ASM_REDEFINED;
+		if (line.equ != UINT32_MAX && !define(line.equ, SYM_EQU))
+			return ASM_REDEFINED;
+
+		size_t* once = line.kind == LINE_WIDTH ? &width_line : line.kind == LINE_MEMSIZE ? &memsize_line : line.kind == LINE_ENTRY ? &entry_line : nullptr;
+		if (once == nullptr)
+			continue;
+		if (*once != SIZE_MAX)
+		{
+			a->error_line = i + 1;
+			a->error_detail = line.kind == LINE_WIDTH ? ".width" : line.kind == LINE_MEMSIZE ? ".memsize" : ".entry";
+			return ASM_REDEFINED;
+		}
+		*once = i;
+	}
+
+	int64_t v = asm_default_width;
+	if (width_line != SIZE_MAX)
+	{
+		const ASM_RESULT r = _asm_constant(a, width_line, 0, v);
+		if (r != ASM_OK)
+			return r;
+		if (v != 1 && v != 2 && v != 4 && v != 8)
+		{
+			a->error_line = width_line + 1;
+			return ASM_BAD_WIDTH;
+		}
+	}
+	a->width = (uint8_t)v;
+
+	size_t addr = 0;
+	for (size_t i = 0; i < a->lines.size(); ++i)
+	{
+		_asm_line& line = a->lines[i];
+		uint64_t cells = line.cells;
+		if (line.kind == LINE_ORG || line.kind == LINE_ZERO)
+		{
+			const ASM_RESULT r = _asm_constant(a, i, addr, v);
+			if (r != ASM_OK)
+				return r;
+			if (line.kind == LINE_ORG && (uint64_t)v < addr)
+			{
+				a->error_line = i + 1;
+				return ASM_BAD_ORG;
+			}
+			if (line.kind == LINE_ORG) addr = (size_t)v;
+			else cells = (uint64_t)v;
+		}
+		if (addr > asm_max_memsize || cells > (asm_max_memsize - addr) / a->width)
+		{
+			a->error_line = i + 1;
+			return ASM_TOO_LARGE;
+		}
+		line.addr = addr;
+		line.size = line.kind == LINE_CELLS || line.kind == LINE_ZERO ? (size_t)cells * a->width : 0;
+		addr += line.size;
+		for (const uint32_t id : line.labels)
+			syms[id].value = (int64_t)line.addr;
+	}
+
+	// Z goes after the program unless the program has its own
+	_asm_symbol& z = syms[a->z];
+	if (z.kind == SYM_UNDEFINED && z.uses > 0)
+	{
+		z.kind = SYM_LABEL;
+		z.value = (int64_t)addr;
+		z.line = a->lines.size();
+		addr += a->width;
+	}
+
+	a->memsize = addr;
+	if (memsize_line != SIZE_MAX)
+	{
+		const ASM_RESULT r = _asm_constant(a, memsize_line, 0, v);
+		if (r != ASM_OK)
+			return r;
+		if ((uint64_t)v < addr || (uint64_t)v > asm_max_memsize)
+		{
+			a->error_line = memsize_line + 1;
+			return ASM_TOO_LARGE;
+		}
+		a->memsize = (size_t)v;
+	}
+
+	_asm_eval ev;
+	for (uint32_t id = 0; id < (uint32_t)syms.size(); ++id)
+	{
+		const ASM_RESULT r = syms[id].kind == SYM_EQU ? _asm_symbol_value(a, id, ev, v) : ASM_OK;
+		if (r != ASM_OK)
+		{
+			if (a->error_line == 0)
+				a->error_line = syms[id].line + 1;
+			return r;
+		}
+		syms[id].changed = syms[id].value != old_values[id] || (syms[id].kind != SYM_UNDEFINED) != old_defined[id];
+	}
+
+	a->ip = 0;
+	if (entry_line != SIZE_MAX)
+	{
+		const ASM_RESULT r = _asm_run(a, a->lines[entry_line], a->lines[entry_line].addr, ev, a->ip, nullptr);
+		if (r != ASM_OK)
+			return r;
+	}
+	return ASM_OK;
+}
+
+// What reading the new source found
+struct _asm_update
+{
+	// Lines that matched the start of the old source
+	size_t prefix = 0;
+	bool in_prefix = true;
+	// The lines after that. With no old lines to compare with they are parsed as they are
+	// read, otherwise they are kept as text until the unchanged end of the source is known.
+	std::deque<_asm_line> pending;
+	std::vector<uint64_t> hashes;
+	std::vector<size_t> ends;
+	std::string text;
+};
+
+inline ASM_RESULT _asm_take_line(subleq_asm* a, _asm_update& u, const char* p, const char* end)
+{
+	if (end != p && end[-1] == '\r')
+		--end;
+	const uint64_t hash = _asm_hash(p, end);
+	if (u.in_prefix && u.prefix < a->lines.size() && a->lines[u.prefix].hash == hash)
+	{
+		++u.prefix;
+		return ASM_OK;
+	}
+	u.in_prefix = false;
+	if (!a->lines.empty())
+	{
+		u.hashes.push_back(hash);
+		u.text.append(p, end);
+		u.ends.push_back(u.text.size());
+		return ASM_OK;
+	}
+	u.pending.emplace_back();
+	_asm_line& line = u.pending.back();
+	line.hash = hash;
+	const ASM_RESULT r = _asm_parse_line(a, line, p, end);
+	if (r != ASM_OK)
+		a->error_line = u.prefix + u.pending.size();
+	_asm_count_uses(a, line, 1);
+	return r;
+}
+
+// Ranges mostly arrive in order, so they are joined to the last one as they come in
+inline void _asm_add_patch(std::vector<asm_patch>& patches, const asm_patch& p)
+{
+	if (p.size == 0)
+		return;
+	asm_patch* last = patches.empty() ? nullptr : &patches.back();
+	if (last != nullptr && p.addr >= last->addr && p.addr <= last->addr + last->size)
+		last->size = std::max(last->size, p.addr + p.size - last->addr);
+	else patches.push_back(p);
+}
+
+// Sorts and joins touching ranges
+inline void _asm_merge_patches(std::vector<asm_patch>& patches)
+{
+	std::sort(patches.begin(), patches.end(), [](const asm_patch& x, const asm_patch& y) { return x.addr < y.addr; });
+	size_t n = 0;
+	for (const asm_patch& p : patches)
+	{
+		if (p.size == 0)
+			continue;
+		if (n > 0 && p.addr <= patches[n - 1].addr + patches[n - 1].size)
+		{
+			const size_t end = std::max(patches[n - 1].addr + patches[n - 1].size, p.addr + p.size);
+			patches[n - 1].size = end - patches[n - 1].addr;
+		}
+		else patches[n++] = p;
+	}
+	patches.resize(n);
+}
+
+// Swaps the new lines in, lays them out and writes the image
+inline ASM_RESULT _asm_finish(subleq_asm* a, _asm_update& u)
+{
+	const size_t n_old = a->lines.size();
+	const size_t p = u.prefix;
+	const size_t n_pend = u.pending.size() + u.hashes.size();
+	size_t s = 0;
+	while (s < n_pend && s < n_old - p && u.hashes[n_pend - 1 - s] == a->lines[n_old - 1 - s].hash)
+		++s;
+	const size_t n_new = p + n_pend;
+	for (size_t i = 0; i < n_pend - s && !u.hashes.empty(); ++i)
+	{
+		u.pending.emplace_back();
+		_asm_line& line = u.pending.back();
+		line.hash = u.hashes[i];
+		const size_t start = i > 0 ? u.ends[i - 1] : 0;
+		const ASM_RESULT r = _asm_parse_line(a, line, u.text.data() + start, u.text.data() + u.ends[i]);
+		_asm_count_uses(a, line, 1);
+		if (r != ASM_OK)
+		{
+			a->error_line = p + i + 1;
+			return r;
+		}
+	}
+
+	// Where the old lines were, to spot the ones that moved
+	std::vector<asm_patch> old_ranges(n_old);
+	for (size_t i = 0; i < n_old; ++i)
+		old_ranges[i] = { a->lines[i].addr, a->lines[i].size };
+
+	for (size_t i = p; i < n_old - s; ++i)
+		_asm_count_uses(a, a->lines[i], -1);
+	a->lines.erase(a->lines.begin() + p, a->lines.begin() + (n_old - s));
+	a->lines.insert(a->lines.begin() + p, std::make_move_iterator(u.pending.begin()), std::make_move_iterator(u.pending.end()));
+
+	ASM_RESULT r = _asm_layout(a);
+	if (r != ASM_OK)
+		return r;
+	const std::vector<_asm_symbol>& syms = a->symbols.entries;
+	const bool full = !a->valid || a->width != a->image_width;
+	const bool same_machine = a->has_image && a->width == a->image_width && a->memsize == a->image.size();
+
+	// Lines are evaluated into scratch first, so a failure leaves the image as it was
+	std::vector<size_t> redo;
+	std::vector<asm_patch> cleared;
+	size_t scratch_size = 0;
+	for (size_t i = 0; i < n_new; ++i)
+	{
+		const _asm_line& line = a->lines[i];
+		const bool is_new = i >= p && i < n_new - s;
+		const size_t old = i < p ? i : i - n_new + n_old;
+		bool need = full || is_new || line.addr != old_ranges[old].addr || line.size != old_ranges[old].size;
+		if (!full && !is_new && need)
+			_asm_add_patch(cleared, old_ranges[old]);
+		for (size_t j = 0; !need && j < line.ops.size(); ++j)
+			need = line.ops[j].op == OP_SYM && syms[line.ops[j].value].changed;
+		if (!need || line.size == 0)
+			continue;
+		if (line.kind == LINE_ZERO)
+			_asm_add_patch(cleared, { line.addr, line.size });
+		else
+		{
+			redo.push_back(i);
+			scratch_size += line.size;
+		}
+	}
+	if (!full)
+	{
+		for (size_t i = p; i < n_old - s; ++i)
+			_asm_add_patch(cleared, old_ranges[i]);
+		const _asm_symbol& z = syms[a->z];
+		if (z.changed && z.kind == SYM_LABEL && z.line == n_new)
+			_asm_add_patch(cleared, { (size_t)z.value, a->width });
+	}
+
+	std::vector<uint8_t> out(scratch_size);
+	size_t offset = 0;
+	for (const size_t i : redo)
+	{
+		const _asm_line& line = a->lines[i];
+		_asm_eval ev;
+		int64_t v = 0;
+		if ((r = _asm_run(a, line, line.addr, ev, v, out.data() + offset)) != ASM_OK)
+			return r;
+		offset += line.size;
+	}
+
+	std::vector<uint8_t> before;
+	if (full)
+	{
+		before = std::move(a->image);
+		a->image.assign(a->memsize, 0);
+	}
+	else a->image.resize(a->memsize, 0);
+	a->patches.clear();
+	for (asm_patch& c : cleared)
+	{
+		if (c.addr >= a->memsize)
+			continue;
+		c.size = std::min(c.size, a->memsize - c.addr);
+		memset(a->image.data() + c.addr, 0, c.size);
+		_asm_add_patch(a->patches, c);
+	}
+	offset = 0;
+	for (const size_t i : redo)
+	{
+		const _asm_line& line = a->lines[i];
+		memcpy(a->image.data() + line.addr, out.data() + offset, line.size);
+		offset += line.size;
+		_asm_add_patch(a->patches, { line.addr, line.size });
+	}
+
+	if (full)
+	{
+		// Everything was written again, so compare with what was there before
+		a->patches.clear();
+		if (same_machine)
+		{
+			const size_t block = 64;
+			for (size_t addr = 0; addr < a->memsize;)
+			{
+				if (addr % block == 0 && a->memsize - addr >= block && memcmp(&a->image[addr], &before[addr], block) == 0)
+				{
+					addr += block;
+					continue;
+				}
+				if (a->image[addr] == before[addr])
+				{
+					++addr;
+					continue;
+				}
+				const size_t start = addr;
+				while (addr < a->memsize && a->image[addr] != before[addr])
+					++addr;
+				a->patches.push_back({ start, addr - start });
+			}
+		}
+	}
+	_asm_merge_patches(a->patches);
+	a->patchable = same_machine;
+	if (!a->patchable)
+		a->patches.clear();
+	return ASM_OK;
+}
+
+inline void _asm_begin(subleq_asm* a)
+{
+	a->error_line = 0;
+	a->error_detail.clear();
+	if (!a->valid)
+	{
+		a->lines.clear();
+		a->symbols = _asm_symbols();
+		a->z = _asm_intern(a->symbols, "Z", "Z" + 1);
+	}
+}
+
+inline ASM_RESULT _asm_end(subleq_asm* a, _asm_update& u, ASM_RESULT r)
+{
+	if (r == ASM_OK)
+		r = _asm_finish(a, u);
+	a->valid = r == ASM_OK;
+	if (a->valid)
+	{
+		a->has_image = true;
+		a->image_width = a->width;
+	}
+	if (!a->valid)
+	{
+		a->patchable = false;
+		a->patches.clear();
+	}
+	return r;
+}
+
+// Assembles source text held in memory
+inline ASM_RESULT subleq_asm_source(subleq_asm* a, const char* text, const size_t size)
+{
+	_asm_begin(a);
+	_asm_update u;
+	ASM_RESULT r = ASM_OK;
+	const char* end = text + size;
+	for (const char* p = text; r == ASM_OK && p != end;)
+	{
+		const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+		const char* line_end = nl != nullptr ? nl : end;
+		r = _asm_take_line(a, u, p, line_end);
+		p = nl != nullptr ? nl + 1 : end;
+	}
+	return _asm_end(a, u, r);
+}
+
+// Assembles a source file, reading it in chunks
+inline ASM_RESULT subleq_asm_file(subleq_asm* a, const char* fname)
+{
+	std::ifstream f(fname, std::ios::binary);
+	if (!f.is_open())
+		return ASM_OPEN_FAILED;
+	_asm_begin(a);
+	_asm_update u;
+	ASM_RESULT r = ASM_OK;
+	std::vector<char> buf(asm_chunk_size);
+	// The start of a line that ran over the end of a chunk
+	std::string carry;
+	while (r == ASM_OK && f)
+	{
+		f.read(buf.data(), buf.size());
+		const size_t n = (size_t)f.gcount();
+		const char* end = buf.data() + n;
+		const char* p = buf.data();
+		while (r == ASM_OK)
+		{
+			const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+			if (nl == nullptr)
+			{
+				carry.append(p, end);
+				break;
+			}
+			if (carry.empty())
+				r = _asm_take_line(a, u, p, nl);
+			else
+			{
+				carry.append(p, nl);
+				r = _asm_take_line(a, u, carry.data(), carry.data() + carry.size());
+				carry.clear();
+			}
+			p = nl + 1;
+		}
+	}
+	if (r == ASM_OK && !carry.empty())
+		r = _asm_take_line(a, u, carry.data(), carry.data() + carry.size());
+	return _asm_end(a, u, r);
+}
+
+// The 1-based source line whose cells hold addr, 0 if there is none
+inline size_t subleq_asm_line_at(const subleq_asm* a, const size_t addr)
+{
+	if (!a->valid)
+		return 0;
+	auto it = std::upper_bound(a->lines.begin(), a->lines.end(), addr, [](const size_t x, const _asm_line& line) { return x < line.addr; });
+	while (it != a->lines.begin())
+	{
+		--it;
+		if (it->size > 0)
+			return addr < it->addr + it->size ? (size_t)(it - a->lines.begin()) + 1 : 0;
+	}
+	return 0;
+}
+
+// The address of the first cell written at or after a 1-based source line, SIZE_MAX if none is
+inline size_t subleq_asm_addr_of(const subleq_asm* a, const size_t line)
+{
+	if (!a->valid || line == 0)
+		return SIZE_MAX;
+	for (size_t i = line - 1; i < a->lines.size(); ++i)
+		if (a->lines[i].size > 0)
+			return a->lines[i].addr;
+	return SIZE_MAX;
+}
+
+// Creates a machine holding the assembled image, nullptr if it couldn't be allocated
+template <typename T>
+subleq<T>* subleq_asm_build(const subleq_asm* a)
+{
+	subleq<T>* sim = create_subleq<T>(a->memsize);
+	if (sim == nullptr)
+		return nullptr;
+	memcpy(sim->memory, a->image.data(), a->memsize);
+	sim->_ip = (T)a->ip;
+	return sim;
+}
+
+// Copies what the last assembly changed into a machine running the one before it
+template <typename T>
+void subleq_asm_patch(const subleq_asm* a, subleq<T>* sim)
+{
+	for (const asm_patch& p : a->patches)
+		memcpy(sim->memory + p.addr, a->image.data() + p.addr, p.size);
+}
@@ -0,0 +1,549 @@
+#pragma once
+#include <vector>
+#include "binfile.h"
+#include "subleq.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Many instances of one program advanced in lockstep, for sweeps over the same image with
+// different inputs patched in. Instances are stepped in groups of batch_lane_width, and a
+// group's memory is interleaved: cell k of every instance in the group sits in row k, one
+// cell per lane. When the lanes of a group share an ip, the instruction, both operands and
+// the result are read and written a whole row at a time, so with AVX2 a step of all eight
+// instances costs about as much as one step of a single machine.
+//
+// Instances may diverge, each runs its own ip. Every step, the lanes at the lowest ip take
+// their step and the rest wait, which pulls lanes that left a loop early back into step
+// with the ones still inside it. Halted or faulted instances and ones out of steps are
+// masked out. Lanes that can't take the row step (input, output, operands that differ
+// between instances or straddle cells) run one instance at a time.
+//
+// Input instructions read -1, as there is no input, and output is collected per instance.
+const size_t batch_lane_width = 8;
+// Bytes after each group's memory that the row loads may touch
+const size_t batch_padding = 64;
+// Steps a group takes before its counters are folded into steps, so they fit in 32 bits
+const uint32_t batch_pass_steps = 1u << 30;
+
+template <typename T>
+struct subleq_batch
+{
+	// ips are kept sign extended, 32-bit when the cell fits so a group's ips fill one vector
+	typedef std::conditional_t<sizeof(T) <= 4, int32_t, int64_t> ip_t;
+
+	size_t count;
+	size_t memsize;						// Per instance, in bytes
+	size_t group_bytes;					// Bytes between the memory of neighbouring groups
+	// Indexed by instance, padded to whole groups with instances that never run
+	std::vector<ip_t> ip;
+	std::vector<int32_t> running;		// -1 while the instance is running, else 0
+	std::vector<uint64_t> steps;		// Instructions executed by each instance
+	std::vector<std::vector<char>> output;
+	uint8_t* memory;
+};
+
+// Where byte addr of the instance in lane lies in its group's memory
+template <typename T>
+constexpr size_t _batch_offset(const size_t addr, const size_t lane)
+{ return ((addr / sizeof(T)) * batch_lane_width + lane) * sizeof(T) + addr % sizeof(T); }
+
+template <typename T>
+inline uint8_t* _batch_group_memory(const subleq_batch<T>* batch, const size_t instance)
+{ return batch->memory + instance / batch_lane_width * batch->group_bytes; }
+
+template <typename T>
+inline bool _batch_in_bounds(const subleq_batch<T>* batch, const size_t addr)
+{ return addr <= batch->memsize && batch->memsize - addr >= sizeof(T); }
+
+template <typename T>
+inline bool _batch_ip_running(const subleq_batch<T>* batch, const typename subleq_batch<T>::ip_t ip)
+{ return ip >= 0 && (size_t)ip < batch->memsize; }
+
+// Creates count copies of image, all starting at its ip. Returns nullptr on allocation failure.
+template <typename T>
+subleq_batch<T>* create_subleq_batch(const subleq<T>* image, const size_t count)
+{
+	const size_t groups = (count + batch_lane_width - 1) / batch_lane_width;
+	const size_t cells = (image->memsize + sizeof(T) - 1) / sizeof(T);
+	subleq_batch<T>* batch = new subleq_batch<T>();
+	batch->count = count;
+	batch->memsize = image->memsize;
+	batch->group_bytes = (cells * sizeof(T) * batch_lane_width + batch_padding + 63) & ~(size_t)63;
+	batch->memory = (uint8_t*)calloc(groups, batch->group_bytes);
+	if (batch->memory == nullptr)
+	{
+		delete batch;
+		return nullptr;
+	}
+	// The first group is filled a cell at a time, the others are copies of it
+	for (size_t k = 0; k < cells; ++k)
+	{
+		const size_t n = image->memsize - k * sizeof(T) < sizeof(T) ? image->memsize - k * sizeof(T) : sizeof(T);
+		for (size_t lane = 0; lane < batch_lane_width; ++lane)
+			memcpy(batch->memory + _batch_offset<T>(k * sizeof(T), lane), image->memory + k * sizeof(T), n);
+	}
+	for (size_t g = 1; g < groups; ++g)
+		memcpy(batch->memory + g * batch->group_bytes, batch->memory, batch->group_bytes);
+
+	const typename subleq_batch<T>::ip_t ip = image->_ip;
+	const size_t lanes = groups * batch_lane_width;
+	batch->ip.assign(lanes, ip);
+	batch->running.assign(lanes, 0);
+	for (size_t i = 0; i < count; ++i)
+		batch->running[i] = _batch_ip_running(batch, ip) ? -1 : 0;
+	batch->steps.assign(lanes, 0);
+	batch->output.resize(count);
+	return batch;
+}
+
+template <typename T>
+void destroy_subleq_batch(subleq_batch<T>* batch)
+{
+	if (batch == nullptr)
+		return;
+	free(batch->memory);
+	delete batch;
+}
+
+// Reads size bytes of one instance's memory from addr, which the caller keeps inside memsize
+template <typename T>
+void subleq_batch_read(const subleq_batch<T>* batch, const size_t instance, const size_t addr, void* data, const size_t size)
+{
+	const uint8_t* mem = _batch_group_memory(batch, instance);
+	const size_t lane = instance % batch_lane_width;
+	for (size_t i = 0; i < size; ++i)
+		((uint8_t*)data)[i] = mem[_batch_offset<T>(addr + i, lane)];
+}
+
+// Writes size bytes into one instance's memory at addr, for patching before a run
+template <typename T>
+void subleq_batch_write(subleq_batch<T>* batch, const size_t instance, const size_t addr, const void* data, const size_t size)
+{
+	uint8_t* mem = _batch_group_memory(batch, instance);
+	const size_t lane = instance % batch_lane_width;
+	for (size_t i = 0; i < size; ++i)
+		mem[_batch_offset<T>(addr + i, lane)] = ((const uint8_t*)data)[i];
+}
+
+template <typename T>
+inline void subleq_batch_set_ip(subleq_batch<T>* batch, const size_t instance, const T ip)
+{
+	batch->ip[instance] = ip;
+	batch->running[instance] = _batch_ip_running(batch, batch->ip[instance]) ? -1 : 0;
+}
+
+// Copies one instance out into a new simulator that the caller must destroy_subleq()
+template <typename T>
+subleq<T>* subleq_batch_extract(const subleq_batch<T>* batch, const size_t instance)
+{
+	subleq<T>* sim = create_subleq<T>(batch->memsize);
+	if (sim == nullptr)
+		return nullptr;
+	subleq_batch_read(batch, instance, 0, sim->memory, batch->memsize);
+	sim->_ip = (T)batch->ip[instance];
+	sim->running = batch->running[instance] != 0;
+	return sim;
+}
+
+// Cell at a byte address of the instance in lane, which may straddle two rows
+template <typename T>
+inline T _batch_load(const uint8_t* mem, const size_t lane, const size_t addr)
+{
+	T v;
+	if (addr % sizeof(T) == 0)
+		memcpy(&v, mem + _batch_offset<T>(addr, lane), sizeof(T));
+	else
+		for (size_t i = 0; i < sizeof(T); ++i)
+			((uint8_t*)&v)[i] = mem[_batch_offset<T>(addr + i, lane)];
+	return v;
+}
+
+template <typename T>
+inline void _batch_store(uint8_t* mem, const size_t lane, const size_t addr, const T v)
+{
+	if (addr % sizeof(T) == 0)
+		memcpy(mem + _batch_offset<T>(addr, lane), &v, sizeof(T));
+	else
+		for (size_t i = 0; i < sizeof(T); ++i)
+			mem[_batch_offset<T>(addr + i, lane)] = ((const uint8_t*)&v)[i];
+}
+
+// One instruction of one running instance, the same as subleq_step with output collected.
+// Returns false if it faulted, which like subleq_step doesn't count as a step.
+template <typename T>
+bool _batch_step_lane(subleq_batch<T>* batch, const size_t instance)
+{
+	uint8_t* mem = _batch_group_memory(batch, instance);
+	const size_t lane = instance % batch_lane_width;
+	const T ip_val = (T)batch->ip[instance];
+	const size_t ip = (size_t)ip_val;
+	if (!_batch_in_bounds(batch, ip + sizeof(T) * 2))
+	{
+		batch->running[instance] = 0;
+		return false;
+	}
+	const T a = _batch_load<T>(mem, lane, ip);
+	const T b = _batch_load<T>(mem, lane, ip + sizeof(T));
+	const T c = _batch_load<T>(mem, lane, ip + sizeof(T) * 2);
+	const size_t a_addr = _subleq_addr(a);
+	const size_t b_addr = _subleq_addr(b);
+	const bool in = a == ((T)(-1)) && b != ((T)(-1));
+	if ((!in && !_batch_in_bounds(batch, a_addr)) || (b != ((T)(-1)) && !_batch_in_bounds(batch, b_addr)))
+	{
+		batch->running[instance] = 0;
+		return false;
+	}
+
+	T next = c;
+	if (b == ((T)(-1)))
+		batch->output[instance].push_back((char)_batch_load<T>(mem, lane, a_addr));
+	else if (in)
+		_batch_store<T>(mem, lane, b_addr, (T)(-1));
+	else
+	{
+		const T r = _subleq_sub(_batch_load<T>(mem, lane, b_addr), _batch_load<T>(mem, lane, a_addr));
+		_batch_store<T>(mem, lane, b_addr, r);
+		if (r > 0)
+			next = (T)(ip_val + sizeof(T) * 3);
+	}
+	batch->ip[instance] = next;
+	batch->running[instance] = _batch_ip_running(batch, batch->ip[instance]) ? -1 : 0;
+	return true;
+}
+
+inline unsigned _batch_lowest_lane(const unsigned lanes)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, lanes);
+	return (unsigned)i;
+#else
+	return (unsigned)__builtin_ctz(lanes);
+#endif
+}
+
+// Row operations a lane at a time, for builds and CPUs without AVX2. Rows are batch_lane_width
+// cells, sel picks the lanes that take part.
+template <typename T>
+struct _batch_rows
+{
+	unsigned sel;
+
+	explicit _batch_rows(const unsigned sel) : sel(sel) {}
+
+	// Lanes whose cells in the row at p hold x and in the row after hold y
+	unsigned equal(const uint8_t* p, const T x, const T y) const
+	{
+		const T* row = (const T*)p;
+		unsigned lanes = 0;
+		for (size_t l = 0; l < batch_lane_width; ++l)
+			lanes |= row[l] == x && row[batch_lane_width + l] == y ? 1u << l : 0;
+		return lanes;
+	}
+
+	// Subtracts row a from row b in the selected lanes, returns the lanes whose result is positive
+	unsigned sub(uint8_t* row_b, const uint8_t* row_a) const
+	{
+		T* mb = (T*)row_b;
+		const T* ma = (const T*)row_a;
+		unsigned positive = 0;
+		for (size_t l = 0; l < batch_lane_width; ++l)
+		{
+			const T r = _subleq_sub(mb[l], ma[l]);
+			mb[l] = (sel >> l) & 1 ? r : mb[l];
+			positive |= r > 0 ? 1u << l : 0;
+		}
+		return positive;
+	}
+};
+
+#if SUBLEQ_BIN_AVX2
+// Sign extends the low sizeof(T) bytes of each lane
+template <typename T>
+_BIN_TARGET_AVX2 inline __m256i _batch_sext(const __m256i v)
+{
+	if (sizeof(T) == 1) return _mm256_srai_epi32(_mm256_slli_epi32(v, 24), 24);
+	if (sizeof(T) == 2) return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+	return v;
+}
+
+// A row of cells up to 32-bit, sign extended to 32 bits
+template <typename T>
+_BIN_TARGET_AVX2 inline __m256i _batch_load_row(const uint8_t* p)
+{
+	if constexpr (sizeof(T) == 1) return _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)p));
+	else if constexpr (sizeof(T) == 2) return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p));
+	else return _mm256_loadu_si256((const __m256i*)p);
+}
+
+// Lanes already hold values that fit in T, so the saturating packs only narrow them
+template <typename T>
+_BIN_TARGET_AVX2 inline void _batch_store_row(uint8_t* p, const __m256i v)
+{
+	if constexpr (sizeof(T) == 4)
+		_mm256_storeu_si256((__m256i*)p, v);
+	else
+	{
+		const __m128i w = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packs_epi32(v, v), 0x08));
+		if constexpr (sizeof(T) == 2) _mm_storeu_si128((__m128i*)p, w);
+		else _mm_storel_epi64((__m128i*)p, _mm_packs_epi16(w, w));
+	}
+}
+
+// _batch_rows with a row in one vector, or two for 64-bit cells, and masked blends in place
+// of the per-lane selects
+template <typename T>
+struct _batch_rows_avx2
+{
+	__m256i sel_lo;
+	__m256i sel_hi;		// Upper four lanes of 64-bit cells
+
+	_BIN_TARGET_AVX2 explicit _batch_rows_avx2(const unsigned sel)
+	{
+		if constexpr (sizeof(T) == 8)
+		{
+			const __m256i bits = _mm256_setr_epi64x(1, 2, 4, 8);
+			sel_lo = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(sel & 15), bits), bits);
+			sel_hi = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(sel >> 4), bits), bits);
+		}
+		else
+		{
+			const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+			sel_lo = sel_hi = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(sel), bits), bits);
+		}
+	}
+
+	_BIN_TARGET_AVX2 unsigned equal(const uint8_t* p, const T x, const T y) const
+	{
+		if constexpr (sizeof(T) == 8)
+		{
+			const __m256i vx = _mm256_set1_epi64x(x);
+			const __m256i vy = _mm256_set1_epi64x(y);
+			const __m256i lo = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)p), vx), _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(p + 64)), vy));
+			const __m256i hi = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(p + 32)), vx), _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(p + 96)), vy));
+			return (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(lo)) | (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+		}
+		else
+			return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(
+				_mm256_cmpeq_epi32(_batch_load_row<T>(p), _mm256_set1_epi32(x)),
+				_mm256_cmpeq_epi32(_batch_load_row<T>(p + batch_lane_width * sizeof(T)), _mm256_set1_epi32(y)))));
+	}
+
+	_BIN_TARGET_AVX2 unsigned sub(uint8_t* row_b, const uint8_t* row_a) const
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		if constexpr (sizeof(T) == 8)
+		{
+			unsigned positive = 0;
+			for (int half = 0; half < 2; ++half)
+			{
+				__m256i* p = (__m256i*)(row_b + half * 32);
+				const __m256i mb = _mm256_loadu_si256(p);
+				const __m256i r = _mm256_sub_epi64(mb, _mm256_loadu_si256((const __m256i*)(row_a + half * 32)));
+				_mm256_storeu_si256(p, _mm256_blendv_epi8(mb, r, half ? sel_hi : sel_lo));
+				positive |= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(r, zero))) << (half * 4);
+			}
+			return positive;
+		}
+		else
+		{
+			const __m256i mb = _batch_load_row<T>(row_b);
+			const __m256i r = _batch_sext<T>(_mm256_sub_epi32(mb, _batch_load_row<T>(row_a)));
+			_batch_store_row<T>(row_b, _mm256_blendv_epi8(mb, r, sel_lo));
+			return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(r, zero)));
+		}
+	}
+};
+#endif
+
+// Runs the lanes in sel, which are all at ip at, for up to budget steps while they keep
+// taking the same branches and stay below limit, the lowest ip of the other active lanes.
+// Their ip is a single scalar until then, so a step is the one row subtraction and a test of
+// where it went. Returns the steps taken and leaves the lanes' ips and run state in the batch.
+// Instructions that can't run as a row (input, output, operands that differ between the
+// lanes or straddle cells) end it, so it returns 0 when the first one can't.
+template <typename T, typename Rows>
+inline uint32_t _batch_run_together(subleq_batch<T>* batch, const size_t first, typename subleq_batch<T>::ip_t at, const unsigned sel, const uint32_t budget, const size_t limit)
+{
+	typedef typename subleq_batch<T>::ip_t ip_t;
+	const size_t W = sizeof(T);
+	const size_t L = batch_lane_width;
+	if (batch->memsize < W * 3)
+		return 0;
+	uint8_t* mem = _batch_group_memory(batch, first);
+	ip_t* ip = batch->ip.data() + first;
+	int32_t* running = batch->running.data() + first;
+	const unsigned lane = _batch_lowest_lane(sel);
+	// Aligned cells in bounds start at or below last, and ips from stop on end the loop
+	const size_t last = batch->memsize - W;
+	const size_t stop = limit < batch->memsize ? limit : batch->memsize;
+	const Rows rows(sel);
+
+	uint32_t n = 0;
+	for (; n < budget; ++n)
+	{
+		// An aligned row starts at addr * L, and -1 is never aligned for cells wider than a byte
+		const size_t ip_addr = (size_t)at;
+		if (ip_addr % W != 0 || ip_addr > last - W * 2)
+			break;
+		const uint8_t* ins = mem + ip_addr * L;
+		T a, b;
+		memcpy(&a, ins + lane * W, W);
+		memcpy(&b, ins + (L + lane) * W, W);
+		const size_t a_addr = _subleq_addr(a);
+		const size_t b_addr = _subleq_addr(b);
+		if ((a_addr | b_addr) % W != 0 || a_addr > last || b_addr > last || (W == 1 && (a == ((T)(-1)) || b == ((T)(-1)))))
+			break;
+		// An instruction writing its own jump target runs a lane at a time, so c can be read
+		// after the write
+		if (b_addr == ip_addr + W * 2 || (rows.equal(ins, a, b) & sel) != sel)
+			break;
+
+		const unsigned taken = rows.sub(mem + b_addr * L, mem + a_addr * L) & sel;
+		const ip_t next = (T)(ip_addr + W * 3);
+		ip_t to = next;
+		if (taken != sel)
+		{
+			const T* c = (const T*)(ins + L * W * 2);
+			if (taken != 0 || (rows.equal(ins + L * W, b, c[lane]) & sel) != sel)
+			{
+				// The lanes part ways here
+				for (unsigned lanes = sel; lanes != 0; lanes &= lanes - 1)
+				{
+					const unsigned l = _batch_lowest_lane(lanes);
+					ip[l] = (taken >> l) & 1 ? next : (ip_t)c[l];
+					running[l] = _batch_ip_running(batch, ip[l]) ? -1 : 0;
+				}
+				return n + 1;
+			}
+			to = c[lane];
+		}
+		// Negative ips read as huge here, so this also catches them leaving memory
+		if ((size_t)to >= stop)
+		{
+			for (unsigned lanes = sel; lanes != 0; lanes &= lanes - 1)
+			{
+				const unsigned l = _batch_lowest_lane(lanes);
+				ip[l] = to;
+				running[l] = _batch_ip_running(batch, to) ? -1 : 0;
+			}
+			return n + 1;
+		}
+		at = to;
+	}
+	for (unsigned lanes = sel; lanes != 0; lanes &= lanes - 1)
+		ip[_batch_lowest_lane(lanes)] = at;
+	return n;
+}
+
+#if SUBLEQ_BIN_AVX2
+#if defined(_MSC_VER) && !defined(__clang__)
+#define _BATCH_FLATTEN
+#else
+#define _BATCH_FLATTEN __attribute__((flatten))
+#endif
+// The loop and the row operations are inlined here, where AVX2 is enabled
+template <typename T>
+_BIN_TARGET_AVX2 _BATCH_FLATTEN uint32_t _batch_run_together_avx2(subleq_batch<T>* batch, const size_t first, typename subleq_batch<T>::ip_t at, const unsigned sel, const uint32_t budget, const size_t limit)
+{ return _batch_run_together<T, _batch_rows_avx2<T>>(batch, first, at, sel, budget, limit); }
+#endif
+
+// Runs one group for up to pass steps per instance. Each step the lanes at the lowest ip go,
+// together as long as they can and a lane at a time where they can't.
+template <typename T>
+void _batch_run_group(subleq_batch<T>* batch, const size_t first, const uint32_t pass, const bool avx2)
+{
+	typedef typename subleq_batch<T>::ip_t ip_t;
+	const size_t L = batch_lane_width;
+	ip_t* ip = batch->ip.data() + first;
+	int32_t* running = batch->running.data() + first;
+	uint32_t left[batch_lane_width];
+	for (size_t l = 0; l < L; ++l)
+		left[l] = running[l] ? pass : 0;
+	uint32_t start[batch_lane_width];
+	memcpy(start, left, sizeof(left));
+
+	while (true)
+	{
+		unsigned active = 0;
+		size_t lowest = SIZE_MAX;
+		for (size_t l = 0; l < L; ++l)
+			if (running[l] && left[l] != 0)
+			{
+				active |= 1u << l;
+				lowest = (size_t)ip[l] < lowest ? (size_t)ip[l] : lowest;
+			}
+		if (active == 0)
+			break;
+		unsigned sel = 0;
+		uint32_t budget = UINT32_MAX;
+		size_t waiting = SIZE_MAX;
+		for (size_t l = 0; l < L; ++l)
+			if (((active >> l) & 1) == 0)
+				continue;
+			else if ((size_t)ip[l] == lowest)
+			{
+				sel |= 1u << l;
+				budget = left[l] < budget ? left[l] : budget;
+			}
+			else
+				waiting = (size_t)ip[l] < waiting ? (size_t)ip[l] : waiting;
+
+		uint32_t done;
+#if SUBLEQ_BIN_AVX2
+		if (avx2)
+			done = _batch_run_together_avx2(batch, first, (ip_t)lowest, sel, budget, waiting);
+		else
+#else
+		(void)avx2;
+#endif
+			done = _batch_run_together<T, _batch_rows<T>>(batch, first, (ip_t)lowest, sel, budget, waiting);
+		if (done != 0)
+		{
+			for (unsigned lanes = sel; lanes != 0; lanes &= lanes - 1)
+				left[_batch_lowest_lane(lanes)] -= done;
+			continue;
+		}
+		for (unsigned lanes = sel; lanes != 0; lanes &= lanes - 1)
+		{
+			const unsigned l = _batch_lowest_lane(lanes);
+			left[l] -= _batch_step_lane(batch, first + l);
+		}
+	}
+	for (size_t l = 0; l < L; ++l)
+		batch->steps[first + l] += start[l] - left[l];
+}
+
+template <typename T>
+size_t _batch_count_running(const subleq_batch<T>* batch, const size_t first, const size_t last)
+{
+	size_t running = 0;
+	for (size_t i = first; i < last; ++i)
+		running += batch->running[i] != 0;
+	return running;
+}
+
+// Advances every running instance by up to max_steps instructions. Returns the number of
+// instances still running.
+template <typename T>
+size_t subleq_batch_run(subleq_batch<T>* batch, const uint64_t max_steps)
+{
+#if SUBLEQ_BIN_AVX2
+	const bool avx2 = _bin_has_avx2();
+#else
+	const bool avx2 = false;
+#endif
+	// Instances don't interact, so each group runs to the end of its budget while its
+	// memory is in cache
+	for (size_t first = 0; first < batch->ip.size(); first += batch_lane_width)
+	{
+		for (uint64_t left = max_steps; left > 0 && _batch_count_running(batch, first, first + batch_lane_width) != 0; )
+		{
+			const uint32_t pass = left < batch_pass_steps ? (uint32_t)left : batch_pass_steps;
+			_batch_run_group(batch, first, pass, avx2);
+			left -= pass;
+		}
+	}
+	return _batch_count_running(batch, 0, batch->count);
+}
@@ -0,0 +1,828 @@
+// Benchmark: runs every engine over a set of generated workloads and reports how fast they go
+//   subleq-bench [-n steps] [-r repeats] [-w width] [-m bytes] [-e engines] [-k workloads]
+//                [-j json_file] [-c baseline.json] [-x percent] [-l label]
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdarg.h>
+#include <stdlib.h>
+#include "analysis.h"
+#include "assembler.h"
+#include "cycle.h"
+#include "jit.h"
+#include "fusion.h"
+#include "history.h"
+#include "paged.h"
+#include "sink.h"
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <sys/resource.h>
+#endif
+
+enum BENCH_RESULT : int
+{
+	BENCH_OK = 0,
+	BENCH_ERROR = 1,		// Bad options, a workload didn't assemble, or the engines disagreed
+	BENCH_REGRESSED = 2,	// Slower than the baseline by more than the threshold
+};
+
+enum BENCH_ENGINE : uint8_t
+{
+	BENCH_INTERP,		// subleq_step
+	BENCH_CACHED,		// subleq_run_analyzed, subleq_run_cached without checks where that is safe
+	BENCH_FUSED,		// subleq_run_fused
+	BENCH_JIT,			// subleq_jit_run
+	BENCH_RECORDED,		// subleq_run_recorded, what the editor runs when it keeps history
+	BENCH_PAGED,		// subleq_run_paged, memory behind a page table
+	BENCH_CHECKED,		// subleq_run_checked, what subleq-run -c runs to find endless loops
+	BENCH_ENGINE_COUNT,
+};
+
+const char* bench_engine_str(const BENCH_ENGINE e)
+{
+	switch (e)
+	{
+	case BENCH_INTERP:		return "interp";
+	case BENCH_CACHED:		return "cached";
+	case BENCH_FUSED:		return "fused";
+	case BENCH_JIT:			return "jit";
+	case BENCH_RECORDED:	return "recorded";
+	case BENCH_PAGED:		return "paged";
+	case BENCH_CHECKED:		return "checked";
+	default:				return "unknown";
+	}
+}
+
+struct BenchOptions
+{
+	uint64_t steps = 50000000;
+	unsigned repeats = 3;
+	uint8_t width = 4;
+	size_t large_memsize = 8 << 20;
+	// Empty runs everything
+	std::vector<std::string> engines;
+	std::vector<std::string> workloads;
+	const char* json_name = nullptr;
+	const char* baseline = nullptr;
+	double threshold = 10.0;
+	const char* label = "";
+};
+
+// Every workload loops forever, so each engine runs exactly the same number of steps and has
+// to end up in exactly the same state
+struct BenchWorkload
+{
+	const char* name;
+	const char* description;
+	std::string (*source)(const BenchOptions& opt);
+	// Workloads that read input take a byte every this many steps and are given enough for the
+	// whole run, 0 for none
+	size_t steps_per_input = 0;
+};
+
+struct BenchCounters
+{
+	// -1 where the counter isn't available
+	int64_t cycles = -1;
+	int64_t instructions = -1;
+	int64_t cache_refs = -1;
+	int64_t cache_misses = -1;
+};
+
+struct BenchResult
+{
+	std::string workload;
+	BENCH_ENGINE engine;
+	uint64_t steps = 0;
+	// Of the fastest repeat
+	double seconds = 0.0;
+	double setup_seconds = 0.0;
+	BenchCounters counters;
+	size_t peak_rss = 0;
+	uint64_t output_bytes = 0;
+	uint64_t checksum = 0;
+	bool consistent = true;
+};
+
+static void _bench_append(std::string& s, const char* fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	s += buf;
+}
+
+// Prints the same line over and over, like the program[] the editor started out with
+static std::string _bench_hello(const BenchOptions& opt)
+{
+	const char msg[] = "Hello, World!\n";
+	std::string s;
+	_bench_append(s, ".width %u\nstart:\n", opt.width);
+	for (size_t i = 0; i + 1 < sizeof(msg); ++i)
+		_bench_append(s, "\tout msg + %zu\n", i * opt.width);
+	s += "\tjmp start\nmsg:\t.data \"Hello, World!\", 10\nZ:\t.data 0\n";
+	return s;
+}
+
+// Counts a cell down to zero and starts over
+static std::string _bench_countdown(const BenchOptions& opt)
+{
+	std::string s;
+	_bench_append(s, ".width %u\n", opt.width);
+	s += "loop:\tsubleq one, count, reset\n"
+		"\tjmp loop\n"
+		"reset:\tmov count, init\n"
+		"\tjmp loop\n"
+		"one:\t.data 1\n"
+		"count:\t.data 1000000\n"
+		"init:\t.data 1000000\n"
+		"Z:\t.data 0\n";
+	return s;
+}
+
+// Copies a block of cells with straight-line code
+static std::string _bench_memcpy(const BenchOptions& opt)
+{
+	const size_t cells = 512;
+	std::string s;
+	_bench_append(s, ".width %u\nstart:\n", opt.width);
+	for (size_t i = 0; i < cells; ++i)
+		_bench_append(s, "\tmov dst + %zu, src + %zu\n", i * opt.width, i * opt.width);
+	s += "\tjmp start\nsrc:\n";
+	for (size_t i = 0; i < cells; ++i)
+		_bench_append(s, "\t.data %zu\n", i * 7 + 1);
+	_bench_append(s, "dst:\t.zero %zu\nZ:\t.data 0\n", cells);
+	return s;
+}
+
+// Copies a block in a loop that moves its own operands along, so every iteration rewrites code
+static std::string _bench_selfmod(const BenchOptions& opt)
+{
+	const size_t cells = 1024;
+	const unsigned w = opt.width;
+	std::string s;
+	_bench_append(s, ".width %u\n", w);
+	_bench_append(s,
+		"loop:\n"
+		"s1:\tsubleq src, Z\n"
+		"d1:\tsubleq dst, dst\n"
+		"d2:\tsubleq Z, dst\n"
+		"\tclr Z\n"
+		"\tsubleq step, s1\n"
+		"\tsubleq step, d1\n"
+		"\tsubleq step, d1 + %u\n"
+		"\tsubleq step, d2 + %u\n"
+		"\tsubleq one, count, wrap\n"
+		"\tjmp loop\n"
+		"wrap:\tmov s1, psrc\n"
+		"\tmov d1, pdst\n"
+		"\tmov d1 + %u, pdst\n"
+		"\tmov d2 + %u, pdst\n"
+		"\tmov count, n\n"
+		"\tjmp loop\n", w, w, w, w);
+	_bench_append(s,
+		"one:\t.data 1\n"
+		"step:\t.data -%u\n"
+		"count:\t.data %zu\n"
+		"n:\t.data %zu\n"
+		"psrc:\t.data src\n"
+		"pdst:\t.data dst\n"
+		"Z:\t.data 0\n"
+		"src:\t.zero %zu\n"
+		"dst:\t.zero %zu\n", w, cells, cells, cells, cells);
+	return s;
+}
+
+// Reads and writes a cell in every few cache lines across all of a big memory
+static std::string _bench_large(const BenchOptions& opt)
+{
+	const unsigned w = opt.width;
+	// Not a multiple of the page size, so the walk spreads over every cache set
+	const size_t stride = 320;
+	std::string s;
+	_bench_append(s, ".width %u\n.memsize %zu\n", w, opt.large_memsize);
+	_bench_append(s,
+		"loop:\n"
+		"p:\tsubleq arr, acc\n"
+		"q:\tsubleq one, arr\n"
+		"\tsubleq step, p\n"
+		"\tsubleq step, q + %u\n"
+		"\tsubleq one, count, wrap\n"
+		"\tjmp loop\n"
+		"wrap:\tmov p, parr\n"
+		"\tmov q + %u, parr\n"
+		"\tmov count, n\n"
+		"\tjmp loop\n", w, w);
+	_bench_append(s,
+		"one:\t.data 1\n"
+		"step:\t.data -%zu\n"
+		"acc:\t.data 0\n"
+		"count:\t.data (%zu - arr - %u) / %zu + 1\n"
+		"n:\t.data (%zu - arr - %u) / %zu + 1\n"
+		"parr:\t.data arr\n"
+		"Z:\t.data 0\n"
+		"arr:\n", stride, opt.large_memsize, w, stride, opt.large_memsize, w, stride);
+	return s;
+}
+
+// Adds up a stream of input bytes, three steps per byte
+static std::string _bench_stream(const BenchOptions& opt)
+{
+	std::string s;
+	_bench_append(s, ".width %u\n", opt.width);
+	s += "loop:\tin c\n"
+		"\tsub acc, c\n"
+		"\tjmp loop\n"
+		"c:\t.data 0\n"
+		"acc:\t.data 0\n"
+		"Z:\t.data 0\n";
+	return s;
+}
+
+const BenchWorkload bench_workloads[] = {
+	{ "hello", "Output-heavy, one line of text over and over", _bench_hello },
+	{ "countdown", "Tight decrement loop", _bench_countdown },
+	{ "memcpy", "Straight-line block copy", _bench_memcpy },
+	{ "selfmod", "Copy loop that rewrites its own operands", _bench_selfmod },
+	{ "large", "Read-modify-write walk over a large memory", _bench_large },
+	{ "stream", "Reads megabytes of input one byte at a time", _bench_stream, 3 },
+};
+
+// Hardware counters for this thread, through perf_event_open where the kernel allows it
+struct _bench_perf
+{
+	int fd[4] = { -1, -1, -1, -1 };
+};
+
+static void _bench_perf_open(_bench_perf& perf)
+{
+#if defined(__linux__)
+	const uint64_t configs[4] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES };
+	for (int i = 0; i < 4; ++i)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		// Each counter on its own, so one the CPU lacks doesn't take the others with it
+		perf.fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+#else
+	(void)perf;
+#endif
+}
+
+static void _bench_perf_close(_bench_perf& perf)
+{
+#if defined(__linux__)
+	for (int fd : perf.fd)
+		if (fd >= 0)
+			close(fd);
+#else
+	(void)perf;
+#endif
+}
+
+static bool _bench_perf_available(const _bench_perf& perf)
+{
+	for (int fd : perf.fd)
+		if (fd >= 0)
+			return true;
+	return false;
+}
+
+static void _bench_perf_start(_bench_perf& perf)
+{
+#if defined(__linux__)
+	for (int fd : perf.fd)
+	{
+		if (fd < 0)
+			continue;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#else
+	(void)perf;
+#endif
+}
+
+static BenchCounters _bench_perf_stop(_bench_perf& perf)
+{
+	int64_t values[4] = { -1, -1, -1, -1 };
+#if defined(__linux__)
+	for (int i = 0; i < 4; ++i)
+	{
+		if (perf.fd[i] < 0)
+			continue;
+		ioctl(perf.fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		uint64_t v = 0;
+		if (read(perf.fd[i], &v, sizeof(v)) == sizeof(v))
+			values[i] = (int64_t)v;
+	}
+#else
+	(void)perf;
+#endif
+	BenchCounters c;
+	c.cycles = values[0];
+	c.instructions = values[1];
+	c.cache_refs = values[2];
+	c.cache_misses = values[3];
+	return c;
+}
+
+// Starts a new peak RSS measurement. Only Linux can reset the peak, everywhere else it is the
+// peak of the whole process so far.
+static void _bench_rss_reset()
+{
+#if defined(__linux__)
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if (f != nullptr)
+	{
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+
+// Peak resident set size in bytes, 0 if unknown
+static size_t _bench_rss_peak()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return pmc.PeakWorkingSetSize;
+	return 0;
+#elif defined(__linux__)
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f == nullptr)
+		return 0;
+	char line[256];
+	size_t kb = 0;
+	while (fgets(line, sizeof(line), f) != nullptr)
+		if (strncmp(line, "VmHWM:", 6) == 0)
+			kb = strtoull(line + 6, nullptr, 10);
+	fclose(f);
+	return kb * 1024;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	// Bytes on macOS
+	return (size_t)ru.ru_maxrss;
+#endif
+}
+
+const uint64_t fnv_offset = 0xcbf29ce484222325ull;
+const uint64_t fnv_prime = 0x100000001b3ull;
+
+inline uint64_t _bench_hash(uint64_t h, const uint8_t* data, const size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ data[i]) * fnv_prime;
+	return h;
+}
+
+// Output of the run being measured, hashed so engines that print different things disagree
+struct _bench_output
+{
+	uint64_t bytes = 0;
+	uint64_t hash = fnv_offset;
+};
+
+static void _bench_on_output(const char* data, size_t size, void* userarg)
+{
+	_bench_output* out = (_bench_output*)userarg;
+	out->bytes += size;
+	out->hash = _bench_hash(out->hash, (const uint8_t*)data, size);
+}
+
+// Runs the image for opt.steps steps on one engine, once, reading input from the start of
+// input. Returns false if the engine can't run here.
+template <typename T>
+bool _bench_run_once(const subleq_asm& a, const std::vector<uint8_t>& input, const BENCH_ENGINE engine, const BenchOptions& opt, _bench_perf& perf, BenchResult& r)
+{
+	subleq<T>* sim = subleq_asm_build<T>(&a);
+	if (sim == nullptr)
+		return false;
+	sim->running = true;
+	subleq_source* source = create_subleq_source_buffer(input.data(), input.size());
+	sim->input = source;
+	_bench_output output;
+	subleq_sink* sink = create_subleq_sink_callback(_bench_on_output, &output);
+
+	using clock = std::chrono::steady_clock;
+	const clock::time_point setup = clock::now();
+	subleq_icache<T>* cache = nullptr;
+	subleq_analysis* analysis = nullptr;
+	subleq_fusion<T> fusion;
+	subleq_jit<T>* jit = nullptr;
+	subleq_history<T>* history = nullptr;
+	subleq_paged<T>* paged = nullptr;
+	subleq_cycle* cycle = nullptr;
+	bool ok = true;
+	if (engine == BENCH_CACHED)
+	{
+		ok = (cache = create_subleq_icache(sim)) != nullptr;
+		analysis = create_subleq_analysis(sim);
+	}
+	else if (engine == BENCH_FUSED)
+		subleq_fusion_build(fusion, sim);
+	else if (engine == BENCH_JIT)
+	{
+		ok = (jit = create_subleq_jit(sim)) != nullptr;
+		analysis = create_subleq_analysis(sim);
+		if (ok)
+			subleq_jit_set_analysis(jit, analysis);
+	}
+	else if (engine == BENCH_RECORDED)
+		history = create_subleq_history(sim);
+	else if (engine == BENCH_PAGED)
+	{
+		ok = (paged = create_subleq_paged<T>(sim->memsize)) != nullptr && subleq_paged_write_bytes(paged, 0, sim->memory, sim->memsize);
+		if (ok)
+		{
+			paged->_ip = sim->_ip;
+			paged->input = source;
+		}
+	}
+	else if (engine == BENCH_CHECKED)
+		cycle = create_subleq_cycle(sim);
+
+	uint64_t steps = 0;
+	if (ok)
+	{
+		const clock::time_point start = clock::now();
+		_bench_perf_start(perf);
+		switch (engine)
+		{
+		case BENCH_INTERP:
+			while (steps < opt.steps && subleq_step<T>(sim, subleq_sink_output<T>, sink))
+				++steps;
+			break;
+		case BENCH_CACHED:
+			steps = subleq_run_analyzed<T>(sim, cache, analysis, opt.steps, subleq_sink_output<T>, sink);
+			break;
+		case BENCH_FUSED:
+			steps = subleq_run_fused<T>(sim, fusion, opt.steps, nullptr, nullptr, subleq_sink_output<T>, sink);
+			break;
+		case BENCH_JIT:
+			steps = subleq_jit_run<T>(jit, sim, opt.steps, nullptr, nullptr, subleq_sink_output<T>, sink);
+			break;
+		case BENCH_PAGED:
+			steps = subleq_run_paged<T>(paged, opt.steps, subleq_sink_output_paged<T>, sink);
+			break;
+		case BENCH_CHECKED:
+			// Every workload loops forever, so the search starts over each time it finds that
+			while (steps < opt.steps)
+			{
+				steps += subleq_run_checked<T>(sim, cycle, opt.steps - steps, nullptr, nullptr, subleq_sink_output<T>, sink);
+				if (!cycle->found)
+					break;
+				subleq_cycle_rearm(cycle, (size_t)sim->_ip);
+			}
+			break;
+		default:
+			steps = subleq_run_recorded<T>(sim, history, opt.steps, nullptr, nullptr, subleq_sink_output<T>, sink);
+			break;
+		}
+		const BenchCounters counters = _bench_perf_stop(perf);
+		const clock::time_point end = clock::now();
+		subleq_sink_flush(sink);
+		// Copied back so the checksum covers the same state as the other engines
+		if (paged != nullptr)
+		{
+			subleq_paged_read_bytes(paged, 0, sim->memory, sim->memsize);
+			sim->_ip = paged->_ip;
+		}
+
+		const double seconds = std::chrono::duration<double>(end - start).count();
+		if (r.steps == 0 || seconds < r.seconds)
+		{
+			r.seconds = seconds;
+			r.setup_seconds = std::chrono::duration<double>(start - setup).count();
+			r.counters = counters;
+		}
+		r.steps = steps;
+		r.output_bytes = output.bytes;
+		uint64_t h = _bench_hash(output.hash, sim->memory, sim->memsize);
+		h = _bench_hash(h, (const uint8_t*)&sim->_ip, sizeof(T));
+		h = _bench_hash(h, (const uint8_t*)&steps, sizeof(steps));
+		r.checksum = h;
+	}
+
+	if (cache != nullptr) destroy_subleq_icache(cache);
+	if (jit != nullptr) destroy_subleq_jit(jit);
+	destroy_subleq_analysis(analysis);
+	if (history != nullptr) destroy_subleq_history(history);
+	destroy_subleq_paged(paged);
+	destroy_subleq_cycle(cycle);
+	destroy_subleq_sink(sink);
+	destroy_subleq_source(source);
+	destroy_subleq(sim);
+	return ok;
+}
+
+template <typename T>
+bool _bench_run(const subleq_asm& a, const std::vector<uint8_t>& input, const BENCH_ENGINE engine, const BenchOptions& opt, _bench_perf& perf, BenchResult& r)
+{
+	_bench_rss_reset();
+	for (unsigned i = 0; i < opt.repeats; ++i)
+		if (!_bench_run_once<T>(a, input, engine, opt, perf, r))
+			return false;
+	r.peak_rss = _bench_rss_peak();
+	return true;
+}
+
+static bool _bench_selected(const std::vector<std::string>& names, const char* name)
+{
+	if (names.empty())
+		return true;
+	for (const std::string& n : names)
+		if (n == name)
+			return true;
+	return false;
+}
+
+static void _bench_split(const char* list, std::vector<std::string>& out)
+{
+	std::string cur;
+	for (const char* p = list; ; ++p)
+	{
+		if (*p == ',' || *p == '\0')
+		{
+			if (!cur.empty())
+				out.push_back(cur);
+			cur.clear();
+			if (*p == '\0')
+				break;
+		}
+		else cur += *p;
+	}
+}
+
+static void _bench_json_counter(FILE* f, const char* key, const int64_t v)
+{
+	if (v < 0) fprintf(f, ", \"%s\": null", key);
+	else fprintf(f, ", \"%s\": %lld", key, (long long)v);
+}
+
+// One result per line, which is what _bench_compare reads back
+static void _bench_write_json(FILE* f, const BenchOptions& opt, const std::vector<BenchResult>& results, const bool perf)
+{
+	fprintf(f, "{\n\t\"benchmark\": \"subleq-bench\",\n\t\"label\": \"");
+	for (const char* p = opt.label; *p != '\0'; ++p)
+	{
+		if (*p == '"' || *p == '\\') fputc('\\', f);
+		if ((unsigned char)*p >= 0x20) fputc(*p, f);
+	}
+	fprintf(f, "\",\n\t\"width\": %u,\n\t\"steps\": %llu,\n\t\"repeats\": %u,\n\t\"perf_counters\": %s,\n\t\"results\": [\n",
+		opt.width, (unsigned long long)opt.steps, opt.repeats, perf ? "true" : "false");
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult& r = results[i];
+		fprintf(f, "\t\t{\"workload\": \"%s\", \"engine\": \"%s\", \"width\": %u, \"steps\": %llu, \"seconds\": %.6f, "
+			"\"instr_per_sec\": %.0f, \"ns_per_step\": %.4f, \"setup_ms\": %.3f, \"peak_rss\": %zu, \"output_bytes\": %llu",
+			r.workload.c_str(), bench_engine_str(r.engine), opt.width, (unsigned long long)r.steps, r.seconds,
+			r.seconds > 0.0 ? r.steps / r.seconds : 0.0, r.steps > 0 ? r.seconds * 1e9 / r.steps : 0.0,
+			r.setup_seconds * 1e3, r.peak_rss, (unsigned long long)r.output_bytes);
+		_bench_json_counter(f, "cycles", r.counters.cycles);
+		_bench_json_counter(f, "instructions", r.counters.instructions);
+		_bench_json_counter(f, "cache_refs", r.counters.cache_refs);
+		_bench_json_counter(f, "cache_misses", r.counters.cache_misses);
+		fprintf(f, ", \"checksum\": \"%016llx\", \"consistent\": %s}%s\n", (unsigned long long)r.checksum,
+			r.consistent ? "true" : "false", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+}
+
+// The value of "key" in a line of _bench_write_json output, without quotes
+static std::string _bench_json_field(const char* line, const char* key)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+	const char* p = strstr(line, pattern);
+	if (p == nullptr)
+		return std::string();
+	p += strlen(pattern);
+	if (*p == '"')
+	{
+		const char* end = strchr(++p, '"');
+		return end == nullptr ? std::string() : std::string(p, end);
+	}
+	const char* end = p;
+	while (*end != '\0' && *end != ',' && *end != '}')
+		++end;
+	return std::string(p, end);
+}
+
+// Compares against the results of an earlier run, returns how many got slower than the threshold
+static int _bench_compare(const BenchOptions& opt, const std::vector<BenchResult>& results, FILE* report)
+{
+	FILE* f = fopen(opt.baseline, "r");
+	if (f == nullptr)
+	{
+		fprintf(stderr, "Error: could not open baseline \"%s\"\n", opt.baseline);
+		return -1;
+	}
+	int regressions = 0;
+	size_t matched = 0;
+	char line[2048];
+	fprintf(report, "\nAgainst %s (threshold %.1f%%):\n", opt.baseline, opt.threshold);
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		const std::string workload = _bench_json_field(line, "workload");
+		const std::string engine = _bench_json_field(line, "engine");
+		const std::string width = _bench_json_field(line, "width");
+		const double before = strtod(_bench_json_field(line, "instr_per_sec").c_str(), nullptr);
+		if (workload.empty() || before <= 0.0 || strtoul(width.c_str(), nullptr, 10) != opt.width)
+			continue;
+		for (const BenchResult& r : results)
+		{
+			if (r.workload != workload || engine != bench_engine_str(r.engine) || r.seconds <= 0.0)
+				continue;
+			++matched;
+			const double now = r.steps / r.seconds;
+			const double change = (now - before) / before * 100.0;
+			const bool regressed = change < -opt.threshold;
+			regressions += regressed;
+			fprintf(report, "  %-10s %-9s %+7.1f%%%s\n", workload.c_str(), engine.c_str(), change, regressed ? "  REGRESSED" : "");
+		}
+	}
+	fclose(f);
+	if (matched == 0)
+		fprintf(report, "  No results in common\n");
+	return regressions;
+}
+
+static void _bench_usage(const char* exe)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <steps>     Steps per run, default 50000000\n"
+		"  -r <repeats>   Runs per engine and workload, the fastest is reported, default 3\n"
+		"  -w <width>     Cell width in bytes, 4 (default) or 8\n"
+		"  -m <bytes>     Memory size of the large workload, default 8 MiB\n"
+		"  -e <list>      Engines to run, comma separated: interp, cached, fused, jit, recorded, paged,\n"
+		"                 checked\n"
+		"  -k <list>      Workloads to run, comma separated: hello, countdown, memcpy, selfmod, large,\n"
+		"                 stream\n"
+		"  -j <file>      Write the results as JSON, - for stdout\n"
+		"  -c <file>      Compare against the JSON of an earlier run, exit with 2 on a regression\n"
+		"  -x <percent>   How much slower counts as a regression, default 10\n"
+		"  -l <label>     Stored in the JSON, for telling runs apart\n", exe);
+}
+
+template <typename T>
+int run_bench(const BenchOptions& opt)
+{
+	// The table moves out of the way when the JSON goes to stdout
+	const bool json_stdout = opt.json_name != nullptr && strcmp(opt.json_name, "-") == 0;
+	FILE* report = json_stdout ? stderr : stdout;
+	_bench_perf perf;
+	_bench_perf_open(perf);
+	const bool have_perf = _bench_perf_available(perf);
+	if (!have_perf)
+		fprintf(report, "Hardware counters are not available, cache misses won't be reported\n");
+
+	int result = BENCH_OK;
+	std::vector<BenchResult> results;
+	fprintf(report, "%-10s %-9s %12s %9s %9s %11s %14s\n", "workload", "engine", "steps/s", "ns/step", "setup ms", "peak RSS", "cache misses");
+	for (const BenchWorkload& w : bench_workloads)
+	{
+		if (!_bench_selected(opt.workloads, w.name))
+			continue;
+		const std::string source = w.source(opt);
+		subleq_asm* a = create_subleq_asm();
+		const ASM_RESULT ar = subleq_asm_source(a, source.data(), source.size());
+		if (ar != ASM_OK)
+		{
+			fprintf(stderr, "Error: workload %s:%zu: %s \"%s\"\n", w.name, a->error_line, asm_result_str(ar), a->error_detail.c_str());
+			destroy_subleq_asm(a);
+			result = BENCH_ERROR;
+			continue;
+		}
+		// The same pseudo-random bytes for every engine
+		std::vector<uint8_t> input(w.steps_per_input != 0 ? (size_t)(opt.steps / w.steps_per_input + 1) : 0);
+		uint64_t x = fnv_offset;
+		for (uint8_t& b : input)
+		{
+			x = x * 6364136223846793005ull + 1442695040888963407ull;
+			b = (uint8_t)(x >> 56);
+		}
+
+		const size_t first = results.size();
+		for (int e = 0; e < BENCH_ENGINE_COUNT; ++e)
+		{
+			const BENCH_ENGINE engine = (BENCH_ENGINE)e;
+			if (!_bench_selected(opt.engines, bench_engine_str(engine)))
+				continue;
+			BenchResult r;
+			r.workload = w.name;
+			r.engine = engine;
+			if (!_bench_run<T>(*a, input, engine, opt, perf, r))
+			{
+				fprintf(report, "%-10s %-9s not available\n", w.name, bench_engine_str(engine));
+				continue;
+			}
+			// Every engine has to finish in the same state as the first one
+			if (results.size() > first && r.checksum != results[first].checksum)
+			{
+				r.consistent = false;
+				result = BENCH_ERROR;
+			}
+			char misses[32] = "-";
+			if (r.counters.cache_misses >= 0)
+				snprintf(misses, sizeof(misses), "%lld", (long long)r.counters.cache_misses);
+			fprintf(report, "%-10s %-9s %12.0f %9.3f %9.2f %8.1f MB %14s%s\n", w.name, bench_engine_str(engine),
+				r.seconds > 0.0 ? r.steps / r.seconds : 0.0, r.steps > 0 ? r.seconds * 1e9 / r.steps : 0.0,
+				r.setup_seconds * 1e3, r.peak_rss / (1024.0 * 1024.0), misses,
+				r.consistent ? "" : "  MISMATCH");
+			results.push_back(r);
+		}
+		destroy_subleq_asm(a);
+	}
+	_bench_perf_close(perf);
+
+	if (opt.json_name != nullptr)
+	{
+		FILE* f = json_stdout ? stdout : fopen(opt.json_name, "w");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Error: could not open output file \"%s\"\n", opt.json_name);
+			return BENCH_ERROR;
+		}
+		_bench_write_json(f, opt, results, have_perf);
+		if (f != stdout)
+			fclose(f);
+	}
+	if (opt.baseline != nullptr)
+	{
+		const int regressions = _bench_compare(opt, results, report);
+		if (regressions < 0)
+			return BENCH_ERROR;
+		if (regressions > 0 && result == BENCH_OK)
+			result = BENCH_REGRESSED;
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			opt.steps = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			opt.repeats = (unsigned)strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			opt.width = (uint8_t)strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			opt.large_memsize = (size_t)strtoull(argv[++i], nullptr, 0);
+		else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+			_bench_split(argv[++i], opt.engines);
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			_bench_split(argv[++i], opt.workloads);
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			opt.json_name = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			opt.baseline = argv[++i];
+		else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			opt.threshold = strtod(argv[++i], nullptr);
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			opt.label = argv[++i];
+		else
+		{
+			_bench_usage(argv[0]);
+			return BENCH_ERROR;
+		}
+	}
+	// The loop counters need more than 16 bits
+	if ((opt.width != 4 && opt.width != 8) || opt.steps == 0 || opt.repeats == 0)
+	{
+		_bench_usage(argv[0]);
+		return BENCH_ERROR;
+	}
+	if (opt.width == 4)
+		return run_bench<int32_t>(opt);
+	return run_bench<int64_t>(opt);
+}
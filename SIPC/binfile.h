@@ -0,0 +1,652 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <stddef.h>
+#include <string.h>
+#include "subleq.h"
+// The AVX2 byte swap is compiled on any x86-64 build and picked at runtime
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#define SUBLEQ_BIN_AVX2 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define _BIN_TARGET_AVX2
+#else
+#define _BIN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SUBLEQ_BIN_AVX2 0
+#endif
+#ifdef _WIN32
+#include <stdlib.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum BIN_RESULT : uint8_t
+{
+	BIN_OK,
+	BIN_OPEN_FAILED,	// The file could not be opened
+	BIN_TOO_SMALL,		// The file is smaller than the header or the memory it declares
+	BIN_BAD_MAGIC,		// The file does not start with 0x1337 in either byte order
+	BIN_BAD_VERSION,	// The file version is not supported
+	BIN_ALLOC_FAILED,	// The simulator could not be allocated
+	BIN_BAD_WIDTH,		// The cell width is not supported or doesn't match the simulator
+	BIN_BAD_SEGMENT,	// A segment lies outside memory or the file, or doesn't decompress
+	BIN_WRITE_FAILED,	// The file could not be written completely
+};
+
+inline const char* bin_result_str(const BIN_RESULT r)
+{
+	switch (r)
+	{
+	case BIN_OK:			return "OK";
+	case BIN_OPEN_FAILED:	return "File could not be opened";
+	case BIN_TOO_SMALL:		return "File was too small to be a valid save";
+	case BIN_BAD_MAGIC:		return "File header was not valid";
+	case BIN_BAD_VERSION:	return "File version is not supported";
+	case BIN_ALLOC_FAILED:	return "Failed to allocate the simulator";
+	case BIN_BAD_WIDTH:		return "File cell width is not supported";
+	case BIN_BAD_SEGMENT:	return "File has a damaged segment";
+	case BIN_WRITE_FAILED:	return "File could not be written";
+	default:				return "Unknown error";
+	}
+}
+
+#ifdef _WIN32
+inline uint16_t _bin_bswap(const uint16_t x) { return _byteswap_ushort(x); }
+inline uint32_t _bin_bswap(const uint32_t x) { return _byteswap_ulong(x); }
+inline uint64_t _bin_bswap(const uint64_t x) { return _byteswap_uint64(x); }
+#else
+inline uint16_t _bin_bswap(const uint16_t x) { return __builtin_bswap16(x); }
+inline uint32_t _bin_bswap(const uint32_t x) { return __builtin_bswap32(x); }
+inline uint64_t _bin_bswap(const uint64_t x) { return __builtin_bswap64(x); }
+#endif
+
+template <typename U>
+inline void _bin_swap_elements(uint8_t* d, const uint8_t* s, const size_t num_elements)
+{
+	for (size_t i = 0; i < num_elements; ++i)
+	{
+		U x;
+		memcpy(&x, s + i * sizeof(U), sizeof(U));
+		x = _bin_bswap(x);
+		memcpy(d + i * sizeof(U), &x, sizeof(U));
+	}
+}
+
+#if SUBLEQ_BIN_AVX2
+// True if both the CPU and the OS support AVX2
+inline bool _bin_has_avx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	static const bool has = []() {
+		int r[4];
+		__cpuid(r, 0);
+		if (r[0] < 7)
+			return false;
+		// OSXSAVE and AVX, and the OS saves the ymm registers
+		__cpuid(r, 1);
+		if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(r, 7, 0);
+		return (r[1] & (1 << 5)) != 0;
+	}();
+	return has;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// Swaps whole vectors of elements of 2, 4 or 8 bytes, returning how many elements it did
+_BIN_TARGET_AVX2 inline size_t _bin_swap_avx2(uint8_t* d, const uint8_t* s, const size_t element_size, const size_t num_elements)
+{
+	// The shuffle works within 16 byte lanes, which hold whole elements of every width
+	const __m256i mask =
+		element_size == 2 ? _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+		element_size == 4 ? _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+		_mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	const size_t per_vector = 32 / element_size;
+	size_t i = 0;
+	for (; i + per_vector <= num_elements; i += per_vector)
+	{
+		const __m256i v = _mm256_loadu_si256((const __m256i*)(s + i * element_size));
+		_mm256_storeu_si256((__m256i*)(d + i * element_size), _mm256_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+#endif
+
+// Reverses the bytes of every element, dst may be src
+inline void _bin_swap_byteorder(void* dst, const void* src, const size_t element_size, const size_t num_elements)
+{
+	uint8_t* d = (uint8_t*)dst;
+	const uint8_t* s = (const uint8_t*)src;
+	if (element_size == 1)
+	{
+		if (d != s)
+			memmove(d, s, num_elements);
+		return;
+	}
+	size_t i = 0;
+#if SUBLEQ_BIN_AVX2
+	if (_bin_has_avx2())
+		i = _bin_swap_avx2(d, s, element_size, num_elements);
+#endif
+	d += i * element_size;
+	s += i * element_size;
+	if (element_size == 2) _bin_swap_elements<uint16_t>(d, s, num_elements - i);
+	else if (element_size == 4) _bin_swap_elements<uint32_t>(d, s, num_elements - i);
+	else _bin_swap_elements<uint64_t>(d, s, num_elements - i);
+}
+
+inline bool _bin_little_endian()
+{
+	const uint16_t x = 1;
+	return *(const uint8_t*)&x == 1;
+}
+
+// PackBits: a control byte n below 128 is followed by n + 1 literal bytes, one above 128 by
+// a byte that repeats 257 - n times
+inline void _bin_rle_encode(std::vector<uint8_t>& out, const uint8_t* src, const size_t size)
+{
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t run = 1;
+		while (i + run < size && run < 128 && src[i + run] == src[i])
+			++run;
+		if (run >= 3)
+		{
+			out.push_back((uint8_t)(257 - run));
+			out.push_back(src[i]);
+			i += run;
+			continue;
+		}
+		// Literals up to the next run of three
+		size_t lit = 0;
+		while (i + lit < size && lit < 128 &&
+			!(i + lit + 2 < size && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2]))
+			++lit;
+		out.push_back((uint8_t)(lit - 1));
+		out.insert(out.end(), src + i, src + i + lit);
+		i += lit;
+	}
+}
+
+// False unless src decodes to exactly size bytes
+inline bool _bin_rle_decode(uint8_t* dst, const size_t size, const uint8_t* src, const size_t src_size)
+{
+	size_t o = 0;
+	size_t i = 0;
+	while (i < src_size)
+	{
+		const uint8_t n = src[i++];
+		if (n < 128)
+		{
+			const size_t len = (size_t)n + 1;
+			if (src_size - i < len || size - o < len)
+				return false;
+			memcpy(dst + o, src + i, len);
+			i += len;
+			o += len;
+		}
+		else if (n > 128)
+		{
+			const size_t len = 257 - (size_t)n;
+			if (i == src_size || size - o < len)
+				return false;
+			memset(dst + o, src[i++], len);
+			o += len;
+		}
+	}
+	return o == size;
+}
+
+// Version 1 binaries (always 8-bit cells):
+//   uint16_t magic (0x1337, in the byte order of the machine that saved it)
+//   uint8_t  version
+//   size_t   memsize
+//   int8_t   initial ip
+//   int8_t   memory[memsize]
+// Version 2 binaries record the cell width:
+//   uint16_t magic
+//   uint8_t  version
+//   uint8_t  cell width in bytes (1, 2, 4 or 8)
+//   size_t   memsize in bytes
+//   T        initial ip
+//   T        memory[memsize / sizeof(T)]
+// Version 3 binaries only store the parts of memory that aren't zero, every field is in the
+// byte order given in the header:
+//   uint16_t magic
+//   uint8_t  version
+//   uint8_t  cell width in bytes
+//   uint8_t  byte order, 0 for little endian and 1 for big endian
+//   uint8_t  reserved[3]
+//   uint64_t memsize in bytes
+//   int64_t  initial ip
+//   uint64_t segment count
+//   segments, sorted by address and not overlapping:
+//     uint64_t address and size in memory, in bytes
+//     uint64_t offset and size of the stored data in the file
+//     uint8_t  compression (BIN_COMPRESSION)
+//     uint8_t  reserved[7]
+// Uncompressed data lies at a file offset equal to its address modulo bin_page_size, so
+// bin_map can map it straight into memory.
+const size_t bin_page_size = 4096;
+const uint8_t bin_version = 3;
+const size_t bin_v3_header_size = 32;
+const size_t bin_v3_segment_size = 40;
+
+enum BIN_COMPRESSION : uint8_t
+{
+	BIN_COMPRESS_NONE,	// Stored as is
+	BIN_COMPRESS_RLE,	// PackBits run-length encoding
+};
+
+struct bin_segment
+{
+	uint64_t addr;
+	uint64_t size;
+	uint64_t file_offset;
+	uint64_t stored_size;
+	BIN_COMPRESSION compression;
+};
+
+struct bin_header
+{
+	uint8_t version;
+	uint8_t cell_width;
+	bool match_endian;
+	size_t memsize;
+	size_t file_size;
+	int64_t ip;
+	// Older versions are read as a single segment covering all of memory
+	std::vector<bin_segment> segments;
+};
+
+template <typename U>
+inline U _bin_read(std::ifstream& f, const bool match_endian)
+{
+	U x{};
+	f.read((char*)&x, sizeof(U));
+	if (!match_endian)
+		_bin_swap_byteorder(&x, &x, sizeof(U), 1);
+	return x;
+}
+
+// Reads a cell of the given width, sign extended
+inline int64_t _bin_read_cell(std::ifstream& f, const uint8_t width, const bool match_endian)
+{
+	switch (width)
+	{
+	case 1:		return _bin_read<int8_t>(f, match_endian);
+	case 2:		return _bin_read<int16_t>(f, match_endian);
+	case 4:		return _bin_read<int32_t>(f, match_endian);
+	default:	return _bin_read<int64_t>(f, match_endian);
+	}
+}
+
+inline BIN_RESULT _bin_read_v3_header(std::ifstream& f, bin_header& h, const bool magic_matches)
+{
+	if (h.file_size < bin_v3_header_size)
+		return BIN_TOO_SMALL;
+	f.read((char*)(&h.cell_width), 1);
+	uint8_t order = 0;
+	f.read((char*)(&order), 1);
+	if (order > 1)
+		return BIN_BAD_MAGIC;
+	h.match_endian = (order == 0) == _bin_little_endian();
+	if (h.match_endian != magic_matches)
+		return BIN_BAD_MAGIC;
+	if (h.cell_width != 1 && h.cell_width != 2 && h.cell_width != 4 && h.cell_width != 8)
+		return BIN_BAD_WIDTH;
+	f.seekg(8, std::ios::beg);
+	const uint64_t memsize = _bin_read<uint64_t>(f, h.match_endian);
+	if (memsize > SIZE_MAX - 2 * bin_page_size)
+		return BIN_ALLOC_FAILED;
+	h.memsize = (size_t)memsize;
+	h.ip = _bin_read<int64_t>(f, h.match_endian);
+	const uint64_t count = _bin_read<uint64_t>(f, h.match_endian);
+	if (count > (h.file_size - bin_v3_header_size) / bin_v3_segment_size)
+		return BIN_TOO_SMALL;
+
+	h.segments.resize((size_t)count);
+	uint64_t prev_end = 0;
+	for (bin_segment& s : h.segments)
+	{
+		s.addr = _bin_read<uint64_t>(f, h.match_endian);
+		s.size = _bin_read<uint64_t>(f, h.match_endian);
+		s.file_offset = _bin_read<uint64_t>(f, h.match_endian);
+		s.stored_size = _bin_read<uint64_t>(f, h.match_endian);
+		f.read((char*)(&s.compression), 1);
+		f.seekg(7, std::ios::cur);
+		// Byte order is fixed per cell, so segments must start and end on one
+		if (s.addr < prev_end || s.addr > h.memsize || s.size > h.memsize - s.addr || s.addr % h.cell_width != 0 || s.size % h.cell_width != 0 ||
+			s.file_offset > h.file_size || s.stored_size > h.file_size - s.file_offset ||
+			s.compression > BIN_COMPRESS_RLE || (s.compression == BIN_COMPRESS_NONE && s.stored_size != s.size))
+			return BIN_BAD_SEGMENT;
+		prev_end = s.addr + s.size;
+	}
+	return BIN_OK;
+}
+
+inline BIN_RESULT _bin_read_header(std::ifstream& f, bin_header& h)
+{
+	f.seekg(0, std::ios::end);
+	h.file_size = (size_t)f.tellg();
+	f.seekg(0, std::ios::beg);
+	if (h.file_size < 2 + 1 + sizeof(size_t) + 1)
+		return BIN_TOO_SMALL;
+
+	uint16_t magic;
+	f.read((char*)(&magic), 2);
+	if (magic != 0x1337 && magic != 0x3713)
+		return BIN_BAD_MAGIC;
+	h.match_endian = magic == 0x1337;
+
+	f.read((char*)(&h.version), 1);
+	if (h.version == bin_version)
+		return _bin_read_v3_header(f, h, h.match_endian);
+	else if (h.version == 1)
+		h.cell_width = 1;
+	else if (h.version == 2)
+		f.read((char*)(&h.cell_width), 1);
+	else
+		return BIN_BAD_VERSION;
+	if (h.cell_width != 1 && h.cell_width != 2 && h.cell_width != 4 && h.cell_width != 8)
+		return BIN_BAD_WIDTH;
+
+	f.read((char*)(&h.memsize), sizeof(size_t));
+	if (!h.match_endian)
+		_bin_swap_byteorder(&h.memsize, &h.memsize, sizeof(size_t), 1);
+	const size_t ip_offset = (size_t)f.tellg();
+	if (h.file_size < ip_offset + h.cell_width || h.file_size - ip_offset - h.cell_width < h.memsize)
+		return BIN_TOO_SMALL;
+	h.ip = _bin_read_cell(f, h.cell_width, h.match_endian);
+	h.segments.push_back({ 0, h.memsize, ip_offset + h.cell_width, h.memsize, BIN_COMPRESS_NONE });
+	return BIN_OK;
+}
+
+// Reads just the cell width of a binary, so the caller can pick the matching bin_load<T>
+inline BIN_RESULT bin_peek(const char* fname, uint8_t* cell_width)
+{
+	std::ifstream f(fname, std::ios::binary);
+	if (!f.is_open())
+		return BIN_OPEN_FAILED;
+	bin_header h{};
+	const BIN_RESULT r = _bin_read_header(f, h);
+	*cell_width = h.cell_width;
+	return r;
+}
+
+// Turns the stored bytes of a segment into memory, in the file's byte order
+inline bool _bin_decode_segment(uint8_t* memory, const bin_segment& s, const uint8_t* stored)
+{
+	if (s.compression == BIN_COMPRESS_RLE)
+		return _bin_rle_decode(memory + s.addr, (size_t)s.size, stored, (size_t)s.stored_size);
+	memcpy(memory + s.addr, stored, (size_t)s.size);
+	return true;
+}
+
+inline void _bin_fix_byteorder(const bin_header& h, uint8_t* memory)
+{
+	if (h.match_endian)
+		return;
+	for (const bin_segment& s : h.segments)
+		_bin_swap_byteorder(memory + s.addr, memory + s.addr, h.cell_width, (size_t)s.size / h.cell_width);
+}
+
+// On success *out holds a new simulator that the caller must destroy_subleq()
+template <typename T>
+BIN_RESULT bin_load(const char* fname, subleq<T>** out)
+{
+	*out = nullptr;
+	std::ifstream f(fname, std::ios::binary);
+	if (!f.is_open())
+		return BIN_OPEN_FAILED;
+	bin_header h{};
+	const BIN_RESULT r = _bin_read_header(f, h);
+	if (r != BIN_OK)
+		return r;
+	if (h.cell_width != sizeof(T))
+		return BIN_BAD_WIDTH;
+
+	subleq<T>* sim = create_subleq<T>(h.memsize);
+	if (sim == nullptr)
+		return BIN_ALLOC_FAILED;
+	sim->_ip = (T)h.ip;
+	std::vector<uint8_t> stored;
+	for (const bin_segment& s : h.segments)
+	{
+		f.seekg((std::streamoff)s.file_offset, std::ios::beg);
+		if (s.compression == BIN_COMPRESS_NONE)
+		{
+			f.read((char*)sim->memory + s.addr, (std::streamsize)s.size);
+			continue;
+		}
+		stored.resize((size_t)s.stored_size);
+		f.read((char*)stored.data(), (std::streamsize)stored.size());
+		if (!_bin_decode_segment(sim->memory, s, stored.data()))
+		{
+			destroy_subleq(sim);
+			return BIN_BAD_SEGMENT;
+		}
+	}
+	_bin_fix_byteorder(h, sim->memory);
+
+	*out = sim;
+	return BIN_OK;
+}
+
+#ifdef _WIN32
+// Mapping a file copy-on-write at a chosen address isn't available here, so this is bin_load
+template <typename T>
+BIN_RESULT bin_map(const char* fname, subleq<T>** out)
+{ return bin_load<T>(fname, out); }
+
+template <typename T>
+void bin_unmap(subleq<T>* sim)
+{ destroy_subleq(sim); }
+#else
+inline bool _bin_pread(const int fd, uint8_t* dst, size_t size, uint64_t offset)
+{
+	while (size > 0)
+	{
+		const ssize_t n = pread(fd, dst, size, (off_t)offset);
+		if (n <= 0)
+			return false;
+		dst += n;
+		size -= (size_t)n;
+		offset += (uint64_t)n;
+	}
+	return true;
+}
+
+// Loads like bin_load, but memory is an anonymous mapping that stays zero until written,
+// and whole pages of uncompressed segments in this machine's byte order are mapped from
+// the file copy-on-write. Nothing is read until it is touched and zero regions cost nothing.
+// Release the simulator with bin_unmap. The header fields sit at the end of the page before
+// memory so memory starts on a page, which leaves them unaligned like the cells are.
+template <typename T>
+BIN_RESULT bin_map(const char* fname, subleq<T>** out)
+{
+	*out = nullptr;
+	bin_header h{};
+	{
+		std::ifstream f(fname, std::ios::binary);
+		if (!f.is_open())
+			return BIN_OPEN_FAILED;
+		const BIN_RESULT r = _bin_read_header(f, h);
+		if (r != BIN_OK)
+			return r;
+	}
+	if (h.cell_width != sizeof(T))
+		return BIN_BAD_WIDTH;
+	const int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return BIN_OPEN_FAILED;
+
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t len = page + (h.memsize + page - 1) / page * page;
+	void* base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		return BIN_ALLOC_FAILED;
+	}
+	subleq<T>* sim = (subleq<T>*)((uint8_t*)base + page - offsetof(subleq<T>, memory));
+	sim->_ip = (T)h.ip;
+	sim->memsize = h.memsize;
+	sim->running = false;
+	sim->input = nullptr;
+	sim->dirty = nullptr;
+
+	bool ok = true;
+	std::vector<uint8_t> stored;
+	for (const bin_segment& s : h.segments)
+	{
+		if (s.compression == BIN_COMPRESS_NONE && h.match_endian)
+		{
+			// Whole pages are mapped, the partial pages at either end are read
+			const size_t lo = ((size_t)s.addr + page - 1) / page * page;
+			const size_t hi = (size_t)(s.addr + s.size) / page * page;
+			if (hi > lo && (s.file_offset + (lo - s.addr)) % page == 0 &&
+				mmap(sim->memory + lo, hi - lo, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)(s.file_offset + (lo - s.addr))) != MAP_FAILED)
+			{
+				ok = ok && _bin_pread(fd, sim->memory + s.addr, lo - (size_t)s.addr, s.file_offset);
+				ok = ok && _bin_pread(fd, sim->memory + hi, (size_t)(s.addr + s.size) - hi, s.file_offset + (hi - s.addr));
+				continue;
+			}
+		}
+		stored.resize((size_t)s.stored_size);
+		ok = ok && _bin_pread(fd, stored.data(), stored.size(), s.file_offset) && _bin_decode_segment(sim->memory, s, stored.data());
+	}
+	close(fd);
+	if (!ok)
+	{
+		munmap(base, len);
+		return BIN_BAD_SEGMENT;
+	}
+	_bin_fix_byteorder(h, sim->memory);
+
+	*out = sim;
+	return BIN_OK;
+}
+
+template <typename T>
+void bin_unmap(subleq<T>* sim)
+{
+	if (sim == nullptr)
+		return;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	munmap(sim->memory - page, page + (sim->memsize + page - 1) / page * page);
+}
+#endif
+
+template <typename U>
+inline void _bin_write(std::ofstream& f, const U x)
+{ f.write((const char*)&x, sizeof(U)); }
+
+// Saves a version 3 binary in the byte order of this machine. Memory is split into
+// bin_page_size pages and every run of pages that aren't all zero becomes a segment.
+template <typename T>
+BIN_RESULT bin_save(const char* fname, const subleq<T>* sim, const BIN_COMPRESSION compression=BIN_COMPRESS_NONE)
+{
+	std::ofstream f(fname, std::ios::binary);
+	if (!f.is_open())
+		return BIN_OPEN_FAILED;
+
+	static const uint8_t zero_page[bin_page_size] = {};
+	std::vector<bin_segment> segments;
+	for (size_t addr = 0; addr < sim->memsize; addr += bin_page_size)
+	{
+		const size_t len = sim->memsize - addr < bin_page_size ? sim->memsize - addr : bin_page_size;
+		if (memcmp(sim->memory + addr, zero_page, len) == 0)
+			continue;
+		if (!segments.empty() && segments.back().addr + segments.back().size == addr)
+		{
+			segments.back().size += len;
+			segments.back().stored_size += len;
+		}
+		else
+			segments.push_back({ addr, len, 0, len, BIN_COMPRESS_NONE });
+	}
+
+	// Compressed data is packed right after the table, uncompressed data goes after it on
+	// offsets that line up with its address
+	std::vector<std::vector<uint8_t>> packed(segments.size());
+	uint64_t offset = bin_v3_header_size + bin_v3_segment_size * segments.size();
+	if (compression == BIN_COMPRESS_RLE)
+	{
+		for (size_t i = 0; i < segments.size(); ++i)
+		{
+			bin_segment& s = segments[i];
+			_bin_rle_encode(packed[i], sim->memory + s.addr, (size_t)s.size);
+			if (packed[i].size() >= s.size)
+			{
+				packed[i] = {};
+				continue;
+			}
+			s.compression = BIN_COMPRESS_RLE;
+			s.stored_size = packed[i].size();
+			s.file_offset = offset;
+			offset += s.stored_size;
+		}
+	}
+	for (bin_segment& s : segments)
+	{
+		if (s.compression != BIN_COMPRESS_NONE)
+			continue;
+		offset += (s.addr - offset % bin_page_size + bin_page_size) % bin_page_size;
+		s.file_offset = offset;
+		offset += s.size;
+	}
+
+	const uint16_t magic = 0x1337;
+	const uint8_t cell_width = sizeof(T);
+	const uint8_t order = _bin_little_endian() ? 0 : 1;
+	const uint8_t reserved[7] = {};
+	f.write((const char*)(&magic), 2);
+	f.write((const char*)(&bin_version), 1);
+	f.write((const char*)(&cell_width), 1);
+	f.write((const char*)(&order), 1);
+	f.write((const char*)reserved, 3);
+	_bin_write<uint64_t>(f, sim->memsize);
+	_bin_write<int64_t>(f, sim->_ip);
+	_bin_write<uint64_t>(f, segments.size());
+	for (const bin_segment& s : segments)
+	{
+		_bin_write<uint64_t>(f, s.addr);
+		_bin_write<uint64_t>(f, s.size);
+		_bin_write<uint64_t>(f, s.file_offset);
+		_bin_write<uint64_t>(f, s.stored_size);
+		f.write((const char*)(&s.compression), 1);
+		f.write((const char*)reserved, 7);
+	}
+
+	// Segments are written in file order, padding the gaps with zeros
+	std::vector<size_t> order_in_file(segments.size());
+	for (size_t i = 0; i < segments.size(); ++i)
+		order_in_file[i] = i;
+	std::sort(order_in_file.begin(), order_in_file.end(), [&segments](const size_t x, const size_t y) {
+		return segments[x].file_offset < segments[y].file_offset;
+	});
+	uint64_t pos = bin_v3_header_size + bin_v3_segment_size * segments.size();
+	for (const size_t i : order_in_file)
+	{
+		const bin_segment& s = segments[i];
+		f.write((const char*)zero_page, (std::streamsize)(s.file_offset - pos));
+		if (s.compression == BIN_COMPRESS_RLE)
+			f.write((const char*)packed[i].data(), (std::streamsize)packed[i].size());
+		else
+			f.write((const char*)sim->memory + s.addr, (std::streamsize)s.size);
+		pos = s.file_offset + s.stored_size;
+	}
+	if (!f.good())
+		return BIN_WRITE_FAILED;
+	return BIN_OK;
+}
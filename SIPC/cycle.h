@@ -0,0 +1,244 @@
+#pragma once
+#include <type_traits>
+#include "subleq.h"
+
+// Loop detection for programs that will never halt because they came back to a machine state
+// they were in before: the same ip and the same memory. Memory is summarised by a hash over
+// its cell sized words that every write updates from the value it replaced, and Brent's
+// algorithm compares the state each step with one saved at the last power of two, so a loop
+// of period p entered at step s is found within about 2 * max(s, p) + p steps, at constant
+// work per step. A match is only reported once the loop went round again and matched a
+// second time, so a hash collision can't stop a program that is still making progress.
+// How much input was read is part of the state, so only a program that waits for input that
+// has run out can be caught reading it.
+
+struct subleq_cycle
+{
+	uint64_t hash = 0;				// Of every memory word
+	uint64_t steps = 0;				// Steps seen since the last reset
+	// Brent's algorithm: the saved state, and how many steps ago it was saved
+	uint64_t saved_hash = 0;
+	size_t saved_ip = 0;
+	uint64_t power = 1;
+	uint64_t lambda = 0;
+	// Steps left until a match is confirmed, 0 while there is none
+	uint64_t confirm_left = 0;
+
+	// Filled in once a loop was found
+	bool found = false;
+	size_t entry_ip = 0;			// The ip of the state that repeats
+	uint64_t period = 0;			// Steps per trip around the loop
+	uint64_t since = 0;				// A step by which the program was already in the loop
+};
+
+// 64-bit finalizer from MurmurHash3
+inline uint64_t _cycle_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// Each word index gets its own odd multiplier. Zero words hash to 0 without a branch, so
+// memory that was never written costs nothing.
+inline uint64_t _cycle_word_hash(const size_t w, const uint64_t v)
+{ return _cycle_mix(v * ((uint64_t)w * 0x9E3779B97F4A7C16ull + 1)); }
+
+// The word at index w, zero padded past the end of memory
+template <typename T>
+inline uint64_t _cycle_load(const uint8_t* memory, const size_t memsize, const size_t w)
+{
+	const size_t at = w * sizeof(T);
+	std::make_unsigned_t<T> v = 0;
+	if (memsize - at >= sizeof(T))
+		memcpy(&v, memory + at, sizeof(T));
+	else
+		memcpy(&v, memory + at, memsize - at);
+	return v;
+}
+
+// Cells that don't line up with the words overlap two of them. Memory has already been
+// written, so the words' old values are worked out from the bytes that changed.
+template <typename T>
+void _cycle_write_unaligned(subleq_cycle* cycle, const uint8_t* memory, const size_t memsize, const size_t addr, const uint64_t diff)
+{
+	const size_t w = addr / sizeof(T);
+	const size_t shift = (addr % sizeof(T)) * 8;
+	const uint64_t lo = (std::make_unsigned_t<T>)(diff << shift);
+	const uint64_t hi = diff >> (sizeof(T) * 8 - shift);
+	const uint64_t now_lo = _cycle_load<T>(memory, memsize, w);
+	const uint64_t now_hi = _cycle_load<T>(memory, memsize, w + 1);
+	cycle->hash ^= _cycle_word_hash(w, now_lo) ^ _cycle_word_hash(w, now_lo ^ lo);
+	cycle->hash ^= _cycle_word_hash(w + 1, now_hi) ^ _cycle_word_hash(w + 1, now_hi ^ hi);
+}
+
+// The read position of the input, mixed in like a word of its own
+inline uint64_t _cycle_input_hash(const subleq_source* input)
+{ return input != nullptr ? _cycle_mix(subleq_source_tell(input) ^ 0xA0761D6478BD642Full) : 0; }
+
+// Updates the hash after the cell at addr changed from old to now. An aligned cell is a word
+// of its own, so the common case never reads memory back.
+template <typename T>
+inline void _subleq_cycle_write(subleq_cycle* cycle, const uint8_t* memory, const size_t memsize, const size_t addr, const T old, const T now)
+{
+	typedef std::make_unsigned_t<T> U;
+	if (addr % sizeof(T) == 0)
+	{
+		const size_t w = addr / sizeof(T);
+		cycle->hash ^= _cycle_word_hash(w, (U)old) ^ _cycle_word_hash(w, (U)now);
+	}
+	else if (old != now)
+		_cycle_write_unaligned<T>(cycle, memory, memsize, addr, (U)(old ^ now));
+}
+
+inline void _cycle_save(subleq_cycle* cycle, const size_t ip)
+{
+	cycle->saved_hash = cycle->hash;
+	cycle->saved_ip = ip;
+	cycle->lambda = 0;
+}
+
+// Feeds the state after a step to Brent's algorithm, true once a loop was found
+inline bool _subleq_cycle_observe(subleq_cycle* cycle, const size_t ip)
+{
+	++cycle->steps;
+	if (cycle->confirm_left != 0)
+	{
+		if (--cycle->confirm_left != 0)
+			return false;
+		if (cycle->hash == cycle->saved_hash && ip == cycle->saved_ip)
+			return cycle->found = true;
+		// A collision, search again from here
+		cycle->power = 1;
+		_cycle_save(cycle, ip);
+		return false;
+	}
+	++cycle->lambda;
+	if (cycle->hash == cycle->saved_hash && ip == cycle->saved_ip)
+	{
+		cycle->entry_ip = ip;
+		cycle->period = cycle->lambda;
+		cycle->since = cycle->steps - cycle->lambda;
+		cycle->confirm_left = cycle->lambda;
+	}
+	else if (cycle->lambda == cycle->power)
+	{
+		cycle->power *= 2;
+		_cycle_save(cycle, ip);
+	}
+	return cycle->found;
+}
+
+// Forgets everything seen and hashes memory again, call this after memory or ip are changed
+// outside of stepping
+template <typename T>
+void subleq_cycle_reset(subleq_cycle* cycle, const subleq<T>* state)
+{
+	*cycle = subleq_cycle();
+	const size_t words = (state->memsize + sizeof(T) - 1) / sizeof(T);
+	for (size_t w = 0; w < words; ++w)
+		cycle->hash ^= _cycle_word_hash(w, _cycle_load<T>(state->memory, state->memsize, w));
+	cycle->hash ^= _cycle_input_hash(state->input);
+	_cycle_save(cycle, (size_t)state->_ip);
+}
+
+// Searches again from the state the machine is in now, after a loop was found. The hash
+// still holds as long as every write since the reset went through subleq_run_checked.
+inline void subleq_cycle_rearm(subleq_cycle* cycle, const size_t ip)
+{
+	cycle->found = false;
+	cycle->confirm_left = 0;
+	cycle->power = 1;
+	_cycle_save(cycle, ip);
+}
+
+template <typename T>
+subleq_cycle* create_subleq_cycle(const subleq<T>* state)
+{
+	subleq_cycle* cycle = new subleq_cycle();
+	subleq_cycle_reset(cycle, state);
+	return cycle;
+}
+
+inline void destroy_subleq_cycle(subleq_cycle* cycle)
+{ delete cycle; }
+
+// Runs up to max_steps instructions like subleq_step, hashing every write, and stops as soon
+// as the machine is found in a loop. Stops in front of any address flagged in stop_at, other
+// than the one it starts on, and after any write to a cell watch flags. Returns how many
+// instructions were executed.
+template <typename T>
+uint64_t subleq_run_checked(subleq<T>* state, subleq_cycle* cycle, const uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	// Keep the hot state in locals, stores through memory could otherwise alias it
+	uint8_t* const memory = state->memory;
+	const size_t memsize = state->memsize;
+	subleq_cycle c = *cycle;
+	T ip = state->_ip;
+	uint64_t steps = 0;
+	bool fault = false;
+	while (steps < max_steps && (size_t)ip < memsize)
+	{
+		const size_t at = (size_t)ip;
+		if (!_subleq_in_bounds(state, at + sizeof(T) * 2))
+		{
+			fault = true;
+			break;
+		}
+		const T a = *(T*)(memory + at);
+		const T b = *(T*)(memory + at + sizeof(T));
+		const size_t a_addr = _subleq_addr(a);
+		const size_t b_addr = _subleq_addr(b);
+		const bool in = a == ((T)(-1)) && b != ((T)(-1));
+		if ((!in && !_subleq_in_bounds(state, a_addr)) || (b != ((T)(-1)) && !_subleq_in_bounds(state, b_addr)))
+		{
+			fault = true;
+			break;
+		}
+
+		if (b == ((T)(-1)))
+		{
+			state->_ip = ip;
+			if (FN_OnOutput != nullptr)
+				FN_OnOutput(state, *(T*)(memory + a_addr), state->_ip, userarg);
+			ip = *(T*)(memory + at + sizeof(T) * 2);
+		}
+		else
+		{
+			T& mb = *(T*)(memory + b_addr);
+			const T old = mb;
+			T now;
+			if (in)
+			{
+				c.hash ^= _cycle_input_hash(state->input);
+				now = _subleq_input<T>(state->input);
+				c.hash ^= _cycle_input_hash(state->input);
+				ip = *(T*)(memory + at + sizeof(T) * 2);
+			}
+			else
+			{
+				now = _subleq_sub(old, *(T*)(memory + a_addr));
+				ip = now <= 0 ? *(T*)(memory + at + sizeof(T) * 2) : (T)(at + sizeof(T) * 3);
+			}
+			mb = now;
+			if (state->dirty != nullptr)
+				_subleq_dirty_write<T>(state->dirty, b_addr);
+			_subleq_cycle_write<T>(&c, memory, memsize, b_addr, old, now);
+			if (watch != nullptr)
+				_subleq_watch_write<T>(watch, b_addr, at);
+		}
+		++steps;
+
+		if ((size_t)ip >= memsize || _subleq_cycle_observe(&c, (size_t)ip))
+			break;
+		if ((watch != nullptr && watch->hit()) || (stop_at != nullptr && stop_at[(size_t)ip]))
+			break;
+	}
+	*cycle = c;
+	state->_ip = ip;
+	state->running = !fault && (size_t)ip < memsize;
+	return steps;
+}
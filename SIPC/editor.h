@@ -1,12 +1,49 @@
 ﻿#pragma once
 #include <map>
+#include <vector>
+#include <string>
+#include <variant>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <iostream>
 #include <fstream>
+#include <stdarg.h>
 #include <conio.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "subleq.h"
+#include "analysis.h"
+#include "binfile.h"
+#include "jit.h"
+#include "fusion.h"
+#include "sink.h"
+#include "savepoint.h"
+#include "history.h"
+#include "profile.h"
+#include "assembler.h"
+#include "cycle.h"
 
 
-typedef int8_t cell_value_t;
+// How many instructions the JIT runs between checks for a pause or snapshot request
+const uint64_t editor_jit_slice = 1 << 20;
+// The same for superinstructions when the JIT is off
+const uint64_t editor_fused_slice = 1 << 16;
+// The same for logged stepping while history is on, and for loop checking
+const uint64_t editor_recorded_slice = 1 << 16;
+// How many instructions fast-forwarding runs between checks for a pause
+const uint64_t editor_fast_slice = 1 << 24;
+// How often the memory view is redrawn while running
+const std::chrono::milliseconds editor_frame_interval(33);
+// Savepoint taken when a binary is loaded, reset goes back to it
+const char* const editor_initial_savepoint = "initial";
+// Rows in each table of an exported profile
+const size_t editor_profile_rows = 20;
 
 enum BREAKPT_TYPE : uint8_t
 {
@@ -21,11 +58,285 @@ enum BREAKPT_TYPE : uint8_t
 struct BreakPoint
 {
 	BREAKPT_TYPE type = BREAK;
-	cell_value_t meta = 0;
+	int64_t meta = 0;
+	// In cells relative to the ip
 	int8_t addr_offset = 0;
 	bool is_valid = true;
 };
 
+// Breakpoints are looked up on every executed instruction, so each address has a flag
+// and the full BreakPoint is only stored (and looked up) for flagged addresses.
+struct BreakPointSet
+{
+	// One entry per memory address, non-zero if a valid breakpoint is set there
+	std::vector<uint8_t> flags;
+	std::map<size_t, BreakPoint> points;
+
+	bool empty() const { return points.empty(); }
+	bool contains(const size_t addr) const { return addr < flags.size() && flags[addr]; }
+	const BreakPoint& at(const size_t addr) const { return points.at(addr); }
+
+	void set(const size_t addr, const BreakPoint& bk)
+	{
+		if (addr >= flags.size())
+			return;
+		if (!bk.is_valid)
+		{
+			erase(addr);
+			return;
+		}
+		points[addr] = bk;
+		flags[addr] = 1;
+	}
+	void erase(const size_t addr)
+	{
+		if (addr >= flags.size())
+			return;
+		points.erase(addr);
+		flags[addr] = 0;
+	}
+	// Resizes to a new memory size, dropping any breakpoints past the end
+	void resize(const size_t memsize)
+	{
+		flags.resize(memsize, 0);
+		points.erase(points.lower_bound(memsize), points.end());
+	}
+};
+
+// A data watchpoint, fires when an instruction writes any cell in first..last (byte addresses
+// covering whole cells) and the value written passes the comparison
+struct WatchPoint
+{
+	size_t first = 0;
+	size_t last = 0;
+	BREAKPT_TYPE type = BREAK;
+	int64_t meta = 0;
+};
+
+// Checked on the single write each step makes, so like breakpoints every watched byte has a
+// flag and the watchpoint covering it is only looked up when a write hits one. Watchpoints
+// never overlap, setting one drops any it overlaps.
+struct WatchPointSet
+{
+	std::vector<uint8_t> flags;
+	// Keyed by the first address
+	std::map<size_t, WatchPoint> points;
+
+	bool empty() const { return points.empty(); }
+	bool contains(const size_t addr) const { return addr < flags.size() && flags[addr]; }
+	// The watchpoint overlapping first..last, nullptr if there is none
+	const WatchPoint* find(const size_t first, const size_t last) const
+	{
+		auto it = points.upper_bound(last);
+		if (it == points.begin())
+			return nullptr;
+		--it;
+		return it->second.last >= first ? &it->second : nullptr;
+	}
+
+	void set(const WatchPoint& wp)
+	{
+		if (wp.last >= flags.size() || wp.first > wp.last)
+			return;
+		const WatchPoint* old;
+		while ((old = find(wp.first, wp.last)) != nullptr)
+			erase(old->first);
+		points[wp.first] = wp;
+		std::fill(flags.begin() + wp.first, flags.begin() + wp.last + 1, 1);
+	}
+	// Drops the watchpoint covering addr
+	void erase(const size_t addr)
+	{
+		const WatchPoint* wp = find(addr, addr);
+		if (wp == nullptr)
+			return;
+		std::fill(flags.begin() + wp->first, flags.begin() + wp->last + 1, 0);
+		points.erase(wp->first);
+	}
+	// Resizes to a new memory size, dropping any watchpoints that don't fit anymore
+	void resize(const size_t memsize)
+	{
+		flags.resize(memsize, 0);
+		while (!points.empty() && points.rbegin()->second.last >= memsize)
+			erase(points.rbegin()->first);
+	}
+};
+
+inline const char* breakpt_type_str(const BREAKPT_TYPE t)
+{
+	switch (t)
+	{
+	case BREAKPT_TYPE::BREAK:		return "any";
+	case BREAKPT_TYPE::COND_GT:		return ">";
+	case BREAKPT_TYPE::COND_GEQ:	return ">=";
+	case BREAKPT_TYPE::COND_LT:		return "<";
+	case BREAKPT_TYPE::COND_LEQ:	return "<=";
+	case BREAKPT_TYPE::COND_EQ:		return "==";
+	case BREAKPT_TYPE::COND_NEQ:	return "!=";
+	default:						return "unknown";
+	}
+}
+
+inline bool _editor_compare(const BREAKPT_TYPE op, const int64_t x, const int64_t y)
+{
+	switch (op)
+	{
+	case BREAKPT_TYPE::BREAK:		return true;
+	case BREAKPT_TYPE::COND_EQ:		return x == y;
+	case BREAKPT_TYPE::COND_NEQ:	return x != y;
+	case BREAKPT_TYPE::COND_GT:		return x > y;
+	case BREAKPT_TYPE::COND_GEQ:	return x >= y;
+	case BREAKPT_TYPE::COND_LT:		return x < y;
+	case BREAKPT_TYPE::COND_LEQ:	return x <= y;
+	default:						return false;
+	}
+}
+
+enum RUN_OPERAND : uint8_t
+{
+	OPERAND_CONST,		// A number
+	OPERAND_IP,			// The instruction pointer
+	OPERAND_CELL,		// The cell at a byte address, [addr]
+	OPERAND_IP_CELL,	// The cell at an offset in cells from the ip, [ip+n]
+};
+struct RunOperand
+{
+	RUN_OPERAND kind = OPERAND_CONST;
+	int64_t value = 0;
+};
+struct RunComparison
+{
+	RunOperand lhs;
+	BREAKPT_TYPE op = COND_EQ;
+	RunOperand rhs;
+	// Followed by || rather than &&
+	bool last_in_group = true;
+};
+// Comparisons joined by && and ||, where && binds tighter. Holds if every comparison in
+// any one group holds. Kept flat, it is checked after every instruction.
+struct RunCondition
+{
+	std::vector<RunComparison> terms;
+};
+
+inline const char* _run_skip_space(const char* p)
+{
+	while (*p == ' ' || *p == '\t')
+		++p;
+	return p;
+}
+
+inline const char* _run_parse_operand(const char* p, RunOperand& o)
+{
+	p = _run_skip_space(p);
+	const bool cell = *p == '[';
+	if (cell)
+		p = _run_skip_space(p + 1);
+	char* end = nullptr;
+	if (p[0] == 'i' && p[1] == 'p')
+	{
+		p = _run_skip_space(p + 2);
+		o.kind = cell ? OPERAND_IP_CELL : OPERAND_IP;
+		o.value = 0;
+		if (cell && (*p == '+' || *p == '-'))
+		{
+			o.value = strtoll(p, &end, 0);
+			if (end == p + 1)
+				return nullptr;
+			p = end;
+		}
+	}
+	else
+	{
+		o.kind = cell ? OPERAND_CELL : OPERAND_CONST;
+		o.value = strtoll(p, &end, 0);
+		if (end == p)
+			return nullptr;
+		p = end;
+	}
+	if (cell)
+	{
+		p = _run_skip_space(p);
+		if (*p != ']')
+			return nullptr;
+		++p;
+	}
+	return p;
+}
+
+// Parses something like "[24] == 0 && ip > 96 || [ip+1] != -1", returning nullptr on
+// success or where parsing failed
+inline const char* _run_parse_condition(const char* text, RunCondition& cond)
+{
+	cond.terms.clear();
+	const char* p = text;
+	while (true)
+	{
+		RunComparison cmp;
+		const char* next = _run_parse_operand(p, cmp.lhs);
+		if (next == nullptr)
+			return _run_skip_space(p);
+		p = _run_skip_space(next);
+		if (p[0] == '=' && p[1] == '=')			{ cmp.op = COND_EQ; p += 2; }
+		else if (p[0] == '!' && p[1] == '=')	{ cmp.op = COND_NEQ; p += 2; }
+		else if (p[0] == '<' && p[1] == '=')	{ cmp.op = COND_LEQ; p += 2; }
+		else if (p[0] == '>' && p[1] == '=')	{ cmp.op = COND_GEQ; p += 2; }
+		else if (p[0] == '<')					{ cmp.op = COND_LT; p += 1; }
+		else if (p[0] == '>')					{ cmp.op = COND_GT; p += 1; }
+		else return p;
+		next = _run_parse_operand(p, cmp.rhs);
+		if (next == nullptr)
+			return _run_skip_space(p);
+		cond.terms.push_back(cmp);
+
+		p = _run_skip_space(next);
+		if (*p == '\0' || *p == '\r' || *p == '\n')
+			return nullptr;
+		else if (p[0] == '&' && p[1] == '&')
+		{
+			cond.terms.back().last_in_group = false;
+			p += 2;
+		}
+		else if (p[0] == '|' && p[1] == '|')
+			p += 2;
+		else return p;
+	}
+}
+
+template <typename T>
+int64_t _run_operand_value(const subleq<T>* sim, const RunOperand& o)
+{
+	size_t addr = (size_t)o.value;
+	if (o.kind == OPERAND_CONST)
+		return o.value;
+	else if (o.kind == OPERAND_IP)
+		return sim->_ip;
+	else if (o.kind == OPERAND_IP_CELL)
+		addr = (size_t)sim->_ip + o.value * (int64_t)sizeof(T);
+	if (!_subleq_in_bounds(sim, addr))
+		return 0;
+	return *(T*)(sim->memory + addr);
+}
+
+template <typename T>
+bool _run_condition_holds(const subleq<T>* sim, const RunCondition& cond)
+{
+	bool holds = true;
+	for (const RunComparison& cmp : cond.terms)
+	{
+		// Once a comparison fails the rest of its group can be skipped
+		if (holds)
+			holds = _editor_compare(cmp.op, _run_operand_value(sim, cmp.lhs), _run_operand_value(sim, cmp.rhs));
+		if (cmp.last_in_group)
+		{
+			if (holds)
+				return true;
+			holds = true;
+		}
+	}
+	return false;
+}
+
 enum EditorMode : uint8_t
 {
 	RUNNING,			// The simulator is running until breakpoint or end
@@ -35,34 +346,187 @@ enum EditorMode : uint8_t
 	EDIT_VALUES,		// The simulator is paused (or potentially halted) and being edited
 	QUIT,				// Quit the editor and simulator
 	END_OF_PROGRAM,		// The simulator has finished running
+	STEP_BACK,			// The last step is undone from the history
+	REVERSE_RUNNING,	// Steps are undone until a breakpoint or the oldest logged step
+	GOTO_STEP,			// Prompts for a step number and goes backwards or forwards to it
+	RUN_STEPS,			// The simulator runs a given number of steps without redrawing, or until a breakpoint
+	RUN_UNTIL,			// The simulator runs without redrawing until a condition holds or a breakpoint
+};
+// Everything that depends on the cell width. Each width gets its own fully specialized
+// instantiation of the engines, and EditorState holds whichever one was loaded.
+template <typename T>
+struct EditorEngine
+{
+	typedef T cell_t;
+	subleq<T>* sim = nullptr;
+	subleq_savepoints<T> savepoints;
+	// Set while JIT mode is on, RUNNING then executes through it between breakpoints
+	subleq_jit<T>* jit = nullptr;
+	// Superinstructions running executes when the JIT, history, profiling and loop checking
+	// are all off, rebuilt whenever running starts
+	subleq_fusion<T> fusion;
+	// Set while history is on, every step is then logged so it can be undone. Exclusive
+	// with the JIT, whose compiled code can't log its writes.
+	subleq_history<T>* history = nullptr;
+	// Set while profiling is on, every step then goes through the interpreter and is counted.
+	// Exclusive with the JIT for the same reason.
+	subleq_profile<T>* profile = nullptr;
+	// Set while loop checking is on, every step then goes through the checked interpreter so
+	// running stops once the program can't get out of a loop. Exclusive with the JIT, history
+	// and profiling, which all have their own run loops.
+	subleq_cycle* cycle = nullptr;
+	// Which cells the program uses as code and which as data, for the memory view. Made again
+	// whenever memory or ip are changed from outside, nullptr while ip lies outside memory.
+	subleq_analysis* analysis = nullptr;
+	// The pages written since savepoints and history checkpoints were taken, attached to sim
+	subleq_dirty* dirty = nullptr;
+
+	EditorEngine() {}
+	explicit EditorEngine(subleq<T>* sim) : sim(sim) {}
+	~EditorEngine()
+	{
+		destroy_subleq(this->sim);
+		destroy_subleq_jit(this->jit);
+		destroy_subleq_history(this->history);
+		destroy_subleq_profile(this->profile);
+		destroy_subleq_cycle(this->cycle);
+		destroy_subleq_analysis(this->analysis);
+		destroy_subleq_dirty(this->dirty);
+	}
+
+	EditorEngine(const EditorEngine&) = delete;
+	EditorEngine& operator =(const EditorEngine&) = delete;
+
+	EditorEngine& operator =(EditorEngine&& other) noexcept
+	{
+		std::swap(this->sim, other.sim);
+		std::swap(this->savepoints, other.savepoints);
+		std::swap(this->jit, other.jit);
+		std::swap(this->fusion, other.fusion);
+		std::swap(this->history, other.history);
+		std::swap(this->profile, other.profile);
+		std::swap(this->cycle, other.cycle);
+		std::swap(this->analysis, other.analysis);
+		std::swap(this->dirty, other.dirty);
+		return *this;
+	}
+	EditorEngine(EditorEngine&& other) noexcept { *this = std::move(other); }
 };
+typedef std::variant<EditorEngine<int8_t>, EditorEngine<int16_t>, EditorEngine<int32_t>, EditorEngine<int64_t>> EditorEngines;
+
+// How a memory cell was last drawn
+enum CELL_ATTR : uint8_t
+{
+	CELL_PLAIN,
+	CELL_CURSOR,		// Under the edit/breakpoint cursor
+	CELL_IP,			// Holds the instruction pointer
+	CELL_BREAKPOINT,
+	CELL_WATCH,			// Covered by a watchpoint
+};
+
+// What is currently on screen, so a frame only has to redraw the cells that changed.
+// Each frame is built up in buf and written out in one go.
+struct EditorFrame
+{
+	std::string buf;
+	std::vector<int64_t> values;
+	std::vector<CELL_ATTR> attrs;
+	std::vector<uint8_t> heats;
+	std::vector<SUBLEQ_CELL> kinds;
+	size_t elements_per_row = 0;
+	size_t element_width = 0;
+	// Cleared whenever something outside a frame printed to the screen
+	bool valid = false;
+};
+
+// RUNNING executes on its own thread. The UI thread never touches the simulator while it
+// runs: it asks for a snapshot of memory and ip to draw, and output arrives through a sink.
+struct EditorWorker
+{
+	std::thread thread;
+	// Owned by the UI thread, true from starting the thread until it has been joined
+	bool active = false;
+	std::atomic<bool> stop{ false };
+	std::atomic<bool> done{ false };
+	// Whether the machine can still run once the thread is done, false after a halt or fault
+	bool still_running = true;
+
+	// Set by the UI, the thread fills in the snapshot and clears it again
+	std::atomic<bool> snapshot_requested{ false };
+	std::vector<uint8_t> snapshot;
+	size_t snapshot_ip = 0;
+	uint64_t snapshot_input_pos = 0;
+	// Heatmap levels per cell, filled in with the snapshot while the heatmap is on
+	std::vector<uint8_t> snapshot_heat;
+	std::chrono::steady_clock::time_point last_frame;
+
+	subleq_sink* sink = nullptr;
+	std::mutex output_lock;
+	std::string pending_output;
+
+	~EditorWorker() { destroy_subleq_sink(sink); }
+};
+
+inline void _editor_worker_out(const char* data, size_t size, void* userarg)
+{
+	EditorWorker& w = *(EditorWorker*)userarg;
+	std::lock_guard<std::mutex> lock(w.output_lock);
+	w.pending_output.append(data, size);
+}
+
+struct EditorState;
+inline void _editor_layout(EditorState& state);
+
 struct EditorState
 {
 	// Once the simulator has finished running, this will be set to false
 	// The moment the simulator steps, this is set to true.
 	bool sim_started = true;
-	subleq<cell_value_t>* sim = nullptr;
-	subleq<cell_value_t>* sim_initial = nullptr;
+	EditorEngines engine;
 	size_t elements_per_row = -1;
-	// Maps an address to a breakpoint
-	std::map<size_t, BreakPoint> breakpoints;
+	BreakPointSet breakpoints;
+	WatchPointSet watchpoints;
+	// Describes the watched write running last stopped on, cleared when running again
+	std::string watch_message;
+	// The same for a loop found while loop checking is on
+	std::string loop_message;
 	EditorMode mode = EditorMode::MENU;
 
 	char* program_output = nullptr;
 	size_t program_output_size = 0;
 	size_t program_output_capacity = 0;
+	// What input instructions read, every machine reads it through the same source
+	std::vector<uint8_t> program_input;
+	subleq_source* input = nullptr;
 
 	uint16_t term_rows = -1;
 	uint16_t term_cols = -1;
+	// In cells, not bytes
 	size_t term_mem_cursor = 0;
 	size_t element_width = 0;
+	EditorFrame frame;
+	// What RUN_STEPS and RUN_UNTIL ran last, used again when the prompt is left empty
+	uint64_t run_steps = 0;
+	std::string run_until;
+	RunCondition run_condition;
+	std::unique_ptr<EditorWorker> worker;
+	// The source the loaded program was assembled from, empty after loading a binary. Kept
+	// so assembling it again only patches what changed, and for the source map.
+	std::string source_name;
+	subleq_asm assembler;
+	// What the memory view is coloured by while profiling, and the level of each cell
+	PROFILE_HEAT heatmap = HEAT_EXEC;
+	std::vector<uint8_t> heat;
 
 	~EditorState()
 	{
-		destroy_subleq(this->sim);
-		if (this->sim_initial != nullptr)
-			destroy_subleq(this->sim_initial);
+		if (worker != nullptr && worker->active)
+		{
+			worker->stop.store(true);
+			worker->thread.join();
+		}
 		free(program_output);
+		destroy_subleq_source(input);
 	}
 
 	EditorState(){}
@@ -77,17 +541,31 @@ struct EditorState
 		this->program_output = other.program_output;
 		this->program_output_capacity = other.program_output_capacity;
 		this->program_output_size = other.program_output_size;
-		this->sim = other.sim;
+		this->program_input = std::move(other.program_input);
+		std::swap(this->input, other.input);
+		this->engine = std::move(other.engine);
+		this->element_width = other.element_width;
 		this->sim_started = other.sim_started;
 		this->term_cols = other.term_cols;
 		this->term_mem_cursor = other.term_mem_cursor;
 		this->term_rows = other.term_rows;
 		this->breakpoints = std::move(other.breakpoints);
+		this->watchpoints = std::move(other.watchpoints);
+		this->watch_message = std::move(other.watch_message);
+		this->loop_message = std::move(other.loop_message);
+		this->frame = std::move(other.frame);
+		this->run_steps = other.run_steps;
+		this->run_until = std::move(other.run_until);
+		this->run_condition = std::move(other.run_condition);
+		this->worker = std::move(other.worker);
+		this->source_name = std::move(other.source_name);
+		this->assembler = std::move(other.assembler);
+		this->heatmap = other.heatmap;
+		this->heat = std::move(other.heat);
 
 		other.program_output = nullptr;
 		other.program_output_size = 0;
 		other.program_output_capacity = 0;
-		other.sim = nullptr;
 		other.term_mem_cursor = -1;
 		return *this;
 	}
@@ -96,7 +574,15 @@ struct EditorState
 	static EditorState create(const size_t mem_size)
 	{
 		EditorState state;
-		state.sim = create_subleq<cell_value_t>(mem_size);
+		state.input = create_subleq_source_buffer(nullptr, 0);
+		EditorEngine<int8_t> eng(create_subleq<int8_t>(mem_size));
+		eng.sim->input = state.input;
+		eng.history = create_subleq_history(eng.sim);
+		state.engine = std::move(eng);
+		state.worker = std::make_unique<EditorWorker>();
+		state.worker->sink = create_subleq_sink_callback(_editor_worker_out, state.worker.get());
+		state.breakpoints.resize(mem_size);
+		state.watchpoints.resize(mem_size);
 		state.program_output = (char*)malloc(mem_size);
 		state.program_output_capacity = mem_size;
 		state.program_output_size = 0;
@@ -127,202 +613,675 @@ struct EditorState
 		}
 		printf("\033[1;1H");
 
-		state.element_width = 5;
-		state.elements_per_row = state.term_cols / state.element_width;
-		const size_t total_num_elements = mem_size;
-		while (((total_num_elements / state.elements_per_row) * state.elements_per_row) != total_num_elements)
-			state.elements_per_row--;
-		if (state.elements_per_row == 1)
-			throw std::exception("Failed to find elements per row");
-
+		_editor_layout(state);
 		return state;
 	}
 };
 
-inline void _editor_draw_sim_cell(EditorState& state, const size_t& i)
+// Width of a cell in bytes
+inline size_t _editor_cell_width(const EditorState& state)
+{ return (size_t)1 << state.engine.index(); }
+
+inline size_t _editor_memsize(const EditorState& state)
+{ return std::visit([](const auto& eng) { return eng.sim->memsize; }, state.engine); }
+
+inline size_t _editor_num_cells(const EditorState& state)
+{ return _editor_memsize(state) / _editor_cell_width(state); }
+
+// While the simulation thread runs, the UI reads the ip and memory from its last snapshot
+inline size_t _editor_ip(const EditorState& state)
 {
-	if (state.term_mem_cursor == i && (state.mode == ADD_BREAKPOINT || state.mode == EDIT_VALUES)) printf("\033[7m");
-	else if (state.sim->_ip == i) printf("\033[48;5;10m");
-	else if (state.breakpoints.contains(i) &&
-			 state.breakpoints[i].is_valid)
-		printf("\033[48;5;9m");
+	if (state.worker->active)
+		return state.worker->snapshot_ip;
+	return std::visit([](const auto& eng) { return (size_t)eng.sim->_ip; }, state.engine);
+}
+
+// Reads the cell at a byte address, 0 if it lies outside memory
+inline int64_t _editor_cell(const EditorState& state, const size_t addr)
+{
+	const uint8_t* snapshot = state.worker->active ? state.worker->snapshot.data() : nullptr;
+	return std::visit([addr, snapshot](const auto& eng) -> int64_t {
+		typedef typename std::remove_reference_t<decltype(eng)>::cell_t T;
+		if (!_subleq_in_bounds(eng.sim, addr))
+			return 0;
+		T x;
+		memcpy(&x, (snapshot != nullptr ? snapshot : eng.sim->memory) + addr, sizeof(T));
+		return x;
+	}, state.engine);
+}
 
-	printf("% *d", state.element_width, (cell_value_t)state.sim->memory[i]);
-	
-	printf("\033[m");
+inline void _editor_set_cell(EditorState& state, const size_t addr, const int64_t value)
+{
+	std::visit([addr, value](auto& eng) {
+		typedef typename std::remove_reference_t<decltype(eng)>::cell_t T;
+		if (!_subleq_in_bounds(eng.sim, addr))
+			return;
+		const T x = (T)value;
+		memcpy(eng.sim->memory + addr, &x, sizeof(T));
+	}, state.engine);
+}
+
+// Picks the element width and how many cells go on a row for the loaded cell width
+inline void _editor_layout(EditorState& state)
+{
+	// Wide enough for the most negative value plus a space
+	const size_t widths[] = { 5, 7, 12, 21 };
+	state.element_width = widths[state.engine.index()];
+	const size_t max_per_row = state.term_cols / state.element_width > 0 ? state.term_cols / state.element_width : 1;
+	const size_t total_num_elements = _editor_num_cells(state);
+	state.elements_per_row = max_per_row;
+	while (state.elements_per_row > 1 && total_num_elements % state.elements_per_row != 0)
+		state.elements_per_row--;
+	// No even split, let the last row be short instead
+	if (state.elements_per_row == 1)
+		state.elements_per_row = max_per_row;
+}
+
+inline void _editor_frame_printf(EditorState& state, const char* fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	const int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (n > 0)
+		state.frame.buf.append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// Forces the next frame to redraw everything, after prompts or messages printed outside of one
+inline void _editor_invalidate_frame(EditorState& state)
+{ state.frame.valid = false; }
+
+// Writes the frame with a single write call
+inline void _editor_present(EditorState& state)
+{
+	const std::string& buf = state.frame.buf;
+	fflush(stdout);
+#ifdef _WIN32
+	_write(_fileno(stdout), buf.data(), (unsigned int)buf.size());
+#else
+	write(STDOUT_FILENO, buf.data(), buf.size());
+#endif
+	state.frame.buf.clear();
+}
+
+// i is a cell index
+inline CELL_ATTR _editor_cell_attr(const EditorState& state, const size_t i)
+{
+	const size_t width = _editor_cell_width(state);
+	const size_t addr = i * width;
+	const size_t ip = _editor_ip(state);
+	if (state.term_mem_cursor == i && (state.mode == ADD_BREAKPOINT || state.mode == EDIT_VALUES)) return CELL_CURSOR;
+	else if (ip >= addr && ip < addr + width) return CELL_IP;
+	else if (state.breakpoints.contains(addr)) return CELL_BREAKPOINT;
+	else if (state.watchpoints.contains(addr)) return CELL_WATCH;
+	return CELL_PLAIN;
 }
 
+// Heatmap level of cell i, 0 when the heatmap is off or the cell was never touched
+inline uint8_t _editor_cell_heat(const EditorState& state, const size_t i)
+{
+	const std::vector<uint8_t>& heat = state.worker->active ? state.worker->snapshot_heat : state.heat;
+	return i < heat.size() ? heat[i] : 0;
+}
+
+// Recomputes the heatmap from the profile, unless the simulation thread is filling it in
+inline void _editor_update_heat(EditorState& state)
+{
+	if (state.worker->active)
+		return;
+	std::visit([&state](const auto& eng) {
+		if (eng.profile != nullptr)
+			subleq_profile_heat(eng.profile, state.heatmap, state.heat);
+		else
+			state.heat.clear();
+	}, state.engine);
+}
+
+// What the analysis found cell i to be, data (drawn plain) when there is no analysis
+inline SUBLEQ_CELL _editor_cell_kind(const EditorState& state, const size_t i)
+{
+	return std::visit([i](const auto& eng) {
+		typedef typename std::remove_reference_t<decltype(eng)>::cell_t T;
+		return eng.analysis != nullptr ? subleq_analysis_cell(eng.analysis, i * sizeof(T), sizeof(T)) : SUBLEQ_CELL_DATA;
+	}, state.engine);
+}
+
+inline void _editor_draw_sim_cell(EditorState& state, const CELL_ATTR attr, const uint8_t heat, const SUBLEQ_CELL kind, const int64_t value)
+{
+	// Dark red for the coldest cells up to yellow for the hottest
+	static const uint8_t heat_colors[profile_heat_levels] = { 52, 88, 124, 160, 196, 202, 208, 220 };
+	// Text by SUBLEQ_CELL: grey for unused cells, cyan for code, yellow for code the program
+	// rewrites, plain data and green constants
+	static const uint8_t kind_colors[] = { 8, 14, 11, 0, 10 };
+	if (attr == CELL_CURSOR) state.frame.buf += "\033[7m";
+	else if (attr == CELL_IP) state.frame.buf += "\033[48;5;10m";
+	else if (attr == CELL_BREAKPOINT) state.frame.buf += "\033[48;5;9m";
+	else if (attr == CELL_WATCH) state.frame.buf += "\033[48;5;13m";
+	else if (heat != 0) _editor_frame_printf(state, "\033[48;5;%um", (unsigned)heat_colors[heat - 1]);
+
+	const bool colored = (attr == CELL_PLAIN || attr == CELL_WATCH) && kind != SUBLEQ_CELL_DATA;
+	if (colored) _editor_frame_printf(state, "\033[38;5;%um", (unsigned)kind_colors[kind]);
+
+	_editor_frame_printf(state, "% *lld", (int)state.element_width, (long long)value);
+
+	if (attr != CELL_PLAIN || heat != 0 || colored) state.frame.buf += "\033[m";
+}
+
+// Starts a frame with the memory view, leaving the cursor on the line below it with the
+// rest of the screen cleared. Callers append their own lines and then _editor_present().
 inline void _editor_draw_sim(EditorState& state)
 {
-	// Clear and set cursor to 1,1
-	printf("\033[2J\033[1;1H\033[m");
-	for (uint16_t c = 0; c < state.term_cols; ++c)
-		printf("%c", 220);
-	for (size_t i = 0; i < state.sim->memsize; ++i)
+	EditorFrame& frame = state.frame;
+	const size_t num_cells = _editor_num_cells(state);
+	const size_t width = _editor_cell_width(state);
+	const size_t num_rows = (num_cells + state.elements_per_row - 1) / state.elements_per_row;
+	// The screen must not scroll between frames for the old positions to still hold
+	const bool fits = num_rows + 2 < state.term_rows;
+	const bool full = !frame.valid || !fits || frame.values.size() != num_cells ||
+		frame.elements_per_row != state.elements_per_row || frame.element_width != state.element_width;
+
+	frame.buf.clear();
+	_editor_update_heat(state);
+	if (full)
+	{
+		// Clear and set cursor to 1,1
+		frame.buf += "\033[2J\033[1;1H\033[m";
+		frame.buf.append(state.term_cols, (char)220);
+		frame.values.resize(num_cells);
+		frame.attrs.resize(num_cells);
+		frame.heats.resize(num_cells);
+		frame.kinds.resize(num_cells);
+		for (size_t i = 0; i < num_cells; ++i)
+		{
+			if (i % state.elements_per_row == 0 && i != 0)
+				frame.buf += '\n';
+			frame.values[i] = _editor_cell(state, i * width);
+			frame.attrs[i] = _editor_cell_attr(state, i);
+			frame.heats[i] = _editor_cell_heat(state, i);
+			frame.kinds[i] = _editor_cell_kind(state, i);
+			_editor_draw_sim_cell(state, frame.attrs[i], frame.heats[i], frame.kinds[i], frame.values[i]);
+		}
+		frame.buf += '\n';
+		frame.buf.append(state.term_cols, (char)223);
+		frame.buf += '\n';
+		frame.elements_per_row = state.elements_per_row;
+		frame.element_width = state.element_width;
+		frame.valid = fits;
+	}
+	else
 	{
-		if (i % state.elements_per_row == 0 && i != 0)
-			printf("\n");
-		_editor_draw_sim_cell(state, i);
+		for (size_t i = 0; i < num_cells; ++i)
+		{
+			const int64_t value = _editor_cell(state, i * width);
+			const CELL_ATTR attr = _editor_cell_attr(state, i);
+			const uint8_t heat = _editor_cell_heat(state, i);
+			const SUBLEQ_CELL kind = _editor_cell_kind(state, i);
+			if (value == frame.values[i] && attr == frame.attrs[i] && heat == frame.heats[i] && kind == frame.kinds[i])
+				continue;
+			frame.values[i] = value;
+			frame.attrs[i] = attr;
+			frame.heats[i] = heat;
+			frame.kinds[i] = kind;
+			// Row 1 is the top border
+			_editor_frame_printf(state, "\033[%llu;%lluH", (unsigned long long)(2 + i / state.elements_per_row),
+				(unsigned long long)(1 + (i % state.elements_per_row) * state.element_width));
+			_editor_draw_sim_cell(state, attr, heat, kind, value);
+		}
+		_editor_frame_printf(state, "\033[%llu;1H", (unsigned long long)(num_rows + 3));
 	}
-	printf("\n");
-	for (uint16_t c = 0; c < state.term_cols; ++c)
-		printf("%c", 223);
-	printf("\n");
+	frame.buf += "\033[J";
 }
 
-inline void _editor_reset(EditorState& state)
+// How much of the input has been read
+inline uint64_t _editor_input_pos(const EditorState& state)
+{ return state.worker->active ? state.worker->snapshot_input_pos : subleq_source_tell(state.input); }
+
+// One row with the read position and the input still to be read, escaped like a string
+inline void _editor_draw_input(EditorState& state)
 {
-	if (state.sim_initial == nullptr)
+	const uint64_t pos = _editor_input_pos(state);
+	const size_t start = state.frame.buf.size();
+	_editor_frame_printf(state, "Input %llu/%zu: ", (unsigned long long)pos, state.program_input.size());
+	for (size_t i = (size_t)pos; i < state.program_input.size() && state.frame.buf.size() - start + 4 < state.term_cols; ++i)
 	{
-		memset(state.sim->memory, 0, state.sim->memsize * sizeof(cell_value_t));
-		state.sim->_ip = 0;
-		state.sim->running = false;
+		const uint8_t c = state.program_input[i];
+		if (c == '\n') state.frame.buf += "\\n";
+		else if (c < 0x20 || c >= 0x7F) _editor_frame_printf(state, "\\x%02x", c);
+		else state.frame.buf += (char)c;
 	}
-	else
-		memcpy(state.sim, state.sim_initial, sizeof(subleq<cell_value_t>)+sizeof(cell_value_t)*state.sim->memsize);
+	state.frame.buf += '\n';
 }
 
-inline void _editor_load_asm(EditorState& state)
+// The input row and the tail of the program output, as much as fits in the rows left under
+// the memory view
+inline void _editor_draw_output(EditorState& state, const size_t reserved_rows)
 {
-	// prompt filename
+	_editor_draw_input(state);
+	const size_t num_rows = (_editor_num_cells(state) + state.elements_per_row - 1) / state.elements_per_row;
+	const size_t used = num_rows + 2 + reserved_rows + 1 + 1;
+	const size_t avail = state.term_rows > used ? state.term_rows - used : 1;
+	const char* out = state.program_output;
+	size_t start = state.program_output_size;
+	size_t rows = 1;
+	size_t col = 0;
+	while (start > 0)
+	{
+		const char c = out[start - 1];
+		if (c == '\n' || ++col > state.term_cols)
+		{
+			if (++rows > avail)
+				break;
+			col = c == '\n' ? 0 : 1;
+		}
+		--start;
+	}
+	state.frame.buf.append(out + start, state.program_output_size - start);
+	state.frame.buf += '\n';
+}
+
+// Starts the history, loop checking and code analysis over from the current state, after
+// memory was changed outside of stepping
+inline void _editor_restart_history(EditorState& state)
+{
+	std::visit([](auto& eng) {
+		if (eng.history != nullptr)
+			subleq_history_clear(eng.history, eng.sim);
+		if (eng.cycle != nullptr)
+			subleq_cycle_reset(eng.cycle, eng.sim);
+		destroy_subleq_analysis(eng.analysis);
+		eng.analysis = create_subleq_analysis(eng.sim);
+		if (eng.jit != nullptr)
+			subleq_jit_set_analysis(eng.jit, eng.analysis);
+	}, state.engine);
+}
+
+inline void _editor_reset(EditorState& state)
+{
+	std::visit([](auto& eng) {
+		if (subleq_savepoint_restore(eng.savepoints, eng.sim, editor_initial_savepoint) < 0)
+		{
+			memset(eng.sim->memory, 0, eng.sim->memsize);
+			subleq_dirty_untracked(eng.sim);
+			eng.sim->_ip = 0;
+			eng.sim->running = false;
+			subleq_source_seek(eng.sim->input, 0);
+		}
+		// The profile follows the program from its start
+		if (eng.profile != nullptr)
+			subleq_profile_clear(eng.profile);
+	}, state.engine);
+	_editor_restart_history(state);
+	state.sim_started = true;
+}
 
-	// assemble assembley
+// Prompts for a savepoint name, empty if none was given
+inline std::string _editor_prompt_savepoint(EditorState& state)
+{
+	_editor_invalidate_frame(state);
+	std::visit([](const auto& eng) {
+		printf("Savepoints:");
+		for (const auto& [name, sp] : eng.savepoints.points)
+			printf(" %s", name.c_str());
+		printf("\n");
+	}, state.engine);
+	const size_t name_buf_size = 64;
+	char name[name_buf_size]{ '\0' };
+	printf("Savepoint Name: ");
+	fgets(name, name_buf_size, stdin);
+	name[strcspn(name, "\r\n")] = '\0';
+	return name;
+}
 
+inline void _editor_take_savepoint(EditorState& state)
+{
+	const std::string name = _editor_prompt_savepoint(state);
+	if (name.empty())
+		return;
+	std::visit([&name](auto& eng) { subleq_savepoint_take(eng.savepoints, eng.sim, name); }, state.engine);
 }
 
-inline void _editor_swap_byteorder(void* dst, void* src, const size_t element_size, const size_t num_elements)
+inline void _editor_restore_savepoint(EditorState& state)
 {
-	if (element_size == 1)
+	const std::string name = _editor_prompt_savepoint(state);
+	if (name.empty())
 		return;
-	char* d = (char*)dst;
-	char* s = (char*)src;
-	for (size_t i = 0; i < num_elements; ++i)
+	const int64_t written = std::visit([&name](auto& eng) { return subleq_savepoint_restore(eng.savepoints, eng.sim, name); }, state.engine);
+	if (written < 0)
 	{
-		const size_t idx = i * element_size;
-		if (d == s)
-		{
-			for (size_t j = 0; j < element_size / 2; ++j)
-			{
-				char tmp = d[idx + j];
-				d[idx + j] = s[idx + element_size - j - 1];
-				s[idx + element_size - j - 1] = tmp;
-			}
-		}
-		else
-			for (size_t j = 0; j < element_size; ++j)
-				d[idx + j] = s[idx + element_size - j - 1];
+		printf("\033[38;5;9mNo savepoint called \"%s\"!\033[m\nPress any key to continue...\n", name.c_str());
+		_getch();
+		return;
 	}
+	_editor_restart_history(state);
+	state.sim_started = true;
 }
 
-inline void _editor_load_bin(EditorState& state)
+// Swaps in a new simulator, keeping JIT mode, history and profiling as they were
+template <typename T>
+void _editor_use_sim(EditorState& state, subleq<T>* sim)
 {
-	// prompt filename
-	std::ifstream f;
+	const bool use_jit = std::visit([](const auto& eng) { return eng.jit != nullptr; }, state.engine);
+	const bool use_history = std::visit([](const auto& eng) { return eng.history != nullptr; }, state.engine);
+	const bool use_profile = std::visit([](const auto& eng) { return eng.profile != nullptr; }, state.engine);
+	const bool use_cycle = std::visit([](const auto& eng) { return eng.cycle != nullptr; }, state.engine);
+
+	// A new program reads the input from the start
+	sim->input = state.input;
+	subleq_source_seek(state.input, 0);
+	EditorEngine<T> eng(sim);
+	eng.dirty = create_subleq_dirty(sim);
+	subleq_savepoint_take(eng.savepoints, sim, editor_initial_savepoint);
+	eng.analysis = create_subleq_analysis(sim);
+	if (use_jit && (eng.jit = create_subleq_jit(sim)) != nullptr)
+		subleq_jit_set_analysis(eng.jit, eng.analysis);
+	if (use_history)
+		eng.history = create_subleq_history(sim);
+	if (use_profile)
+		eng.profile = create_subleq_profile(sim);
+	if (use_cycle)
+		eng.cycle = create_subleq_cycle(sim);
+
+	state.breakpoints.resize(sim->memsize);
+	state.watchpoints.resize(sim->memsize);
+	state.engine = std::move(eng);
+	state.term_mem_cursor = 0;
+	_editor_layout(state);
+}
+
+template <typename T>
+BIN_RESULT _editor_load_engine(EditorState& state, const char* fname)
+{
+	subleq<T>* sim = nullptr;
+	const BIN_RESULT r = bin_load<T>(fname, &sim);
+	if (r != BIN_OK)
+		return r;
+	_editor_use_sim(state, sim);
+	state.source_name.clear();
+	state.assembler = subleq_asm();
+	return BIN_OK;
+}
+
+// The source line the cell at addr was assembled from, 0 if there is none
+inline size_t _editor_source_line(const EditorState& state, const size_t addr)
+{ return state.source_name.empty() ? 0 : subleq_asm_line_at(&state.assembler, addr); }
+
+template <typename T>
+bool _editor_assembled_engine(EditorState& state)
+{
+	subleq<T>* sim = subleq_asm_build<T>(&state.assembler);
+	if (sim == nullptr)
+		return false;
+	_editor_use_sim(state, sim);
+	return true;
+}
+
+// Copies the changes from the last assembly into the running machine, which carries on
+// from where it is. Reset goes back to the new version.
+template <typename T>
+void _editor_patch_engine(EditorState& state, EditorEngine<T>& eng)
+{
+	subleq_asm_patch(&state.assembler, eng.sim);
+	subleq_dirty_untracked(eng.sim);
+	subleq<T>* initial = subleq_asm_build<T>(&state.assembler);
+	if (initial != nullptr)
+	{
+		subleq_savepoint_take(eng.savepoints, initial, editor_initial_savepoint);
+		destroy_subleq(initial);
+	}
+}
+
+inline void _editor_load_asm(EditorState& state)
+{
+	// prompt filename, empty assembles the loaded source again
 	const size_t fname_buf_size = 261;
 	char fname[fname_buf_size]{ '\0' };
-	do {
-		printf("File Name: ");
-		fgets(fname, fname_buf_size, stdin);
-		fname[strlen(fname) - 1] = '\0';
-		uint16_t x = 0;
-		f.open(fname);
-		if (!f.is_open())
-			printf("\033[38;5;9mFile could not be created\033[m\n");
-	} while (!f.is_open());
-
+	_editor_invalidate_frame(state);
+	if (!state.source_name.empty())
+		printf("Source File (%s): ", state.source_name.c_str());
+	else printf("Source File: ");
+	fgets(fname, fname_buf_size, stdin);
+	fname[strcspn(fname, "\r\n")] = '\0';
+	const std::string name = fname[0] != '\0' ? fname : state.source_name;
+	if (name.empty())
+		return;
 
-	std::streampos f_size = f.tellg();
-	f.seekg(0, std::ios::end);
-	f_size = f.tellg() - f_size;
-	f.seekg(0, std::ios::beg);
-	if (f_size < (2 + 1 + sizeof(size_t) + sizeof(cell_value_t)))
+	// A different file starts from scratch, and only replaces the loaded source if it assembles
+	const bool same = name == state.source_name;
+	subleq_asm fresh;
+	subleq_asm& target = same ? state.assembler : fresh;
+	const ASM_RESULT r = subleq_asm_file(&target, name.c_str());
+	if (r == ASM_OPEN_FAILED)
 	{
-		printf("\033[38;5;9mFile was too small to be a valid save!\033[m\nPress any key to continue...\n");
+		printf("\033[38;5;9mFile could not be opened!\033[m\nPress any key to continue...\n");
 		_getch();
 		return;
 	}
-	// read magic value, version, memsize and initial IP
-	bool match_endian = true;
-	uint16_t magic;
-	f.read((char*)(&magic), 2);
-	if (magic != 0x1337 && magic != 0x3713)
+	else if (r != ASM_OK)
 	{
-		printf("\033[38;5;9mFile header was not valid!\033[m\nPress any key to continue...\n");
+		printf("\033[38;5;9m%s:%llu: %s", name.c_str(), (unsigned long long)target.error_line, asm_result_str(r));
+		if (!target.error_detail.empty())
+			printf(" \"%s\"", target.error_detail.c_str());
+		printf("!\033[m\nPress any key to continue...\n");
 		_getch();
 		return;
 	}
-	match_endian = memcmp(&magic, "\x13\x37", 2) != 0;
+	if (!same)
+		state.assembler = std::move(fresh);
+	const subleq_asm& a = state.assembler;
 
-	uint8_t version;
-	f.read((char*)(&version), 1);
-	if (version != 1)
+	const bool patch = same && a.patchable && a.width == _editor_cell_width(state) && a.memsize == _editor_memsize(state);
+	size_t patched = 0;
+	for (const asm_patch& p : a.patches)
+		patched += p.size;
+	bool ok = true;
+	if (patch)
+	{
+		std::visit([&state](auto& eng) { _editor_patch_engine(state, eng); }, state.engine);
+		_editor_restart_history(state);
+		state.sim_started = true;
+	}
+	else
 	{
-		printf("\033[38;5;9mFile verrsion does not match version %d!\033[m\nPress any key to continue...\n", 1);
+		switch (a.width)
+		{
+		case 1:		ok = _editor_assembled_engine<int8_t>(state); break;
+		case 2:		ok = _editor_assembled_engine<int16_t>(state); break;
+		case 4:		ok = _editor_assembled_engine<int32_t>(state); break;
+		default:	ok = _editor_assembled_engine<int64_t>(state); break;
+		}
+	}
+	if (!ok)
+	{
+		state.source_name.clear();
+		printf("\033[38;5;9m%s!\033[m\nPress any key to continue...\n", bin_result_str(BIN_ALLOC_FAILED));
 		_getch();
 		return;
 	}
-	size_t memsize;
-	f.read((char*)(&memsize), sizeof(size_t));
-	if (!match_endian)
-		_editor_swap_byteorder(&memsize, &memsize, sizeof(size_t), 1);
-	destroy_subleq(state.sim);
-	state.sim = create_subleq<cell_value_t>(memsize);
-	f.read((char*)(&state.sim->_ip), sizeof(cell_value_t));
-	if (!match_endian && sizeof(cell_value_t) != 1)
-		_editor_swap_byteorder(&state.sim->_ip, &state.sim->_ip, sizeof(cell_value_t), 1);
+	state.source_name = name;
 
-	// copy into memory
-	f.read((char*)&state.sim->memory, memsize*sizeof(cell_value_t));
-	if (!match_endian && sizeof(cell_value_t) != 1)
-		_editor_swap_byteorder(&state.sim->memory, &state.sim->memory, sizeof(cell_value_t), memsize);
-	f.close();
+	if (patch)
+		printf("Patched %llu bytes from \"%s\"\nPress any key to continue...\n", (unsigned long long)patched, name.c_str());
+	else printf("Assembled \"%s\" (%llu lines, %llu bytes)\nPress any key to continue...\n",
+		name.c_str(), (unsigned long long)a.lines.size(), (unsigned long long)a.memsize);
+	_getch();
+}
 
-	if (state.sim_initial == nullptr)
-		state.sim_initial = create_subleq<cell_value_t>(state.sim->memsize);
-	memcpy(state.sim_initial, state.sim, sizeof(subleq<cell_value_t>) + sizeof(cell_value_t) * state.sim->memsize);
+inline void _editor_load_bin(EditorState& state)
+{
+	// prompt filename
+	const size_t fname_buf_size = 261;
+	char fname[fname_buf_size]{ '\0' };
+	uint8_t cell_width = 0;
+	BIN_RESULT r = BIN_OPEN_FAILED;
+	_editor_invalidate_frame(state);
+	do {
+		printf("File Name: ");
+		fgets(fname, fname_buf_size, stdin);
+		fname[strlen(fname) - 1] = '\0';
+		r = bin_peek(fname, &cell_width);
+		if (r == BIN_OPEN_FAILED)
+			printf("\033[38;5;9mFile could not be opened\033[m\n");
+	} while (r == BIN_OPEN_FAILED);
+
+	if (r == BIN_OK)
+	{
+		switch (cell_width)
+		{
+		case 1:		r = _editor_load_engine<int8_t>(state, fname); break;
+		case 2:		r = _editor_load_engine<int16_t>(state, fname); break;
+		case 4:		r = _editor_load_engine<int32_t>(state, fname); break;
+		default:	r = _editor_load_engine<int64_t>(state, fname); break;
+		}
+	}
+	if (r != BIN_OK)
+	{
+		printf("\033[38;5;9m%s!\033[m\nPress any key to continue...\n", bin_result_str(r));
+		_getch();
+	}
 }
 
 inline void _editor_save_bin(EditorState& state)
 {
 	// prompt filename
-	std::ofstream f;
 	const size_t fname_buf_size = 261;
 	char fname[fname_buf_size]{'\0'};
+	BIN_RESULT r = BIN_OPEN_FAILED;
+	_editor_invalidate_frame(state);
+	// Compressed segments load slower and can't be mapped, but repetitive memory gets a lot smaller
+	char compress[8]{ '\0' };
+	printf("Compress [y/N]: ");
+	fgets(compress, sizeof(compress), stdin);
+	const BIN_COMPRESSION compression = compress[0] == 'y' || compress[0] == 'Y' ? BIN_COMPRESS_RLE : BIN_COMPRESS_NONE;
 	do {
 		printf("File Name: ");
 		fgets(fname, fname_buf_size, stdin);
 		fname[strlen(fname) - 1] = '\0';
-		uint16_t x = 0;
-		f.open(fname);
-		if (!f.is_open())
-			printf("\033[38;5;9mFile could not be created\033[m\n");
-	} while (!f.is_open());
-	
-	// write magic value, version, memsize and initial IP
-	const uint16_t magic = 0x1337;
-	const uint8_t version = 1;
-	f.write((const char*)(&magic), 2);
-	f.write((const char*)(&version), 1);
-	f.write((const char*)(&state.sim->memsize), sizeof(size_t));
-	f.write((const char*)(&state.sim->_ip), sizeof(cell_value_t));
-
-	// write the memory values
-	f.write((const char*)(&state.sim->memory), sizeof(cell_value_t) * state.sim->memsize);
-	f.close();
+		r = std::visit([&fname, compression](const auto& eng) { return bin_save(fname, eng.sim, compression); }, state.engine);
+		if (r != BIN_OK)
+			printf("\033[38;5;9m%s\033[m\n", r == BIN_OPEN_FAILED ? "File could not be created" : bin_result_str(r));
+	} while (r != BIN_OK);
+
 	printf("Saved binary \"%s\"\nPress any key to continue...\n", fname);
 	_getch();
 }
 
+inline std::string _editor_profile_label(const size_t addr, void* userarg)
+{
+	const EditorState& state = *(const EditorState*)userarg;
+	const size_t line = _editor_source_line(state, addr);
+	return line != 0 ? state.source_name + ":" + std::to_string(line) : std::string();
+}
+
+// Writes the hottest instructions, loops and cells of the profile to a file
+inline void _editor_export_profile(EditorState& state)
+{
+	_editor_invalidate_frame(state);
+	const bool profiling = std::visit([](const auto& eng) { return eng.profile != nullptr; }, state.engine);
+	if (!profiling)
+	{
+		printf("\033[38;5;9mProfiling is off, turn it on with [P] and run the program first!\033[m\nPress any key to continue...\n");
+		_getch();
+		return;
+	}
+	const size_t fname_buf_size = 261;
+	char fname[fname_buf_size]{ '\0' };
+	printf("Report File: ");
+	fgets(fname, fname_buf_size, stdin);
+	fname[strcspn(fname, "\r\n")] = '\0';
+	if (fname[0] == '\0')
+		return;
+	FILE* f = fopen(fname, "w");
+	if (f == nullptr)
+	{
+		printf("\033[38;5;9mCould not open \"%s\"!\033[m\nPress any key to continue...\n", fname);
+		_getch();
+		return;
+	}
+	std::visit([&state, f](const auto& eng) {
+		subleq_profile_write(eng.profile, eng.sim, f, editor_profile_rows, _editor_profile_label, &state);
+	}, state.engine);
+	fclose(f);
+	printf("Wrote profile \"%s\"\nPress any key to continue...\n", fname);
+	_getch();
+}
+
+// Prompts for a line to add to the end of the input, or a file after <. The read position
+// stays where it is, so a program waiting at the end of input can carry on.
+inline void _editor_add_input(EditorState& state)
+{
+	_editor_invalidate_frame(state);
+	const size_t line_buf_size = 1024;
+	char line[line_buf_size]{ '\0' };
+	printf("Input Line (<file adds a file): ");
+	fgets(line, line_buf_size, stdin);
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0')
+		return;
+	if (line[0] == '<')
+	{
+		FILE* f = fopen(line + 1, "rb");
+		if (f == nullptr)
+		{
+			printf("\033[38;5;9mCould not open \"%s\"!\033[m\nPress any key to continue...\n", line + 1);
+			_getch();
+			return;
+		}
+		uint8_t buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			state.program_input.insert(state.program_input.end(), buf, buf + n);
+		fclose(f);
+	}
+	else
+	{
+		state.program_input.insert(state.program_input.end(), line, line + strlen(line));
+		state.program_input.push_back('\n');
+	}
+	subleq_source_set_buffer(state.input, state.program_input.data(), state.program_input.size());
+}
+
+// Empties the input, which also moves the read position back to the start
+inline void _editor_clear_input(EditorState& state)
+{
+	state.program_input.clear();
+	subleq_source_set_buffer(state.input, nullptr, 0);
+	subleq_source_seek(state.input, 0);
+	_editor_restart_history(state);
+}
+
 inline EditorMode _editor_menu(EditorState& state)
 {
+	const bool jit_on = std::visit([](const auto& eng) { return eng.jit != nullptr; }, state.engine);
+	const int64_t step = std::visit([](const auto& eng) { return eng.history != nullptr ? (int64_t)subleq_history_step(eng.history) : -1; }, state.engine);
+	const int64_t profiled = std::visit([](const auto& eng) { return eng.profile != nullptr ? (int64_t)eng.profile->steps : -1; }, state.engine);
+	const bool loop_check = std::visit([](const auto& eng) { return eng.cycle != nullptr; }, state.engine);
 	_editor_draw_sim(state);
-	printf("%.*s\n", state.program_output_size, state.program_output);
-	for (uint16_t c = 0; c < state.term_cols; ++c)
-		printf("%c", 223);
-	printf("\n");
-	
-	printf("[q]uit    [c]ontinue    [s]tep    [e]dit    [b]reakpoint\n");
-	printf("[r]eset   [l]oad asm    [L]oad bin          [S]ave bin\n");
+	_editor_draw_output(state, 6);
+	state.frame.buf.append(state.term_cols, (char)223);
+	state.frame.buf += '\n';
+
+	_editor_frame_printf(state, "[q]uit    [c]ontinue    [s]tep    [e]dit    [b]reakpoint    [n] run steps    [t] run until\n");
+	_editor_frame_printf(state, "[r]eset   [l]oad asm    [L]oad bin          [S]ave bin    [j]it (%s)    %llu-bit cells\n",
+		jit_on ? "on" : "off", (unsigned long long)_editor_cell_width(state) * 8);
+	_editor_frame_printf(state, "[v] take savepoint    [V] restore savepoint    [h]istory (%s)", step >= 0 ? "on" : "off");
+	if (step >= 0)
+		_editor_frame_printf(state, "    step %lld", (long long)step);
+	const size_t line = _editor_source_line(state, _editor_ip(state));
+	if (line != 0)
+		_editor_frame_printf(state, "    %s:%llu", state.source_name.c_str(), (unsigned long long)line);
+	_editor_frame_printf(state, "\n[u] step back    [U] reverse continue    [g]oto step");
+	if (!state.watch_message.empty())
+		_editor_frame_printf(state, "    %s", state.watch_message.c_str());
+	_editor_frame_printf(state, "\n");
+	_editor_frame_printf(state, "[P]rofile (%s)    [m] heatmap (%s)    [x] export profile", profiled >= 0 ? "on" : "off", profile_heat_str(state.heatmap));
+	if (profiled >= 0)
+		_editor_frame_printf(state, "    %llu steps profiled", (unsigned long long)profiled);
+	_editor_frame_printf(state, "\n[i]nput add    [I]nput clear    [o] loop check (%s)", loop_check ? "on" : "off");
+	if (!state.loop_message.empty())
+		_editor_frame_printf(state, "    %s", state.loop_message.c_str());
+	_editor_frame_printf(state, "\n");
+	_editor_present(state);
 	while (true)
 	{
 		int keycode = _getch();
@@ -331,47 +1290,205 @@ inline EditorMode _editor_menu(EditorState& state)
 		else if (keycode == 'b' || keycode == 'B') return ADD_BREAKPOINT;
 		else if (keycode == 'c' || keycode == 'C') return RUNNING;
 		else if (keycode == 's') return STEP;
+		else if (keycode == 'n' || keycode == 'N') return RUN_STEPS;
+		else if (keycode == 't' || keycode == 'T') return RUN_UNTIL;
+		else if (keycode == 'u') return STEP_BACK;
+		else if (keycode == 'U') return REVERSE_RUNNING;
+		else if (keycode == 'g' || keycode == 'G') return GOTO_STEP;
 		else if (keycode == 'r' || keycode == 'R') { _editor_reset(state); return MENU; }
 		else if (keycode == 'l') { _editor_load_asm(state); return MENU; }
 		else if (keycode == 'L') { _editor_load_bin(state); return MENU; }
 		else if (keycode == 'S') { _editor_save_bin(state); return MENU; }
+		else if (keycode == 'v') { _editor_take_savepoint(state); return MENU; }
+		else if (keycode == 'V') { _editor_restore_savepoint(state); return MENU; }
+		else if (keycode == 'x' || keycode == 'X') { _editor_export_profile(state); return MENU; }
+		else if (keycode == 'i') { _editor_add_input(state); return MENU; }
+		else if (keycode == 'I') { _editor_clear_input(state); return MENU; }
+		else if (keycode == 'm' || keycode == 'M')
+		{
+			state.heatmap = state.heatmap == HEAT_EXEC ? HEAT_WRITES : state.heatmap == HEAT_WRITES ? HEAT_OFF : HEAT_EXEC;
+			return MENU;
+		}
+		else if (keycode == 'P')
+		{
+			std::visit([](auto& eng) {
+				if (eng.profile != nullptr)
+				{
+					destroy_subleq_profile(eng.profile);
+					eng.profile = nullptr;
+					return;
+				}
+				eng.profile = create_subleq_profile(eng.sim);
+				destroy_subleq_jit(eng.jit);
+				eng.jit = nullptr;
+				destroy_subleq_cycle(eng.cycle);
+				eng.cycle = nullptr;
+			}, state.engine);
+			return MENU;
+		}
+		else if (keycode == 'j' || keycode == 'J')
+		{
+			const bool ok = std::visit([](auto& eng) {
+				if (eng.jit != nullptr)
+				{
+					destroy_subleq_jit(eng.jit);
+					eng.jit = nullptr;
+					return true;
+				}
+				if ((eng.jit = create_subleq_jit(eng.sim)) == nullptr)
+					return false;
+				subleq_jit_set_analysis(eng.jit, eng.analysis);
+				destroy_subleq_history(eng.history);
+				eng.history = nullptr;
+				destroy_subleq_profile(eng.profile);
+				eng.profile = nullptr;
+				destroy_subleq_cycle(eng.cycle);
+				eng.cycle = nullptr;
+				return true;
+			}, state.engine);
+			if (!ok)
+			{
+				_editor_invalidate_frame(state);
+				printf("\033[38;5;9mThe JIT is not available on this platform!\033[m\nPress any key to continue...\n");
+				_getch();
+			}
+			return MENU;
+		}
+		else if (keycode == 'h' || keycode == 'H')
+		{
+			std::visit([](auto& eng) {
+				if (eng.history != nullptr)
+				{
+					destroy_subleq_history(eng.history);
+					eng.history = nullptr;
+					return;
+				}
+				eng.history = create_subleq_history(eng.sim);
+				destroy_subleq_jit(eng.jit);
+				eng.jit = nullptr;
+				destroy_subleq_cycle(eng.cycle);
+				eng.cycle = nullptr;
+			}, state.engine);
+			return MENU;
+		}
+		else if (keycode == 'o' || keycode == 'O')
+		{
+			std::visit([](auto& eng) {
+				if (eng.cycle != nullptr)
+				{
+					destroy_subleq_cycle(eng.cycle);
+					eng.cycle = nullptr;
+					return;
+				}
+				eng.cycle = create_subleq_cycle(eng.sim);
+				destroy_subleq_jit(eng.jit);
+				eng.jit = nullptr;
+				destroy_subleq_history(eng.history);
+				eng.history = nullptr;
+				destroy_subleq_profile(eng.profile);
+				eng.profile = nullptr;
+			}, state.engine);
+			state.loop_message.clear();
+			return MENU;
+		}
 	}
 	return EditorMode::QUIT;
 }
 
+// Reads the comparison of a conditional breakpoint or watchpoint
+inline void _editor_prompt_compare(BREAKPT_TYPE& type, int64_t& meta)
+{
+	printf("Cmp Op ] ");
+	char buf[9]{'\1'};
+	buf[8] = '\0';
+	do {
+		fgets(buf, 8, stdin);
+	} while(buf[0] != '\0' &&
+			buf[0] != '>' &&
+			buf[0] != '<' &&
+			buf[0] != '!' &&
+			buf[0] != '=');
+
+	if		(buf[0] == '\0')					type = BREAKPT_TYPE::BREAK;
+	else if (buf[0] == '=' && buf[1] == '=')	type = BREAKPT_TYPE::COND_EQ;
+	else if (buf[0] == '!' && buf[1] == '=')	type = BREAKPT_TYPE::COND_NEQ;
+	else if (buf[0] == '>' && buf[1] == '\n')	type = BREAKPT_TYPE::COND_GT;
+	else if (buf[0] == '>' && buf[1] == '=')	type = BREAKPT_TYPE::COND_GEQ;
+	else if (buf[0] == '<' && buf[1] == '\n')	type = BREAKPT_TYPE::COND_LT;
+	else if (buf[0] == '<' && buf[1] == '=')	type = BREAKPT_TYPE::COND_LEQ;
+
+	if (type != BREAKPT_TYPE::BREAK)
+	{
+		printf("Cmp RHS ] ");
+		long long r = -1;
+		while (!scanf_s("%lld", &r));
+		meta = r;
+	}
+}
+
 inline void _editor_add_breakpoints(EditorState& state)
 {
+	const size_t width = _editor_cell_width(state);
 	while (true)
 	{
+		const size_t addr = state.term_mem_cursor * width;
 		_editor_draw_sim(state);
-		printf("[c]ancel    [return/space] toggle breakpt    [e] Edit breakpt\n");
-		if (state.breakpoints.contains(state.term_mem_cursor) &&
-			state.breakpoints[state.term_mem_cursor].is_valid)
+		_editor_frame_printf(state, "[c]ancel    [return/space] toggle breakpt    [e] Edit breakpt    [w/W] toggle watch    [l] go to source line\n");
+		if (state.breakpoints.contains(addr))
 		{
-			const BreakPoint& pt = state.breakpoints[state.term_mem_cursor];
-			printf("Breakpoint    ");
-			if (pt.type == BREAKPT_TYPE::COND_EQ) printf("x == %d", pt.meta);
-			else if (pt.type == BREAKPT_TYPE::COND_NEQ) printf("x != %d", pt.meta);
-			else if (pt.type == BREAKPT_TYPE::COND_GT) printf("x > %d", pt.meta);
-			else if (pt.type == BREAKPT_TYPE::COND_GEQ) printf("x >= %d", pt.meta);
-			else if (pt.type == BREAKPT_TYPE::COND_LT) printf("x < %d", pt.meta);
-			else if (pt.type == BREAKPT_TYPE::COND_LEQ) printf("x <= %d", pt.meta);
+			const BreakPoint& pt = state.breakpoints.at(addr);
+			_editor_frame_printf(state, "Breakpoint    ");
+			if (pt.type != BREAKPT_TYPE::BREAK) _editor_frame_printf(state, "x %s %lld", breakpt_type_str(pt.type), (long long)pt.meta);
 
-			if (pt.addr_offset != 0) printf(", x = [ip%+d]", pt.addr_offset);
+			if (pt.addr_offset != 0) _editor_frame_printf(state, ", x = [ip%+d]", pt.addr_offset);
+		}
+		else _editor_frame_printf(state, "Memory Cell    [%llu] = %lld", (unsigned long long)addr, (long long)_editor_cell(state, addr));
+		const WatchPoint* wp = state.watchpoints.find(addr, addr);
+		if (wp != nullptr)
+		{
+			_editor_frame_printf(state, "    Watch [%llu..%llu]", (unsigned long long)wp->first, (unsigned long long)wp->last);
+			if (wp->type != BREAKPT_TYPE::BREAK) _editor_frame_printf(state, " when x %s %lld", breakpt_type_str(wp->type), (long long)wp->meta);
 		}
-		else printf("Memory Cell    [%llu] = %d\n", state.term_mem_cursor, (cell_value_t)state.sim->memory[state.term_mem_cursor]);
+		const size_t line = _editor_source_line(state, addr);
+		if (line != 0)
+			_editor_frame_printf(state, "    %s:%llu", state.source_name.c_str(), (unsigned long long)line);
+		std::visit([&state, addr](const auto& eng) {
+			if (eng.profile != nullptr && addr < eng.profile->memsize)
+				_editor_frame_printf(state, "    ran %llu, taken %llu, written %llu", (unsigned long long)eng.profile->exec[addr],
+					(unsigned long long)eng.profile->taken[addr], (unsigned long long)eng.profile->writes[addr]);
+		}, state.engine);
+		_editor_frame_printf(state, "\n");
+		_editor_present(state);
 
 		int keycode = _getch();
 		if (keycode == 'c')
 			break;
+		else if (keycode == 'l')
+		{
+			_editor_invalidate_frame(state);
+			if (state.source_name.empty())
+			{
+				printf("\033[38;5;9mNo source is loaded, assemble one with [l] in the menu!\033[m\nPress any key to continue...\n");
+				_getch();
+				continue;
+			}
+			const size_t line_buf_size = 32;
+			char buf[line_buf_size]{ '\0' };
+			printf("Source Line: ");
+			fgets(buf, line_buf_size, stdin);
+			const size_t target = subleq_asm_addr_of(&state.assembler, (size_t)strtoull(buf, nullptr, 10));
+			if (target < _editor_memsize(state))
+				state.term_mem_cursor = target / width;
+		}
 		else if (keycode == 'e')
 		{
+			_editor_invalidate_frame(state);
 			printf("[c]ancel    edit [m]ode    edit [v]alue    edit [o]ffset\n");
 		}
 		else if (keycode == 224)
 		{
 			const size_t& max_per_row = state.elements_per_row;
-			const size_t& max = state.sim->memsize;
+			const size_t max = _editor_num_cells(state);
 			size_t& new_cur = state.term_mem_cursor;
 			int dir = _getch();
 			if		(dir == 72 && (new_cur- max_per_row) <= new_cur) new_cur -= max_per_row;
@@ -381,8 +1498,8 @@ inline void _editor_add_breakpoints(EditorState& state)
 		}
 		else if (keycode == '\r' || keycode == ' ')
 		{
-			if (state.breakpoints.contains(state.term_mem_cursor) && state.breakpoints[state.term_mem_cursor].is_valid)
-				state.breakpoints.erase(state.term_mem_cursor);
+			if (state.breakpoints.contains(addr))
+				state.breakpoints.erase(addr);
 			else
 			{
 				BreakPoint bk;
@@ -390,44 +1507,45 @@ inline void _editor_add_breakpoints(EditorState& state)
 				bk.addr_offset = 0;
 				bk.type = BREAKPT_TYPE::BREAK;
 				bk.meta = 0;
-				
+
 				if (keycode == ' ')
 				{
+					_editor_invalidate_frame(state);
 					printf("Address Offset ] ");
 					int r = -1;
 					while (!scanf_s("%d", &r));
 					bk.addr_offset = r;
 
-					printf("Cmp Op ] ");
-					char buf[9]{'\1'};
-					buf[8] = '\0';
-					do {
-						fgets(buf, 8, stdin);
-					} while(buf[0] != '\0' && 
-							buf[0] != '>' && 
-							buf[0] != '<' && 
-							buf[0] != '!' && 
-							buf[0] != '=');
-
-					if		(buf[0] == '\0')					bk.type = BREAKPT_TYPE::BREAK;
-					else if (buf[0] == '=' && buf[1] == '=')	bk.type = BREAKPT_TYPE::COND_EQ;
-					else if (buf[0] == '!' && buf[1] == '=')	bk.type = BREAKPT_TYPE::COND_NEQ;
-					else if (buf[0] == '>' && buf[1] == '\n')	bk.type = BREAKPT_TYPE::COND_GT;
-					else if (buf[0] == '>' && buf[1] == '=')	bk.type = BREAKPT_TYPE::COND_GEQ;
-					else if (buf[0] == '<' && buf[1] == '\n')	bk.type = BREAKPT_TYPE::COND_LT;
-					else if (buf[0] == '<' && buf[1] == '=')	bk.type = BREAKPT_TYPE::COND_LEQ;
-
-					if (bk.type != BREAKPT_TYPE::BREAK)
-					{
-						printf("Cmp RHS ] ");
-						int r = -1;
-						while (!scanf_s("%d", &r));
-						bk.meta = r;
-					}
+					_editor_prompt_compare(bk.type, bk.meta);
 				}
 
 				bk.is_valid = true;
-				state.breakpoints.emplace(state.term_mem_cursor, bk);
+				state.breakpoints.set(addr, bk);
+			}
+		}
+		// 'w' watches the cell under the cursor for any write, 'W' asks for a range and a
+		// comparison the written value has to pass
+		else if (keycode == 'w' || keycode == 'W')
+		{
+			if (state.watchpoints.contains(addr))
+				state.watchpoints.erase(addr);
+			else
+			{
+				WatchPoint wp;
+				size_t cells = 1;
+				if (keycode == 'W')
+				{
+					_editor_invalidate_frame(state);
+					printf("Cells ] ");
+					long long r = -1;
+					while (!scanf_s("%lld", &r));
+					cells = r > 0 ? (size_t)r : 1;
+					_editor_prompt_compare(wp.type, wp.meta);
+				}
+				const size_t max_cells = (_editor_memsize(state) - addr) / width;
+				wp.first = addr;
+				wp.last = addr + (cells < max_cells ? cells : max_cells) * width - 1;
+				state.watchpoints.set(wp);
 			}
 		}
 	}
@@ -438,25 +1556,31 @@ inline void _editor_add_breakpoints(EditorState& state)
 
 inline void _editor_edit(EditorState& state)
 {
+	const size_t width = _editor_cell_width(state);
+	const size_t memsize = _editor_memsize(state);
 	bool sign = false;
-	cell_value_t new_val = 0;
-	cell_value_t* prev_vals = (cell_value_t*)malloc(state.sim->memsize*sizeof(cell_value_t));
-	memcpy(prev_vals, state.sim->memory, state.sim->memsize * sizeof(cell_value_t));
+	int64_t new_val = 0;
+	uint8_t* prev_vals = (uint8_t*)malloc(memsize);
+	uint8_t* memory = std::visit([](auto& eng) { return eng.sim->memory; }, state.engine);
+	memcpy(prev_vals, memory, memsize);
+	const size_t prev_ip = _editor_ip(state);
 
 	while (true)
 	{
+		const size_t addr = state.term_mem_cursor * width;
 		_editor_draw_sim(state);
-		printf("Memory Cell    [%llu] = %d    New Value: %d\n", 
-			state.term_mem_cursor, (cell_value_t)state.sim->memory[state.term_mem_cursor], 
-			new_val*!sign - new_val*sign
+		_editor_frame_printf(state, "Memory Cell    [%llu] = %lld    New Value: %lld\n",
+			(unsigned long long)addr, (long long)_editor_cell(state, addr),
+			(long long)(new_val*!sign - new_val*sign)
 		);
-		printf("[c]ancel    [s]ave    [del]ete new value    [0-9\\-\\+] Type number    [return] Set value    [j]ump\n");
+		_editor_frame_printf(state, "[c]ancel    [s]ave    [del]ete new value    [0-9\\-\\+] Type number    [return] Set value    [j]ump\n");
+		_editor_present(state);
 		int keycode = _getch();
 
 		if (keycode == 224)
 		{
 			const size_t& max_per_row = state.elements_per_row;
-			const size_t& max = state.sim->memsize;
+			const size_t max = _editor_num_cells(state);
 			size_t& new_cur = state.term_mem_cursor;
 			int dir = _getch();
 			if (dir == 72 && (new_cur - max_per_row) <= new_cur) new_cur -= max_per_row;
@@ -472,7 +1596,7 @@ inline void _editor_edit(EditorState& state)
 		else if (keycode == 8)
 			new_val /= 10;
 		else if (keycode == '\r')
-			state.sim->memory[state.term_mem_cursor] = new_val * !sign - new_val * sign;
+			_editor_set_cell(state, addr, new_val * !sign - new_val * sign);
 		else if (keycode == '+')
 			sign = false;
 		else if (keycode == '-')
@@ -480,89 +1604,478 @@ inline void _editor_edit(EditorState& state)
 		else if (keycode >= 48 && keycode < 58)
 			new_val = new_val * 10 + keycode - 48;
 		else if (keycode == 'j')
-			state.sim->_ip = state.term_mem_cursor;
+			std::visit([addr](auto& eng) { eng.sim->_ip = (typename std::remove_reference_t<decltype(eng)>::cell_t)addr; }, state.engine);
 		else if (keycode == 's')
 			break;
 		else if (keycode == 'c')
 		{
-			memcpy(state.sim->memory, prev_vals, state.sim->memsize);
+			memcpy(memory, prev_vals, memsize);
 			break;
 		}
 	}
+	if (memcmp(memory, prev_vals, memsize) != 0 || _editor_ip(state) != prev_ip)
+	{
+		std::visit([](auto& eng) { subleq_dirty_untracked(eng.sim); }, state.engine);
+		_editor_restart_history(state);
+	}
 	free(prev_vals);
 	state.term_mem_cursor = 0;
 	if (state.mode == EDIT_VALUES)
 		state.mode = MENU;
 }
 
-inline bool _breakpoint_breaks(EditorState& state, const BreakPoint& bk)
+template <typename T>
+bool _breakpoint_breaks(const EditorEngine<T>& eng, const BreakPoint& bk)
 {
-	const cell_value_t& x = state.sim->memory[state.sim->_ip + bk.addr_offset];
-	switch (bk.type)
-	{
-	case BREAKPT_TYPE::BREAK:		return true;
-	case BREAKPT_TYPE::COND_EQ:		return x == bk.meta;
-	case BREAKPT_TYPE::COND_NEQ:	return x != bk.meta;
-	case BREAKPT_TYPE::COND_GT:		return x > bk.meta;
-	case BREAKPT_TYPE::COND_GEQ:	return x >= bk.meta;
-	case BREAKPT_TYPE::COND_LT:		return x < bk.meta;
-	case BREAKPT_TYPE::COND_LEQ:	return x <= bk.meta;
-	default:						return false;
-	}
+	const size_t addr = (size_t)eng.sim->_ip + bk.addr_offset * (int64_t)sizeof(T);
+	int64_t x = 0;
+	if (_subleq_in_bounds(eng.sim, addr))
+		x = *(T*)(eng.sim->memory + addr);
+	return _editor_compare(bk.type, x, bk.meta);
 }
 
+// True if the watchpoint covering a write of value to the cell at addr fires, describing the
+// write in watch_message when it does
 template <typename T>
-void _editor_on_sim_out(subleq<T>* sim, T& outval, const T& ip, void* userarg)
+bool _watchpoint_fires(EditorState& state, const size_t addr, const int64_t value, const size_t ip)
+{
+	const WatchPoint* wp = state.watchpoints.find(addr, addr + sizeof(T) - 1);
+	if (wp == nullptr || !_editor_compare(wp->type, value, wp->meta))
+		return false;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "Watch [%llu] = %lld, written by ip %llu", (unsigned long long)addr, (long long)value, (unsigned long long)ip);
+	state.watch_message = buf;
+	return true;
+}
+
+// Called after a run loop returned, true if it stopped on a watched write that fires.
+// Writes whose comparison doesn't hold are cleared so running can go on.
+template <typename T>
+bool _editor_watch_stops(EditorState& state, const EditorEngine<T>& eng, subleq_watch* watch)
+{
+	if (watch == nullptr || !watch->hit())
+		return false;
+	const bool fires = _watchpoint_fires<T>(state, watch->addr, *(T*)(eng.sim->memory + watch->addr), watch->ip);
+	watch->clear();
+	return fires;
+}
+
+// Called after a run loop returned, true if loop checking found the program in a loop. The
+// loop is described in loop_message.
+template <typename T>
+bool _editor_loop_stops(EditorState& state, const EditorEngine<T>& eng)
 {
-	EditorState& state = *(EditorState*)userarg;
-	if ((state.program_output_size + 1) >= state.program_output_capacity)
+	if (eng.cycle == nullptr || !eng.cycle->found)
+		return false;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "Endless loop at ip %llu, every %llu steps", (unsigned long long)eng.cycle->entry_ip, (unsigned long long)eng.cycle->period);
+	state.loop_message = buf;
+	return true;
+}
+
+inline void _editor_append_output(EditorState& state, const char* data, const size_t size)
+{
+	if ((state.program_output_size + size) >= state.program_output_capacity)
 	{
-		char* new_output = (char*)malloc(state.program_output_capacity*2);
+		size_t new_capacity = state.program_output_capacity * 2;
+		while (new_capacity <= state.program_output_size + size)
+			new_capacity *= 2;
+		char* new_output = (char*)malloc(new_capacity);
 		if (new_output == nullptr || new_output == 0)
 			throw std::exception("Failed to reallocate program output buffer");
 		memcpy(new_output, state.program_output, state.program_output_size);
 		free(state.program_output);
 		state.program_output = new_output;
-		state.program_output_capacity *= 2;
+		state.program_output_capacity = new_capacity;
 	}
-	state.program_output[state.program_output_size] = (char)outval;
-	state.program_output_size++;
+	memcpy(state.program_output + state.program_output_size, data, size);
+	state.program_output_size += size;
 }
 
-inline bool editor_tick(EditorState& state)
+template <typename T>
+void _editor_on_sim_out(subleq<T>* sim, T& outval, const T& ip, void* userarg)
 {
-	if (!state.sim_started)
-		state.mode = END_OF_PROGRAM;
+	const char c = (char)outval;
+	_editor_append_output(*(EditorState*)userarg, &c, 1);
+}
+
+// Output taken back by stepping backwards, one character per output instruction
+inline void _editor_drop_output(EditorState& state, const uint64_t count)
+{ state.program_output_size -= count < state.program_output_size ? (size_t)count : state.program_output_size; }
 
-	if ( (state.mode == RUNNING || state.mode == STEP) && state.sim_started)
+// Prompts for a step to go to, false if none was given
+inline bool _editor_prompt_step(EditorState& state, const uint64_t first, const uint64_t current, uint64_t& step)
+{
+	_editor_invalidate_frame(state);
+	const size_t step_buf_size = 32;
+	char buf[step_buf_size]{ '\0' };
+	printf("Go to step (%llu - %llu, or later): ", (unsigned long long)first, (unsigned long long)current);
+	fgets(buf, step_buf_size, stdin);
+	char* end = nullptr;
+	step = strtoull(buf, &end, 10);
+	return end != buf;
+}
+
+template <typename T>
+void _editor_travel_engine(EditorState& state, EditorEngine<T>& eng)
+{
+	subleq_history<T>* history = eng.history;
+	if (state.mode == STEP_BACK)
 	{
-		if (state.breakpoints.contains(state.sim->_ip) &&
-			state.breakpoints.at(state.sim->_ip).is_valid &&
-			_breakpoint_breaks(state, state.breakpoints.at(state.sim->_ip)))
+		const subleq_history_entry<T>* e = subleq_history_back(history, eng.sim);
+		if (e != nullptr)
+			_editor_drop_output(state, e->b == ((T)(-1)));
+	}
+	else if (state.mode == REVERSE_RUNNING)
+	{
+		// Like continuing, the breakpoint it starts on doesn't count
+		const subleq_history_entry<T>* e = nullptr;
+		T wrote = 0;
+		state.watch_message.clear();
+		while ((e = subleq_history_back(history, eng.sim, &wrote)) != nullptr)
 		{
-			state.mode = MENU;
+			const bool output = e->b == ((T)(-1));
+			_editor_drop_output(state, output);
+			const size_t ip = (size_t)eng.sim->_ip;
+			if (state.breakpoints.contains(ip) && _breakpoint_breaks(eng, state.breakpoints.at(ip)))
+				break;
+			// Output writes no cell
+			if (output)
+				continue;
+			// Stops in front of the instruction that made a watched write, with the value it
+			// wrote as it was undone, which also covers input instructions
+			const size_t b_addr = _subleq_addr(e->b);
+			if ((state.watchpoints.contains(b_addr) || state.watchpoints.contains(b_addr + sizeof(T) - 1)) &&
+				_watchpoint_fires<T>(state, b_addr, wrote, ip))
+				break;
+		}
+	}
+	else
+	{
+		const uint64_t current = subleq_history_step(history);
+		uint64_t step = 0;
+		if (!_editor_prompt_step(state, subleq_history_first_step(history), current, step))
+			return;
+		if (step < current)
+			_editor_drop_output(state, subleq_history_rewind(history, eng.sim, step));
+		// Going forwards runs the program, stopping early if it ends
+		else if (step > current)
+			subleq_run_recorded<T>(eng.sim, history, step - current, nullptr, nullptr, _editor_on_sim_out<T>, &state);
+	}
+	state.sim_started = (size_t)eng.sim->_ip < eng.sim->memsize;
+}
+
+// Handles the modes that move through the history
+inline void _editor_travel(EditorState& state)
+{
+	const bool has_history = std::visit([](const auto& eng) { return eng.history != nullptr; }, state.engine);
+	if (!has_history)
+	{
+		_editor_invalidate_frame(state);
+		printf("\033[38;5;9mHistory is off, turn it on with [h] before stepping!\033[m\nPress any key to continue...\n");
+		_getch();
+	}
+	else std::visit([&state](auto& eng) { _editor_travel_engine(state, eng); }, state.engine);
+	state.mode = MENU;
+}
+
+// Prompts for what RUN_STEPS or RUN_UNTIL should run to, false if there is nothing to run
+inline bool _editor_prompt_fast_forward(EditorState& state)
+{
+	_editor_invalidate_frame(state);
+	const size_t buf_size = 256;
+	char buf[buf_size]{ '\0' };
+	if (state.mode == RUN_STEPS)
+	{
+		printf("Steps (%llu): ", (unsigned long long)state.run_steps);
+		fgets(buf, buf_size, stdin);
+		char* end = nullptr;
+		const uint64_t steps = strtoull(buf, &end, 10);
+		if (end != buf)
+			state.run_steps = steps;
+		return state.run_steps > 0;
+	}
+
+	printf("ip, [addr], [ip+cells], numbers, == != < <= > >=, && ||\n");
+	printf("Run Until (%s): ", state.run_until.c_str());
+	fgets(buf, buf_size, stdin);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if (*_run_skip_space(buf) == '\0')
+		return !state.run_until.empty();
+	RunCondition cond;
+	const char* error = _run_parse_condition(buf, cond);
+	if (error != nullptr)
+	{
+		printf("\033[38;5;9mCould not parse the condition at \"%s\"!\033[m\nPress any key to continue...\n", error);
+		_getch();
+		return false;
+	}
+	state.run_until = buf;
+	state.run_condition = std::move(cond);
+	return true;
+}
+
+// Runs without any drawing or input, other than a check for 'p' every editor_fast_slice
+// instructions, until done, a breakpoint fires or the program ends
+template <typename T>
+void _editor_fast_forward_engine(EditorState& state, EditorEngine<T>& eng)
+{
+	subleq<T>* sim = eng.sim;
+	const uint8_t* stop_at = state.breakpoints.empty() ? nullptr : state.breakpoints.flags.data();
+	subleq_watch watch_set;
+	watch_set.flags = state.watchpoints.flags.data();
+	subleq_watch* watch = state.watchpoints.empty() ? nullptr : &watch_set;
+	const bool until = state.mode == RUN_UNTIL;
+	uint64_t left = until ? UINT64_MAX : state.run_steps;
+	uint64_t since_poll = 0;
+	sim->running = (size_t)sim->_ip < sim->memsize;
+	// Like continuing, the breakpoint it starts on doesn't count
+	bool first = true;
+	while (sim->running && left > 0)
+	{
+		const size_t ip = (size_t)sim->_ip;
+		if (!first && stop_at != nullptr && stop_at[ip] && _breakpoint_breaks(eng, state.breakpoints.at(ip)))
+			break;
+		first = false;
+
+		const uint64_t slice = left < editor_fast_slice - since_poll ? left : editor_fast_slice - since_poll;
+		uint64_t done = 0;
+		if (until)
+		{
+			// The condition is checked after every instruction, so these are run one at a time
+			bool met = false;
+			while (done < slice)
+			{
+				uint64_t n;
+				if (eng.cycle != nullptr)
+					n = subleq_run_checked<T>(sim, eng.cycle, 1, nullptr, watch, _editor_on_sim_out<T>, &state);
+				else if (eng.profile != nullptr)
+					n = subleq_run_profiled<T>(sim, eng.profile, eng.history, 1, nullptr, watch, _editor_on_sim_out<T>, &state);
+				else if (eng.history != nullptr)
+					n = subleq_run_recorded<T>(sim, eng.history, 1, nullptr, watch, _editor_on_sim_out<T>, &state);
+				else
+					n = subleq_run_fused<T>(sim, eng.fusion, 1, nullptr, watch, _editor_on_sim_out<T>, &state);
+				if (n == 0 || !sim->running)
+					break;
+				++done;
+				if ((met = _editor_loop_stops(state, eng) || _editor_watch_stops(state, eng, watch) || _run_condition_holds(sim, state.run_condition)))
+					break;
+				if (stop_at != nullptr && stop_at[(size_t)sim->_ip])
+					break;
+			}
+			if (met)
+				break;
+		}
+		else if (eng.cycle != nullptr)
+			done = subleq_run_checked<T>(sim, eng.cycle, slice, stop_at, watch, _editor_on_sim_out<T>, &state);
+		else if (eng.profile != nullptr)
+			done = subleq_run_profiled<T>(sim, eng.profile, eng.history, slice, stop_at, watch, _editor_on_sim_out<T>, &state);
+		else if (eng.history != nullptr)
+			done = subleq_run_recorded<T>(sim, eng.history, slice, stop_at, watch, _editor_on_sim_out<T>, &state);
+		else if (eng.jit != nullptr)
+		{
+			done = subleq_jit_run<T>(eng.jit, sim, slice, stop_at, watch, _editor_on_sim_out<T>, &state);
+			// Compiled code doesn't stamp the pages it writes
+			subleq_dirty_untracked(sim);
 		}
 		else
+			done = subleq_run_fused<T>(sim, eng.fusion, slice, stop_at, watch, _editor_on_sim_out<T>, &state);
+
+		left -= done;
+		if (_editor_loop_stops(state, eng) || _editor_watch_stops(state, eng, watch))
+			break;
+		since_poll += done;
+		if (since_poll >= editor_fast_slice)
+		{
+			since_poll = 0;
+			if (_kbhit() && _getch_nolock() == 'p')
+				break;
+		}
+	}
+	state.sim_started = sim->running;
+}
+
+inline void _editor_fast_forward(EditorState& state)
+{
+	if (_editor_prompt_fast_forward(state))
+		std::visit([&state](auto& eng) { _editor_fast_forward_engine(state, eng); }, state.engine);
+}
+
+// Runs on the simulation thread until a breakpoint, halt, fault or pause request
+template <typename T>
+void _editor_worker_main(EditorState& state, EditorEngine<T>& eng)
+{
+	EditorWorker& w = *state.worker;
+	subleq<T>* sim = eng.sim;
+	const uint8_t* stop_at = state.breakpoints.empty() ? nullptr : state.breakpoints.flags.data();
+	subleq_watch watch_set;
+	watch_set.flags = state.watchpoints.flags.data();
+	subleq_watch* watch = state.watchpoints.empty() ? nullptr : &watch_set;
+	sim->running = (size_t)sim->_ip < sim->memsize;
+	// Continuing from a breakpoint runs the instruction under it rather than stopping again
+	bool first = true;
+	while (sim->running && !w.stop.load(std::memory_order_relaxed))
+	{
+		if (w.snapshot_requested.load(std::memory_order_acquire))
+		{
+			subleq_sink_flush(w.sink);
+			memcpy(w.snapshot.data(), sim->memory, sim->memsize);
+			w.snapshot_ip = (size_t)sim->_ip;
+			w.snapshot_input_pos = subleq_source_tell(sim->input);
+			if (eng.profile != nullptr)
+				subleq_profile_heat(eng.profile, state.heatmap, w.snapshot_heat);
+			w.snapshot_requested.store(false, std::memory_order_release);
+		}
+
+		const size_t ip = (size_t)sim->_ip;
+		if (!first && stop_at != nullptr && stop_at[ip] && _breakpoint_breaks(eng, state.breakpoints.at(ip)))
+			break;
+		first = false;
+
+		if (eng.cycle != nullptr)
+			subleq_run_checked<T>(sim, eng.cycle, editor_recorded_slice, stop_at, watch, subleq_sink_output<T>, w.sink);
+		else if (eng.profile != nullptr)
+			subleq_run_profiled<T>(sim, eng.profile, eng.history, editor_recorded_slice, stop_at, watch, subleq_sink_output<T>, w.sink);
+		else if (eng.history != nullptr)
+			subleq_run_recorded<T>(sim, eng.history, editor_recorded_slice, stop_at, watch, subleq_sink_output<T>, w.sink);
+		else if (eng.jit != nullptr)
 		{
-			state.sim_started = subleq_step<cell_value_t>(state.sim, _editor_on_sim_out<cell_value_t>, &state);
-			if (state.mode == STEP)
-				state.mode = MENU;
-			if (state.mode != MENU && _getch_nolock() == 'p')
-				state.mode = MENU;
+			subleq_jit_run<T>(eng.jit, sim, editor_jit_slice, stop_at, watch, subleq_sink_output<T>, w.sink);
+			subleq_dirty_untracked(sim);
 		}
+		else
+			subleq_run_fused<T>(sim, eng.fusion, editor_fused_slice, stop_at, watch, subleq_sink_output<T>, w.sink);
+		// The messages are only read by the UI once the thread has been joined
+		if (_editor_loop_stops(state, eng) || _editor_watch_stops(state, eng, watch))
+			break;
+	}
+	subleq_sink_flush(w.sink);
+	w.still_running = sim->running;
+	w.done.store(true, std::memory_order_release);
+}
+
+inline void _editor_drain_output(EditorState& state)
+{
+	EditorWorker& w = *state.worker;
+	std::lock_guard<std::mutex> lock(w.output_lock);
+	if (!w.pending_output.empty())
+		_editor_append_output(state, w.pending_output.data(), w.pending_output.size());
+	w.pending_output.clear();
+}
+
+inline void _editor_start_worker(EditorState& state)
+{
+	EditorWorker& w = *state.worker;
+	std::visit([&w](const auto& eng) {
+		w.snapshot.assign(eng.sim->memory, eng.sim->memory + eng.sim->memsize);
+		w.snapshot_ip = (size_t)eng.sim->_ip;
+		w.snapshot_input_pos = subleq_source_tell(eng.sim->input);
+	}, state.engine);
+	w.snapshot_heat = state.heat;
+	w.stop.store(false);
+	w.done.store(false);
+	w.snapshot_requested.store(false);
+	w.last_frame = std::chrono::steady_clock::now();
+	w.active = true;
+	w.thread = std::thread([&state]() {
+		std::visit([&state](auto& eng) { _editor_worker_main(state, eng); }, state.engine);
+	});
+}
+
+// One UI tick while the simulation thread runs: handle keys, forward output and redraw
+inline void _editor_tick_running(EditorState& state)
+{
+	EditorWorker& w = *state.worker;
+	if (!w.active)
+		_editor_start_worker(state);
+
+	_editor_drain_output(state);
+	if (w.done.load(std::memory_order_acquire))
+	{
+		w.thread.join();
+		w.active = false;
+		_editor_drain_output(state);
+		state.sim_started = w.still_running;
+		state.mode = MENU;
+		return;
+	}
+
+	if (_kbhit() && _getch_nolock() == 'p')
+		w.stop.store(true, std::memory_order_relaxed);
+
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - w.last_frame >= editor_frame_interval && !w.snapshot_requested.load(std::memory_order_acquire))
+	{
+		_editor_draw_sim(state);
+		_editor_draw_output(state, 2);
+		state.frame.buf.append(state.term_cols, (char)223);
+		state.frame.buf += "\n[p]ause\n";
+		_editor_present(state);
+		w.snapshot_requested.store(true, std::memory_order_release);
+		w.last_frame = now;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+inline bool editor_tick(EditorState& state)
+{
+	if (!state.sim_started)
+		state.mode = END_OF_PROGRAM;
+
+	if (state.mode == RUNNING && state.sim_started)
+		_editor_tick_running(state);
+	else if ((state.mode == RUN_STEPS || state.mode == RUN_UNTIL) && state.sim_started)
+	{
+		_editor_fast_forward(state);
+		state.mode = MENU;
+	}
+	else if (state.mode == STEP && state.sim_started)
+	{
+		// A step always executes, even from a breakpoint
+		std::visit([&state](auto& eng) {
+			typedef typename std::remove_reference_t<decltype(eng)>::cell_t T;
+			if (eng.cycle != nullptr)
+			{
+				subleq_run_checked<T>(eng.sim, eng.cycle, 1, nullptr, nullptr, _editor_on_sim_out<T>, &state);
+				state.sim_started = eng.sim->running;
+			}
+			else if (eng.profile != nullptr)
+				state.sim_started = subleq_step_profiled<T>(eng.sim, eng.profile, eng.history, _editor_on_sim_out<T>, &state);
+			else if (eng.history != nullptr)
+				state.sim_started = subleq_step_recorded<T>(eng.sim, eng.history, _editor_on_sim_out<T>, &state);
+			else
+				state.sim_started = subleq_step<T>(eng.sim, _editor_on_sim_out<T>, &state);
+		}, state.engine);
+		state.mode = MENU;
 	}
 
 	if (state.mode == MENU || state.mode == END_OF_PROGRAM)
 	{
 		state.mode = _editor_menu(state);
-		if (state.mode == RUNNING)
-			printf("[p]ause\n");
+		// The menu may have changed memory, breakpoints or watchpoints that compiled blocks and superinstructions depend on
+		if (state.mode == RUNNING || state.mode == RUN_STEPS || state.mode == RUN_UNTIL)
+		{
+			state.watch_message.clear();
+			state.loop_message.clear();
+			std::visit([&state](auto& eng) {
+				// Running on from a loop that was found searches for it again
+				if (eng.cycle != nullptr && eng.cycle->found)
+					subleq_cycle_rearm(eng.cycle, (size_t)eng.sim->_ip);
+				if (eng.jit != nullptr)
+					subleq_jit_flush(eng.jit, eng.jit->memsize);
+				else if (eng.history == nullptr && eng.profile == nullptr && eng.cycle == nullptr)
+					subleq_fusion_build(eng.fusion, eng.sim, state.breakpoints.flags.data(), state.watchpoints.flags.data());
+			}, state.engine);
+		}
 	}
 
 	if (state.mode == ADD_BREAKPOINT)
 		_editor_add_breakpoints(state);
 	else if (state.mode == EDIT_VALUES)
 		_editor_edit(state);
+	// Handled straight away, going back also works once the program has ended
+	else if (state.mode == STEP_BACK || state.mode == REVERSE_RUNNING || state.mode == GOTO_STEP)
+		_editor_travel(state);
 
 	return state.mode != QUIT;
 }
@@ -0,0 +1,562 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "subleq.h"
+
+// Superinstructions: every instruction reachable from ip is decoded into an operation, and
+// contiguous runs whose branches don't matter until the last one (every earlier instruction
+// jumps to its own fall-through) into a single one. Each operation links to the ones starting
+// at its branch target and fall-through, so running them only looks ip up after an instruction
+// that had to be run on its own.
+const size_t fused_max_len = 4;
+// Operations are indexed per cell in pages of this many cells, only allocated for pages
+// holding code
+const size_t fusion_page_bits = 12;
+const size_t fusion_page_size = (size_t)1 << fusion_page_bits;
+// An operation dropped by writes this often reads its instruction from memory each time instead
+const uint8_t fused_max_rewrites = 8;
+
+enum SUBLEQ_FUSED : uint8_t
+{
+	FUSED_SUB,		// A single subtraction
+	FUSED_SEQ,		// Any other run of subtractions, run in order through memory
+	FUSED_CLR,		// X X ; Y Y ...           clears, the last one jumps
+	FUSED_ADD,		// A Z ; Z B ; Z Z         B -= Z - A, A, B and Z don't overlap
+	FUSED_MOV,		// B B ; A Z ; Z B ; Z Z   B = A - Z, A, B and Z don't overlap
+	FUSED_OUT,		// Output A, jump
+	FUSED_IN,		// Read an input byte into B, jump
+	FUSED_LIVE,		// Rewritten too often, a single instruction read from memory as it runs
+};
+
+template <typename T>
+struct subleq_fused_op
+{
+	SUBLEQ_FUSED kind;
+	uint8_t length;				// Number of instructions it replaces
+	uint8_t built;				// Length it was first built with, rebuilding never covers more
+	uint8_t rewrites;			// How often writes into its instructions dropped it
+	bool valid;					// Cleared when a write lands in its instructions
+	bool smc;					// Its writes may land in code and have to be checked
+	std::make_unsigned_t<T> a[fused_max_len];
+	std::make_unsigned_t<T> b[fused_max_len];
+	T c;						// Branch target of the last instruction
+	T next;						// Fall-through of the last instruction
+	uint32_t taken;				// ops[taken - 1] starts at c, 0 if none does or it isn't known yet
+	uint32_t fall;				// The same for next
+	size_t start;
+};
+
+enum FUSION_CELL : uint8_t
+{
+	FUSION_SEEN = 1,		// An operation was built or tried here
+	FUSION_CODE = 2,		// Some operation was built over the cell
+	FUSION_WRITTEN = 4,		// Written by an operation that doesn't check its writes
+};
+
+struct _fusion_cell
+{
+	uint32_t op;				// ops[op - 1] starts at this cell, 0 if none does
+	uint8_t covered;			// Number of valid operations covering the cell
+	uint8_t flags;				// FUSION_* flags
+};
+
+// No cell is ever both FUSION_CODE and FUSION_WRITTEN: an operation whose writes can reach a
+// cell some operation was built over checks them, and no operation is built over a cell an
+// unchecked one writes.
+template <typename T>
+struct subleq_fusion
+{
+	// Indexed by cell >> fusion_page_bits, empty for pages without code
+	std::vector<std::vector<_fusion_cell>> pages;
+	std::vector<subleq_fused_op<T>> ops;
+	// The bytes operations were ever built over, writes outside can't drop any
+	size_t code_begin = 0;
+	size_t code_end = 0;
+};
+
+template <typename T>
+constexpr bool _fusion_apart(const size_t x, const size_t y)
+{ return x + sizeof(T) <= y || y + sizeof(T) <= x; }
+
+template <typename T>
+SUBLEQ_FUSED _fusion_classify(const subleq_fused_op<T>& op)
+{
+	const auto* a = op.a;
+	const auto* b = op.b;
+	bool all_clear = true;
+	for (size_t i = 0; i < op.length; ++i)
+		all_clear &= a[i] == b[i];
+	if (all_clear)
+		return FUSED_CLR;
+	if (op.length == 1)
+		return FUSED_SUB;
+	// Run in registers, which is only the same as stepping while the cells don't overlap
+	if (op.length == 3 && a[1] == b[0] && a[2] == b[0] && b[2] == b[0] &&
+		_fusion_apart<T>(a[0], b[0]) && _fusion_apart<T>(a[0], b[1]) && _fusion_apart<T>(b[0], b[1]))
+		return FUSED_ADD;
+	if (op.length == 4 && a[0] == b[0] && b[2] == b[0] && b[1] == a[2] && a[3] == a[2] && b[3] == a[2] &&
+		_fusion_apart<T>(a[1], b[0]) && _fusion_apart<T>(a[1], b[1]) && _fusion_apart<T>(b[0], b[1]))
+		return FUSED_MOV;
+	return FUSED_SEQ;
+}
+
+// The entry of a cell, nullptr if its page has no code
+template <typename T>
+inline _fusion_cell* _fusion_at(subleq_fusion<T>& fusion, const size_t cell)
+{
+	std::vector<_fusion_cell>& page = fusion.pages[cell >> fusion_page_bits];
+	return page.empty() ? nullptr : &page[cell & (fusion_page_size - 1)];
+}
+
+template <typename T>
+inline _fusion_cell& _fusion_alloc(subleq_fusion<T>& fusion, const size_t cell)
+{
+	std::vector<_fusion_cell>& page = fusion.pages[cell >> fusion_page_bits];
+	if (page.empty())
+		page.resize(fusion_page_size, _fusion_cell{ 0, 0, 0 });
+	return page[cell & (fusion_page_size - 1)];
+}
+
+// The index of the operation starting at ip plus one, 0 if there is none
+template <typename T>
+inline uint32_t _fusion_find(subleq_fusion<T>& fusion, const size_t ip)
+{
+	if (ip % sizeof(T) != 0 || ip < fusion.code_begin || ip >= fusion.code_end)
+		return 0;
+	const _fusion_cell* e = _fusion_at(fusion, ip / sizeof(T));
+	return e != nullptr ? e->op : 0;
+}
+
+// The operation starting at start as memory is now, at most max_len instructions long. Runs end
+// in front of instructions flagged in stop_at, and an instruction writing a cell flagged in
+// watch isn't part of any, so the run loop can stop where the others do.
+template <typename T>
+bool _fusion_make(const subleq<T>* state, const size_t start, subleq_fused_op<T>& op, const size_t max_len, const uint8_t* stop_at, const uint8_t* watch)
+{
+	const size_t instr_size = sizeof(T) * 3;
+	op = subleq_fused_op<T>{};
+	op.start = start;
+	op.valid = true;
+	size_t ip = start;
+	while (op.length < max_len && _subleq_in_bounds(state, ip + sizeof(T) * 2))
+	{
+		if (op.length > 0 && stop_at != nullptr && stop_at[ip])
+			break;
+		const T a = *(T*)(state->memory + ip);
+		const T b = *(T*)(state->memory + ip + sizeof(T));
+		const size_t a_addr = _subleq_addr(a);
+		const size_t b_addr = _subleq_addr(b);
+		const size_t end = ip + instr_size;
+		if (b == ((T)(-1)) || a == ((T)(-1)))
+		{
+			// Input and output are operations of their own
+			if (op.length > 0)
+				break;
+			if (b == ((T)(-1)) ? !_subleq_in_bounds(state, a_addr) : !_subleq_in_bounds(state, b_addr))
+				return false;
+			if (b != ((T)(-1)) && ((b_addr + sizeof(T) > start && b_addr < end) || (watch != nullptr && (watch[b_addr] | watch[b_addr + sizeof(T) - 1]))))
+				return false;
+			op.kind = b == ((T)(-1)) ? FUSED_OUT : FUSED_IN;
+			op.a[0] = (std::make_unsigned_t<T>)a_addr;
+			op.b[0] = (std::make_unsigned_t<T>)b_addr;
+			op.c = *(T*)(state->memory + ip + sizeof(T) * 2);
+			op.next = (T)end;
+			op.length = op.built = 1;
+			return true;
+		}
+		if (!_subleq_in_bounds(state, a_addr) || !_subleq_in_bounds(state, b_addr))
+			break;
+		if (watch != nullptr && (watch[b_addr] | watch[b_addr + sizeof(T) - 1]))
+			break;
+		// A run must not write into its own instructions
+		if (b_addr + sizeof(T) > start && b_addr < end)
+			break;
+		bool self_write = false;
+		for (size_t i = 0; i < op.length; ++i)
+			self_write |= op.b[i] + sizeof(T) > ip && op.b[i] < end;
+		if (self_write)
+			break;
+
+		op.a[op.length] = (std::make_unsigned_t<T>)a_addr;
+		op.b[op.length] = (std::make_unsigned_t<T>)b_addr;
+		op.c = *(T*)(state->memory + ip + sizeof(T) * 2);
+		op.next = (T)end;
+		op.length++;
+		// Stop at the first instruction whose branch matters
+		if ((size_t)op.c != end || (size_t)op.next != end)
+			break;
+		ip = end;
+	}
+	if (op.length == 0)
+		return false;
+	op.built = op.length;
+	op.kind = _fusion_classify(op);
+	return true;
+}
+
+// Adds or removes op from the coverage counts of its instructions' cells
+template <typename T>
+void _fusion_cover(subleq_fusion<T>& fusion, const subleq_fused_op<T>& op, const bool add)
+{
+	const size_t first = op.start / sizeof(T);
+	for (size_t i = first; i < first + op.length * 3; ++i)
+	{
+		_fusion_cell& e = _fusion_alloc(fusion, i);
+		if (add)
+		{
+			e.covered++;
+			e.flags |= FUSION_CODE;
+		}
+		else
+			e.covered--;
+	}
+	if (add)
+	{
+		fusion.code_begin = std::min(fusion.code_begin, op.start);
+		fusion.code_end = std::max(fusion.code_end, op.start + op.length * sizeof(T) * 3);
+	}
+}
+
+// True if an operation can be built over op's cells, none of them is written unchecked
+template <typename T>
+bool _fusion_unwritten(subleq_fusion<T>& fusion, const subleq_fused_op<T>& op)
+{
+	const size_t first = op.start / sizeof(T);
+	for (size_t i = first; i < first + op.length * 3; ++i)
+	{
+		const _fusion_cell* e = _fusion_at(fusion, i);
+		if (e != nullptr && (e->flags & FUSION_WRITTEN))
+			return false;
+	}
+	return true;
+}
+
+// Sets op.smc if any cell it writes was ever code, and marks the cells it writes unchecked
+// otherwise
+template <typename T>
+void _fusion_check_writes(subleq_fusion<T>& fusion, subleq_fused_op<T>& op)
+{
+	op.smc = op.kind == FUSED_LIVE;
+	if (op.kind == FUSED_LIVE || op.kind == FUSED_OUT)
+		return;
+	for (size_t i = 0; i < op.length; ++i)
+	{
+		const _fusion_cell* e = _fusion_at(fusion, op.b[i] / sizeof(T));
+		const _fusion_cell* f = _fusion_at(fusion, (op.b[i] + sizeof(T) - 1) / sizeof(T));
+		op.smc |= (e != nullptr && (e->flags & FUSION_CODE)) || (f != nullptr && (f->flags & FUSION_CODE));
+	}
+	if (op.smc)
+		return;
+	for (size_t i = 0; i < op.length; ++i)
+	{
+		_fusion_alloc(fusion, op.b[i] / sizeof(T)).flags |= FUSION_WRITTEN;
+		_fusion_alloc(fusion, (op.b[i] + sizeof(T) - 1) / sizeof(T)).flags |= FUSION_WRITTEN;
+	}
+}
+
+template <typename T>
+inline void _fusion_link(subleq_fusion<T>& fusion, subleq_fused_op<T>& op)
+{
+	op.taken = _fusion_find(fusion, (size_t)op.c);
+	op.fall = _fusion_find(fusion, (size_t)op.next);
+}
+
+// Builds the operations for the code reachable from ip, following jumps and fall-throughs of
+// the instructions as they are in memory. Code reached otherwise gets its operations the first
+// time it runs. Rebuild after memory, ip, stop_at or watch change outside of running.
+template <typename T>
+void subleq_fusion_build(subleq_fusion<T>& fusion, const subleq<T>* state, const uint8_t* stop_at=nullptr, const uint8_t* watch=nullptr)
+{
+	const size_t cells = (state->memsize + sizeof(T) - 1) / sizeof(T);
+	fusion.pages.clear();
+	fusion.pages.resize((cells + fusion_page_size - 1) >> fusion_page_bits);
+	fusion.ops.clear();
+	fusion.code_begin = SIZE_MAX;
+	fusion.code_end = 0;
+
+	std::vector<size_t> todo{ (size_t)state->_ip };
+	while (!todo.empty())
+	{
+		const size_t ip = todo.back();
+		todo.pop_back();
+		if (ip % sizeof(T) != 0 || ip >= state->memsize || !_subleq_in_bounds(state, ip + sizeof(T) * 2))
+			continue;
+		_fusion_cell& e = _fusion_alloc(fusion, ip / sizeof(T));
+		if (e.flags & FUSION_SEEN)
+			continue;
+		e.flags |= FUSION_SEEN;
+
+		const T a = *(T*)(state->memory + ip);
+		const T b = *(T*)(state->memory + ip + sizeof(T));
+		const size_t c = (size_t)*(T*)(state->memory + ip + sizeof(T) * 2);
+		todo.push_back(c);
+		// Subtracting a cell from itself always jumps, which keeps the walk out of zeroed memory
+		if (b != ((T)(-1)) && a != ((T)(-1)) && a != b)
+			todo.push_back(ip + sizeof(T) * 3);
+
+		subleq_fused_op<T> op;
+		if (!_fusion_make(state, ip, op, fused_max_len, stop_at, watch))
+			continue;
+		fusion.ops.push_back(op);
+		e.op = (uint32_t)fusion.ops.size();
+		_fusion_cover(fusion, op, true);
+	}
+	// Only now that all the code is known
+	for (subleq_fused_op<T>& op : fusion.ops)
+	{
+		_fusion_link(fusion, op);
+		_fusion_check_writes(fusion, op);
+	}
+}
+
+// Builds an operation at ip the first time code outside what was built runs there, returns its
+// index plus one or 0 if it can't have one
+template <typename T>
+uint32_t _fusion_extend(subleq_fusion<T>& fusion, const subleq<T>* state, const size_t ip, const uint8_t* stop_at, const uint8_t* watch)
+{
+	_fusion_cell& e = _fusion_alloc(fusion, ip / sizeof(T));
+	if (e.flags & FUSION_SEEN)
+		return 0;
+	e.flags |= FUSION_SEEN;
+	subleq_fused_op<T> op;
+	if (!_fusion_make(state, ip, op, fused_max_len, stop_at, watch) || !_fusion_unwritten(fusion, op))
+		return 0;
+	_fusion_cover(fusion, op, true);
+	_fusion_link(fusion, op);
+	_fusion_check_writes(fusion, op);
+	fusion.ops.push_back(op);
+	return e.op = (uint32_t)fusion.ops.size();
+}
+
+// Builds the dropped operation ops[index - 1] again from memory as it is now, or turns it into
+// a FUSED_LIVE once it was dropped too often or what is there now can't be one. Its cells were
+// code already, so that can't make a write some other operation doesn't check reach code.
+template <typename T>
+void _fusion_rebuild(subleq_fusion<T>& fusion, const subleq<T>* state, const uint32_t index, const uint8_t* stop_at, const uint8_t* watch)
+{
+	subleq_fused_op<T>& op = fusion.ops[index - 1];
+	subleq_fused_op<T> made;
+	if (op.rewrites < fused_max_rewrites && _fusion_make(state, op.start, made, op.built, stop_at, watch))
+	{
+		made.built = op.built;
+		made.rewrites = op.rewrites;
+		op = made;
+		_fusion_cover(fusion, op, true);
+	}
+	else
+	{
+		op.kind = FUSED_LIVE;
+		op.length = 1;
+		op.valid = true;
+		op.next = (T)(op.start + sizeof(T) * 3);
+		if (_subleq_in_bounds(state, op.start + sizeof(T) * 2))
+			op.c = *(T*)(state->memory + op.start + sizeof(T) * 2);
+	}
+	_fusion_link(fusion, op);
+	_fusion_check_writes(fusion, op);
+}
+
+// Drops every operation overlapping a cell written at addr
+template <typename T>
+void _fusion_invalidate(subleq_fusion<T>& fusion, const size_t addr)
+{
+	const size_t written = addr / sizeof(T);
+	const size_t last = (addr + sizeof(T) - 1) / sizeof(T);
+	const size_t span = fused_max_len * 3;
+	for (size_t i = written >= span - 1 ? written - (span - 1) : 0; i <= last; ++i)
+	{
+		_fusion_cell* e = _fusion_at(fusion, i);
+		if (e == nullptr || e->op == 0)
+			continue;
+		subleq_fused_op<T>& op = fusion.ops[e->op - 1];
+		if (!op.valid || op.kind == FUSED_LIVE || i + op.length * 3 <= written)
+			continue;
+		_fusion_cover(fusion, op, false);
+		op.valid = false;
+		op.rewrites += op.rewrites < fused_max_rewrites;
+	}
+}
+
+template <typename T>
+inline void _fusion_on_write(subleq_fusion<T>& fusion, const size_t addr)
+{
+	if (addr + sizeof(T) <= fusion.code_begin || addr >= fusion.code_end)
+		return;
+	const _fusion_cell* e = _fusion_at(fusion, addr / sizeof(T));
+	if (e != nullptr && e->covered)
+		_fusion_invalidate(fusion, addr);
+	// An unaligned write touches two cells
+	else if (addr % sizeof(T) != 0 && (e = _fusion_at(fusion, addr / sizeof(T) + 1)) != nullptr && e->covered)
+		_fusion_invalidate(fusion, addr);
+}
+
+// Runs up to max_steps original instructions, returning how many were executed. Where there is
+// no operation, or the one there would go past max_steps, a single instruction is run in place.
+// Stops in front of any address flagged in stop_at, other than the one it starts on, and after
+// any write to a cell watch flags; both have to be the ones fusion was built with.
+template <typename T>
+uint64_t subleq_run_fused(subleq<T>* state, subleq_fusion<T>& fusion, uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	// Keep the hot state in locals, stores through memory could otherwise alias it
+	uint8_t* const memory = state->memory;
+	const size_t memsize = state->memsize;
+	subleq_dirty* const dirty = state->dirty;
+	const uint8_t* const watched = watch != nullptr ? watch->flags : nullptr;
+	subleq_fused_op<T>* ops = fusion.ops.data();
+	T ip = state->_ip;
+	uint64_t steps = 0;
+	bool fault = false;
+	uint32_t cur = (size_t)ip < memsize ? _fusion_find(fusion, (size_t)ip) : 0;
+	while (steps < max_steps && (size_t)ip < memsize)
+	{
+		subleq_fused_op<T>* op = cur != 0 ? &ops[cur - 1] : nullptr;
+		if (op != nullptr && op->valid && op->length <= max_steps - steps && op->kind != FUSED_LIVE)
+		{
+			bool taken = true;
+			switch (op->kind)
+			{
+			case FUSED_SUB:
+			{
+				T& mb = *(T*)(memory + op->b[0]);
+				mb = _subleq_sub(mb, *(T*)(memory + op->a[0]));
+				taken = mb <= 0;
+				break;
+			}
+			case FUSED_CLR:
+				for (uint8_t i = 0; i < op->length; ++i)
+					*(T*)(memory + op->b[i]) = 0;
+				break;
+			case FUSED_ADD:
+			{
+				T& mz = *(T*)(memory + op->b[0]);
+				T& mb = *(T*)(memory + op->b[1]);
+				mb = _subleq_sub(mb, _subleq_sub(mz, *(T*)(memory + op->a[0])));
+				mz = 0;
+				break;
+			}
+			case FUSED_MOV:
+			{
+				T& mz = *(T*)(memory + op->b[1]);
+				*(T*)(memory + op->b[0]) = _subleq_sub(*(T*)(memory + op->a[1]), mz);
+				mz = 0;
+				break;
+			}
+			case FUSED_OUT:
+				state->_ip = ip;
+				if (FN_OnOutput != nullptr)
+					FN_OnOutput(state, *(T*)(memory + op->a[0]), state->_ip, userarg);
+				break;
+			case FUSED_IN:
+				*(T*)(memory + op->b[0]) = _subleq_input<T>(state->input);
+				break;
+			default:
+			{
+				T result = 0;
+				for (uint8_t i = 0; i < op->length; ++i)
+				{
+					T& mb = *(T*)(memory + op->b[i]);
+					result = mb = _subleq_sub(mb, *(T*)(memory + op->a[i]));
+				}
+				taken = result <= 0;
+				break;
+			}
+			}
+			// Operations never write their own instructions, so op stays valid
+			if (op->smc)
+				for (uint8_t i = 0; i < op->length; ++i)
+					_fusion_on_write(fusion, op->b[i]);
+			if (dirty != nullptr && op->kind != FUSED_OUT)
+				for (uint8_t i = 0; i < op->length; ++i)
+					_subleq_dirty_write<T>(dirty, op->b[i]);
+			steps += op->length;
+			uint32_t& link = taken ? op->taken : op->fall;
+			ip = taken ? op->c : op->next;
+			if ((size_t)ip >= memsize)
+				break;
+			// Code that got its operation after op was linked
+			if (link == 0)
+				link = _fusion_find(fusion, (size_t)ip);
+			cur = link;
+			if (stop_at != nullptr && stop_at[(size_t)ip])
+				break;
+			continue;
+		}
+
+		const size_t at = (size_t)ip;
+		if (op != nullptr && !op->valid)
+		{
+			_fusion_rebuild(fusion, state, cur, stop_at, watched);
+			continue;
+		}
+		if (op == nullptr && at % sizeof(T) == 0 && (cur = _fusion_extend(fusion, state, at, stop_at, watched)) != 0)
+		{
+			ops = fusion.ops.data();
+			continue;
+		}
+
+		if (!_subleq_in_bounds(state, at + sizeof(T) * 2))
+		{
+			fault = true;
+			break;
+		}
+		const T a = *(T*)(memory + at);
+		const T b = *(T*)(memory + at + sizeof(T));
+		const T c = *(T*)(memory + at + sizeof(T) * 2);
+		const size_t a_addr = _subleq_addr(a);
+		const size_t b_addr = _subleq_addr(b);
+		if (b == ((T)(-1)))
+		{
+			if (!_subleq_in_bounds(state, a_addr))
+			{
+				fault = true;
+				break;
+			}
+			state->_ip = ip;
+			if (FN_OnOutput != nullptr)
+				FN_OnOutput(state, *(T*)(memory + a_addr), state->_ip, userarg);
+			ip = c;
+		}
+		else if (!_subleq_in_bounds(state, b_addr) || (a != ((T)(-1)) && !_subleq_in_bounds(state, a_addr)))
+		{
+			fault = true;
+			break;
+		}
+		else
+		{
+			T& mb = *(T*)(memory + b_addr);
+			if (a == ((T)(-1)))
+			{
+				mb = _subleq_input<T>(state->input);
+				ip = c;
+			}
+			else
+			{
+				mb = _subleq_sub(mb, *(T*)(memory + a_addr));
+				ip = mb <= 0 ? c : (T)(at + sizeof(T) * 3);
+			}
+			_fusion_on_write(fusion, b_addr);
+			if (dirty != nullptr)
+				_subleq_dirty_write<T>(dirty, b_addr);
+		}
+		++steps;
+		if (b != ((T)(-1)) && watch != nullptr && _subleq_watch_write<T>(watch, b_addr, at))
+			break;
+		if ((size_t)ip >= memsize)
+			break;
+		// A live operation still links to where its instruction went last time
+		if (op != nullptr && op->kind == FUSED_LIVE && (ip == op->c || ip == op->next))
+		{
+			uint32_t& link = ip == op->c ? op->taken : op->fall;
+			if (link == 0)
+				link = _fusion_find(fusion, (size_t)ip);
+			cur = link;
+		}
+		else
+			cur = _fusion_find(fusion, (size_t)ip);
+		if (stop_at != nullptr && stop_at[(size_t)ip])
+			break;
+	}
+	state->_ip = ip;
+	state->running = !fault && (size_t)ip < memsize;
+	return steps;
+}
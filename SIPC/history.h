@@ -0,0 +1,300 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <vector>
+#include "subleq.h"
+#include "savepoint.h"
+
+// Execution history for stepping backwards. Every instruction writes at most one cell, so
+// logging the ip, b and the value b held before is enough to undo it. The log is kept in
+// fixed size chunks, and every so often a checkpoint of the whole machine starts a new
+// segment, so jumping far back restores a checkpoint instead of undoing every entry.
+const size_t history_chunk_entries = 1 << 16;
+// Oldest segments are dropped once the log holds more than this
+const size_t history_max_bytes = 64 << 20;
+
+template <typename T>
+struct subleq_history_entry
+{
+	T ip;
+	T b;			// -1 for an output instruction, which writes nothing
+	T old;
+};
+
+template <typename T>
+struct _history_segment
+{
+	uint64_t first_step;
+	subleq_savepoint<T> checkpoint;
+	// All but the last chunk are full
+	std::vector<std::unique_ptr<subleq_history_entry<T>[]>> chunks;
+};
+
+template <typename T>
+struct subleq_history
+{
+	std::deque<_history_segment<T>> segments;
+	// Where the next entry goes in the last chunk of the last segment
+	subleq_history_entry<T>* begin = nullptr;
+	subleq_history_entry<T>* cur = nullptr;
+	subleq_history_entry<T>* end = nullptr;
+	size_t chunks_per_segment = 1;
+	uint64_t max_entries = 0;
+	// Kept when stepping back empties a chunk, so going back and forth over the edge of one
+	// doesn't allocate every time
+	std::unique_ptr<subleq_history_entry<T>[]> spare;
+};
+
+template <typename T>
+void _history_use_chunk(subleq_history<T>* history, std::unique_ptr<subleq_history_entry<T>[]>& chunk, const size_t used)
+{
+	history->begin = chunk.get();
+	history->cur = chunk.get() + used;
+	history->end = chunk.get() + history_chunk_entries;
+}
+
+template <typename T>
+void _history_add_chunk(subleq_history<T>* history)
+{
+	std::unique_ptr<subleq_history_entry<T>[]> chunk = std::move(history->spare);
+	if (chunk == nullptr)
+		chunk.reset(new subleq_history_entry<T>[history_chunk_entries]);
+	std::vector<std::unique_ptr<subleq_history_entry<T>[]>>& chunks = history->segments.back().chunks;
+	chunks.push_back(std::move(chunk));
+	_history_use_chunk(history, chunks.back(), 0);
+}
+
+template <typename T>
+uint64_t subleq_history_step(const subleq_history<T>* history)
+{
+	const _history_segment<T>& seg = history->segments.back();
+	return seg.first_step + (seg.chunks.size() - 1) * history_chunk_entries + (history->cur - history->begin);
+}
+
+// The oldest step that can still be gone back to
+template <typename T>
+uint64_t subleq_history_first_step(const subleq_history<T>* history)
+{ return history->segments.front().first_step; }
+
+template <typename T>
+void _history_start_segment(subleq_history<T>* history, const subleq<T>* state, const uint64_t step)
+{
+	const subleq_savepoint<T>* parent = history->segments.empty() ? nullptr : &history->segments.back().checkpoint;
+	_history_segment<T> seg;
+	seg.first_step = step;
+	seg.checkpoint = subleq_savepoint_capture(state, parent);
+	history->segments.push_back(std::move(seg));
+	_history_add_chunk(history);
+}
+
+// Called when the current chunk is full, state must not have executed the next step yet
+template <typename T>
+void _subleq_history_next_chunk(subleq_history<T>* history, const subleq<T>* state)
+{
+	if (history->segments.back().chunks.size() < history->chunks_per_segment)
+	{
+		_history_add_chunk(history);
+		return;
+	}
+	const uint64_t step = subleq_history_step(history);
+	_history_start_segment(history, state, step);
+	while (history->segments.size() > 1 && step - history->segments.front().first_step > history->max_entries)
+		history->segments.pop_front();
+}
+
+// Forgets everything and starts again at step 0 from state
+template <typename T>
+void subleq_history_clear(subleq_history<T>* history, const subleq<T>* state)
+{
+	history->segments.clear();
+	_history_start_segment(history, state, 0);
+}
+
+template <typename T>
+subleq_history<T>* create_subleq_history(const subleq<T>* state)
+{
+	subleq_history<T>* history = new subleq_history<T>();
+	history->max_entries = history_max_bytes / sizeof(subleq_history_entry<T>);
+	// Taking a checkpoint compares all of memory when writes aren't tracked, so they are
+	// spaced out to about one step per byte, but never so far apart that the log holds fewer than four segments
+	const size_t max_chunks = (size_t)(history->max_entries / history_chunk_entries);
+	size_t chunks = state->memsize / history_chunk_entries;
+	if (chunks > max_chunks / 4) chunks = max_chunks / 4;
+	history->chunks_per_segment = chunks > 1 ? chunks : 1;
+	subleq_history_clear(history, state);
+	return history;
+}
+
+template <typename T>
+void destroy_subleq_history(subleq_history<T>* history)
+{ delete history; }
+
+// Same as subleq_step, but logs the instruction first. Faults change nothing and aren't logged.
+template <typename T>
+inline bool subleq_step_recorded(subleq<T>* state, subleq_history<T>* history, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	state->running = (size_t)state->_ip < state->memsize;
+	if (!state->running)
+		return false;
+	const size_t ip = (size_t)state->_ip;
+	if (!_subleq_in_bounds(state, ip + sizeof(T) * 2))
+		return state->running = false;
+	const T a = *(T*)(state->memory + ip);
+	const T b = *(T*)(state->memory + ip + sizeof(T));
+	const T c = *(T*)(state->memory + ip + sizeof(T) * 2);
+	const size_t a_addr = _subleq_addr(a);
+	const bool in = a == ((T)(-1)) && b != ((T)(-1));
+	if (!in && !_subleq_in_bounds(state, a_addr))
+		return state->running = false;
+
+	if (history->cur == history->end)
+		_subleq_history_next_chunk(history, state);
+	subleq_history_entry<T>* e = history->cur;
+	e->ip = state->_ip;
+	e->b = b;
+	if (b == ((T)(-1)))
+	{
+		e->old = 0;
+		history->cur++;
+		if (FN_OnOutput != nullptr)
+			FN_OnOutput(state, *(T*)(state->memory + a_addr), state->_ip, userarg);
+		state->_ip = c;
+	}
+	else
+	{
+		const size_t b_addr = _subleq_addr(b);
+		if (!_subleq_in_bounds(state, b_addr))
+			return state->running = false;
+		T& mb = *(T*)(state->memory + b_addr);
+		e->old = mb;
+		history->cur++;
+		if (state->dirty != nullptr)
+			_subleq_dirty_write<T>(state->dirty, b_addr);
+		if (in)
+		{
+			mb = _subleq_input<T>(state->input);
+			state->_ip = c;
+		}
+		else
+		{
+			mb = _subleq_sub(mb, *(T*)(state->memory + a_addr));
+			if (mb <= 0) state->_ip = c;
+			else state->_ip += sizeof(T) * 3;
+		}
+	}
+
+	state->running = (size_t)state->_ip < state->memsize;
+	return state->running;
+}
+
+// Runs up to max_steps logged instructions, returning how many were executed. Stops in front
+// of any address flagged in stop_at, other than the one it starts on, and after any write to
+// a cell watch flags. The write is read back from the log entry the step just made.
+template <typename T>
+uint64_t subleq_run_recorded(subleq<T>* state, subleq_history<T>* history, const uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	uint64_t steps = 0;
+	while (steps < max_steps)
+	{
+		const subleq_history_entry<T>* const prev = history->cur;
+		const bool more = subleq_step_recorded(state, history, FN_OnOutput, userarg);
+		// The halting instruction still ran, a fault didn't
+		if (!more && (size_t)state->_ip < state->memsize)
+			break;
+		++steps;
+		if (watch != nullptr && history->cur != prev)
+		{
+			const subleq_history_entry<T>* e = history->cur - 1;
+			if (e->b != ((T)(-1)) && _subleq_watch_write<T>(watch, _subleq_addr(e->b), (size_t)e->ip))
+				break;
+		}
+		if (!more || (stop_at != nullptr && stop_at[(size_t)state->_ip]))
+			break;
+	}
+	return steps;
+}
+
+// Undoes the last logged instruction, returning its entry or nullptr at the oldest step. An
+// input instruction that read a byte puts it back into the machine's input. If wrote isn't
+// nullptr it receives the value the instruction wrote, for entries that aren't output.
+template <typename T>
+const subleq_history_entry<T>* subleq_history_back(subleq_history<T>* history, subleq<T>* state, T* wrote=nullptr)
+{
+	if (history->cur == history->begin)
+	{
+		_history_segment<T>& seg = history->segments.back();
+		if (seg.chunks.size() > 1)
+		{
+			history->spare = std::move(seg.chunks.back());
+			seg.chunks.pop_back();
+		}
+		// An empty segment's checkpoint is the state it is in now
+		else if (history->segments.size() > 1)
+			history->segments.pop_back();
+		else return nullptr;
+		_history_use_chunk(history, history->segments.back().chunks.back(), history_chunk_entries);
+	}
+
+	const subleq_history_entry<T>* e = --history->cur;
+	if (e->b != ((T)(-1)))
+	{
+		uint8_t* mb = state->memory + _subleq_addr(e->b);
+		T value;
+		memcpy(&value, mb, sizeof(T));
+		memcpy(mb, &e->old, sizeof(T));
+		if (state->dirty != nullptr)
+			_subleq_dirty_write<T>(state->dirty, _subleq_addr(e->b));
+		// With the write undone the instruction reads as it did when it ran
+		if (state->input != nullptr && value != ((T)(-1)) && *(T*)(state->memory + (size_t)e->ip) == ((T)(-1)))
+			subleq_source_unget(state->input);
+		if (wrote != nullptr)
+			*wrote = value;
+	}
+	state->_ip = e->ip;
+	state->running = true;
+	return e;
+}
+
+// Goes back to step target, or the oldest step still logged if that is later. A segment
+// that lies entirely after target is skipped by restoring its checkpoint when that is
+// cheaper than undoing its entries, which puts the input back to where it was read up to.
+// Returns how many output instructions were undone.
+template <typename T>
+uint64_t subleq_history_rewind(subleq_history<T>* history, subleq<T>* state, uint64_t target)
+{
+	if (target < subleq_history_first_step(history))
+		target = subleq_history_first_step(history);
+	uint64_t outputs = 0;
+	uint64_t step = subleq_history_step(history);
+	while (step > target)
+	{
+		_history_segment<T>& seg = history->segments.back();
+		// Restoring can compare every byte of memory, undoing touches one cell per entry
+		if (seg.first_step < target || step - seg.first_step < state->memsize / 32)
+		{
+			const subleq_history_entry<T>* e = subleq_history_back(history, state);
+			outputs += e->b == ((T)(-1));
+			--step;
+			continue;
+		}
+
+		for (const std::unique_ptr<subleq_history_entry<T>[]>& chunk : seg.chunks)
+		{
+			const subleq_history_entry<T>* last = chunk.get() == history->begin ? history->cur : chunk.get() + history_chunk_entries;
+			for (const subleq_history_entry<T>* e = chunk.get(); e != last; ++e)
+				outputs += e->b == ((T)(-1));
+		}
+		subleq_savepoint_apply(seg.checkpoint, state);
+		step = seg.first_step;
+		if (history->segments.size() == 1)
+		{
+			seg.chunks.resize(1);
+			_history_use_chunk(history, seg.chunks.back(), 0);
+			break;
+		}
+		history->segments.pop_back();
+		_history_use_chunk(history, history->segments.back().chunks.back(), history_chunk_entries);
+	}
+	state->running = (size_t)state->_ip < state->memsize;
+	return outputs;
+}
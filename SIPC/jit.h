@@ -0,0 +1,664 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include "subleq.h"
+#include "analysis.h"
+
+// Translates SUBLEQ code into x86-64 blocks of straight-line instructions.
+// Each block ends at an output instruction, at the fall-through into a branch target
+// of the block, at a stop address or after jit_max_block_len instructions.
+// Blocks jump straight into each other once both are compiled, and a per-cell count of
+// the blocks covering each cell lets every store check for self-modification. Stores that
+// an analysis of the program proves can't land in code leave the check out.
+#if defined(_M_X64) || defined(__x86_64__)
+#define SUBLEQ_JIT_SUPPORTED 1
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#else
+#define SUBLEQ_JIT_SUPPORTED 0
+#endif
+
+const size_t jit_max_block_len = 32;
+const size_t jit_code_size = 16 * 1024 * 1024;
+// A block is only compiled if at least this much code space is left
+const size_t jit_block_reserve = 8 * 1024;
+// Code that is dropped for being written to this often is left to the interpreter
+const uint8_t jit_max_rewrites = 8;
+// Blocks are indexed by the ip they start at in pages of this many bytes, only allocated
+// for pages code was compiled or dropped in
+const size_t jit_page_bits = 12;
+const size_t jit_page_size = (size_t)1 << jit_page_bits;
+
+enum JIT_EXIT : uint32_t
+{
+	JIT_EXIT_BLOCK,		// Jumped to exit_ip, which has no compiled block (or must not be chained to)
+	JIT_EXIT_BUDGET,	// Not enough steps left to run the block at exit_ip
+	JIT_EXIT_OUTPUT,	// Output memory[exit_addr] for the instruction at exit_from, continue at exit_ip
+	JIT_EXIT_SMC,		// The instruction at exit_from wrote into compiled code or a watched cell at exit_addr, continue at exit_ip
+};
+
+// Shared with the generated code, the offsets are baked into the trampoline and exit stubs
+struct _jit_ctx
+{
+	uint8_t* mem;		// 0
+	uint8_t* code_map;	// 8
+	uint64_t budget;	// 16
+	int64_t exit_ip;	// 24
+	uint64_t exit_addr;	// 32
+	int64_t exit_from;	// 40
+};
+
+// A rel32 jump that is either linked to a block or points at its exit stub
+struct _jit_link
+{
+	uint8_t* site;
+	uint8_t* stub;
+};
+
+struct _jit_block
+{
+	size_t start;
+	size_t end;
+	size_t length;
+	uint8_t* code;
+	uint8_t* code_end;
+	std::vector<_jit_link> incoming;
+	// Where this block's chained or waiting edges lead, so they can be unlinked when it dies
+	std::vector<size_t> targets;
+};
+
+struct _jit_slot
+{
+	_jit_block* block;		// The block starting at this ip, nullptr if there is none
+	uint8_t rewrites;		// How often a block starting here was dropped by a write into it
+};
+
+template <typename T>
+struct subleq_jit
+{
+	size_t memsize = 0;
+	uint8_t* code = nullptr;
+	size_t code_used = 0;
+	uint8_t* trampoline = nullptr;
+	uint8_t* epilogue = nullptr;
+	size_t code_start = 0;
+	// Number of blocks covering each cell of memory, read by the generated stores. calloc
+	// leaves the pages of it that no code is compiled over untouched.
+	uint8_t* code_map = nullptr;
+	// Indexed by ip >> jit_page_bits, empty for pages without code
+	std::vector<std::vector<_jit_slot>> slots;
+	// Jumps waiting for a block to be compiled at an ip
+	std::unordered_map<size_t, std::vector<_jit_link>> pending;
+	// The watch flags the blocks were compiled against, writes to watched cells always exit
+	const uint8_t* watch_flags = nullptr;
+	// Set by subleq_jit_set_analysis, stores outside its code are compiled without the check
+	const subleq_analysis* analysis = nullptr;
+	_jit_ctx ctx{};
+};
+
+typedef uint32_t (*_jit_entry_fn)(_jit_ctx* ctx, const uint8_t* block);
+
+struct _jit_emitter
+{
+	uint8_t* p;
+	void b(const uint8_t x) { *p++ = x; }
+	void bs(std::initializer_list<uint8_t> xs) { for (uint8_t x : xs) *p++ = x; }
+	void d32(const int32_t x) { memcpy(p, &x, 4); p += 4; }
+	void q64(const uint64_t x) { memcpy(p, &x, 8); p += 8; }
+	// Emits a rel32 placeholder and returns its address
+	uint8_t* rel32() { uint8_t* site = p; d32(0); return site; }
+};
+
+inline void _jit_patch(uint8_t* site, const uint8_t* target)
+{
+	const int32_t rel = (int32_t)(target - (site + 4));
+	memcpy(site, &rel, 4);
+}
+
+// Operand size prefix for a T-sized operation on rax
+template <typename T>
+inline void _jit_size_prefix(_jit_emitter& e)
+{
+	if (sizeof(T) == 2) e.b(0x66);
+	else if (sizeof(T) == 8) e.b(0x48);
+}
+
+// op r, [rbx + disp32] (or [rbx + disp32], r) using the 8-bit or full-width opcode
+template <typename T>
+inline void _jit_rbx_op(_jit_emitter& e, const uint8_t op8, const uint8_t op, const size_t disp)
+{
+	_jit_size_prefix<T>(e);
+	e.b(sizeof(T) == 1 ? op8 : op);
+	e.b(0x83);
+	e.d32((int32_t)disp);
+}
+
+// mov rcx, imm64 ; mov [r14 + off], rcx
+inline void _jit_store_ctx(_jit_emitter& e, const uint8_t off, const uint64_t value)
+{
+	e.bs({ 0x48, 0xB9 }); e.q64(value);
+	e.bs({ 0x49, 0x89, 0x4E, off });
+}
+
+// mov eax, status ; jmp epilogue
+template <typename T>
+inline void _jit_exit(subleq_jit<T>* jit, _jit_emitter& e, const JIT_EXIT status)
+{
+	e.b(0xB8); e.d32((int32_t)status);
+	e.b(0xE9); _jit_patch(e.rel32(), jit->epilogue);
+}
+
+inline bool _jit_alloc(uint8_t** code)
+{
+#if SUBLEQ_JIT_SUPPORTED
+#ifdef _WIN32
+	*code = (uint8_t*)VirtualAlloc(nullptr, jit_code_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	return *code != nullptr;
+#else
+	void* p = mmap(nullptr, jit_code_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	*code = p == MAP_FAILED ? nullptr : (uint8_t*)p;
+	return *code != nullptr;
+#endif
+#else
+	*code = nullptr;
+	return false;
+#endif
+}
+
+inline void _jit_free(uint8_t* code)
+{
+#if SUBLEQ_JIT_SUPPORTED
+#ifdef _WIN32
+	VirtualFree(code, 0, MEM_RELEASE);
+#else
+	munmap(code, jit_code_size);
+#endif
+#endif
+}
+
+// The slot of ip, nullptr if its page has none
+template <typename T>
+inline _jit_slot* _jit_slot_at(subleq_jit<T>* jit, const size_t ip)
+{
+	std::vector<_jit_slot>& page = jit->slots[ip >> jit_page_bits];
+	return page.empty() ? nullptr : &page[ip & (jit_page_size - 1)];
+}
+
+template <typename T>
+inline _jit_slot& _jit_slot_alloc(subleq_jit<T>* jit, const size_t ip)
+{
+	std::vector<_jit_slot>& page = jit->slots[ip >> jit_page_bits];
+	if (page.empty())
+		page.resize(jit_page_size, _jit_slot{ nullptr, 0 });
+	return page[ip & (jit_page_size - 1)];
+}
+
+// The block starting at ip, nullptr if none does
+template <typename T>
+inline _jit_block* _jit_block_at(subleq_jit<T>* jit, const size_t ip)
+{
+	const _jit_slot* slot = _jit_slot_at(jit, ip);
+	return slot != nullptr ? slot->block : nullptr;
+}
+
+// The cells of the code map holding [start, end)
+template <typename T>
+inline size_t _jit_first_cell(const size_t start) { return start / sizeof(T); }
+template <typename T>
+inline size_t _jit_end_cell(const size_t end) { return (end + sizeof(T) - 1) / sizeof(T); }
+
+// Drops every compiled block, call this after memory or the stop addresses change. Returns
+// false if there was no memory for the code map of a new memsize, nothing is compiled then.
+template <typename T>
+bool subleq_jit_flush(subleq_jit<T>* jit, const size_t memsize)
+{
+	for (std::vector<_jit_slot>& page : jit->slots)
+		for (_jit_slot& slot : page)
+		{
+			if (slot.block == nullptr)
+				continue;
+			if (jit->code_map != nullptr)
+				memset(jit->code_map + _jit_first_cell<T>(slot.block->start), 0, _jit_end_cell<T>(slot.block->end) - _jit_first_cell<T>(slot.block->start));
+			delete slot.block;
+			slot.block = nullptr;
+		}
+	jit->pending.clear();
+	jit->code_used = jit->code_start;
+	// The rewrite counts are kept across flushes, code that rewrites itself keeps doing so
+	if (memsize == jit->memsize && jit->code_map != nullptr)
+		return true;
+	jit->memsize = memsize;
+	jit->slots.clear();
+	jit->slots.resize((memsize + jit_page_size - 1) >> jit_page_bits);
+	free(jit->code_map);
+	jit->code_map = (uint8_t*)calloc(_jit_end_cell<T>(memsize) + 1, 1);
+	return jit->code_map != nullptr;
+}
+
+// Lets blocks leave out the self-modification check on stores the analysis proves can't land
+// in reachable code. Only a closed analysis of the machine's current memory is used, and the
+// JIT goes back to checking every store once it has to compile code the analysis didn't reach.
+// an must outlive its use, pass nullptr to drop it before memory is changed outside of running.
+template <typename T>
+void subleq_jit_set_analysis(subleq_jit<T>* jit, const subleq_analysis* an)
+{
+	jit->analysis = an != nullptr && an->closed && an->memsize == jit->memsize ? an : nullptr;
+	subleq_jit_flush(jit, jit->memsize);
+}
+
+template <typename T>
+void destroy_subleq_jit(subleq_jit<T>* jit)
+{
+	if (jit == nullptr)
+		return;
+	for (std::vector<_jit_slot>& page : jit->slots)
+		for (_jit_slot& slot : page)
+			delete slot.block;
+	free(jit->code_map);
+	if (jit->code != nullptr)
+		_jit_free(jit->code);
+	delete jit;
+}
+
+// Returns nullptr when this platform has no JIT or executable memory could not be allocated
+template <typename T>
+subleq_jit<T>* create_subleq_jit(const subleq<T>* state)
+{
+	// Operands are addressed as [base + disp32]
+	if (state->memsize > INT32_MAX - 16)
+		return nullptr;
+	uint8_t* code;
+	if (!_jit_alloc(&code))
+		return nullptr;
+
+	subleq_jit<T>* jit = new subleq_jit<T>();
+	jit->code = code;
+	_jit_emitter e{ code };
+
+	// Trampoline: saves callee-saved registers, loads rbx = memory, r12 = budget,
+	// r13 = code map, r14 = ctx and jumps into the block given as the second argument
+	jit->trampoline = e.p;
+	e.bs({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56 });
+#ifdef _WIN32
+	e.bs({ 0x57, 0x56 });
+	e.bs({ 0x49, 0x89, 0xCE });					// mov r14, rcx
+#else
+	e.bs({ 0x49, 0x89, 0xFE });					// mov r14, rdi
+#endif
+	e.bs({ 0x49, 0x8B, 0x5E, 0x00 });			// mov rbx, [r14]
+	e.bs({ 0x4D, 0x8B, 0x6E, 0x08 });			// mov r13, [r14 + 8]
+	e.bs({ 0x4D, 0x8B, 0x66, 0x10 });			// mov r12, [r14 + 16]
+#ifdef _WIN32
+	e.bs({ 0xFF, 0xE2 });						// jmp rdx
+#else
+	e.bs({ 0xFF, 0xE6 });						// jmp rsi
+#endif
+
+	// Epilogue: every exit stub lands here with its status in eax
+	jit->epilogue = e.p;
+	e.bs({ 0x4D, 0x89, 0x66, 0x10 });			// mov [r14 + 16], r12
+#ifdef _WIN32
+	e.bs({ 0x5E, 0x5F });
+#endif
+	e.bs({ 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+
+	jit->code_start = e.p - code;
+	if (!subleq_jit_flush(jit, state->memsize))
+	{
+		destroy_subleq_jit(jit);
+		return nullptr;
+	}
+	return jit;
+}
+
+template <typename T>
+void _jit_kill_block(subleq_jit<T>* jit, _jit_block* blk)
+{
+	for (size_t i = _jit_first_cell<T>(blk->start); i < _jit_end_cell<T>(blk->end); ++i)
+		jit->code_map[i]--;
+	// Forget the edges out of this block first, or code that keeps rewriting itself piles up
+	// dead links on the blocks it jumps to
+	const auto dead = [blk](const _jit_link& l) { return l.site >= blk->code && l.site < blk->code_end; };
+	for (const size_t target : blk->targets)
+	{
+		if (_jit_block* to = _jit_block_at(jit, target))
+			std::erase_if(to->incoming, dead);
+		else
+		{
+			auto it = jit->pending.find(target);
+			if (it != jit->pending.end() && std::erase_if(it->second, dead) != 0 && it->second.empty())
+				jit->pending.erase(it);
+		}
+	}
+	std::vector<_jit_link>& waiting = jit->pending[blk->start];
+	for (const _jit_link& l : blk->incoming)
+	{
+		_jit_patch(l.site, l.stub);
+		waiting.push_back(l);
+	}
+	_jit_slot_at(jit, blk->start)->block = nullptr;
+	delete blk;
+}
+
+// Drops every block whose code overlaps a cell written at addr
+template <typename T>
+void _jit_invalidate(subleq_jit<T>* jit, const size_t addr)
+{
+	const size_t span = jit_max_block_len * sizeof(T) * 3;
+	const size_t first = addr >= span ? addr - span + 1 : 0;
+	const size_t last = addr + sizeof(T) < jit->memsize ? addr + sizeof(T) : jit->memsize;
+	for (size_t i = first; i < last; ++i)
+	{
+		_jit_slot* slot = _jit_slot_at(jit, i);
+		if (slot != nullptr && slot->block != nullptr && slot->block->end > addr)
+		{
+			slot->rewrites += slot->rewrites < jit_max_rewrites;
+			_jit_kill_block(jit, slot->block);
+		}
+	}
+}
+
+template <typename T>
+inline bool _jit_covers_code(const subleq_jit<T>* jit, const size_t addr)
+{
+	// An unaligned cell overlaps two
+	return jit->code_map[_jit_first_cell<T>(addr)] != 0 || jit->code_map[_jit_end_cell<T>(addr + sizeof(T)) - 1] != 0;
+}
+
+// Emits a jmp for an edge to target, which is chained or given an exit stub once the block is laid out
+template <typename T>
+void _jit_emit_edge(_jit_emitter& e, std::vector<std::pair<uint8_t*, T>>& edges, const T target)
+{
+	e.b(0xE9);
+	edges.emplace_back(e.rel32(), target);
+}
+
+template <typename T>
+_jit_block* _jit_compile(subleq_jit<T>* jit, const subleq<T>* state, const size_t start, const uint8_t* stop_at)
+{
+	if (jit_code_size - jit->code_used < jit_block_reserve)
+		subleq_jit_flush(jit, jit->memsize);
+	// Code the analysis didn't reach may be where one of the unchecked stores lands
+	if (jit->analysis != nullptr && (jit->analysis->memsize != jit->memsize || subleq_analysis_node(jit->analysis, start) == nullptr))
+	{
+		jit->analysis = nullptr;
+		subleq_jit_flush(jit, jit->memsize);
+	}
+
+	// Collect the straight-line run of instructions
+	subleq_decoded<T> instrs[jit_max_block_len];
+	size_t ips[jit_max_block_len];
+	size_t n = 0;
+	size_t ip = start;
+	while (n < jit_max_block_len)
+	{
+		if (n != 0 && stop_at != nullptr && stop_at[ip])
+			break;
+		subleq_decoded<T>& d = instrs[n];
+		d.op = SUBLEQ_OP_FAULT;
+		if (!_subleq_in_bounds(state, ip + sizeof(T) * 2))
+			break;
+		const T a = *(T*)(state->memory + ip);
+		const T b = *(T*)(state->memory + ip + sizeof(T));
+		d.a = _subleq_addr(a);
+		d.b = _subleq_addr(b);
+		d.c = *(T*)(state->memory + ip + sizeof(T) * 2);
+		d.next = (T)(ip + sizeof(T) * 3);
+		// Input is left to the interpreter
+		if (!_subleq_in_bounds(state, d.a) || (a == ((T)(-1)) && b != ((T)(-1))))
+			break;
+		if (b == ((T)(-1))) d.op = SUBLEQ_OP_OUT;
+		else if (_subleq_in_bounds(state, d.b)) d.op = SUBLEQ_OP_SUB;
+		else break;
+		const bool watched = d.op == SUBLEQ_OP_SUB && jit->watch_flags != nullptr &&
+			(jit->watch_flags[d.b] | jit->watch_flags[d.b + sizeof(T) - 1]);
+
+		bool overflow = false;
+		for (size_t i = _jit_first_cell<T>(ip); i < _jit_end_cell<T>(ip + sizeof(T) * 3); ++i)
+			overflow |= jit->code_map[i] == UINT8_MAX;
+		if (overflow)
+			break;
+
+		ips[n++] = ip;
+		if (d.op == SUBLEQ_OP_OUT || watched || !((size_t)d.next < state->memsize))
+			break;
+		bool is_target = false;
+		for (size_t i = 0; i < n; ++i)
+			is_target |= (size_t)instrs[i].c == (size_t)d.next;
+		if (is_target)
+			break;
+		ip = (size_t)d.next;
+	}
+	if (n == 0)
+		return nullptr;
+
+	_jit_block* blk = new _jit_block();
+	blk->start = start;
+	blk->end = ips[n - 1] + sizeof(T) * 3;
+	blk->length = n;
+	_jit_emitter e{ jit->code + jit->code_used };
+	blk->code = e.p;
+	std::vector<std::pair<uint8_t*, T>> edges;
+
+	// Charge the whole block up front, side exits give back what they skip
+	e.bs({ 0x49, 0x81, 0xEC }); e.d32((int32_t)n);			// sub r12, n
+	e.bs({ 0x0F, 0x82 }); uint8_t* budget_site = e.rel32();	// jb budget_stub
+
+	uint8_t* smc_sites[jit_max_block_len];
+	uint8_t* taken_sites[jit_max_block_len];
+	for (size_t k = 0; k < n; ++k)
+	{
+		const subleq_decoded<T>& d = instrs[k];
+		if (d.op == SUBLEQ_OP_OUT)
+		{
+			_jit_store_ctx(e, 32, d.a);
+			_jit_store_ctx(e, 24, (uint64_t)(int64_t)d.c);
+			_jit_store_ctx(e, 40, ips[k]);
+			_jit_exit(jit, e, JIT_EXIT_OUTPUT);
+			break;
+		}
+		_jit_rbx_op<T>(e, 0x8A, 0x8B, d.b);		// mov r, [rbx + b]
+		_jit_rbx_op<T>(e, 0x2A, 0x2B, d.a);		// sub r, [rbx + a]
+		_jit_rbx_op<T>(e, 0x88, 0x89, d.b);		// mov [rbx + b], r
+
+		// A watched write ends the block and always leaves through its smc stub
+		if (jit->watch_flags != nullptr && (jit->watch_flags[d.b] | jit->watch_flags[d.b + sizeof(T) - 1]))
+		{
+			e.b(0xE9); smc_sites[k] = e.rel32();
+			taken_sites[k] = nullptr;
+			break;
+		}
+
+		// cmp byte [r13 + cell], 0 (word for an unaligned b, which spans two cells) ; jne smc_stub
+		smc_sites[k] = nullptr;
+		if (jit->analysis == nullptr || _analysis_any(jit->analysis, d.b, sizeof(T), ANALYSIS_CODE))
+		{
+			if (d.b % sizeof(T) == 0) e.bs({ 0x41, 0x80, 0xBD });
+			else e.bs({ 0x66, 0x41, 0x83, 0xBD });
+			e.d32((int32_t)_jit_first_cell<T>(d.b));
+			e.b(0x00);
+			e.bs({ 0x0F, 0x85 }); smc_sites[k] = e.rel32();
+		}
+
+		// test r, r ; jle taken_stub
+		_jit_size_prefix<T>(e);
+		e.bs({ sizeof(T) == 1 ? (uint8_t)0x84 : (uint8_t)0x85, 0xC0 });
+		e.bs({ 0x0F, 0x8E }); taken_sites[k] = e.rel32();
+
+		if (k == n - 1)
+			_jit_emit_edge(e, edges, d.next);
+	}
+
+	// Cold stubs
+	_jit_patch(budget_site, e.p);
+	e.bs({ 0x49, 0x81, 0xC4 }); e.d32((int32_t)n);			// add r12, n
+	_jit_store_ctx(e, 24, start);
+	_jit_exit(jit, e, JIT_EXIT_BUDGET);
+	for (size_t k = 0; k < n && instrs[k].op == SUBLEQ_OP_SUB; ++k)
+	{
+		const subleq_decoded<T>& d = instrs[k];
+		const int32_t skipped = (int32_t)(n - k - 1);
+
+		if (smc_sites[k] != nullptr)
+		{
+			_jit_patch(smc_sites[k], e.p);
+			if (skipped != 0) { e.bs({ 0x49, 0x81, 0xC4 }); e.d32(skipped); }
+			_jit_store_ctx(e, 32, d.b);
+			_jit_store_ctx(e, 40, ips[k]);
+			_jit_store_ctx(e, 24, (uint64_t)(int64_t)d.next);
+			_jit_size_prefix<T>(e);
+			e.bs({ sizeof(T) == 1 ? (uint8_t)0x84 : (uint8_t)0x85, 0xC0 });	// test r, r
+			e.bs({ 0x7F, 14 });												// jg over the next store
+			_jit_store_ctx(e, 24, (uint64_t)(int64_t)d.c);
+			_jit_exit(jit, e, JIT_EXIT_SMC);
+		}
+
+		if (taken_sites[k] == nullptr)
+			continue;
+		_jit_patch(taken_sites[k], e.p);
+		if (skipped != 0) { e.bs({ 0x49, 0x81, 0xC4 }); e.d32(skipped); }
+		_jit_emit_edge(e, edges, d.c);
+	}
+
+	// Every edge gets an exit stub, and is chained to its target when it can be
+	for (const std::pair<uint8_t*, T>& edge : edges)
+	{
+		const _jit_link link{ edge.first, e.p };
+		_jit_store_ctx(e, 24, (uint64_t)(int64_t)edge.second);
+		_jit_exit(jit, e, JIT_EXIT_BLOCK);
+		_jit_patch(link.site, link.stub);
+
+		const size_t target = (size_t)edge.second;
+		if (!(target < state->memsize) || (stop_at != nullptr && stop_at[target]))
+			continue;
+		if (std::find(blk->targets.begin(), blk->targets.end(), target) == blk->targets.end())
+			blk->targets.push_back(target);
+		if (_jit_block* to = _jit_block_at(jit, target))
+		{
+			_jit_patch(link.site, to->code);
+			to->incoming.push_back(link);
+		}
+		else
+			jit->pending[target].push_back(link);
+	}
+	jit->code_used = e.p - jit->code;
+	blk->code_end = e.p;
+
+	for (size_t i = _jit_first_cell<T>(blk->start); i < _jit_end_cell<T>(blk->end); ++i)
+		jit->code_map[i]++;
+	_jit_slot_alloc(jit, start).block = blk;
+
+	// Link everything that was waiting for this block, including its own back edges
+	auto waiting = jit->pending.find(start);
+	if (waiting != jit->pending.end())
+	{
+		for (const _jit_link& l : waiting->second)
+		{
+			_jit_patch(l.site, blk->code);
+			blk->incoming.push_back(l);
+		}
+		jit->pending.erase(waiting);
+	}
+	return blk;
+}
+
+// Runs one instruction through subleq_step, dropping any blocks it writes into.
+// Returns true if the instruction executed (including one that halted the machine), and sets
+// written to the cell it wrote or SIZE_MAX.
+template <typename T>
+bool _jit_interp_step(subleq_jit<T>* jit, subleq<T>* state, size_t& written, subleq_output_fn<T> FN_OnOutput, void* userarg)
+{
+	const size_t ip = (size_t)state->_ip;
+	written = SIZE_MAX;
+	if (_subleq_in_bounds(state, ip + sizeof(T) * 2))
+	{
+		const T b = *(T*)(state->memory + ip + sizeof(T));
+		if (b != ((T)(-1)))
+			written = _subleq_addr(b);
+	}
+	const bool more = subleq_step(state, FN_OnOutput, userarg);
+	if (!more && (size_t)state->_ip < state->memsize)
+		return false;
+	if (written < jit->memsize && _jit_covers_code(jit, written))
+		_jit_invalidate(jit, written);
+	return true;
+}
+
+// Runs up to max_steps instructions, returning how many were executed.
+// Execution stops before any instruction whose stop_at flag is set (except the first one),
+// so callers can check breakpoints there, and right after a write to a cell watch flags.
+// stop_at and watch may be nullptr, and the blocks must be flushed with subleq_jit_flush
+// whenever the stop addresses, the watched cells or memory change outside of running.
+template <typename T>
+uint64_t subleq_jit_run(subleq_jit<T>* jit, subleq<T>* state, uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	const uint8_t* watch_flags = watch != nullptr ? watch->flags : nullptr;
+	bool interp_only = false;
+	if (jit->memsize != state->memsize || jit->watch_flags != watch_flags)
+	{
+		interp_only = !subleq_jit_flush(jit, state->memsize);
+		jit->watch_flags = watch_flags;
+	}
+	jit->ctx.mem = state->memory;
+	jit->ctx.code_map = jit->code_map;
+
+	uint64_t steps = 0;
+	bool first = true;
+	state->running = (size_t)state->_ip < state->memsize;
+	while (steps < max_steps && state->running)
+	{
+		const size_t ip = (size_t)state->_ip;
+		const bool at_stop = stop_at != nullptr && stop_at[ip];
+		if (at_stop && !first)
+			break;
+		first = false;
+
+		_jit_block* blk = nullptr;
+		const _jit_slot* slot = interp_only ? nullptr : _jit_slot_at(jit, ip);
+		if (!interp_only && !at_stop && (slot == nullptr || slot->rewrites < jit_max_rewrites))
+			blk = slot != nullptr && slot->block != nullptr ? slot->block : _jit_compile(jit, state, ip, stop_at);
+		if (blk == nullptr)
+		{
+			size_t written;
+			if (!_jit_interp_step(jit, state, written, FN_OnOutput, userarg))
+				break;
+			++steps;
+			if (watch != nullptr && written != SIZE_MAX && _subleq_watch_write<T>(watch, written, ip))
+				break;
+			continue;
+		}
+
+		jit->ctx.budget = max_steps - steps;
+		const uint32_t status = ((_jit_entry_fn)jit->trampoline)(&jit->ctx, blk->code);
+		steps = max_steps - jit->ctx.budget;
+
+		// The output callback sees ip at the output instruction, like it does from subleq_step
+		if (status == JIT_EXIT_OUTPUT)
+		{
+			state->_ip = (T)jit->ctx.exit_from;
+			if (FN_OnOutput != nullptr)
+				FN_OnOutput(state, *(T*)(state->memory + jit->ctx.exit_addr), state->_ip, userarg);
+		}
+		state->_ip = (T)jit->ctx.exit_ip;
+
+		if (status == JIT_EXIT_BUDGET)
+			interp_only = true;
+		else if (status == JIT_EXIT_SMC)
+		{
+			const size_t addr = (size_t)jit->ctx.exit_addr;
+			if (_jit_covers_code(jit, addr))
+				_jit_invalidate(jit, addr);
+			state->running = (size_t)state->_ip < state->memsize;
+			if (watch != nullptr && _subleq_watch_write<T>(watch, addr, (size_t)jit->ctx.exit_from))
+				break;
+		}
+		state->running = (size_t)state->_ip < state->memsize;
+	}
+	return steps;
+}
@@ -0,0 +1,439 @@
+#pragma once
+#include <stdlib.h>
+#include <vector>
+#include "subleq.h"
+#include "binfile.h"
+#include "sink.h"
+
+// A machine whose memory is split into pages that are only allocated once something other
+// than zero is written to them, so programs that use a few scattered regions of a huge
+// address space only pay for those. A two level table finds a page: the top bits of an
+// address pick a table from the directory, the middle bits a page from the table, and a
+// table is allocated with its first page. The page of the last instruction fetch and the
+// page of the last operand access are cached, so dense code mostly skips the table walk.
+const size_t paged_page_bits = 12;
+const size_t paged_table_bits = 12;
+const size_t paged_page_size = (size_t)1 << paged_page_bits;
+const size_t paged_table_size = (size_t)1 << paged_table_bits;
+// The directory has an entry per 16 MiB, which keeps it at 8 MiB of address space. It is
+// allocated zeroed, so the operating system only backs the parts that are used.
+const uint64_t paged_max_memsize = (uint64_t)1 << 44;
+
+enum PAGED_TLB : uint8_t
+{
+	PAGED_TLB_FETCH,	// The three cells of an instruction
+	PAGED_TLB_DATA,		// Its operands
+	PAGED_TLB_COUNT,
+};
+
+// A cached page, always an allocated one so writes can go straight through
+struct _paged_tlb
+{
+	size_t page = SIZE_MAX;
+	uint8_t* data = nullptr;
+};
+
+template <typename T>
+struct subleq_paged
+{
+	T _ip;
+	size_t memsize;
+	bool running;
+	subleq_source* input;
+	// Number of tables the directory has room for, each nullptr until one of its pages is
+	uint8_t*** directory;
+	size_t num_tables;
+	size_t num_pages;
+	// The page each kind of access went to last
+	_paged_tlb tlb[PAGED_TLB_COUNT];
+};
+
+// Same as subleq_output_fn, value is a copy of the cell being output
+template <typename T>
+using subleq_paged_output_fn = void (*)(subleq_paged<T>* state, T& value, const T& current_ip, void* userarg);
+
+// Returns nullptr if memory_size is above paged_max_memsize or the directory can't be allocated
+template <typename T>
+subleq_paged<T>* create_subleq_paged(const size_t memory_size)
+{
+	if ((uint64_t)memory_size > paged_max_memsize)
+		return nullptr;
+	const size_t table_span = paged_page_size * paged_table_size;
+	const size_t num_tables = (memory_size + table_span - 1) / table_span;
+	uint8_t*** directory = (uint8_t***)calloc(num_tables > 0 ? num_tables : 1, sizeof(uint8_t**));
+	if (directory == nullptr)
+		return nullptr;
+	subleq_paged<T>* x = (subleq_paged<T>*)malloc(sizeof(subleq_paged<T>));
+	if (x == nullptr)
+	{
+		free(directory);
+		return nullptr;
+	}
+	x->_ip = 0;
+	x->memsize = memory_size;
+	x->running = false;
+	x->input = nullptr;
+	x->directory = directory;
+	x->num_tables = num_tables;
+	x->num_pages = 0;
+	for (size_t k = 0; k < PAGED_TLB_COUNT; ++k)
+		x->tlb[k] = _paged_tlb();
+	return x;
+}
+
+template <typename T>
+void destroy_subleq_paged(subleq_paged<T>* state)
+{
+	if (state == nullptr)
+		return;
+	for (size_t t = 0; t < state->num_tables; ++t)
+	{
+		uint8_t** table = state->directory[t];
+		if (table == nullptr)
+			continue;
+		for (size_t p = 0; p < paged_table_size; ++p)
+			free(table[p]);
+		free(table);
+	}
+	free(state->directory);
+	free(state);
+}
+
+// Bytes of memory that have pages behind them
+template <typename T>
+size_t subleq_paged_resident(const subleq_paged<T>* state)
+{ return state->num_pages * paged_page_size; }
+
+template <typename T>
+inline bool _paged_in_bounds(const subleq_paged<T>* state, const size_t addr)
+{ return addr <= state->memsize && state->memsize - addr >= sizeof(T); }
+
+// The data of a page, nullptr if it was never written
+template <typename T>
+inline uint8_t* _paged_lookup(const subleq_paged<T>* state, const size_t page)
+{
+	uint8_t** table = state->directory[page >> paged_table_bits];
+	return table != nullptr ? table[page & (paged_table_size - 1)] : nullptr;
+}
+
+// The data of a page, allocating it zeroed if needed. nullptr when out of memory.
+template <typename T>
+uint8_t* _paged_alloc(subleq_paged<T>* state, const size_t page)
+{
+	uint8_t**& table = state->directory[page >> paged_table_bits];
+	if (table == nullptr && (table = (uint8_t**)calloc(paged_table_size, sizeof(uint8_t*))) == nullptr)
+		return nullptr;
+	uint8_t*& data = table[page & (paged_table_size - 1)];
+	if (data == nullptr && (data = (uint8_t*)calloc(1, paged_page_size)) != nullptr)
+		state->num_pages++;
+	return data;
+}
+
+template <typename T>
+inline uint8_t _paged_read_byte(const subleq_paged<T>* state, const size_t addr)
+{
+	const uint8_t* data = _paged_lookup(state, addr >> paged_page_bits);
+	return data != nullptr ? data[addr & (paged_page_size - 1)] : 0;
+}
+
+// Zero bytes aren't written to pages that don't exist, so they stay unallocated
+template <typename T>
+inline bool _paged_write_byte(subleq_paged<T>* state, const size_t addr, const uint8_t value)
+{
+	uint8_t* data = _paged_lookup(state, addr >> paged_page_bits);
+	if (data == nullptr && value != 0 && (data = _paged_alloc(state, addr >> paged_page_bits)) == nullptr)
+		return false;
+	if (data != nullptr)
+		data[addr & (paged_page_size - 1)] = value;
+	return true;
+}
+
+// Reads the cell at addr through the page table, caching its page when it has one. Cells
+// split across two pages are read a byte at a time, they only happen when code or data isn't
+// aligned.
+template <typename T>
+T _paged_read_miss(const subleq_paged<T>* state, const size_t addr, _paged_tlb& tlb)
+{
+	const size_t page = addr >> paged_page_bits;
+	const size_t offset = addr & (paged_page_size - 1);
+	if (offset <= paged_page_size - sizeof(T))
+	{
+		uint8_t* data = _paged_lookup(state, page);
+		if (data == nullptr)
+			return 0;
+		tlb.page = page;
+		tlb.data = data;
+		return *(T*)(data + offset);
+	}
+	T value;
+	uint8_t* bytes = (uint8_t*)&value;
+	for (size_t i = 0; i < sizeof(T); ++i)
+		bytes[i] = _paged_read_byte(state, addr + i);
+	return value;
+}
+
+// Reads the cell at addr, which must be in bounds
+template <typename T>
+inline T _paged_read(const subleq_paged<T>* state, const size_t addr, _paged_tlb& tlb)
+{
+	const size_t offset = addr & (paged_page_size - 1);
+	if ((addr >> paged_page_bits) == tlb.page && offset <= paged_page_size - sizeof(T))
+		return *(T*)(tlb.data + offset);
+	return _paged_read_miss(state, addr, tlb);
+}
+
+// Writes the cell at addr through the page table, allocating its pages unless only zeros go
+// to them. Returns false when a page couldn't be allocated, which leaves memory as it was.
+template <typename T>
+bool _paged_write_miss(subleq_paged<T>* state, const size_t addr, const T value, _paged_tlb& tlb)
+{
+	const size_t page = addr >> paged_page_bits;
+	const size_t offset = addr & (paged_page_size - 1);
+	if (offset <= paged_page_size - sizeof(T))
+	{
+		uint8_t* data = _paged_lookup(state, page);
+		if (data == nullptr)
+		{
+			if (value == 0)
+				return true;
+			if ((data = _paged_alloc(state, page)) == nullptr)
+				return false;
+		}
+		tlb.page = page;
+		tlb.data = data;
+		*(T*)(data + offset) = value;
+		return true;
+	}
+	const uint8_t* bytes = (const uint8_t*)&value;
+	const size_t split = paged_page_size - offset;
+	bool nonzero[2] = { false, false };
+	for (size_t i = 0; i < sizeof(T); ++i)
+		nonzero[i >= split] |= bytes[i] != 0;
+	// Both pages first, so a failed allocation doesn't leave half a cell written
+	if ((nonzero[0] && _paged_alloc(state, page) == nullptr) || (nonzero[1] && _paged_alloc(state, page + 1) == nullptr))
+		return false;
+	for (size_t i = 0; i < sizeof(T); ++i)
+		_paged_write_byte(state, addr + i, bytes[i]);
+	return true;
+}
+
+// Writes the cell at addr, which must be in bounds
+template <typename T>
+inline bool _paged_write(subleq_paged<T>* state, const size_t addr, const T value, _paged_tlb& tlb)
+{
+	const size_t offset = addr & (paged_page_size - 1);
+	if ((addr >> paged_page_bits) == tlb.page && offset <= paged_page_size - sizeof(T))
+	{
+		*(T*)(tlb.data + offset) = value;
+		return true;
+	}
+	return _paged_write_miss(state, addr, value, tlb);
+}
+
+template <typename T>
+T subleq_paged_read_cell(subleq_paged<T>* state, const size_t addr)
+{ return _paged_in_bounds(state, addr) ? _paged_read(state, addr, state->tlb[PAGED_TLB_DATA]) : 0; }
+
+template <typename T>
+bool subleq_paged_write_cell(subleq_paged<T>* state, const size_t addr, const T value)
+{ return _paged_in_bounds(state, addr) && _paged_write(state, addr, value, state->tlb[PAGED_TLB_DATA]); }
+
+// Copies bytes into memory. Pages that would only receive zeros aren't allocated, so
+// copying in a mostly empty image stays sparse. False if it doesn't fit or runs out of memory.
+template <typename T>
+bool subleq_paged_write_bytes(subleq_paged<T>* state, const size_t addr, const uint8_t* src, size_t size)
+{
+	if (addr > state->memsize || state->memsize - addr < size)
+		return false;
+	size_t at = addr;
+	while (size > 0)
+	{
+		const size_t offset = at & (paged_page_size - 1);
+		const size_t n = paged_page_size - offset < size ? paged_page_size - offset : size;
+		uint8_t* data = _paged_lookup(state, at >> paged_page_bits);
+		if (data == nullptr)
+		{
+			bool zero = true;
+			for (size_t i = 0; i < n && zero; ++i)
+				zero = src[i] == 0;
+			if (!zero && (data = _paged_alloc(state, at >> paged_page_bits)) == nullptr)
+				return false;
+		}
+		if (data != nullptr)
+			memcpy(data + offset, src, n);
+		at += n;
+		src += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Copies memory out, unallocated pages read as zero
+template <typename T>
+void subleq_paged_read_bytes(const subleq_paged<T>* state, const size_t addr, uint8_t* dst, size_t size)
+{
+	size_t at = addr;
+	while (size > 0)
+	{
+		const size_t offset = at & (paged_page_size - 1);
+		const size_t n = paged_page_size - offset < size ? paged_page_size - offset : size;
+		const uint8_t* data = _paged_lookup(state, at >> paged_page_bits);
+		if (data != nullptr) memcpy(dst, data + offset, n);
+		else memset(dst, 0, n);
+		at += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+// Steps through the given cached pages, which the run loop keeps in locals so stores into
+// pages can't force the compiler to reload them
+template <typename T>
+inline bool _paged_step(subleq_paged<T>* state, _paged_tlb& fetch, _paged_tlb& data, subleq_paged_output_fn<T> FN_OnOutput, void* userarg)
+{
+	state->running = (size_t)state->_ip < state->memsize;
+	if (!state->running)
+		return false;
+	const size_t ip = (size_t)state->_ip;
+	if (!_paged_in_bounds(state, ip + sizeof(T) * 2))
+		return state->running = false;
+	const T a = _paged_read(state, ip, fetch);
+	const T b = _paged_read(state, ip + sizeof(T), fetch);
+	const T c = _paged_read(state, ip + sizeof(T) * 2, fetch);
+	const size_t a_addr = _subleq_addr(a);
+	const bool in = a == ((T)(-1)) && b != ((T)(-1));
+	if (!in && !_paged_in_bounds(state, a_addr))
+		return state->running = false;
+
+	if (b == ((T)(-1)))
+	{
+		if (FN_OnOutput != nullptr)
+		{
+			T value = _paged_read(state, a_addr, data);
+			FN_OnOutput(state, value, state->_ip, userarg);
+		}
+		state->_ip = c;
+	}
+	else if (in)
+	{
+		const size_t b_addr = _subleq_addr(b);
+		if (!_paged_in_bounds(state, b_addr) || !_paged_write(state, b_addr, _subleq_input<T>(state->input), data))
+			return state->running = false;
+		state->_ip = c;
+	}
+	else
+	{
+		const size_t b_addr = _subleq_addr(b);
+		if (!_paged_in_bounds(state, b_addr))
+			return state->running = false;
+		const T ma = _paged_read(state, a_addr, data);
+		const T mb = _subleq_sub(_paged_read(state, b_addr, data), ma);
+		if (!_paged_write(state, b_addr, mb, data))
+			return state->running = false;
+
+		if (mb <= 0) state->_ip = c;
+		else state->_ip += sizeof(T) * 3;
+	}
+
+	state->running = (size_t)state->_ip < state->memsize;
+	return state->running;
+}
+
+// Same as subleq_step. Running out of memory for a new page stops the machine like a fault.
+template <typename T>
+bool subleq_step_paged(subleq_paged<T>* state, subleq_paged_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{ return _paged_step(state, state->tlb[PAGED_TLB_FETCH], state->tlb[PAGED_TLB_DATA], FN_OnOutput, userarg); }
+
+// Runs up to max_steps instructions, returning how many were executed
+template <typename T>
+uint64_t subleq_run_paged(subleq_paged<T>* state, const uint64_t max_steps, subleq_paged_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	_paged_tlb fetch = state->tlb[PAGED_TLB_FETCH];
+	_paged_tlb data = state->tlb[PAGED_TLB_DATA];
+	uint64_t steps = 0;
+	while (steps < max_steps)
+	{
+		if (!_paged_step(state, fetch, data, FN_OnOutput, userarg))
+		{
+			// The halting instruction still ran, a fault didn't
+			steps += !((size_t)state->_ip < state->memsize);
+			break;
+		}
+		++steps;
+	}
+	state->tlb[PAGED_TLB_FETCH] = fetch;
+	state->tlb[PAGED_TLB_DATA] = data;
+	return steps;
+}
+
+// Same as subleq_sink_output, for the paged machine
+template <typename T>
+void subleq_sink_output_paged(subleq_paged<T>* state, T& value, const T& current_ip, void* userarg)
+{
+	subleq_sink* sink = (subleq_sink*)userarg;
+	subleq_sink_put(sink, (char)value);
+	const size_t ip = (size_t)current_ip;
+	if (_paged_in_bounds(state, ip + sizeof(T) * 2) && !((size_t)subleq_paged_read_cell(state, ip + sizeof(T) * 2) < state->memsize))
+		subleq_sink_flush(sink);
+}
+
+// Loads a binary of any version into a new paged machine, which the caller must
+// destroy_subleq_paged(). Only the pages holding something other than zero are allocated,
+// so a sparse version 3 binary with a huge memsize loads in the space its segments need.
+template <typename T>
+BIN_RESULT bin_load_paged(const char* fname, subleq_paged<T>** out)
+{
+	*out = nullptr;
+	std::ifstream f(fname, std::ios::binary);
+	if (!f.is_open())
+		return BIN_OPEN_FAILED;
+	bin_header h{};
+	const BIN_RESULT r = _bin_read_header(f, h);
+	if (r != BIN_OK)
+		return r;
+	if (h.cell_width != sizeof(T))
+		return BIN_BAD_WIDTH;
+
+	subleq_paged<T>* sim = create_subleq_paged<T>(h.memsize);
+	if (sim == nullptr)
+		return BIN_ALLOC_FAILED;
+	sim->_ip = (T)h.ip;
+	// Segments are decoded a slice at a time, so a dense image doesn't need a second copy
+	const size_t slice = paged_page_size * 256;
+	std::vector<uint8_t> stored;
+	std::vector<uint8_t> decoded;
+	for (const bin_segment& s : h.segments)
+	{
+		f.seekg((std::streamoff)s.file_offset, std::ios::beg);
+		bool ok = true;
+		if (s.compression == BIN_COMPRESS_NONE)
+		{
+			for (uint64_t done = 0; done < s.size && ok; done += slice)
+			{
+				decoded.resize((size_t)(s.size - done < slice ? s.size - done : slice));
+				f.read((char*)decoded.data(), (std::streamsize)decoded.size());
+				if (!h.match_endian)
+					_bin_swap_byteorder(decoded.data(), decoded.data(), h.cell_width, decoded.size() / h.cell_width);
+				ok = !f.fail() && subleq_paged_write_bytes(sim, (size_t)(s.addr + done), decoded.data(), decoded.size());
+			}
+		}
+		else
+		{
+			stored.resize((size_t)s.stored_size);
+			f.read((char*)stored.data(), (std::streamsize)stored.size());
+			decoded.resize((size_t)s.size);
+			ok = !f.fail() && _bin_rle_decode(decoded.data(), decoded.size(), stored.data(), stored.size());
+			if (ok && !h.match_endian)
+				_bin_swap_byteorder(decoded.data(), decoded.data(), h.cell_width, decoded.size() / h.cell_width);
+			ok = ok && subleq_paged_write_bytes(sim, (size_t)s.addr, decoded.data(), decoded.size());
+		}
+		if (!ok)
+		{
+			destroy_subleq_paged(sim);
+			return BIN_BAD_SEGMENT;
+		}
+	}
+
+	*out = sim;
+	return BIN_OK;
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "batch.h"
+#include "binfile.h"
+#include "cycle.h"
+#include "sink.h"
+
+// Runs independent jobs across worker threads. Every worker owns a deque of job indices,
+// takes work from its own end and steals from the far end of the others' once it runs out,
+// so short jobs never queue behind a long one. Workers only write to their own output
+// buffer and results; they are merged into one report after all of them have finished.
+// With batching, jobs that share an image and max_steps are queued in groups that run in
+// lockstep on one worker (batch.h) instead of one at a time.
+
+// Jobs queued with batching that run as one subleq_batch, one group of its lanes
+const size_t pool_batch_jobs = batch_lane_width;
+
+// A cell written before the job starts, at a byte address
+struct pool_patch
+{
+	size_t addr;
+	int64_t value;
+};
+
+struct pool_job
+{
+	std::string image;
+	std::vector<pool_patch> patches;
+	uint64_t max_steps = UINT64_MAX;
+};
+
+enum POOL_STATUS : uint8_t
+{
+	POOL_HALTED,		// ip left memory
+	POOL_FAULT,			// An instruction or operand lay outside memory
+	POOL_STEP_LIMIT,	// Stopped after max_steps
+	POOL_LOOP,			// Came back to an earlier state, so it would never have halted
+	POOL_LOAD_FAILED,	// The image could not be loaded, see pool_result::load
+};
+
+inline const char* pool_status_str(const POOL_STATUS s)
+{
+	switch (s)
+	{
+	case POOL_HALTED:		return "halted";
+	case POOL_FAULT:		return "fault";
+	case POOL_STEP_LIMIT:	return "step limit";
+	case POOL_LOOP:			return "loop";
+	case POOL_LOAD_FAILED:	return "load failed";
+	default:				return "unknown";
+	}
+}
+
+struct pool_result
+{
+	POOL_STATUS status = POOL_LOAD_FAILED;
+	BIN_RESULT load = BIN_OK;
+	int64_t exit_ip = 0;
+	uint64_t steps = 0;
+	uint64_t period = 0;		// Steps per trip around the loop for POOL_LOOP
+	// Where the job's output lies in its worker's buffer
+	unsigned worker = 0;
+	size_t output_offset = 0;
+	size_t output_size = 0;
+};
+
+struct pool_report
+{
+	// Indexed like the jobs
+	std::vector<pool_result> results;
+	std::vector<std::vector<char>> outputs;
+	uint64_t total_steps = 0;
+	uint64_t steals = 0;
+	unsigned workers = 0;
+
+	const char* output(const pool_result& r) const { return outputs[r.worker].data() + r.output_offset; }
+};
+
+// Chase-Lev deque without push, every job is queued before the workers start. The owner
+// pops from the bottom, thieves take from the top, and only the last job is contended.
+struct alignas(64) _pool_deque
+{
+	std::vector<size_t> jobs;
+	std::atomic<int64_t> top{ 0 };
+	std::atomic<int64_t> bottom{ 0 };
+
+	bool pop(size_t& job)
+	{
+		const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+		job = jobs[b];
+		if (t == b)
+		{
+			const bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+		return true;
+	}
+
+	bool steal(size_t& job)
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+			return false;
+		job = jobs[t];
+		return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
+
+	bool empty() const
+	{ return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire); }
+};
+
+// Images are loaded once up front and copied for every job that uses them
+struct _pool_image
+{
+	BIN_RESULT load = BIN_OK;
+	uint8_t cell_width = 0;
+	void* sim = nullptr;
+};
+
+struct alignas(64) _pool_worker
+{
+	_pool_deque deque;
+	std::vector<char> output;
+	std::vector<std::pair<size_t, pool_result>> results;
+	uint64_t steps = 0;
+	uint64_t steals = 0;
+};
+
+template <typename T>
+BIN_RESULT _pool_load_image(const char* fname, _pool_image& image)
+{
+	subleq<T>* sim = nullptr;
+	const BIN_RESULT r = bin_load<T>(fname, &sim);
+	image.sim = sim;
+	return r;
+}
+
+// Sink callback, userarg is the worker's output buffer
+inline void _pool_append_output(const char* data, size_t size, void* userarg)
+{
+	std::vector<char>* output = (std::vector<char>*)userarg;
+	output->insert(output->end(), data, data + size);
+}
+
+template <typename T>
+void _pool_run_job(const pool_job& job, const _pool_image& image, subleq_sink* sink, pool_result& r, const bool check_cycles)
+{
+	const subleq<T>* src = (const subleq<T>*)image.sim;
+	subleq<T>* sim = create_subleq<T>(src->memsize);
+	if (sim == nullptr)
+	{
+		r.load = BIN_ALLOC_FAILED;
+		return;
+	}
+	memcpy(sim, src, sizeof(subleq<T>) + src->memsize);
+	for (const pool_patch& p : job.patches)
+	{
+		const T value = (T)p.value;
+		if (_subleq_in_bounds(sim, p.addr))
+			memcpy(sim->memory + p.addr, &value, sizeof(T));
+	}
+
+	uint64_t steps = 0;
+	bool more = (size_t)sim->_ip < sim->memsize;
+	subleq_cycle* cycle = nullptr;
+	if (check_cycles)
+	{
+		cycle = create_subleq_cycle(sim);
+		steps = subleq_run_checked<T>(sim, cycle, job.max_steps, nullptr, nullptr, subleq_sink_output<T>, sink);
+		more = sim->running;
+	}
+	else
+	{
+		while (more && steps < job.max_steps)
+		{
+			more = subleq_step<T>(sim, subleq_sink_output<T>, sink);
+			if (more || !((size_t)sim->_ip < sim->memsize))
+				++steps;
+		}
+	}
+
+	if (cycle != nullptr && cycle->found)
+	{
+		r.status = POOL_LOOP;
+		r.period = cycle->period;
+	}
+	else if (steps >= job.max_steps && more) r.status = POOL_STEP_LIMIT;
+	else if ((size_t)sim->_ip < sim->memsize) r.status = POOL_FAULT;
+	else r.status = POOL_HALTED;
+	r.exit_ip = sim->_ip;
+	r.steps = steps;
+	destroy_subleq_cycle(cycle);
+	destroy_subleq(sim);
+}
+
+// Runs jobs that share an image and max_steps in one batch and records their results. Batch
+// instances collect their own output, which is appended to the buffer one job after another.
+template <typename T>
+void _pool_run_batch(const std::vector<pool_job>& jobs, const std::vector<size_t>& unit, const _pool_image& image, _pool_worker& w, const unsigned self)
+{
+	subleq_batch<T>* batch = create_subleq_batch<T>((const subleq<T>*)image.sim, unit.size());
+	if (batch != nullptr)
+	{
+		for (size_t i = 0; i < unit.size(); ++i)
+			for (const pool_patch& p : jobs[unit[i]].patches)
+			{
+				const T value = (T)p.value;
+				if (_batch_in_bounds(batch, p.addr))
+					subleq_batch_write(batch, i, p.addr, &value, sizeof(T));
+			}
+		subleq_batch_run(batch, jobs[unit[0]].max_steps);
+	}
+
+	for (size_t i = 0; i < unit.size(); ++i)
+	{
+		pool_result r;
+		r.worker = self;
+		r.output_offset = w.output.size();
+		r.load = batch != nullptr ? BIN_OK : BIN_ALLOC_FAILED;
+		if (batch != nullptr)
+		{
+			// Instances only stop running early by halting or faulting
+			if (batch->running[i]) r.status = POOL_STEP_LIMIT;
+			else if ((size_t)batch->ip[i] < batch->memsize) r.status = POOL_FAULT;
+			else r.status = POOL_HALTED;
+			r.exit_ip = batch->ip[i];
+			r.steps = batch->steps[i];
+			w.output.insert(w.output.end(), batch->output[i].begin(), batch->output[i].end());
+		}
+		r.output_size = w.output.size() - r.output_offset;
+		w.steps += r.steps;
+		w.results.emplace_back(unit[i], r);
+	}
+	destroy_subleq_batch(batch);
+}
+
+inline void _pool_worker_main(const std::vector<pool_job>& jobs, const std::vector<_pool_image>& images,
+	const std::vector<size_t>& image_of_job, const std::vector<std::vector<size_t>>& units, std::vector<_pool_worker>& workers,
+	const unsigned self, const bool check_cycles)
+{
+	_pool_worker& w = workers[self];
+	const unsigned n = (unsigned)workers.size();
+	subleq_sink* sink = create_subleq_sink_callback(_pool_append_output, &w.output);
+	size_t u = 0;
+	while (true)
+	{
+		bool found = w.deque.pop(u);
+		// Nothing is ever queued again, so once every deque is empty the work is done
+		for (unsigned i = 1; !found && i < n; ++i)
+		{
+			_pool_deque& victim = workers[(self + i) % n].deque;
+			while (!found && !victim.empty())
+				found = victim.steal(u);
+			w.steals += found;
+		}
+		if (!found)
+			break;
+
+		const std::vector<size_t>& unit = units[u];
+		const _pool_image& image = images[image_of_job[unit[0]]];
+		if (unit.size() > 1 && image.load == BIN_OK)
+		{
+			switch (image.cell_width)
+			{
+			case 1:		_pool_run_batch<int8_t>(jobs, unit, image, w, self); break;
+			case 2:		_pool_run_batch<int16_t>(jobs, unit, image, w, self); break;
+			case 4:		_pool_run_batch<int32_t>(jobs, unit, image, w, self); break;
+			default:	_pool_run_batch<int64_t>(jobs, unit, image, w, self); break;
+			}
+			continue;
+		}
+
+		const size_t job = unit[0];
+		pool_result r;
+		r.worker = self;
+		r.output_offset = w.output.size();
+		r.load = image.load;
+		if (image.load == BIN_OK)
+		{
+			switch (image.cell_width)
+			{
+			case 1:		_pool_run_job<int8_t>(jobs[job], image, sink, r, check_cycles); break;
+			case 2:		_pool_run_job<int16_t>(jobs[job], image, sink, r, check_cycles); break;
+			case 4:		_pool_run_job<int32_t>(jobs[job], image, sink, r, check_cycles); break;
+			default:	_pool_run_job<int64_t>(jobs[job], image, sink, r, check_cycles); break;
+			}
+		}
+		// Every job's output ends up in the buffer before the next one starts
+		subleq_sink_flush(sink);
+		r.output_size = w.output.size() - r.output_offset;
+		w.steps += r.steps;
+		w.results.emplace_back(job, r);
+	}
+	destroy_subleq_sink(sink);
+}
+
+// Runs every job on num_workers threads (0 for one per core) and waits for all of them. With
+// check_cycles, jobs run through the loop detector and end as POOL_LOOP once they repeat a state.
+// With batch, jobs that share an image and max_steps run in lockstep; it is ignored with
+// check_cycles, which needs each job's whole state.
+inline pool_report pool_run(const std::vector<pool_job>& jobs, unsigned num_workers=0, const bool check_cycles=false, const bool batch=false)
+{
+	if (num_workers == 0)
+		num_workers = std::thread::hardware_concurrency();
+	if (num_workers == 0)
+		num_workers = 1;
+
+	std::vector<_pool_image> images;
+	std::vector<size_t> image_of_job(jobs.size());
+	std::map<std::string, size_t> image_index;
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		auto it = image_index.find(jobs[i].image);
+		if (it == image_index.end())
+		{
+			_pool_image image;
+			const char* fname = jobs[i].image.c_str();
+			image.load = bin_peek(fname, &image.cell_width);
+			if (image.load == BIN_OK)
+			{
+				switch (image.cell_width)
+				{
+				case 1:		image.load = _pool_load_image<int8_t>(fname, image); break;
+				case 2:		image.load = _pool_load_image<int16_t>(fname, image); break;
+				case 4:		image.load = _pool_load_image<int32_t>(fname, image); break;
+				default:	image.load = _pool_load_image<int64_t>(fname, image); break;
+				}
+			}
+			it = image_index.emplace(jobs[i].image, images.size()).first;
+			images.push_back(image);
+		}
+		image_of_job[i] = it->second;
+	}
+
+	// A unit is a single job, or with batching up to pool_batch_jobs that share an image and
+	// max_steps, filled in job order
+	std::vector<std::vector<size_t>> units;
+	std::map<std::pair<size_t, uint64_t>, size_t> open_unit;
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		if (!batch || check_cycles)
+		{
+			units.push_back({ i });
+			continue;
+		}
+		auto it = open_unit.find({ image_of_job[i], jobs[i].max_steps });
+		if (it == open_unit.end() || units[it->second].size() == pool_batch_jobs)
+		{
+			open_unit[{ image_of_job[i], jobs[i].max_steps }] = units.size();
+			units.emplace_back();
+			units.back().reserve(pool_batch_jobs);
+			units.back().push_back(i);
+		}
+		else
+			units[it->second].push_back(i);
+	}
+
+	// Dealt out round robin, stealing evens out whatever that gets wrong
+	std::vector<_pool_worker> workers(num_workers);
+	for (size_t i = 0; i < units.size(); ++i)
+		workers[i % num_workers].deque.jobs.push_back(i);
+	for (_pool_worker& w : workers)
+		w.deque.bottom.store((int64_t)w.deque.jobs.size());
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < num_workers; ++i)
+		threads.emplace_back(_pool_worker_main, std::cref(jobs), std::cref(images), std::cref(image_of_job), std::cref(units), std::ref(workers), i, check_cycles);
+	_pool_worker_main(jobs, images, image_of_job, units, workers, 0, check_cycles);
+	for (std::thread& t : threads)
+		t.join();
+
+	pool_report report;
+	report.workers = num_workers;
+	report.results.resize(jobs.size());
+	for (_pool_worker& w : workers)
+	{
+		for (const auto& [job, r] : w.results)
+			report.results[job] = r;
+		report.total_steps += w.steps;
+		report.steals += w.steals;
+		report.outputs.push_back(std::move(w.output));
+	}
+	for (_pool_image& image : images)
+		free(image.sim);
+	return report;
+}
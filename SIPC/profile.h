@@ -0,0 +1,288 @@
+#pragma once
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "subleq.h"
+#include "history.h"
+
+// Per-address execution profile. The counters are flat arrays parallel to memory and indexed
+// by byte address like the ip: how often the instruction starting at an address ran, how often
+// its branch was taken, and how often the cell starting there was written. Only the profiled
+// run loops below touch them, so the other engines pay nothing while profiling is off.
+template <typename T>
+struct subleq_profile
+{
+	size_t memsize = 0;
+	uint64_t steps = 0;
+	std::vector<uint64_t> exec;
+	std::vector<uint64_t> taken;
+	std::vector<uint64_t> writes;
+};
+
+// What a heatmap is coloured by
+enum PROFILE_HEAT : uint8_t
+{
+	HEAT_OFF,
+	HEAT_EXEC,		// Cells of instructions that ran, by how often
+	HEAT_WRITES,	// Cells that were written, by how often
+};
+
+inline const char* profile_heat_str(const PROFILE_HEAT h)
+{
+	switch (h)
+	{
+	case HEAT_OFF:		return "off";
+	case HEAT_EXEC:		return "exec";
+	case HEAT_WRITES:	return "writes";
+	default:			return "unknown";
+	}
+}
+
+// Heat levels run from 1 for the coldest cell that was touched up to this for the hottest
+const uint8_t profile_heat_levels = 8;
+
+template <typename T>
+void subleq_profile_clear(subleq_profile<T>* profile)
+{
+	profile->steps = 0;
+	std::fill(profile->exec.begin(), profile->exec.end(), 0);
+	std::fill(profile->taken.begin(), profile->taken.end(), 0);
+	std::fill(profile->writes.begin(), profile->writes.end(), 0);
+}
+
+template <typename T>
+subleq_profile<T>* create_subleq_profile(const subleq<T>* state)
+{
+	subleq_profile<T>* profile = new subleq_profile<T>();
+	profile->memsize = state->memsize;
+	profile->exec.assign(state->memsize, 0);
+	profile->taken.assign(state->memsize, 0);
+	profile->writes.assign(state->memsize, 0);
+	return profile;
+}
+
+template <typename T>
+void destroy_subleq_profile(subleq_profile<T>* profile)
+{ delete profile; }
+
+// Same as subleq_step, or subleq_step_recorded when history isn't null, but counts the
+// instruction first. Faults change nothing and aren't counted. Sets written to the cell the
+// step wrote, or SIZE_MAX if it wrote none.
+template <typename T>
+inline bool _subleq_step_profiled(subleq<T>* state, subleq_profile<T>* profile, subleq_history<T>* history, size_t& written, subleq_output_fn<T> FN_OnOutput, void* userarg)
+{
+	written = SIZE_MAX;
+	const size_t ip = (size_t)state->_ip;
+	if (!(ip < state->memsize) || !_subleq_in_bounds(state, ip + sizeof(T) * 2))
+		return history != nullptr ? subleq_step_recorded(state, history, FN_OnOutput, userarg) : subleq_step(state, FN_OnOutput, userarg);
+	// Read before running, the instruction may overwrite itself
+	const T a = *(T*)(state->memory + ip);
+	const T b = *(T*)(state->memory + ip + sizeof(T));
+	const bool more = history != nullptr ? subleq_step_recorded(state, history, FN_OnOutput, userarg) : subleq_step(state, FN_OnOutput, userarg);
+	if (!more && (size_t)state->_ip < state->memsize)
+		return false;
+
+	profile->steps++;
+	profile->exec[ip]++;
+	if (b != ((T)(-1)))
+	{
+		const size_t b_addr = _subleq_addr(b);
+		profile->writes[b_addr]++;
+		written = b_addr;
+		T result;
+		memcpy(&result, state->memory + b_addr, sizeof(T));
+		// Input always jumps
+		profile->taken[ip] += result <= 0 || a == ((T)(-1));
+	}
+	return more;
+}
+
+template <typename T>
+inline bool subleq_step_profiled(subleq<T>* state, subleq_profile<T>* profile, subleq_history<T>* history, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	size_t written;
+	return _subleq_step_profiled(state, profile, history, written, FN_OnOutput, userarg);
+}
+
+// Runs up to max_steps counted instructions, returning how many were executed. Stops in front
+// of any address flagged in stop_at, other than the one it starts on, and after any write to
+// a cell watch flags.
+template <typename T>
+uint64_t subleq_run_profiled(subleq<T>* state, subleq_profile<T>* profile, subleq_history<T>* history, const uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	uint64_t steps = 0;
+	while (steps < max_steps)
+	{
+		const size_t ip = (size_t)state->_ip;
+		size_t written;
+		const bool more = _subleq_step_profiled(state, profile, history, written, FN_OnOutput, userarg);
+		// The halting instruction still ran, a fault didn't
+		if (!more && (size_t)state->_ip < state->memsize)
+			break;
+		++steps;
+		if (watch != nullptr && written != SIZE_MAX && _subleq_watch_write<T>(watch, written, ip))
+			break;
+		if (!more || (stop_at != nullptr && stop_at[(size_t)state->_ip]))
+			break;
+	}
+	return steps;
+}
+
+inline uint8_t _profile_level(const uint64_t count, const uint64_t max)
+{
+	if (count == 0)
+		return 0;
+	if (count >= max)
+		return profile_heat_levels;
+	return (uint8_t)(1 + (profile_heat_levels - 1) * log2((double)count) / log2((double)max));
+}
+
+// Fills levels with the heat of every cell, 0 for cells never touched, on a log scale
+// relative to the hottest one
+template <typename T>
+void subleq_profile_heat(const subleq_profile<T>* profile, const PROFILE_HEAT kind, std::vector<uint8_t>& levels)
+{
+	const size_t num_cells = profile->memsize / sizeof(T);
+	levels.assign(num_cells, 0);
+	if (kind == HEAT_OFF)
+		return;
+	const std::vector<uint64_t>& counts = kind == HEAT_EXEC ? profile->exec : profile->writes;
+	// An instruction covers its three cells
+	const size_t span = kind == HEAT_EXEC ? 3 : 1;
+	const uint64_t max = *std::max_element(counts.begin(), counts.end());
+	for (size_t addr = 0; addr < profile->memsize; ++addr)
+	{
+		if (counts[addr] == 0)
+			continue;
+		const uint8_t level = _profile_level(counts[addr], max);
+		for (size_t k = 0; k < span; ++k)
+		{
+			const size_t cell = addr / sizeof(T) + k;
+			if (cell < num_cells && levels[cell] < level)
+				levels[cell] = level;
+		}
+	}
+}
+
+struct subleq_hotspot
+{
+	size_t addr;
+	uint64_t count;
+	uint64_t taken;		// Only for instructions
+};
+
+// The n addresses with the highest counts, hottest first
+inline std::vector<subleq_hotspot> _profile_top(const std::vector<uint64_t>& counts, const std::vector<uint64_t>* taken, const size_t n)
+{
+	std::vector<subleq_hotspot> hot;
+	for (size_t addr = 0; addr < counts.size(); ++addr)
+		if (counts[addr] != 0)
+			hot.push_back({ addr, counts[addr], taken != nullptr ? (*taken)[addr] : 0 });
+	const size_t keep = hot.size() < n ? hot.size() : n;
+	std::partial_sort(hot.begin(), hot.begin() + keep, hot.end(), [](const subleq_hotspot& x, const subleq_hotspot& y) {
+		return x.count != y.count ? x.count > y.count : x.addr < y.addr;
+	});
+	hot.resize(keep);
+	return hot;
+}
+
+template <typename T>
+std::vector<subleq_hotspot> subleq_profile_top_instructions(const subleq_profile<T>* profile, const size_t n)
+{ return _profile_top(profile->exec, &profile->taken, n); }
+
+template <typename T>
+std::vector<subleq_hotspot> subleq_profile_top_writes(const subleq_profile<T>* profile, const size_t n)
+{ return _profile_top(profile->writes, nullptr, n); }
+
+// A taken branch back to an earlier address, and everything that ran in between
+struct subleq_hot_loop
+{
+	size_t head;		// The branch target
+	size_t tail;		// The branching instruction
+	uint64_t iterations;
+	uint64_t steps;		// Instructions run from head up to and including tail
+};
+
+// The n loops that ran the most instructions. Branch targets are read from memory as it is
+// now, so code that rewrote its own jumps may be attributed to where they point last.
+template <typename T>
+std::vector<subleq_hot_loop> subleq_profile_loops(const subleq_profile<T>* profile, const subleq<T>* state, const size_t n)
+{
+	std::vector<uint64_t> prefix(profile->memsize + 1, 0);
+	for (size_t addr = 0; addr < profile->memsize; ++addr)
+		prefix[addr + 1] = prefix[addr] + profile->exec[addr];
+
+	std::vector<subleq_hot_loop> loops;
+	for (size_t ip = 0; ip < profile->memsize && ip < state->memsize; ++ip)
+	{
+		if (profile->taken[ip] == 0 || !_subleq_in_bounds(state, ip + sizeof(T) * 2))
+			continue;
+		T c;
+		memcpy(&c, state->memory + ip + sizeof(T) * 2, sizeof(T));
+		const size_t head = (size_t)c;
+		if (!(head <= ip))
+			continue;
+		loops.push_back({ head, ip, profile->taken[ip], prefix[ip + 1] - prefix[head] });
+	}
+	const size_t keep = loops.size() < n ? loops.size() : n;
+	std::partial_sort(loops.begin(), loops.begin() + keep, loops.end(), [](const subleq_hot_loop& x, const subleq_hot_loop& y) {
+		return x.steps != y.steps ? x.steps > y.steps : x.head < y.head;
+	});
+	loops.resize(keep);
+	return loops;
+}
+
+// Names an address in the report, for example with its source line. Empty leaves it out.
+typedef std::string (*subleq_profile_label_fn)(size_t addr, void* userarg);
+
+// Writes the n hottest instructions, loops and written cells as text
+template <typename T>
+void subleq_profile_write(const subleq_profile<T>* profile, const subleq<T>* state, FILE* f, const size_t n, subleq_profile_label_fn label=nullptr, void* userarg=nullptr)
+{
+	const double total = profile->steps > 0 ? (double)profile->steps : 1.0;
+	// Ends a row with the label of addr, if it has one
+	const auto end_row = [&](const size_t addr) {
+		const std::string where = label != nullptr ? label(addr, userarg) : std::string();
+		if (!where.empty())
+			fprintf(f, "    %s", where.c_str());
+		fputc('\n', f);
+	};
+	fprintf(f, "%llu steps profiled, %zu-bit cells\n", (unsigned long long)profile->steps, sizeof(T) * 8);
+
+	fprintf(f, "\nHot instructions\n%12s %14s %7s %14s %14s   %s\n", "ip", "count", "%", "taken", "not taken", "instruction");
+	for (const subleq_hotspot& h : subleq_profile_top_instructions(profile, n))
+	{
+		T cells[3] = { 0, 0, 0 };
+		if (_subleq_in_bounds(state, h.addr + sizeof(T) * 2))
+			memcpy(cells, state->memory + h.addr, sizeof(cells));
+		fprintf(f, "%12zu %14llu %6.2f%% ", h.addr, (unsigned long long)h.count, h.count * 100.0 / total);
+		if (cells[1] == ((T)(-1)))
+			fprintf(f, "%14s %14s   out %lld, %lld", "-", "-", (long long)cells[0], (long long)cells[2]);
+		else if (cells[0] == ((T)(-1)))
+			fprintf(f, "%14s %14s   in %lld, %lld", "-", "-", (long long)cells[1], (long long)cells[2]);
+		else
+			fprintf(f, "%14llu %14llu   subleq %lld, %lld, %lld", (unsigned long long)h.taken, (unsigned long long)(h.count - h.taken),
+				(long long)cells[0], (long long)cells[1], (long long)cells[2]);
+		end_row(h.addr);
+	}
+
+	fprintf(f, "\nHot loops\n%25s %14s %14s %7s\n", "range", "iterations", "steps", "%");
+	for (const subleq_hot_loop& l : subleq_profile_loops(profile, state, n))
+	{
+		char range[64];
+		snprintf(range, sizeof(range), "%zu..%zu", l.head, l.tail);
+		fprintf(f, "%25s %14llu %14llu %6.2f%%", range, (unsigned long long)l.iterations, (unsigned long long)l.steps, l.steps * 100.0 / total);
+		end_row(l.head);
+	}
+
+	fprintf(f, "\nMost written cells\n%12s %14s %14s\n", "addr", "writes", "value");
+	for (const subleq_hotspot& h : subleq_profile_top_writes(profile, n))
+	{
+		T value = 0;
+		if (_subleq_in_bounds(state, h.addr))
+			memcpy(&value, state->memory + h.addr, sizeof(T));
+		fprintf(f, "%12zu %14llu %14lld", h.addr, (unsigned long long)h.count, (long long)value);
+		end_row(h.addr);
+	}
+}
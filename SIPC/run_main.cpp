@@ -0,0 +1,537 @@
+// Headless runner: executes a binary without the editor at full speed
+//   subleq-run [-e engine] [-n max_steps] [-t max_seconds] [-i input_file] [-o output_file] [-p report_file] [-c] image.bin
+//   subleq-run [-n max_steps] [-w workers] [-o report_file] [-c | -b] -j job_file
+#include <chrono>
+#include <stdlib.h>
+#include "analysis.h"
+#include "binfile.h"
+#include "cycle.h"
+#include "jit.h"
+#include "fusion.h"
+#include "paged.h"
+#include "pool.h"
+#include "profile.h"
+#include "sink.h"
+
+enum RUN_RESULT : int
+{
+	RUN_HALTED = 0,
+	RUN_ERROR = 1,
+	RUN_STEP_LIMIT = 2,
+	RUN_TIME_LIMIT = 3,
+	RUN_LOOP = 4,			// -c found the program in a loop it can never leave
+};
+
+enum RUN_ENGINE : uint8_t
+{
+	ENGINE_INTERP,		// subleq_step
+	ENGINE_CACHED,		// subleq_run_analyzed with a decoded instruction cache
+	ENGINE_JIT,			// subleq_jit_run, native x86-64 blocks
+	ENGINE_FUSED,		// subleq_run_fused, common instruction sequences run as one operation
+	ENGINE_PAGED,		// subleq_run_paged, memory pages are only allocated once written
+};
+
+struct RunOptions
+{
+	const char* image = nullptr;
+	const char* in_name = nullptr;
+	const char* out_name = nullptr;
+	const char* job_file = nullptr;
+	const char* profile_name = nullptr;
+	unsigned workers = 0;
+	uint64_t max_steps = UINT64_MAX;
+	double max_seconds = 0.0;
+	bool check_cycles = false;
+	bool batch = false;
+	RUN_ENGINE engine = ENGINE_INTERP;
+};
+
+// How many steps run between checks of the wall-clock limit
+const uint64_t time_check_interval = 1 << 16;
+// Rows in each table of a profile report
+const size_t profile_report_rows = 20;
+
+static void _run_usage(const char* exe)
+{
+	fprintf(stderr,
+		"Usage: %s [options] image.bin\n"
+		"       %s [-n steps] [-w workers] [-o file] [-c | -b] -j job_file\n"
+		"  -e <engine>    interp (default), cached, fused, jit or paged, which only allocates\n"
+		"                 the memory a program writes\n"
+		"  -n <steps>     Stop after this many steps (per job with -j)\n"
+		"  -t <seconds>   Stop after this much wall-clock time\n"
+		"  -i <file>      Read program input from a file instead of stdin, jobs read no input\n"
+		"  -o <file>      Write program output (or the job report) to a file instead of stdout\n"
+		"  -p <file>      Profile the run with the interpreter and write the hottest instructions,\n"
+		"                 loops and cells to a file\n"
+		"  -c             Stop once the program is back in a state it was in before, ip and memory\n"
+		"                 alike, and report the loop. Runs on the interpreter, also for -j\n"
+		"  -j <file>      Run every job in the file across all cores, one job per line:\n"
+		"                   image.bin [max_steps] [addr=value ...]\n"
+		"  -w <workers>   Number of worker threads for -j, default one per core\n"
+		"  -b             Run -j jobs that share an image and max_steps eight at a time in lockstep\n", exe, exe);
+}
+
+// Reads a job file, returns false and reports the line on a parse error
+static bool _run_read_jobs(const RunOptions& opt, std::vector<pool_job>& jobs)
+{
+	FILE* f = fopen(opt.job_file, "r");
+	if (f == nullptr)
+	{
+		fprintf(stderr, "Error: could not open job file \"%s\"\n", opt.job_file);
+		return false;
+	}
+	char line[4096];
+	size_t line_no = 0;
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		++line_no;
+		pool_job job;
+		job.max_steps = opt.max_steps;
+		bool ok = true;
+		for (char* tok = strtok(line, " \t\r\n"); tok != nullptr && ok; tok = strtok(nullptr, " \t\r\n"))
+		{
+			if (tok[0] == '#')
+				break;
+			char* end = nullptr;
+			char* eq = strchr(tok, '=');
+			if (job.image.empty())
+				job.image = tok;
+			else if (eq != nullptr)
+			{
+				*eq = '\0';
+				pool_patch p;
+				p.addr = strtoull(tok, &end, 0);
+				ok = *end == '\0';
+				p.value = strtoll(eq + 1, &end, 0);
+				ok = ok && *end == '\0';
+				job.patches.push_back(p);
+			}
+			else
+			{
+				job.max_steps = strtoull(tok, &end, 0);
+				ok = *end == '\0';
+			}
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "Error: %s:%zu: expected image.bin [max_steps] [addr=value ...]\n", opt.job_file, line_no);
+			fclose(f);
+			return false;
+		}
+		if (!job.image.empty())
+			jobs.push_back(job);
+	}
+	fclose(f);
+	return true;
+}
+
+// Escapes program output so every job's report stays on one line
+static void _run_print_escaped(FILE* out, const char* s, const size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		const unsigned char c = (unsigned char)s[i];
+		if (c == '\\') fputs("\\\\", out);
+		else if (c == '\n') fputs("\\n", out);
+		else if (c == '\t') fputs("\\t", out);
+		else if (c < 0x20 || c >= 0x7F) fprintf(out, "\\x%02x", c);
+		else fputc(c, out);
+	}
+}
+
+// Runs a job file through the worker pool and writes one tab separated line per job:
+//   index, image, status, exit ip, steps, output
+static int run_jobs(const RunOptions& opt)
+{
+	std::vector<pool_job> jobs;
+	if (!_run_read_jobs(opt, jobs))
+		return RUN_ERROR;
+
+	FILE* out = stdout;
+	if (opt.out_name != nullptr && (out = fopen(opt.out_name, "wb")) == nullptr)
+	{
+		fprintf(stderr, "Error: could not open output file \"%s\"\n", opt.out_name);
+		return RUN_ERROR;
+	}
+
+	using clock = std::chrono::steady_clock;
+	const clock::time_point start = clock::now();
+	const pool_report report = pool_run(jobs, opt.workers, opt.check_cycles, opt.batch);
+	const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	int result = RUN_HALTED;
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		const pool_result& r = report.results[i];
+		if (r.status == POOL_LOAD_FAILED)
+		{
+			fprintf(out, "%zu\t%s\t%s: %s\t\t\t\n", i, jobs[i].image.c_str(), pool_status_str(r.status), bin_result_str(r.load));
+			result = RUN_ERROR;
+			continue;
+		}
+		// A loop's exit ip is where it repeats
+		if (r.status == POOL_LOOP)
+			fprintf(out, "%zu\t%s\t%s of %llu steps\t%lld\t%llu\t", i, jobs[i].image.c_str(), pool_status_str(r.status),
+				(unsigned long long)r.period, (long long)r.exit_ip, (unsigned long long)r.steps);
+		else
+			fprintf(out, "%zu\t%s\t%s\t%lld\t%llu\t", i, jobs[i].image.c_str(), pool_status_str(r.status),
+				(long long)r.exit_ip, (unsigned long long)r.steps);
+		_run_print_escaped(out, report.output(r), r.output_size);
+		fputc('\n', out);
+		if (r.status == POOL_STEP_LIMIT && result == RUN_HALTED)
+			result = RUN_STEP_LIMIT;
+		else if (r.status == POOL_LOOP && (result == RUN_HALTED || result == RUN_STEP_LIMIT))
+			result = RUN_LOOP;
+	}
+	if (out != stdout)
+		fclose(out);
+
+	fprintf(stderr, "%zu jobs on %u workers (%llu steals), %llu steps, %.3f s, %.0f instructions/sec\n",
+		jobs.size(), report.workers, (unsigned long long)report.steals, (unsigned long long)report.total_steps,
+		seconds, seconds > 0.0 ? report.total_steps / seconds : 0.0);
+	return result;
+}
+
+// Calls run_slice(n) until the machine stops, the step budget runs out or the deadline passes.
+// run_slice executes up to n steps and returns how many it executed.
+template <typename S, typename F>
+RUN_RESULT _run_slices(S* sim, const RunOptions& opt, uint64_t& steps, F run_slice)
+{
+	using clock = std::chrono::steady_clock;
+	const clock::time_point deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opt.max_seconds));
+
+	if (!((size_t)sim->_ip < sim->memsize))
+		return RUN_HALTED;
+	while (steps < opt.max_steps)
+	{
+		const uint64_t slice = opt.max_steps - steps < time_check_interval ? opt.max_steps - steps : time_check_interval;
+		const uint64_t done = run_slice(slice);
+		steps += done;
+		if (done < slice || !sim->running)
+			return RUN_HALTED;
+		if (opt.max_seconds > 0.0 && clock::now() >= deadline)
+			return RUN_TIME_LIMIT;
+	}
+	return RUN_STEP_LIMIT;
+}
+
+// Opens the output file (stdout without -o) and a sink writing to it, false if it can't be opened
+static bool _run_open_output(const RunOptions& opt, FILE*& out, subleq_sink*& sink)
+{
+	out = stdout;
+	if (opt.out_name != nullptr)
+	{
+		out = fopen(opt.out_name, "wb");
+		if (out == nullptr)
+		{
+			fprintf(stderr, "Error: could not open output file \"%s\"\n", opt.out_name);
+			return false;
+		}
+	}
+	// Output skips stdio and goes straight to the file descriptor in large batches
+	fflush(out);
+#ifdef _WIN32
+	sink = create_subleq_sink_fd(_fileno(out));
+#else
+	sink = create_subleq_sink_fd(fileno(out));
+#endif
+	return true;
+}
+
+// Opens the input file, or stdin without -i or with -i -. Returns nullptr if it can't be opened.
+static subleq_source* _run_open_input(const RunOptions& opt)
+{
+	if (opt.in_name == nullptr || strcmp(opt.in_name, "-") == 0)
+	{
+#ifdef _WIN32
+		_setmode(0, _O_BINARY);
+#endif
+		return create_subleq_source_fd(0);
+	}
+	subleq_source* source = create_subleq_source_file(opt.in_name);
+	if (source == nullptr)
+		fprintf(stderr, "Error: could not open input file \"%s\"\n", opt.in_name);
+	return source;
+}
+
+static void _run_close_output(FILE* out, subleq_sink* sink)
+{
+	destroy_subleq_sink(sink);
+	if (out != stdout)
+		fclose(out);
+}
+
+static void _run_print_summary(const RUN_RESULT result, const int64_t ip, const size_t memsize, const uint64_t steps, const double seconds)
+{
+	const char* reason = "halted";
+	if (result == RUN_HALTED && (size_t)ip < memsize) reason = "fault";
+	else if (result == RUN_STEP_LIMIT) reason = "step limit";
+	else if (result == RUN_TIME_LIMIT) reason = "time limit";
+	else if (result == RUN_LOOP) reason = "loop";
+	fprintf(stderr, "\n%s: exit ip %lld, %llu steps, %.3f s, %.0f instructions/sec\n",
+		reason, (long long)ip, (unsigned long long)steps, seconds,
+		seconds > 0.0 ? steps / seconds : 0.0);
+}
+
+// Runs the image on the paged engine, which loads it without allocating its zero pages
+template <typename T>
+int run_paged_image(const RunOptions& opt)
+{
+	subleq_paged<T>* sim = nullptr;
+	const BIN_RESULT r = bin_load_paged<T>(opt.image, &sim);
+	if (r != BIN_OK)
+	{
+		fprintf(stderr, "Error: %s: %s\n", opt.image, bin_result_str(r));
+		return RUN_ERROR;
+	}
+	FILE* out;
+	subleq_sink* sink;
+	subleq_source* source = _run_open_input(opt);
+	if (source == nullptr || !_run_open_output(opt, out, sink))
+	{
+		destroy_subleq_source(source);
+		destroy_subleq_paged(sim);
+		return RUN_ERROR;
+	}
+	sim->input = source;
+
+	using clock = std::chrono::steady_clock;
+	const clock::time_point start = clock::now();
+	uint64_t steps = 0;
+	const RUN_RESULT result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+		return subleq_run_paged<T>(sim, n, subleq_sink_output_paged<T>, sink);
+	});
+	const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	_run_close_output(out, sink);
+
+	_run_print_summary(result, (int64_t)sim->_ip, sim->memsize, steps, seconds);
+	fprintf(stderr, "%zu pages resident, %.2f MiB of %.1f MiB\n", sim->num_pages, subleq_paged_resident(sim) / 1048576.0, sim->memsize / 1048576.0);
+	destroy_subleq_source(source);
+	destroy_subleq_paged(sim);
+	return result;
+}
+
+template <typename T>
+int run_image(const RunOptions& opt)
+{
+	if (opt.engine == ENGINE_PAGED)
+		return run_paged_image<T>(opt);
+	subleq<T>* sim = nullptr;
+	// Mapped where the platform allows it, so large sparse images start straight away
+	BIN_RESULT r = bin_map<T>(opt.image, &sim);
+	if (r != BIN_OK)
+	{
+		fprintf(stderr, "Error: %s: %s\n", opt.image, bin_result_str(r));
+		return RUN_ERROR;
+	}
+	FILE* out;
+	subleq_sink* sink;
+	subleq_source* source = _run_open_input(opt);
+	if (source == nullptr || !_run_open_output(opt, out, sink))
+	{
+		destroy_subleq_source(source);
+		bin_unmap(sim);
+		return RUN_ERROR;
+	}
+	sim->input = source;
+
+	using clock = std::chrono::steady_clock;
+	const clock::time_point start = clock::now();
+	RUN_RESULT result = RUN_ERROR;
+	uint64_t steps = 0;
+
+	subleq_profile<T>* profile = nullptr;
+	subleq_cycle* cycle = nullptr;
+	subleq_icache<T>* cache = nullptr;
+	if (opt.engine == ENGINE_CACHED && opt.profile_name == nullptr && !opt.check_cycles)
+	{
+		cache = create_subleq_icache(sim);
+		if (cache == nullptr)
+			fprintf(stderr, "Warning: failed to allocate the instruction cache, running on the interpreter\n");
+	}
+	if (opt.profile_name != nullptr)
+	{
+		// Counting needs every step to go through the interpreter, whatever the engine
+		profile = create_subleq_profile(sim);
+		result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+			return subleq_run_profiled<T>(sim, profile, nullptr, n, nullptr, nullptr, subleq_sink_output<T>, sink);
+		});
+	}
+	else if (opt.check_cycles)
+	{
+		// Hashing needs to see every write, whatever the engine
+		cycle = create_subleq_cycle(sim);
+		result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+			return subleq_run_checked<T>(sim, cycle, n, nullptr, nullptr, subleq_sink_output<T>, sink);
+		});
+		if (cycle->found)
+			result = RUN_LOOP;
+	}
+	else if (opt.engine == ENGINE_INTERP || (opt.engine == ENGINE_CACHED && cache == nullptr))
+	{
+		result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+			uint64_t done = 0;
+			while (done < n)
+			{
+				const bool more = subleq_step<T>(sim, subleq_sink_output<T>, sink);
+				if (more || !((size_t)sim->_ip < sim->memsize))
+					++done;
+				if (!more)
+					break;
+			}
+			return done;
+		});
+	}
+	else if (opt.engine == ENGINE_JIT)
+	{
+		subleq_jit<T>* jit = create_subleq_jit(sim);
+		if (jit == nullptr)
+			fprintf(stderr, "Error: the JIT is not available on this platform\n");
+		else
+		{
+			// Nothing changes memory behind the program's back, so stores into data can go unchecked
+			subleq_analysis* an = create_subleq_analysis(sim);
+			subleq_jit_set_analysis(jit, an);
+			result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+				return subleq_jit_run<T>(jit, sim, n, nullptr, nullptr, subleq_sink_output<T>, sink);
+			});
+			destroy_subleq_jit(jit);
+			destroy_subleq_analysis(an);
+		}
+	}
+	else if (opt.engine == ENGINE_FUSED)
+	{
+		subleq_fusion<T> fusion;
+		subleq_fusion_build(fusion, sim);
+		result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+			return subleq_run_fused<T>(sim, fusion, n, nullptr, nullptr, subleq_sink_output<T>, sink);
+		});
+	}
+	else
+	{
+		subleq_analysis* an = create_subleq_analysis(sim);
+		result = _run_slices(sim, opt, steps, [&](const uint64_t n) {
+			return subleq_run_analyzed<T>(sim, cache, an, n, subleq_sink_output<T>, sink);
+		});
+		destroy_subleq_icache(cache);
+		destroy_subleq_analysis(an);
+	}
+	const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	_run_close_output(out, sink);
+
+	if (result != RUN_ERROR)
+		_run_print_summary(result, (int64_t)sim->_ip, sim->memsize, steps, seconds);
+	if (cycle != nullptr)
+	{
+		if (cycle->found)
+			fprintf(stderr, "loop at ip %llu, period %llu steps, repeating since step %llu\n", (unsigned long long)cycle->entry_ip,
+				(unsigned long long)cycle->period, (unsigned long long)cycle->since);
+		destroy_subleq_cycle(cycle);
+	}
+	if (profile != nullptr)
+	{
+		FILE* report = fopen(opt.profile_name, "w");
+		if (report == nullptr)
+		{
+			fprintf(stderr, "Error: could not open profile report \"%s\"\n", opt.profile_name);
+			result = RUN_ERROR;
+		}
+		else
+		{
+			subleq_profile_write(profile, sim, report, profile_report_rows);
+			fclose(report);
+		}
+		destroy_subleq_profile(profile);
+	}
+
+	destroy_subleq_source(source);
+	bin_unmap(sim);
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	RunOptions opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+		{
+			++i;
+			if (strcmp(argv[i], "interp") == 0) opt.engine = ENGINE_INTERP;
+			else if (strcmp(argv[i], "cached") == 0) opt.engine = ENGINE_CACHED;
+			else if (strcmp(argv[i], "jit") == 0) opt.engine = ENGINE_JIT;
+			else if (strcmp(argv[i], "fused") == 0) opt.engine = ENGINE_FUSED;
+			else if (strcmp(argv[i], "paged") == 0) opt.engine = ENGINE_PAGED;
+			else
+			{
+				_run_usage(argv[0]);
+				return RUN_ERROR;
+			}
+		}
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			opt.max_steps = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			opt.max_seconds = strtod(argv[++i], nullptr);
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			opt.in_name = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			opt.out_name = argv[++i];
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			opt.profile_name = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0)
+			opt.check_cycles = true;
+		else if (strcmp(argv[i], "-b") == 0)
+			opt.batch = true;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			opt.job_file = argv[++i];
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			opt.workers = (unsigned)strtoul(argv[++i], nullptr, 10);
+		else if (argv[i][0] != '-' && opt.image == nullptr)
+			opt.image = argv[i];
+		else
+		{
+			_run_usage(argv[0]);
+			return RUN_ERROR;
+		}
+	}
+	if (opt.batch && (opt.job_file == nullptr || opt.check_cycles))
+	{
+		fprintf(stderr, "Error: -b batches -j jobs and can't check them for loops, use it with -j and without -c\n");
+		return RUN_ERROR;
+	}
+	if (opt.job_file != nullptr && opt.image == nullptr)
+		return run_jobs(opt);
+	if (opt.image == nullptr)
+	{
+		_run_usage(argv[0]);
+		return RUN_ERROR;
+	}
+	if ((opt.profile_name != nullptr || opt.check_cycles) && opt.engine == ENGINE_PAGED)
+	{
+		fprintf(stderr, "Error: -%c runs on the interpreter, which can't run on paged memory\n", opt.check_cycles ? 'c' : 'p');
+		return RUN_ERROR;
+	}
+	if (opt.profile_name != nullptr && opt.check_cycles)
+	{
+		fprintf(stderr, "Error: -p and -c each need their own interpreter loop, use one at a time\n");
+		return RUN_ERROR;
+	}
+
+	// Each cell width runs through its own instantiation of the engines
+	uint8_t cell_width = 0;
+	const BIN_RESULT r = bin_peek(opt.image, &cell_width);
+	if (r != BIN_OK)
+	{
+		fprintf(stderr, "Error: %s: %s\n", opt.image, bin_result_str(r));
+		return RUN_ERROR;
+	}
+	switch (cell_width)
+	{
+	case 1:		return run_image<int8_t>(opt);
+	case 2:		return run_image<int16_t>(opt);
+	case 4:		return run_image<int32_t>(opt);
+	default:	return run_image<int64_t>(opt);
+	}
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "subleq.h"
+
+// Named snapshots of a machine. Memory is split into pages that snapshots share with
+// each other: taking one only allocates the pages that differ from the snapshot taken or
+// restored before it, and restoring one only writes the pages that differ from memory.
+// With a subleq_dirty attached to the machine only the pages stamped since a snapshot last
+// matched memory are compared, otherwise (or once memory was written untracked) all are.
+const size_t savepoint_page_size = (size_t)1 << subleq_dirty_page_bits;
+
+struct savepoint_page
+{
+	uint8_t data[savepoint_page_size];
+};
+
+template <typename T>
+struct subleq_savepoint
+{
+	T ip;
+	size_t memsize;
+	uint64_t input_pos;		// Bytes read from the machine's input
+	// The dirty epoch memory last matched it in, 0 if writes weren't tracked then
+	uint64_t synced = 0;
+	std::vector<std::shared_ptr<const savepoint_page>> pages;
+};
+
+template <typename T>
+struct subleq_savepoints
+{
+	std::map<std::string, subleq_savepoint<T>> points;
+	// The snapshot memory was last synced with, new snapshots share pages with it
+	const subleq_savepoint<T>* parent = nullptr;
+};
+
+inline size_t _savepoint_page_len(const size_t memsize, const size_t page)
+{
+	const size_t start = page * savepoint_page_size;
+	return memsize - start < savepoint_page_size ? memsize - start : savepoint_page_size;
+}
+
+// Tracks the pages state's loops write from now on, so snapshots taken after this only compare
+// those. state keeps a pointer to it, destroy it along with state.
+template <typename T>
+subleq_dirty* create_subleq_dirty(subleq<T>* state)
+{
+	subleq_dirty* dirty = new subleq_dirty();
+	dirty->stamps.assign((state->memsize + savepoint_page_size - 1) / savepoint_page_size, 0);
+	state->dirty = dirty;
+	return dirty;
+}
+
+inline void destroy_subleq_dirty(subleq_dirty* dirty)
+{ delete dirty; }
+
+// Call after writing memory in a way that doesn't stamp pages. Snapshots then compare every
+// page until they have matched memory again.
+template <typename T>
+void subleq_dirty_untracked(subleq<T>* state)
+{
+	if (state->dirty != nullptr)
+		state->dirty->untracked = state->dirty->epoch;
+}
+
+// True if only pages stamped after sp.synced can differ between sp and memory
+template <typename T>
+inline bool _savepoint_tracked(const subleq_savepoint<T>& sp, const subleq<T>* state)
+{ return state->dirty != nullptr && sp.synced != 0 && state->dirty->untracked <= sp.synced; }
+
+// Records that memory matches sp now, later writes are stamped with a newer epoch
+template <typename T>
+inline void _savepoint_sync(subleq_savepoint<T>& sp, const subleq<T>* state)
+{ sp.synced = state->dirty != nullptr ? state->dirty->epoch++ : 0; }
+
+// Captures state, sharing every page that is unchanged from parent (which may be null)
+template <typename T>
+subleq_savepoint<T> subleq_savepoint_capture(const subleq<T>* state, const subleq_savepoint<T>* parent)
+{
+	const size_t num_pages = (state->memsize + savepoint_page_size - 1) / savepoint_page_size;
+	if (parent != nullptr && parent->memsize != state->memsize)
+		parent = nullptr;
+	const bool tracked = parent != nullptr && _savepoint_tracked(*parent, state);
+
+	subleq_savepoint<T> sp;
+	sp.ip = state->_ip;
+	sp.memsize = state->memsize;
+	sp.input_pos = state->input != nullptr ? subleq_source_tell(state->input) : 0;
+	sp.pages.resize(num_pages);
+	for (size_t i = 0; i < num_pages; ++i)
+	{
+		const uint8_t* live = state->memory + i * savepoint_page_size;
+		const size_t len = _savepoint_page_len(state->memsize, i);
+		if (parent != nullptr && ((tracked && state->dirty->stamps[i] <= parent->synced) || memcmp(parent->pages[i]->data, live, len) == 0))
+		{
+			sp.pages[i] = parent->pages[i];
+			continue;
+		}
+		std::shared_ptr<savepoint_page> page = std::make_shared<savepoint_page>();
+		memcpy(page->data, live, len);
+		sp.pages[i] = std::move(page);
+	}
+	_savepoint_sync(sp, state);
+	return sp;
+}
+
+// Writes a snapshot of the same memory size back into state, returns the number of pages written.
+// The input goes back to where it was read up to, as far as its source can seek.
+template <typename T>
+int64_t subleq_savepoint_apply(subleq_savepoint<T>& sp, subleq<T>* state)
+{
+	const bool tracked = _savepoint_tracked(sp, state);
+	int64_t written = 0;
+	for (size_t i = 0; i < sp.pages.size(); ++i)
+	{
+		if (tracked && state->dirty->stamps[i] <= sp.synced)
+			continue;
+		uint8_t* live = state->memory + i * savepoint_page_size;
+		const size_t len = _savepoint_page_len(state->memsize, i);
+		if (memcmp(live, sp.pages[i]->data, len) != 0)
+		{
+			memcpy(live, sp.pages[i]->data, len);
+			if (state->dirty != nullptr)
+				state->dirty->stamps[i] = state->dirty->epoch;
+			++written;
+		}
+	}
+	_savepoint_sync(sp, state);
+	state->_ip = sp.ip;
+	if (state->input != nullptr)
+		subleq_source_seek(state->input, sp.input_pos);
+	return written;
+}
+
+// Takes a snapshot of state under name, replacing any snapshot already called that
+template <typename T>
+const subleq_savepoint<T>& subleq_savepoint_take(subleq_savepoints<T>& store, const subleq<T>* state, const std::string& name)
+{
+	subleq_savepoint<T> sp = subleq_savepoint_capture(state, store.parent);
+	subleq_savepoint<T>& stored = store.points[name];
+	stored = std::move(sp);
+	store.parent = &stored;
+	return stored;
+}
+
+// Restores the snapshot called name, returns the number of pages written or -1 if there is
+// no such snapshot or it was taken with a different memory size
+template <typename T>
+int64_t subleq_savepoint_restore(subleq_savepoints<T>& store, subleq<T>* state, const std::string& name)
+{
+	const auto it = store.points.find(name);
+	if (it == store.points.end() || it->second.memsize != state->memsize)
+		return -1;
+	const int64_t written = subleq_savepoint_apply(it->second, state);
+	state->running = false;
+	store.parent = &it->second;
+	return written;
+}
+
+template <typename T>
+void subleq_savepoint_remove(subleq_savepoints<T>& store, const std::string& name)
+{
+	const auto it = store.points.find(name);
+	if (it == store.points.end())
+		return;
+	if (store.parent == &it->second)
+		store.parent = nullptr;
+	store.points.erase(it);
+}
+
+// Bytes of page memory held by all snapshots, counting shared pages once
+template <typename T>
+size_t subleq_savepoint_bytes(const subleq_savepoints<T>& store)
+{
+	std::vector<const savepoint_page*> seen;
+	for (const auto& [name, sp] : store.points)
+		for (const std::shared_ptr<const savepoint_page>& page : sp.pages)
+			seen.push_back(page.get());
+	std::sort(seen.begin(), seen.end());
+	return (size_t)(std::unique(seen.begin(), seen.end()) - seen.begin()) * sizeof(savepoint_page);
+}
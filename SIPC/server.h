@@ -0,0 +1,959 @@
+#pragma once
+#include <algorithm>
+#include <errno.h>
+#include <memory>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "assembler.h"
+#include "binfile.h"
+#include "jit.h"
+#include "sink.h"
+
+// Debug server. Clients connect over a Unix domain socket or a TCP port on the loopback
+// address and drive machines with framed binary messages, one machine per connection. Every
+// frame starts with a server_header followed by size bytes of payload, all in this machine's
+// byte order. Replies carry the tag and op of their request. Runs report how they ended with
+// a SERVER_EV_STOP frame tagged like the SERVER_RUN, and output goes out as SERVER_EV_OUTPUT
+// frames as the program writes it.
+//
+// One thread serves every connection. Sessions that are running get a slice of steps each
+// between polls of the sockets, so commands such as reads and pauses are answered while they
+// run. Memory reads are sent straight out of the machine's memory with one gather write.
+const uint32_t server_protocol_version = 1;
+// Steps a running session takes before the sockets are polled again
+const uint64_t server_slice = 1 << 16;
+// Connections sending a larger frame are dropped
+const uint32_t server_max_frame = 64 << 20;
+
+struct server_header
+{
+	uint32_t size;		// Payload bytes after the header
+	uint32_t tag;		// Chosen by the client, echoed in the reply
+	uint8_t op;			// SERVER_OP
+	uint8_t status;		// SERVER_STATUS in replies, 0 in requests
+	uint16_t reserved;
+};
+static_assert(sizeof(server_header) == 12, "the header is sent as it is laid out");
+
+enum SERVER_OP : uint8_t
+{
+	SERVER_INFO,			// -> server_info
+	SERVER_LOAD,			// The path of a binary, or of a source ending in .s to assemble -> server_info
+	SERVER_RUN,				// u64 max steps, 0 for no limit. Replied to at once, SERVER_EV_STOP follows.
+	SERVER_STEP,			// u64 steps -> server_stop, once they ran or the machine stopped before
+	SERVER_PAUSE,			// Stops a run or step, which then reports a SERVER_STOP_PAUSED
+	SERVER_BREAK_SET,		// u64 addresses
+	SERVER_BREAK_CLEAR,		// u64 addresses, none clears every breakpoint
+	SERVER_READ,			// Pairs of u64 address and size -> the bytes of every range, back to back
+	SERVER_WRITE,			// u64 address, then the bytes to write there
+	SERVER_SET_IP,			// u64 ip
+	SERVER_INPUT,			// Bytes to add to the end of the program's input
+	SERVER_OP_COUNT,
+
+	// Sent without a request
+	SERVER_EV_STOP = 0x80,	// server_stop
+	SERVER_EV_OUTPUT,		// Program output
+};
+
+inline const char* server_op_str(const SERVER_OP op)
+{
+	switch (op)
+	{
+	case SERVER_INFO:			return "info";
+	case SERVER_LOAD:			return "load";
+	case SERVER_RUN:			return "run";
+	case SERVER_STEP:			return "step";
+	case SERVER_PAUSE:			return "pause";
+	case SERVER_BREAK_SET:		return "break set";
+	case SERVER_BREAK_CLEAR:	return "break clear";
+	case SERVER_READ:			return "read";
+	case SERVER_WRITE:			return "write";
+	case SERVER_SET_IP:			return "set ip";
+	case SERVER_INPUT:			return "input";
+	case SERVER_EV_STOP:		return "stop";
+	case SERVER_EV_OUTPUT:		return "output";
+	default:					return "unknown";
+	}
+}
+
+enum SERVER_STATUS : uint8_t
+{
+	SERVER_OK,
+	SERVER_BAD_REQUEST,		// Unknown op or a payload of the wrong size
+	SERVER_BAD_RANGE,		// An address or range outside memory
+	SERVER_NO_MACHINE,		// Nothing has been loaded yet
+	SERVER_BUSY,			// The machine is running, pause it first
+	SERVER_LOAD_FAILED,
+};
+
+inline const char* server_status_str(const SERVER_STATUS s)
+{
+	switch (s)
+	{
+	case SERVER_OK:				return "ok";
+	case SERVER_BAD_REQUEST:	return "bad request";
+	case SERVER_BAD_RANGE:		return "bad range";
+	case SERVER_NO_MACHINE:		return "no machine";
+	case SERVER_BUSY:			return "busy";
+	case SERVER_LOAD_FAILED:	return "load failed";
+	default:					return "unknown";
+	}
+}
+
+enum SERVER_STOP : uint8_t
+{
+	SERVER_STOP_HALTED,		// ip left memory
+	SERVER_STOP_FAULT,		// An instruction or operand lay outside memory
+	SERVER_STOP_BREAKPOINT,	// In front of a breakpoint
+	SERVER_STOP_DONE,		// Ran every step it was given
+	SERVER_STOP_PAUSED,		// SERVER_PAUSE
+};
+
+inline const char* server_stop_str(const SERVER_STOP s)
+{
+	switch (s)
+	{
+	case SERVER_STOP_HALTED:		return "halted";
+	case SERVER_STOP_FAULT:			return "fault";
+	case SERVER_STOP_BREAKPOINT:	return "breakpoint";
+	case SERVER_STOP_DONE:			return "done";
+	case SERVER_STOP_PAUSED:		return "paused";
+	default:						return "unknown";
+	}
+}
+
+struct server_info
+{
+	uint32_t version;
+	uint8_t cell_width;		// 0 while nothing is loaded
+	uint8_t running;		// A run or step is in progress
+	uint16_t reserved;
+	uint64_t memsize;
+	int64_t ip;
+	uint64_t steps;			// Since the machine was loaded
+	uint64_t input_pos;		// Input bytes read
+};
+
+struct server_stop
+{
+	uint8_t reason;			// SERVER_STOP
+	uint8_t reserved[7];
+	int64_t ip;
+	uint64_t steps;			// Taken by the run or step that stopped
+};
+
+#ifdef _WIN32
+typedef SOCKET server_socket;
+const server_socket server_no_socket = INVALID_SOCKET;
+#else
+typedef int server_socket;
+const server_socket server_no_socket = -1;
+#endif
+
+inline void _server_close_socket(const server_socket s)
+{
+#ifdef _WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+inline bool _server_would_block()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+inline void _server_set_nonblocking(const server_socket s)
+{
+#ifdef _WIN32
+	u_long on = 1;
+	ioctlsocket(s, FIONBIO, &on);
+#else
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+struct _server_chunk
+{
+	const uint8_t* data;
+	size_t size;
+};
+
+// Gather writes take at most this many chunks at once
+const size_t server_max_chunks = 256;
+
+// Writes as much of up to server_max_chunks chunks as the socket takes without blocking, in
+// one call. Returns the bytes written, or -1 if the connection is gone.
+inline int64_t _server_send(const server_socket s, const _server_chunk* chunks, const size_t count)
+{
+#ifdef _WIN32
+	WSABUF bufs[server_max_chunks];
+	for (size_t i = 0; i < count; ++i)
+	{
+		bufs[i].buf = (char*)chunks[i].data;
+		bufs[i].len = (ULONG)chunks[i].size;
+	}
+	DWORD sent = 0;
+	if (WSASend(s, bufs, (DWORD)count, &sent, 0, nullptr, nullptr) != 0)
+		return _server_would_block() ? 0 : -1;
+	return (int64_t)sent;
+#else
+	iovec iov[server_max_chunks];
+	for (size_t i = 0; i < count; ++i)
+	{
+		iov[i].iov_base = (void*)chunks[i].data;
+		iov[i].iov_len = chunks[i].size;
+	}
+	msghdr msg{};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+#ifdef MSG_NOSIGNAL
+	const ssize_t n = sendmsg(s, &msg, MSG_NOSIGNAL);
+#else
+	const ssize_t n = sendmsg(s, &msg, 0);
+#endif
+	if (n < 0)
+		return _server_would_block() ? 0 : -1;
+	return (int64_t)n;
+#endif
+}
+
+// Sessions stop running while more than this is waiting for a client that doesn't read
+const size_t server_max_queued = 16 << 20;
+
+struct _server_session
+{
+	server_socket sock = server_no_socket;
+	bool closed = false;
+	// Received bytes, parsing continues at in_start
+	std::vector<uint8_t> in;
+	size_t in_start = 0;
+	// Bytes the socket hasn't taken yet, from out_start on
+	std::vector<uint8_t> out;
+	size_t out_start = 0;
+
+	// A subleq<T> for T of cell_width bytes, and its JIT once the first run made one
+	uint8_t cell_width = 0;
+	void* sim = nullptr;
+	void* jit = nullptr;
+	bool jit_failed = false;
+	// One flag per memory byte, non-zero where a breakpoint is
+	std::vector<uint8_t> breakpoints;
+	uint64_t steps = 0;
+	std::vector<uint8_t> input;
+	subleq_source* source = nullptr;
+	subleq_sink* sink = nullptr;
+
+	// The run or step in progress
+	bool running = false;
+	bool stepping = false;		// Replied to once done, runs send SERVER_EV_STOP instead
+	uint32_t run_tag = 0;
+	uint64_t run_left = 0;		// UINT64_MAX for no limit
+	uint64_t run_steps = 0;
+};
+
+struct subleq_server
+{
+	server_socket listener = server_no_socket;
+	uint16_t port = 0;			// The TCP port listened on
+	std::string unix_path;		// The socket file, removed again with the server
+	bool use_jit = SUBLEQ_JIT_SUPPORTED;
+	std::vector<std::unique_ptr<_server_session>> sessions;
+};
+
+// Queues a frame, it is sent when the poll round ends
+inline void _server_queue(_server_session& s, const uint32_t tag, const uint8_t op, const uint8_t status, const void* payload, const size_t size)
+{
+	const server_header h{ (uint32_t)size, tag, op, status, 0 };
+	s.out.insert(s.out.end(), (const uint8_t*)&h, (const uint8_t*)&h + sizeof(h));
+	if (size > 0)
+		s.out.insert(s.out.end(), (const uint8_t*)payload, (const uint8_t*)payload + size);
+}
+
+inline void _server_reply(_server_session& s, const server_header& req, const SERVER_STATUS status, const void* payload=nullptr, const size_t size=0)
+{ _server_queue(s, req.tag, req.op, (uint8_t)status, payload, size); }
+
+// Writes out what is queued, false once the connection is gone
+inline bool _server_flush(_server_session& s)
+{
+	while (s.out_start < s.out.size())
+	{
+		const _server_chunk c{ s.out.data() + s.out_start, s.out.size() - s.out_start };
+		const int64_t n = _server_send(s.sock, &c, 1);
+		if (n < 0)
+			return false;
+		if (n == 0)
+			return true;
+		s.out_start += (size_t)n;
+	}
+	s.out.clear();
+	s.out_start = 0;
+	return true;
+}
+
+// Sends a frame whose payload is made up of chunks straight from where they lie, once the
+// frames queued ahead of it are out. Whatever the socket doesn't take is copied into the queue.
+inline bool _server_send_chunks(_server_session& s, const server_header& h, std::vector<_server_chunk>& chunks)
+{
+	chunks.insert(chunks.begin(), { (const uint8_t*)&h, sizeof(h) });
+	if (!_server_flush(s))
+		return false;
+	size_t first = 0;
+	while (s.out.empty() && first < chunks.size())
+	{
+		const size_t count = chunks.size() - first < server_max_chunks ? chunks.size() - first : server_max_chunks;
+		size_t total = 0;
+		for (size_t i = first; i < first + count; ++i)
+			total += chunks[i].size;
+		const int64_t n = _server_send(s.sock, chunks.data() + first, count);
+		if (n < 0)
+			return false;
+		size_t left = (size_t)n;
+		while (first < chunks.size() && left >= chunks[first].size)
+			left -= chunks[first++].size;
+		if (first < chunks.size())
+		{
+			chunks[first].data += left;
+			chunks[first].size -= left;
+		}
+		if ((size_t)n < total)
+			break;
+	}
+	for (; first < chunks.size(); ++first)
+		s.out.insert(s.out.end(), chunks[first].data, chunks[first].data + chunks[first].size);
+	return true;
+}
+
+// Sink callback, userarg is the session
+inline void _server_on_output(const char* data, size_t size, void* userarg)
+{
+	_server_session& s = *(_server_session*)userarg;
+	_server_queue(s, s.run_tag, SERVER_EV_OUTPUT, SERVER_OK, data, size);
+}
+
+template <typename T>
+void _server_free_machine(_server_session& s)
+{
+	destroy_subleq_jit((subleq_jit<T>*)s.jit);
+	destroy_subleq((subleq<T>*)s.sim);
+}
+
+inline void _server_drop_machine(_server_session& s)
+{
+	switch (s.cell_width)
+	{
+	case 0:		break;
+	case 1:		_server_free_machine<int8_t>(s); break;
+	case 2:		_server_free_machine<int16_t>(s); break;
+	case 4:		_server_free_machine<int32_t>(s); break;
+	default:	_server_free_machine<int64_t>(s); break;
+	}
+	s.sim = nullptr;
+	s.jit = nullptr;
+	s.jit_failed = false;
+	s.cell_width = 0;
+	s.running = false;
+}
+
+inline void _server_close_session(_server_session& s)
+{
+	_server_drop_machine(s);
+	destroy_subleq_source(s.source);
+	// The session is going away with whatever output is left
+	delete s.sink;
+	_server_close_socket(s.sock);
+}
+
+template <typename T>
+void _server_fill_info(const _server_session& s, server_info& info)
+{
+	const subleq<T>* sim = (const subleq<T>*)s.sim;
+	info.memsize = sim->memsize;
+	info.ip = (int64_t)sim->_ip;
+}
+
+inline server_info _server_info(const _server_session& s)
+{
+	server_info info{};
+	info.version = server_protocol_version;
+	info.cell_width = s.cell_width;
+	info.running = s.running;
+	info.steps = s.steps;
+	info.input_pos = subleq_source_tell(s.source);
+	switch (s.cell_width)
+	{
+	case 0:		break;
+	case 1:		_server_fill_info<int8_t>(s, info); break;
+	case 2:		_server_fill_info<int16_t>(s, info); break;
+	case 4:		_server_fill_info<int32_t>(s, info); break;
+	default:	_server_fill_info<int64_t>(s, info); break;
+	}
+	return info;
+}
+
+// Loads or assembles the machine at path, reading from source. Leaves the session alone.
+template <typename T>
+bool _server_build(const char* path, subleq_source* source, void** out, size_t* memsize)
+{
+	subleq<T>* sim = nullptr;
+	const size_t len = strlen(path);
+	if (len > 2 && strcmp(path + len - 2, ".s") == 0)
+	{
+		subleq_asm a;
+		if (subleq_asm_file(&a, path) != ASM_OK)
+			return false;
+		sim = subleq_asm_build<T>(&a);
+	}
+	else if (bin_load<T>(path, &sim) != BIN_OK)
+		return false;
+	if (sim == nullptr)
+		return false;
+	sim->input = source;
+	*out = sim;
+	*memsize = sim->memsize;
+	return true;
+}
+
+// Loads a binary, or assembles a source file ending in .s, replacing the session's machine.
+// Input already sent is kept and read again from the start.
+inline SERVER_STATUS _server_load(_server_session& s, const std::string& path)
+{
+	uint8_t width = 0;
+	const size_t len = path.size();
+	if (len > 2 && path.compare(len - 2, 2, ".s") == 0)
+	{
+		// Assembled twice, the width is only known once the source has been read
+		subleq_asm a;
+		if (subleq_asm_file(&a, path.c_str()) != ASM_OK)
+			return SERVER_LOAD_FAILED;
+		width = a.image_width;
+	}
+	else if (bin_peek(path.c_str(), &width) != BIN_OK)
+		return SERVER_LOAD_FAILED;
+
+	// Built before the old machine goes, so a failed load leaves it as it was
+	void* sim = nullptr;
+	size_t memsize = 0;
+	bool ok;
+	switch (width)
+	{
+	case 1:		ok = _server_build<int8_t>(path.c_str(), s.source, &sim, &memsize); break;
+	case 2:		ok = _server_build<int16_t>(path.c_str(), s.source, &sim, &memsize); break;
+	case 4:		ok = _server_build<int32_t>(path.c_str(), s.source, &sim, &memsize); break;
+	case 8:		ok = _server_build<int64_t>(path.c_str(), s.source, &sim, &memsize); break;
+	default:	ok = false; break;
+	}
+	if (!ok)
+		return SERVER_LOAD_FAILED;
+
+	_server_drop_machine(s);
+	subleq_source_seek(s.source, 0);
+	s.steps = 0;
+	s.sim = sim;
+	s.breakpoints.assign(memsize, 0);
+	s.cell_width = width;
+	return SERVER_OK;
+}
+
+// Ends the run or step in progress and tells the client why
+template <typename T>
+void _server_stop(_server_session& s, const SERVER_STOP reason)
+{
+	subleq_sink_flush(s.sink);
+	server_stop stop{};
+	stop.reason = reason;
+	stop.ip = (int64_t)((subleq<T>*)s.sim)->_ip;
+	stop.steps = s.run_steps;
+	_server_queue(s, s.run_tag, s.stepping ? SERVER_STEP : SERVER_EV_STOP, SERVER_OK, &stop, sizeof(stop));
+	s.running = false;
+}
+
+// Runs the next slice of the run or step in progress. Steps go through the interpreter and
+// runs through the JIT when there is one. Both stop in front of breakpoints, except at the
+// instruction a run starts from so it can continue from the breakpoint it stopped at.
+template <typename T>
+void _server_slice(subleq_server* srv, _server_session& s)
+{
+	subleq<T>* sim = (subleq<T>*)s.sim;
+	const uint8_t* stop_at = s.breakpoints.data();
+	if (s.run_steps > 0 && (size_t)sim->_ip < sim->memsize && stop_at[(size_t)sim->_ip])
+		return _server_stop<T>(s, SERVER_STOP_BREAKPOINT);
+
+	if (!s.stepping && srv->use_jit && s.jit == nullptr && !s.jit_failed)
+	{
+		s.jit = create_subleq_jit<T>(sim);
+		s.jit_failed = s.jit == nullptr;
+	}
+	const uint64_t n = s.run_left < server_slice ? s.run_left : server_slice;
+	uint64_t done = 0;
+	if (!s.stepping && s.jit != nullptr)
+		done = subleq_jit_run<T>((subleq_jit<T>*)s.jit, sim, n, stop_at, nullptr, subleq_sink_output<T>, s.sink);
+	else
+	{
+		while (done < n)
+		{
+			const size_t ip = (size_t)sim->_ip;
+			if (done > 0 && ip < sim->memsize && stop_at[ip])
+				break;
+			const bool more = subleq_step<T>(sim, subleq_sink_output<T>, s.sink);
+			if (more || !((size_t)sim->_ip < sim->memsize))
+				++done;
+			if (!more)
+				break;
+		}
+	}
+	s.run_steps += done;
+	s.steps += done;
+	if (s.run_left != UINT64_MAX)
+		s.run_left -= done;
+
+	const size_t ip = (size_t)sim->_ip;
+	if (!(ip < sim->memsize))
+		_server_stop<T>(s, SERVER_STOP_HALTED);
+	else if (done < n)
+		_server_stop<T>(s, done > 0 && stop_at[ip] ? SERVER_STOP_BREAKPOINT : SERVER_STOP_FAULT);
+	else if (s.run_left == 0)
+		_server_stop<T>(s, SERVER_STOP_DONE);
+	else
+		subleq_sink_flush(s.sink);
+}
+
+inline void _server_run_slice(subleq_server* srv, _server_session& s)
+{
+	switch (s.cell_width)
+	{
+	case 1:		_server_slice<int8_t>(srv, s); break;
+	case 2:		_server_slice<int16_t>(srv, s); break;
+	case 4:		_server_slice<int32_t>(srv, s); break;
+	default:	_server_slice<int64_t>(srv, s); break;
+	}
+}
+
+inline uint64_t _server_u64(const uint8_t* p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+template <typename T>
+void _server_flush_jit(_server_session& s)
+{
+	if (s.jit != nullptr)
+		subleq_jit_flush((subleq_jit<T>*)s.jit, ((subleq<T>*)s.sim)->memsize);
+}
+
+// Requests that need a machine
+template <typename T>
+bool _server_machine_request(subleq_server* srv, _server_session& s, const server_header& h, const uint8_t* p)
+{
+	subleq<T>* sim = (subleq<T>*)s.sim;
+	const size_t memsize = sim->memsize;
+	switch (h.op)
+	{
+	case SERVER_RUN:
+	case SERVER_STEP:
+	{
+		if (h.size != 8)
+			break;
+		if (s.running)
+			return _server_reply(s, h, SERVER_BUSY), true;
+		const uint64_t n = _server_u64(p);
+		s.running = true;
+		s.stepping = h.op == SERVER_STEP;
+		s.run_tag = h.tag;
+		s.run_left = n == 0 && h.op == SERVER_RUN ? UINT64_MAX : n;
+		s.run_steps = 0;
+		if (h.op == SERVER_RUN)
+			_server_reply(s, h, SERVER_OK);
+		// Short steps are done before the next request is looked at
+		_server_slice<T>(srv, s);
+		return true;
+	}
+	case SERVER_BREAK_SET:
+	case SERVER_BREAK_CLEAR:
+	{
+		if (h.size % 8 != 0)
+			break;
+		for (uint32_t i = 0; i < h.size; i += 8)
+			if (_server_u64(p + i) >= memsize)
+				return _server_reply(s, h, SERVER_BAD_RANGE), true;
+		if (h.op == SERVER_BREAK_CLEAR && h.size == 0)
+			std::fill(s.breakpoints.begin(), s.breakpoints.end(), 0);
+		for (uint32_t i = 0; i < h.size; i += 8)
+			s.breakpoints[(size_t)_server_u64(p + i)] = h.op == SERVER_BREAK_SET;
+		_server_flush_jit<T>(s);
+		_server_reply(s, h, SERVER_OK);
+		return true;
+	}
+	case SERVER_READ:
+	{
+		if (h.size % 16 != 0)
+			break;
+		std::vector<_server_chunk> chunks;
+		chunks.reserve(h.size / 16 + 1);
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < h.size; i += 16)
+		{
+			const uint64_t addr = _server_u64(p + i);
+			const uint64_t size = _server_u64(p + i + 8);
+			if (addr > memsize || size > memsize - addr)
+				return _server_reply(s, h, SERVER_BAD_RANGE), true;
+			total += size;
+			chunks.push_back({ sim->memory + addr, (size_t)size });
+		}
+		if (total > UINT32_MAX)
+			return _server_reply(s, h, SERVER_BAD_RANGE), true;
+		const server_header reply{ (uint32_t)total, h.tag, h.op, SERVER_OK, 0 };
+		s.closed = s.closed || !_server_send_chunks(s, reply, chunks);
+		return true;
+	}
+	case SERVER_WRITE:
+	{
+		if (h.size < 8)
+			break;
+		if (s.running)
+			return _server_reply(s, h, SERVER_BUSY), true;
+		const uint64_t addr = _server_u64(p);
+		const size_t size = h.size - 8;
+		if (addr > memsize || size > memsize - addr)
+			return _server_reply(s, h, SERVER_BAD_RANGE), true;
+		memcpy(sim->memory + addr, p + 8, size);
+		_server_flush_jit<T>(s);
+		_server_reply(s, h, SERVER_OK);
+		return true;
+	}
+	case SERVER_SET_IP:
+	{
+		if (h.size != 8)
+			break;
+		if (s.running)
+			return _server_reply(s, h, SERVER_BUSY), true;
+		sim->_ip = (T)_server_u64(p);
+		_server_reply(s, h, SERVER_OK);
+		return true;
+	}
+	}
+	return false;
+}
+
+// Answers one request, p points at its h.size bytes of payload
+inline void _server_request(subleq_server* srv, _server_session& s, const server_header& h, const uint8_t* p)
+{
+	bool handled = true;
+	switch (h.op)
+	{
+	case SERVER_INFO:
+	{
+		const server_info info = _server_info(s);
+		_server_reply(s, h, SERVER_OK, &info, sizeof(info));
+		break;
+	}
+	case SERVER_LOAD:
+	{
+		if (s.running)
+			_server_reply(s, h, SERVER_BUSY);
+		else
+		{
+			const SERVER_STATUS r = _server_load(s, std::string((const char*)p, h.size));
+			const server_info info = _server_info(s);
+			_server_reply(s, h, r, &info, r == SERVER_OK ? sizeof(info) : 0);
+		}
+		break;
+	}
+	case SERVER_PAUSE:
+	{
+		if (s.running)
+		{
+			switch (s.cell_width)
+			{
+			case 1:		_server_stop<int8_t>(s, SERVER_STOP_PAUSED); break;
+			case 2:		_server_stop<int16_t>(s, SERVER_STOP_PAUSED); break;
+			case 4:		_server_stop<int32_t>(s, SERVER_STOP_PAUSED); break;
+			default:	_server_stop<int64_t>(s, SERVER_STOP_PAUSED); break;
+			}
+		}
+		_server_reply(s, h, SERVER_OK);
+		break;
+	}
+	case SERVER_INPUT:
+	{
+		s.input.insert(s.input.end(), p, p + h.size);
+		subleq_source_set_buffer(s.source, s.input.data(), s.input.size());
+		_server_reply(s, h, SERVER_OK);
+		break;
+	}
+	default:
+		if (h.op >= SERVER_OP_COUNT)
+			handled = false;
+		else if (s.sim == nullptr)
+			_server_reply(s, h, SERVER_NO_MACHINE);
+		else
+		{
+			switch (s.cell_width)
+			{
+			case 1:		handled = _server_machine_request<int8_t>(srv, s, h, p); break;
+			case 2:		handled = _server_machine_request<int16_t>(srv, s, h, p); break;
+			case 4:		handled = _server_machine_request<int32_t>(srv, s, h, p); break;
+			default:	handled = _server_machine_request<int64_t>(srv, s, h, p); break;
+			}
+		}
+		break;
+	}
+	if (!handled)
+		_server_reply(s, h, SERVER_BAD_REQUEST);
+}
+
+// Answers every complete request that has been received
+inline void _server_parse(subleq_server* srv, _server_session& s)
+{
+	while (!s.closed && s.in.size() - s.in_start >= sizeof(server_header))
+	{
+		server_header h;
+		memcpy(&h, s.in.data() + s.in_start, sizeof(h));
+		if (h.size > server_max_frame)
+		{
+			s.closed = true;
+			break;
+		}
+		if (s.in.size() - s.in_start - sizeof(h) < h.size)
+			break;
+		s.in_start += sizeof(h) + h.size;
+		_server_request(srv, s, h, s.in.data() + s.in_start - h.size);
+	}
+	if (s.in_start == s.in.size())
+	{
+		s.in.clear();
+		s.in_start = 0;
+	}
+	else if (s.in_start > s.in.size() / 2)
+	{
+		s.in.erase(s.in.begin(), s.in.begin() + (ptrdiff_t)s.in_start);
+		s.in_start = 0;
+	}
+}
+
+// Reads what has arrived and answers every complete request in it. At most one largest frame
+// is buffered and read per call, a client that sends faster is left waiting in the socket
+// until the next poll so it can't take all the memory or starve the other sessions.
+inline void _server_receive(subleq_server* srv, _server_session& s)
+{
+	const size_t limit = server_max_frame + sizeof(server_header);
+	uint8_t buf[64 * 1024];
+	size_t received = 0;
+	while (!s.closed && received < limit && s.in.size() - s.in_start < limit)
+	{
+		const size_t room = std::min(sizeof(buf), limit - (s.in.size() - s.in_start));
+		const int n = (int)recv(s.sock, (char*)buf, (int)room, 0);
+		if (n > 0)
+		{
+			s.in.insert(s.in.end(), buf, buf + n);
+			received += (size_t)n;
+			_server_parse(srv, s);
+			continue;
+		}
+		if (n == 0 || !_server_would_block())
+			s.closed = true;
+		break;
+	}
+}
+
+inline bool _server_startup()
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+	return true;
+#endif
+}
+
+inline void _server_cleanup()
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+inline subleq_server* _create_subleq_server(const server_socket listener)
+{
+	if (listen(listener, SOMAXCONN) != 0)
+	{
+		_server_close_socket(listener);
+		_server_cleanup();
+		return nullptr;
+	}
+	_server_set_nonblocking(listener);
+	subleq_server* srv = new subleq_server();
+	srv->listener = listener;
+	return srv;
+}
+
+// Listens on port on the loopback address, 0 picks a free port and stores it in port.
+// Returns nullptr if the port can't be listened on.
+inline subleq_server* create_subleq_server_tcp(const uint16_t port)
+{
+	if (!_server_startup())
+		return nullptr;
+	const server_socket sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == server_no_socket)
+		return _server_cleanup(), nullptr;
+	const int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(sock, (const sockaddr*)&addr, len) != 0 || getsockname(sock, (sockaddr*)&addr, &len) != 0)
+	{
+		_server_close_socket(sock);
+		_server_cleanup();
+		return nullptr;
+	}
+	subleq_server* srv = _create_subleq_server(sock);
+	if (srv != nullptr)
+		srv->port = ntohs(addr.sin_port);
+	return srv;
+}
+
+// Listens on a Unix domain socket at path, replacing a stale socket file left there.
+// Returns nullptr where there are no Unix domain sockets or path can't be bound.
+inline subleq_server* create_subleq_server_unix(const char* path)
+{
+#ifdef _WIN32
+	return nullptr;
+#else
+	sockaddr_un addr{};
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return nullptr;
+	const server_socket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == server_no_socket)
+		return nullptr;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		_server_close_socket(sock);
+		return nullptr;
+	}
+	subleq_server* srv = _create_subleq_server(sock);
+	if (srv != nullptr)
+		srv->unix_path = path;
+	return srv;
+#endif
+}
+
+inline void destroy_subleq_server(subleq_server* srv)
+{
+	if (srv == nullptr)
+		return;
+	for (auto& s : srv->sessions)
+		_server_close_session(*s);
+	_server_close_socket(srv->listener);
+#ifndef _WIN32
+	if (!srv->unix_path.empty())
+		unlink(srv->unix_path.c_str());
+#endif
+	_server_cleanup();
+	delete srv;
+}
+
+#ifdef _WIN32
+typedef WSAPOLLFD _server_pollfd;
+inline int _server_poll(_server_pollfd* fds, const size_t count, const int timeout_ms)
+{ return WSAPoll(fds, (ULONG)count, timeout_ms); }
+#else
+typedef pollfd _server_pollfd;
+inline int _server_poll(_server_pollfd* fds, const size_t count, const int timeout_ms)
+{ return poll(fds, (nfds_t)count, timeout_ms); }
+#endif
+
+// True if the session has a run it can go on with
+inline bool _server_can_run(const _server_session& s)
+{ return s.running && s.out.size() - s.out_start < server_max_queued; }
+
+// Serves one round: waits up to timeout_ms for something to happen (not at all while a
+// session is running), takes new connections, answers requests, runs a slice of every
+// running session and sends what is queued. Returns the number of open sessions.
+inline size_t subleq_server_poll(subleq_server* srv, const int timeout_ms)
+{
+	std::vector<_server_pollfd> fds(srv->sessions.size() + 1);
+	fds[0].fd = srv->listener;
+	fds[0].events = POLLIN;
+	bool busy = false;
+	for (size_t i = 0; i < srv->sessions.size(); ++i)
+	{
+		const _server_session& s = *srv->sessions[i];
+		fds[i + 1].fd = s.sock;
+		fds[i + 1].events = POLLIN | (s.out.empty() ? 0 : POLLOUT);
+		busy = busy || _server_can_run(s);
+	}
+	if (_server_poll(fds.data(), fds.size(), busy ? 0 : timeout_ms) < 0)
+		return srv->sessions.size();
+
+	for (size_t i = 0; i + 1 < fds.size(); ++i)
+		if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+			_server_receive(srv, *srv->sessions[i]);
+	if (fds[0].revents & POLLIN)
+	{
+		while (true)
+		{
+			const server_socket sock = accept(srv->listener, nullptr, nullptr);
+			if (sock == server_no_socket)
+				break;
+			_server_set_nonblocking(sock);
+			const int on = 1;
+			// Fails harmlessly on Unix domain sockets
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+			auto s = std::make_unique<_server_session>();
+			s->sock = sock;
+			s->source = create_subleq_source_buffer(nullptr, 0);
+			s->sink = create_subleq_sink_callback(_server_on_output, s.get());
+			srv->sessions.push_back(std::move(s));
+		}
+	}
+
+	for (size_t i = 0; i < srv->sessions.size();)
+	{
+		_server_session& s = *srv->sessions[i];
+		if (!s.closed && _server_can_run(s))
+			_server_run_slice(srv, s);
+		if (!s.closed && !_server_flush(s))
+			s.closed = true;
+		if (s.closed)
+		{
+			_server_close_session(s);
+			srv->sessions.erase(srv->sessions.begin() + (ptrdiff_t)i);
+		}
+		else
+			++i;
+	}
+	return srv->sessions.size();
+}
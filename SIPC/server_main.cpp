@@ -0,0 +1,65 @@
+// Debug server: lets other programs load, run, step and inspect machines over a socket
+//   subleq-server [-e interp|jit] -p port
+//   subleq-server [-e interp|jit] -u socket_path
+#include <signal.h>
+#include <stdlib.h>
+#include "server.h"
+
+static void _server_usage(const char* exe)
+{
+	fprintf(stderr,
+		"Usage: %s [-e interp|jit] -p <port>\n"
+		"       %s [-e interp|jit] -u <socket path>\n"
+		"  -p <port>      Listen on a TCP port on 127.0.0.1, 0 picks a free one\n"
+		"  -u <path>      Listen on a Unix domain socket\n"
+		"  -e <engine>    What runs use, jit (the default where there is one) or interp.\n"
+		"                 Steps always run on the interpreter.\n",
+		exe, exe);
+}
+
+int main(int argc, char** argv)
+{
+	const char* unix_path = nullptr;
+	long port = -1;
+	bool use_jit = SUBLEQ_JIT_SUPPORTED;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			port = strtol(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+			unix_path = argv[++i];
+		else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && strcmp(argv[i + 1], "interp") == 0)
+			use_jit = false, ++i;
+		else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && strcmp(argv[i + 1], "jit") == 0)
+			++i;
+		else
+		{
+			_server_usage(argv[0]);
+			return 1;
+		}
+	}
+	if ((unix_path == nullptr) == (port < 0) || port > 65535)
+	{
+		_server_usage(argv[0]);
+		return 1;
+	}
+
+#ifndef _WIN32
+	// A client hanging up mid-reply must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	subleq_server* srv = unix_path != nullptr ? create_subleq_server_unix(unix_path) : create_subleq_server_tcp((uint16_t)port);
+	if (srv == nullptr)
+	{
+		fprintf(stderr, "Error: can't listen on %s\n", unix_path != nullptr ? unix_path : "that port");
+		return 1;
+	}
+	srv->use_jit = use_jit;
+	if (unix_path != nullptr)
+		fprintf(stderr, "Listening on %s\n", unix_path);
+	else
+		fprintf(stderr, "Listening on 127.0.0.1:%u\n", (unsigned)srv->port);
+
+	while (true)
+		subleq_server_poll(srv, 1000);
+}
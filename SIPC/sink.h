@@ -0,0 +1,168 @@
+#pragma once
+#include <atomic>
+#include "subleq.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Batched program output. A sink collects output bytes in a small buffer and hands them
+// on in one piece once threshold bytes have built up, when an output instruction halts the
+// machine, or when flushed. Pass subleq_sink_output<T> as the output callback of any engine
+// with the sink as its userarg, and flush it after a run stops for any other reason.
+const size_t subleq_sink_capacity = 4096;
+
+enum SUBLEQ_SINK : uint8_t
+{
+	SINK_DISCARD,		// Output is dropped
+	SINK_CALLBACK,		// Batches are passed to a function
+	SINK_RING,			// Batches are copied into a caller-provided ring buffer
+	SINK_FD,			// Batches are written to a file descriptor
+};
+
+typedef void (*subleq_sink_fn)(const char* data, size_t size, void* userarg);
+
+// Single producer, single consumer: the sink only moves head and the reader only moves
+// tail, so output can be read from another thread while the machine runs.
+struct subleq_ring
+{
+	char* data = nullptr;
+	size_t capacity = 0;
+	std::atomic<size_t> head{ 0 };
+	std::atomic<size_t> tail{ 0 };
+};
+
+// Copies up to max unread bytes out of the ring, returning how many were read
+inline size_t subleq_ring_read(subleq_ring* ring, char* dst, const size_t max)
+{
+	const size_t tail = ring->tail.load(std::memory_order_relaxed);
+	const size_t head = ring->head.load(std::memory_order_acquire);
+	const size_t n = head - tail < max ? head - tail : max;
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = ring->data[(tail + i) % ring->capacity];
+	ring->tail.store(tail + n, std::memory_order_release);
+	return n;
+}
+
+struct subleq_sink
+{
+	SUBLEQ_SINK kind = SINK_DISCARD;
+	subleq_sink_fn callback = nullptr;
+	void* userarg = nullptr;
+	subleq_ring* ring = nullptr;
+	int fd = -1;
+	size_t threshold = subleq_sink_capacity;
+	size_t size = 0;
+	// Bytes lost because a ring stayed full or a write failed
+	uint64_t dropped = 0;
+	char buf[subleq_sink_capacity];
+};
+
+inline subleq_sink* _create_subleq_sink(const SUBLEQ_SINK kind, const size_t threshold)
+{
+	subleq_sink* sink = new subleq_sink();
+	sink->kind = kind;
+	sink->threshold = threshold == 0 || threshold > subleq_sink_capacity ? subleq_sink_capacity : threshold;
+	return sink;
+}
+
+inline subleq_sink* create_subleq_sink_callback(subleq_sink_fn fn, void* userarg, const size_t threshold=subleq_sink_capacity)
+{
+	subleq_sink* sink = _create_subleq_sink(SINK_CALLBACK, threshold);
+	sink->callback = fn;
+	sink->userarg = userarg;
+	return sink;
+}
+
+inline subleq_sink* create_subleq_sink_ring(subleq_ring* ring, const size_t threshold=subleq_sink_capacity)
+{
+	subleq_sink* sink = _create_subleq_sink(SINK_RING, threshold);
+	sink->ring = ring;
+	return sink;
+}
+
+inline subleq_sink* create_subleq_sink_fd(const int fd, const size_t threshold=subleq_sink_capacity)
+{
+	subleq_sink* sink = _create_subleq_sink(SINK_FD, threshold);
+	sink->fd = fd;
+	return sink;
+}
+
+// Passes on everything buffered. A full ring keeps what didn't fit for the next flush.
+inline void subleq_sink_flush(subleq_sink* sink)
+{
+	if (sink->size == 0)
+		return;
+	size_t done = sink->size;
+	if (sink->kind == SINK_CALLBACK)
+		sink->callback(sink->buf, sink->size, sink->userarg);
+	else if (sink->kind == SINK_FD)
+	{
+		done = 0;
+		while (done < sink->size)
+		{
+#ifdef _WIN32
+			const int n = _write(sink->fd, sink->buf + done, (unsigned int)(sink->size - done));
+#else
+			const ssize_t n = write(sink->fd, sink->buf + done, sink->size - done);
+#endif
+			if (n <= 0)
+			{
+				sink->dropped += sink->size - done;
+				done = sink->size;
+				break;
+			}
+			done += (size_t)n;
+		}
+	}
+	else if (sink->kind == SINK_RING)
+	{
+		subleq_ring* ring = sink->ring;
+		const size_t head = ring->head.load(std::memory_order_relaxed);
+		const size_t free = ring->capacity - (head - ring->tail.load(std::memory_order_acquire));
+		done = sink->size < free ? sink->size : free;
+		for (size_t i = 0; i < done; ++i)
+			ring->data[(head + i) % ring->capacity] = sink->buf[i];
+		ring->head.store(head + done, std::memory_order_release);
+		memmove(sink->buf, sink->buf + done, sink->size - done);
+	}
+	sink->size -= done;
+}
+
+inline void subleq_sink_put(subleq_sink* sink, const char c)
+{
+	if (sink->size == subleq_sink_capacity)
+	{
+		subleq_sink_flush(sink);
+		if (sink->size == subleq_sink_capacity)
+		{
+			sink->dropped++;
+			return;
+		}
+	}
+	sink->buf[sink->size++] = c;
+	if (sink->size >= sink->threshold)
+		subleq_sink_flush(sink);
+}
+
+// Flushes whatever is left before freeing the sink
+inline void destroy_subleq_sink(subleq_sink* sink)
+{
+	if (sink == nullptr)
+		return;
+	subleq_sink_flush(sink);
+	delete sink;
+}
+
+// Output callback for the engines, userarg is the subleq_sink
+template <typename T>
+void subleq_sink_output(subleq<T>* state, T& value, const T& current_ip, void* userarg)
+{
+	subleq_sink* sink = (subleq_sink*)userarg;
+	subleq_sink_put(sink, (char)value);
+	// An output instruction jumping out of memory is the last thing the program does
+	const size_t ip = (size_t)current_ip;
+	if (_subleq_in_bounds(state, ip + sizeof(T) * 2) && !((size_t)*(T*)(state->memory + ip + sizeof(T) * 2) < state->memsize))
+		subleq_sink_flush(sink);
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Program input. Input instructions take their bytes from a source, which always serves them
+// out of a block of memory: a buffer the caller owns, a whole file mapped in, or a block that
+// is refilled from a file descriptor a megabyte at a time. Reading a byte is a compare and a
+// load until a block runs out, so programs that consume lots of data aren't held up by it.
+const size_t subleq_source_block = 1 << 20;
+// Bytes of a stream kept in front of every new block, so stepping back over input still
+// works right after a refill
+const size_t subleq_source_keep = 4096;
+
+enum SUBLEQ_SOURCE : uint8_t
+{
+	SOURCE_BUFFER,		// Bytes owned by the caller, which must outlive the source
+	SOURCE_MAPPED,		// A file mapped into memory
+	SOURCE_FD,			// Read from a file descriptor in blocks
+};
+
+inline const char* subleq_source_str(const SUBLEQ_SOURCE s)
+{
+	switch (s)
+	{
+	case SOURCE_BUFFER:	return "buffer";
+	case SOURCE_MAPPED:	return "mapped";
+	case SOURCE_FD:		return "fd";
+	default:			return "unknown";
+	}
+}
+
+struct subleq_source
+{
+	SUBLEQ_SOURCE kind = SOURCE_BUFFER;
+	// The bytes in memory and how far into them reading got
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	uint64_t base = 0;			// Offset of data[0] in the whole input
+	int fd = -1;
+	bool owns_fd = false;
+	bool eof = false;			// The descriptor has nothing more to give
+	uint8_t* block = nullptr;	// subleq_source_keep + subleq_source_block bytes for SOURCE_FD
+	void* map = nullptr;
+	size_t map_size = 0;
+};
+
+inline subleq_source* create_subleq_source_buffer(const void* data, const size_t size)
+{
+	subleq_source* src = new subleq_source();
+	src->data = (const uint8_t*)data;
+	src->size = size;
+	return src;
+}
+
+// Nothing is read until the program asks for a byte, so an interactive descriptor only
+// blocks once input is needed. With owns_fd the descriptor is closed with the source.
+inline subleq_source* create_subleq_source_fd(const int fd, const bool owns_fd=false)
+{
+	subleq_source* src = new subleq_source();
+	src->kind = SOURCE_FD;
+	src->fd = fd;
+	src->owns_fd = owns_fd;
+	src->block = new uint8_t[subleq_source_keep + subleq_source_block];
+	src->data = src->block;
+	return src;
+}
+
+// Maps the file when possible and reads it in blocks otherwise. Returns nullptr if it can't
+// be opened.
+inline subleq_source* create_subleq_source_file(const char* fname)
+{
+#ifdef _WIN32
+	const int fd = _open(fname, _O_RDONLY | _O_BINARY);
+	return fd < 0 ? nullptr : create_subleq_source_fd(fd, true);
+#else
+	const int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return create_subleq_source_fd(fd, true);
+	void* map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return create_subleq_source_fd(fd, true);
+	close(fd);
+	// Input is read front to back, let the kernel read ahead of it
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	subleq_source* src = create_subleq_source_buffer(map, (size_t)st.st_size);
+	src->kind = SOURCE_MAPPED;
+	src->map = map;
+	src->map_size = (size_t)st.st_size;
+	return src;
+#endif
+}
+
+// Points a buffer source at new bytes, such as the same buffer after it grew, keeping the
+// read position
+inline void subleq_source_set_buffer(subleq_source* src, const void* data, const size_t size)
+{
+	src->data = (const uint8_t*)data;
+	src->size = size;
+	if (src->pos > size)
+		src->pos = size;
+}
+
+inline void destroy_subleq_source(subleq_source* src)
+{
+	if (src == nullptr)
+		return;
+#ifndef _WIN32
+	if (src->map != nullptr)
+		munmap(src->map, src->map_size);
+#endif
+	if (src->owns_fd)
+	{
+#ifdef _WIN32
+		_close(src->fd);
+#else
+		close(src->fd);
+#endif
+	}
+	delete[] src->block;
+	delete src;
+}
+
+// Reads the next block of a descriptor, keeping the end of the last one in front of it.
+// False once there is no more input.
+inline bool _subleq_source_refill(subleq_source* src)
+{
+	if (src->kind != SOURCE_FD || src->eof)
+		return false;
+	const size_t keep = src->size < subleq_source_keep ? src->size : subleq_source_keep;
+	memmove(src->block, src->data + src->size - keep, keep);
+	src->base += src->size - keep;
+	src->data = src->block;
+	src->size = keep;
+	src->pos = keep;
+	while (true)
+	{
+#ifdef _WIN32
+		const int n = _read(src->fd, src->block + keep, (unsigned int)subleq_source_block);
+#else
+		const ssize_t n = read(src->fd, src->block + keep, subleq_source_block);
+#endif
+		if (n > 0)
+		{
+			src->size += (size_t)n;
+			return true;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		src->eof = true;
+		return false;
+	}
+}
+
+// The next byte, or -1 at the end of input
+inline int subleq_source_get(subleq_source* src)
+{
+	if (src->pos < src->size || _subleq_source_refill(src))
+		return src->data[src->pos++];
+	return -1;
+}
+
+// How many bytes have been read
+inline uint64_t subleq_source_tell(const subleq_source* src)
+{ return src->base + src->pos; }
+
+// Moves the read position to offset at. Streams can only go back as far as the block in
+// memory and the bytes kept in front of it, returns false if at lies outside that.
+inline bool subleq_source_seek(subleq_source* src, const uint64_t at)
+{
+	if (at < src->base || at - src->base > src->size)
+		return false;
+	src->pos = (size_t)(at - src->base);
+	return true;
+}
+
+// Puts the last byte read back, for stepping backwards
+inline bool subleq_source_unget(subleq_source* src)
+{
+	const uint64_t at = subleq_source_tell(src);
+	return at > 0 && subleq_source_seek(src, at - 1);
+}
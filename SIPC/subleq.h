@@ -3,6 +3,24 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <type_traits>
+#include <vector>
+#include "source.h"
+
+// Which pages of memory were written when, so snapshots (savepoint.h) only look at pages
+// written since they last matched memory. The interpreter, recorded, profiled and checked
+// loops stamp every page they write with the current epoch. Anything else that writes
+// memory, like the JIT or an edit from outside, has to call subleq_dirty_untracked.
+const size_t subleq_dirty_page_bits = 12;
+
+struct subleq_dirty
+{
+	// The epoch each page was last written in
+	std::vector<uint64_t> stamps;
+	uint64_t epoch = 1;
+	// The last epoch memory was written without stamping, snapshots synced before it compare
+	uint64_t untracked = 0;
+};
 
 template <typename T>
 struct subleq
@@ -10,6 +28,10 @@ struct subleq
 	T _ip;
 	size_t memsize;
 	bool running;
+	// Where input instructions read from, they read -1 while this is nullptr
+	subleq_source* input;
+	// Set while writes are tracked for savepoints, nullptr otherwise. Not owned.
+	subleq_dirty* dirty;
 	uint8_t memory[0];
 };
 
@@ -22,6 +44,8 @@ subleq<T>* create_subleq(size_t memory_size=255)
 	x->_ip = 0;
 	x->memsize = memory_size;
 	x->running = false;
+	x->input = nullptr;
+	x->dirty = nullptr;
 	memset(x->memory, 0, memory_size);
 	return x;
 }
@@ -31,31 +55,485 @@ void destroy_subleq(subleq<T>* state)
 { free(state); }
 
 
+// Called for every output instruction, engines drop output when no callback is given.
+// sink.h has a batching callback that forwards to a function, ring buffer or file descriptor.
+template <typename T>
+using subleq_output_fn = void (*)(subleq<T>* state, T& value, const T& current_ip, void* userarg);
+
+// Operands are byte addresses into memory and are read as unsigned values
+template <typename T>
+constexpr size_t _subleq_addr(const T v)
+{ return (size_t)(std::make_unsigned_t<T>)v; }
+
+// Wrapping subtraction, signed overflow would be undefined for the wider cell types
+template <typename T>
+constexpr T _subleq_sub(const T x, const T y)
+{ return (T)((std::make_unsigned_t<T>)x - (std::make_unsigned_t<T>)y); }
+
+// True if a cell at addr lies entirely inside memory
+template <typename T>
+inline bool _subleq_in_bounds(const subleq<T>* state, const size_t addr)
+{ return addr <= state->memsize && state->memsize - addr >= sizeof(T); }
+
+// Data watchpoints. flags has an entry per memory byte, non-zero for watched bytes, and the
+// run loops that take one consult it only for the single cell each step writes. They stop
+// right after the first write to a watched cell and leave it here until the caller clears it.
+struct subleq_watch
+{
+	const uint8_t* flags = nullptr;
+	size_t addr = SIZE_MAX;		// The cell that was written, SIZE_MAX while nothing was hit
+	size_t ip = 0;				// The instruction that wrote it
+
+	bool hit() const { return addr != SIZE_MAX; }
+	void clear() { addr = SIZE_MAX; }
+};
+
+// Records a write of the cell at addr by the instruction at ip, true if it was watched.
+// Watched ranges cover whole cells, so a write touches one if either of its ends does.
+template <typename T>
+inline bool _subleq_watch_write(subleq_watch* watch, const size_t addr, const size_t ip)
+{
+	if (!(watch->flags[addr] | watch->flags[addr + sizeof(T) - 1]))
+		return false;
+	watch->addr = addr;
+	watch->ip = ip;
+	return true;
+}
+
+// Stamps the pages a write of the cell at addr touched
+template <typename T>
+inline void _subleq_dirty_write(subleq_dirty* dirty, const size_t addr)
+{
+	dirty->stamps[addr >> subleq_dirty_page_bits] = dirty->epoch;
+	dirty->stamps[(addr + sizeof(T) - 1) >> subleq_dirty_page_bits] = dirty->epoch;
+}
+
+// The next input byte, or -1 at the end of input or when there is no source. With 8-bit
+// cells byte 255 reads the same as the end of input.
+template <typename T>
+inline T _subleq_input(subleq_source* input)
+{ return input != nullptr ? (T)subleq_source_get(input) : (T)(-1); }
+
+// Executes one instruction at ip:
+//   if b == -1: output memory[a] and jump to c
+//   if a == -1: read an input byte into memory[b] and jump to c
+//   else:       memory[b] -= memory[a], jump to c if memory[b] <= 0
+// The machine halts once ip >= memsize, or when an instruction or operand lies outside memory.
 template <typename T>
 bool subleq_step(subleq<T>* state, void (*FN_OnOutput)(subleq<T>* state, T& value, const T& current_ip, void* userarg)=nullptr, void* userarg=nullptr)
 {
 	state->running = state->_ip < state->memsize;
 	if (!state->running)
 		return false;
-	const T& a = *(T*)(state->memory+state->_ip);
-	T& b = *(T*)(state->memory+state->_ip + sizeof(T));
-	const T& c = *(T*)(state->memory + state->_ip + sizeof(T) * 2);
+	const size_t ip = (size_t)state->_ip;
+	if (!_subleq_in_bounds(state, ip + sizeof(T) * 2))
+		return state->running = false;
+	const T a = *(T*)(state->memory + ip);
+	const T b = *(T*)(state->memory + ip + sizeof(T));
+	const T c = *(T*)(state->memory + ip + sizeof(T) * 2);
+	const size_t a_addr = _subleq_addr(a);
+	const bool in = a == ((T)(-1)) && b != ((T)(-1));
+	if (!in && !_subleq_in_bounds(state, a_addr))
+		return state->running = false;
 
 	if (b == ((T)(-1)))
 	{
 		if (FN_OnOutput != nullptr)
-			FN_OnOutput(state, *(T*)(state->memory+a), state->_ip, userarg);
-		printf("%c", (char)state->memory[a]);
+			FN_OnOutput(state, *(T*)(state->memory + a_addr), state->_ip, userarg);
+		state->_ip = c;
 	}
-	else b = b - a;
+	else if (in)
+	{
+		const size_t b_addr = _subleq_addr(b);
+		if (!_subleq_in_bounds(state, b_addr))
+			return state->running = false;
+		*(T*)(state->memory + b_addr) = _subleq_input<T>(state->input);
+		if (state->dirty != nullptr)
+			_subleq_dirty_write<T>(state->dirty, b_addr);
+		state->_ip = c;
+	}
+	else
+	{
+		const size_t b_addr = _subleq_addr(b);
+		if (!_subleq_in_bounds(state, b_addr))
+			return state->running = false;
+		T& mb = *(T*)(state->memory + b_addr);
+		mb = _subleq_sub(mb, *(T*)(state->memory + a_addr));
+		if (state->dirty != nullptr)
+			_subleq_dirty_write<T>(state->dirty, b_addr);
 
-	if (b <= 0) state->_ip = c;
-	else state->_ip += sizeof(T) * 3;
+		if (mb <= 0) state->_ip = c;
+		else state->_ip += sizeof(T) * 3;
+	}
 
 	state->running = state->_ip < state->memsize;
 	return state->_ip < state->memsize;
 }
 
+// Runs up to max_steps instructions with subleq_step, returning how many were executed. Stops
+// in front of any address flagged in stop_at, other than the one it starts on, and after any
+// write to a cell watch flags.
+template <typename T>
+uint64_t subleq_run(subleq<T>* state, const uint64_t max_steps, const uint8_t* stop_at=nullptr, subleq_watch* watch=nullptr, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	uint64_t steps = 0;
+	while (steps < max_steps)
+	{
+		const size_t ip = (size_t)state->_ip;
+		size_t written = SIZE_MAX;
+		if (watch != nullptr && _subleq_in_bounds(state, ip + sizeof(T) * 2))
+		{
+			const T b = *(T*)(state->memory + ip + sizeof(T));
+			if (b != ((T)(-1)))
+				written = _subleq_addr(b);
+		}
+		const bool more = subleq_step(state, FN_OnOutput, userarg);
+		// The halting instruction still ran, a fault didn't
+		if (!more && (size_t)state->_ip < state->memsize)
+			break;
+		++steps;
+		if (written != SIZE_MAX && _subleq_watch_write<T>(watch, written, ip))
+			break;
+		if (!more || (stop_at != nullptr && stop_at[(size_t)state->_ip]))
+			break;
+	}
+	return steps;
+}
+
+
+enum SUBLEQ_OP : uint8_t
+{
+	SUBLEQ_OP_UNDECODED,	// The entry has not been decoded or was invalidated by a write
+	SUBLEQ_OP_SUB,			// memory[b] -= memory[a], branch to c if <= 0
+	SUBLEQ_OP_OUT,			// Output memory[a], jump to c
+	SUBLEQ_OP_IN,			// Read an input byte into memory[b], jump to c
+	SUBLEQ_OP_FAULT,		// The instruction or one of its operands lies outside memory
+	SUBLEQ_OP_LIVE,			// Rewritten too often to cache, decoded from memory every time it runs
+};
+
+// A pre-decoded instruction, with operands already turned into byte addresses
+template <typename T>
+struct subleq_decoded
+{
+	std::make_unsigned_t<T> a;
+	std::make_unsigned_t<T> b;
+	T c;
+	T next;				// The fall-through ip
+	SUBLEQ_OP op;
+};
+
+// The instruction cache keeps an entry per cell in pages of this many cells, each allocated
+// when the first instruction in it is decoded, so a big memory only pays for the code it runs
+const size_t icache_page_bits = 12;
+const size_t icache_page_size = (size_t)1 << icache_page_bits;
+// An instruction dropped by writes this often is decoded from memory each time it runs instead
+const uint8_t icache_max_rewrites = 8;
+
+enum ICACHE_CODE : uint8_t
+{
+	ICACHE_COVERED = 1,		// Part of a cached instruction
+	ICACHE_START = 2,		// A cached instruction starts here
+};
+
+template <typename T>
+struct _icache_page
+{
+	subleq_decoded<T> entries[icache_page_size];
+	// ICACHE_* flags for every cell, so writes to plain data can skip invalidation
+	uint8_t code[icache_page_size];
+	// How often the entry of each cell was dropped by a write into its instruction
+	uint8_t rewrites[icache_page_size];
+};
+
+// Decoded instructions indexed by ip. An entry stays valid until a write lands inside
+// the instruction's three cells, so code that doesn't modify itself is only decoded once.
+// Instructions that don't start on a cell boundary aren't cached and are decoded as they run.
+template <typename T>
+struct subleq_icache
+{
+	size_t size;
+	size_t num_pages;
+	// Indexed by cell >> icache_page_bits, nullptr until something in the page was decoded
+	_icache_page<T>** pages;
+};
+
+// Drops every decoded instruction, call this after memory is changed outside of stepping
+template <typename T>
+void subleq_icache_clear(subleq_icache<T>* cache)
+{
+	for (size_t i = 0; i < cache->num_pages; ++i)
+	{
+		free(cache->pages[i]);
+		cache->pages[i] = nullptr;
+	}
+}
+
+template <typename T>
+void destroy_subleq_icache(subleq_icache<T>* cache)
+{
+	if (cache == nullptr)
+		return;
+	subleq_icache_clear(cache);
+	free(cache->pages);
+	free(cache);
+}
+
+template <typename T>
+subleq_icache<T>* create_subleq_icache(const subleq<T>* state)
+{
+	subleq_icache<T>* x = (subleq_icache<T>*)malloc(sizeof(subleq_icache<T>));
+	if (x == nullptr)
+		return nullptr;
+	x->size = state->memsize;
+	x->num_pages = ((state->memsize + sizeof(T) - 1) / sizeof(T) + icache_page_size - 1) >> icache_page_bits;
+	x->pages = (_icache_page<T>**)calloc(x->num_pages != 0 ? x->num_pages : 1, sizeof(_icache_page<T>*));
+	if (x->pages == nullptr)
+	{
+		free(x);
+		return nullptr;
+	}
+	return x;
+}
+
+// The ICACHE_* flags of a cell
+template <typename T>
+inline uint8_t _subleq_icache_code(const subleq_icache<T>* cache, const size_t cell)
+{
+	const _icache_page<T>* p = cache->pages[cell >> icache_page_bits];
+	return p != nullptr ? p->code[cell & (icache_page_size - 1)] : 0;
+}
+
+// Drops the instructions that overlap a write of one cell at addr
+template <typename T>
+inline void subleq_icache_invalidate(subleq_icache<T>* cache, const size_t addr)
+{
+	// An unaligned write touches two cells
+	const size_t first = addr / sizeof(T);
+	const size_t last = (addr + sizeof(T) - 1) / sizeof(T);
+	if (!((_subleq_icache_code(cache, first) | (first != last ? _subleq_icache_code(cache, last) : 0)) & ICACHE_COVERED))
+		return;
+	// Every instruction covering them starts up to two cells before
+	for (size_t i = first >= 2 ? first - 2 : 0; i <= last; ++i)
+	{
+		_icache_page<T>* p = cache->pages[i >> icache_page_bits];
+		const size_t at = i & (icache_page_size - 1);
+		if (p == nullptr || !(p->code[at] & ICACHE_START))
+			continue;
+		p->entries[at].op = SUBLEQ_OP_UNDECODED;
+		p->code[at] &= ~ICACHE_START;
+		p->rewrites[at] += p->rewrites[at] < icache_max_rewrites;
+	}
+	// None are cached any more, so later writes to these cells can skip this
+	for (size_t i = first; i <= last; ++i)
+	{
+		_icache_page<T>* p = cache->pages[i >> icache_page_bits];
+		if (p != nullptr)
+			p->code[i & (icache_page_size - 1)] &= ~ICACHE_COVERED;
+	}
+}
+
+// Decodes the instruction at ip as it is in memory now. Returns false if its cells don't all
+// lie inside memory, d.op is SUBLEQ_OP_FAULT then and the other fields aren't set.
+template <typename T>
+bool subleq_decode(const subleq<T>* state, const size_t ip, subleq_decoded<T>& d)
+{
+	d.op = SUBLEQ_OP_FAULT;
+	if (!_subleq_in_bounds(state, ip + sizeof(T) * 2))
+		return false;
+	const T b = *(T*)(state->memory + ip + sizeof(T));
+	d.a = (std::make_unsigned_t<T>)*(T*)(state->memory + ip);
+	d.b = (std::make_unsigned_t<T>)b;
+	d.c = *(T*)(state->memory + ip + sizeof(T) * 2);
+	d.next = (T)(ip + sizeof(T) * 3);
+	if (b == ((T)(-1)))
+		d.op = _subleq_in_bounds(state, d.a) ? SUBLEQ_OP_OUT : SUBLEQ_OP_FAULT;
+	else if (!_subleq_in_bounds(state, d.b))
+		return true;
+	else if (d.a == _subleq_addr((T)(-1)))
+		d.op = SUBLEQ_OP_IN;
+	else if (_subleq_in_bounds(state, d.a))
+		d.op = SUBLEQ_OP_SUB;
+	return true;
+}
+
+// The page holding a cell, allocated if it wasn't yet. nullptr if that failed.
+template <typename T>
+inline _icache_page<T>* _subleq_icache_page(subleq_icache<T>* cache, const size_t cell)
+{
+	_icache_page<T>*& p = cache->pages[cell >> icache_page_bits];
+	if (p == nullptr)
+		p = (_icache_page<T>*)calloc(1, sizeof(_icache_page<T>));
+	return p;
+}
+
+// Decodes the instruction at ip into the cache. Returns nullptr if it isn't cached, because it
+// doesn't start on a cell, was rewritten too often or there was no memory for its page.
+template <typename T>
+const subleq_decoded<T>* _subleq_decode(const subleq<T>* state, subleq_icache<T>* cache, const size_t ip)
+{
+	if (ip % sizeof(T) != 0)
+		return nullptr;
+	const size_t cell = ip / sizeof(T);
+	_icache_page<T>* p = _subleq_icache_page(cache, cell);
+	if (p == nullptr)
+		return nullptr;
+	const size_t at = cell & (icache_page_size - 1);
+	subleq_decoded<T>& d = p->entries[at];
+	if (p->rewrites[at] >= icache_max_rewrites)
+	{
+		d.op = SUBLEQ_OP_LIVE;
+		return nullptr;
+	}
+	if (!subleq_decode(state, ip, d))
+		return &d;
+	// The instruction's cells may reach into the next page
+	for (size_t i = cell; i < cell + 3; ++i)
+	{
+		_icache_page<T>* q = _subleq_icache_page(cache, i);
+		if (q == nullptr)
+		{
+			d.op = SUBLEQ_OP_LIVE;
+			return nullptr;
+		}
+		q->code[i & (icache_page_size - 1)] |= ICACHE_COVERED;
+	}
+	p->code[at] |= ICACHE_START;
+	return &d;
+}
+
+// The instruction at ip from the cache, or decoded into live when it isn't cached
+template <typename T>
+inline const subleq_decoded<T>& _subleq_cached(const subleq<T>* state, subleq_icache<T>* cache, const size_t ip, subleq_decoded<T>& live)
+{
+	const size_t cell = ip / sizeof(T);
+	const _icache_page<T>* p = cache->pages[cell >> icache_page_bits];
+	const subleq_decoded<T>* d = p != nullptr && ip % sizeof(T) == 0 ? &p->entries[cell & (icache_page_size - 1)] : nullptr;
+	if (d != nullptr && d->op != SUBLEQ_OP_UNDECODED && d->op != SUBLEQ_OP_LIVE)
+		return *d;
+	if (d == nullptr || d->op == SUBLEQ_OP_UNDECODED)
+	{
+		d = _subleq_decode(state, cache, ip);
+		if (d != nullptr)
+			return *d;
+	}
+	subleq_decode(state, ip, live);
+	return live;
+}
+
+// Same as subleq_step, but runs from the decoded form in cache
+template <typename T>
+bool subleq_step_cached(subleq<T>* state, subleq_icache<T>* cache, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	state->running = state->_ip < state->memsize;
+	if (!state->running)
+		return false;
+	const size_t ip = (size_t)state->_ip;
+	subleq_decoded<T> live;
+	const subleq_decoded<T>& d = _subleq_cached(state, cache, ip, live);
+
+	if (d.op == SUBLEQ_OP_SUB)
+	{
+		T& mb = *(T*)(state->memory + d.b);
+		mb = _subleq_sub(mb, *(T*)(state->memory + d.a));
+		state->_ip = mb <= 0 ? d.c : d.next;
+		subleq_icache_invalidate(cache, d.b);
+	}
+	else if (d.op == SUBLEQ_OP_OUT)
+	{
+		if (FN_OnOutput != nullptr)
+			FN_OnOutput(state, *(T*)(state->memory + d.a), state->_ip, userarg);
+		state->_ip = d.c;
+	}
+	else if (d.op == SUBLEQ_OP_IN)
+	{
+		*(T*)(state->memory + d.b) = _subleq_input<T>(state->input);
+		state->_ip = d.c;
+		subleq_icache_invalidate(cache, d.b);
+	}
+	else return state->running = false;
+
+	state->running = state->_ip < state->memsize;
+	return state->running;
+}
+
+// Runs up to max_steps instructions from the decoded form, returning how many were executed.
+// Without check_code writes don't invalidate anything, which is only safe for programs that
+// never write their own instructions (see subleq_run_analyzed in analysis.h).
+template <typename T, bool check_code=true>
+uint64_t subleq_run_cached(subleq<T>* state, subleq_icache<T>* cache, uint64_t max_steps, subleq_output_fn<T> FN_OnOutput=nullptr, void* userarg=nullptr)
+{
+	// Keep the hot state in locals, stores through memory could otherwise alias it
+	uint8_t* const memory = state->memory;
+	const size_t memsize = state->memsize;
+	T ip = state->_ip;
+	uint64_t steps = 0;
+	bool fault = false;
+	subleq_decoded<T> live;
+	// The page ip was last in, looked up again when ip leaves it or something was decoded
+	size_t page_at = SIZE_MAX;
+	const _icache_page<T>* page = nullptr;
+	while (steps < max_steps && (size_t)ip < memsize)
+	{
+		const size_t cell = (size_t)ip / sizeof(T);
+		if (cell >> icache_page_bits != page_at)
+		{
+			page_at = cell >> icache_page_bits;
+			page = cache->pages[page_at];
+		}
+		const subleq_decoded<T>* e = page != nullptr && (size_t)ip % sizeof(T) == 0 ? &page->entries[cell & (icache_page_size - 1)] : nullptr;
+		// Most instructions are cached subtractions, run those without going through the rest
+		if (e != nullptr && e->op == SUBLEQ_OP_SUB)
+		{
+			T& mb = *(T*)(memory + e->b);
+			mb = _subleq_sub(mb, *(T*)(memory + e->a));
+			const T next = mb <= 0 ? e->c : e->next;
+			if constexpr (check_code)
+				subleq_icache_invalidate(cache, e->b);
+			ip = next;
+			++steps;
+			continue;
+		}
+		if (e == nullptr || e->op == SUBLEQ_OP_UNDECODED || e->op == SUBLEQ_OP_LIVE)
+		{
+			e = &_subleq_cached(state, cache, (size_t)ip, live);
+			page_at = SIZE_MAX;
+		}
+		const subleq_decoded<T>& d = *e;
+		if (d.op == SUBLEQ_OP_SUB)
+		{
+			T& mb = *(T*)(memory + d.b);
+			mb = _subleq_sub(mb, *(T*)(memory + d.a));
+			const T next = mb <= 0 ? d.c : d.next;
+			if constexpr (check_code)
+				subleq_icache_invalidate(cache, d.b);
+			ip = next;
+		}
+		else if (d.op == SUBLEQ_OP_OUT)
+		{
+			state->_ip = ip;
+			if (FN_OnOutput != nullptr)
+				FN_OnOutput(state, *(T*)(memory + d.a), state->_ip, userarg);
+			ip = d.c;
+		}
+		else if (d.op == SUBLEQ_OP_IN)
+		{
+			*(T*)(memory + d.b) = _subleq_input<T>(state->input);
+			if constexpr (check_code)
+				subleq_icache_invalidate(cache, d.b);
+			ip = d.c;
+		}
+		else
+		{
+			fault = true;
+			break;
+		}
+		++steps;
+	}
+	state->_ip = ip;
+	state->running = !fault && (size_t)ip < memsize;
+	return steps;
+}
+
 template <typename T>
 void subleq_printmem(subleq<T>* state, size_t mem_addr, size_t length=1, FILE* f=stdout)
 {